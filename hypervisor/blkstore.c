@@ -0,0 +1,198 @@
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "blockstore.h"
+
+/* Maintenance of a block store (see blockstore.h) while no hypervisor uses
+ * it: moves disk images in and out of it, clones them and frees the blocks
+ * of the deleted ones. A running guest answers "disk" and "disk gc" on its
+ * control socket instead.
+ */
+
+#define BLKSTORE_CHUNK (1 << 20)
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s import [-b block size] <raw image> <map>\n", prog);
+    printf("       %s export <map> <raw image>\n", prog);
+    printf("       %s clone <map> <new map>\n", prog);
+    printf("       %s stats <dir>\n", prog);
+    printf("       %s gc <dir>\n", prog);
+    printf("The store of a map is the one of its directory, created by the first import\n");
+}
+
+static int blkstore_import(const char *raw, const char *map, uint32_t block_size)
+{
+    struct blockstore_image img;
+    uint8_t *buf = malloc(BLKSTORE_CHUNK);
+    uint64_t done = 0;
+    struct stat st;
+    ssize_t n = 0;
+    int fd = open(raw, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &st) < 0 || !buf) {
+        perror(raw);
+        return 1;
+    }
+    if (blockstore_image_create(&img, map, st.st_size, block_size) < 0)
+        return 1;
+    while (done < (uint64_t) st.st_size &&
+           (n = pread(fd, buf, BLKSTORE_CHUNK, done)) > 0) {
+        if (blockstore_image_write(&img, buf, done, n) != n) {
+            perror(map);
+            break;
+        }
+        done += n;
+    }
+    blockstore_image_close(&img);
+    close(fd);
+    free(buf);
+    if (done != (uint64_t) st.st_size) {
+        unlink(map);
+        return 1;
+    }
+    return 0;
+}
+
+static int blkstore_export(const char *map, const char *raw)
+{
+    struct blockstore_image img;
+    uint8_t *buf = malloc(BLKSTORE_CHUNK);
+    uint64_t done = 0, size;
+    ssize_t n;
+    int fd;
+
+    if (!buf || blockstore_image_open(&img, map) < 0)
+        return 1;
+    size = img.size;
+    fd = open(raw, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 || ftruncate(fd, img.size) < 0) {
+        perror(raw);
+        blockstore_image_close(&img);
+        return 1;
+    }
+    while (done < img.size &&
+           (n = blockstore_image_read(&img, buf, done, BLKSTORE_CHUNK)) > 0) {
+        /* zero blocks stay holes */
+        for (ssize_t i = 0; i < n; i += img.store->block_size) {
+            size_t len = n - i < img.store->block_size ? n - i
+                                                       : img.store->block_size;
+            const uint64_t *p = (const uint64_t *) (buf + i);
+            size_t j = 0;
+
+            while (j < len / 8 && !p[j])
+                j++;
+            if (j < len / 8 && pwrite(fd, buf + i, len, done + i) != (ssize_t) len) {
+                perror(raw);
+                n = -1;
+                break;
+            }
+        }
+        if (n < 0)
+            break;
+        done += n;
+    }
+    blockstore_image_close(&img);
+    close(fd);
+    free(buf);
+    return done == size ? 0 : 1;
+}
+
+static int blkstore_clone(const char *map, const char *new_map)
+{
+    struct blockstore_image img;
+    int ret;
+
+    if (blockstore_image_open(&img, map) < 0)
+        return 1;
+    ret = blockstore_image_clone(&img, new_map) < 0;
+    blockstore_image_close(&img);
+    return ret;
+}
+
+static void print_stats(struct blockstore *s)
+{
+    struct blockstore_stats stats;
+    char path[sizeof(s->dir) + 16];
+    struct stat st = {0};
+
+    blockstore_get_stats(s, &stats);
+    snprintf(path, sizeof(path), "%s/" BLOCKSTORE_BLOCKS, s->dir);
+    stat(path, &st);
+    printf("%s: %u byte blocks\n", s->dir, s->block_size);
+    printf("  disks      %8lu MB in %lu blocks, %lu of them zero\n",
+           (stats.refs + stats.zero_blocks) * s->block_size >> 20,
+           stats.refs + stats.zero_blocks, stats.zero_blocks);
+    printf("  stored     %8lu MB in %lu blocks, %lu of them free\n",
+           stats.unique * s->block_size >> 20, stats.blocks,
+           stats.blocks - stats.unique);
+    printf("  on disk    %8lu MB\n", st.st_blocks * 512 >> 20);
+    printf("  dedup ratio   %.2f (non zero blocks of the disks per stored block)\n",
+           stats.unique ? (double) stats.refs / stats.unique : 1.0);
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t block_size = 0;
+    struct blockstore *s;
+    const char *cmd;
+    int64_t freed;
+    int opt;
+
+    if (argc < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+    cmd = argv[1];
+    optind = 2;
+    while ((opt = getopt(argc, argv, "b:")) != -1) {
+        switch (opt) {
+        case 'b':
+            block_size = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    argv += optind;
+    argc -= optind;
+
+    if (!strcmp(cmd, "import") && argc == 2)
+        return blkstore_import(argv[0], argv[1], block_size);
+    if (!strcmp(cmd, "export") && argc == 2)
+        return blkstore_export(argv[0], argv[1]);
+    if (!strcmp(cmd, "clone") && argc == 2)
+        return blkstore_clone(argv[0], argv[1]);
+    if ((!strcmp(cmd, "stats") || !strcmp(cmd, "gc")) && argc == 1) {
+        char path[4096];
+        struct stat st;
+
+        snprintf(path, sizeof(path), "%s/" BLOCKSTORE_BLOCKS, argv[0]);
+        if (stat(path, &st) < 0) {
+            printf("no block store in %s\n", argv[0]);
+            return 1;
+        }
+        s = blockstore_open(argv[0], 0);
+        if (!s)
+            return 1;
+        if (!strcmp(cmd, "gc")) {
+            freed = blockstore_gc(s);
+            if (freed < 0) {
+                blockstore_close(s);
+                return 1;
+            }
+            printf("%ld free blocks given back\n", freed);
+        }
+        print_stats(s);
+        blockstore_close(s);
+        return 0;
+    }
+    usage(argv[0]);
+    return 1;
+}
@@ -0,0 +1,869 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <linux/falloc.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "blockstore.h"
+
+#define XXH_PRIME1 11400714785074694791ULL
+#define XXH_PRIME2 14029467366897019727ULL
+#define XXH_PRIME3 1609587929392839161ULL
+#define XXH_PRIME4 9650029242287828579ULL
+
+#define BLOCKSTORE_SCAN_REFS 16384 /* map entries read at once */
+
+static struct blockstore *stores;
+static pthread_mutex_t stores_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+    return rotl64(acc + input * XXH_PRIME2, 31) * XXH_PRIME1;
+}
+
+static uint64_t xxh64_merge(uint64_t acc, uint64_t v)
+{
+    return (acc ^ xxh64_round(0, v)) * XXH_PRIME1 + XXH_PRIME4;
+}
+
+/* XXH64 with seed 0 of a block, whose size is a multiple of 32 so there is
+ * no tail to hash */
+static uint64_t block_hash(const uint8_t *data, size_t len)
+{
+    const uint64_t *p = (const uint64_t *) data;
+    uint64_t v1 = XXH_PRIME1 + XXH_PRIME2, v2 = XXH_PRIME2, v3 = 0,
+             v4 = -XXH_PRIME1;
+    uint64_t h;
+
+    for (size_t i = 0; i < len / 8; i += 4) {
+        v1 = xxh64_round(v1, p[i]);
+        v2 = xxh64_round(v2, p[i + 1]);
+        v3 = xxh64_round(v3, p[i + 2]);
+        v4 = xxh64_round(v4, p[i + 3]);
+    }
+    h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+    h = xxh64_merge(h, v1);
+    h = xxh64_merge(h, v2);
+    h = xxh64_merge(h, v3);
+    h = xxh64_merge(h, v4);
+    h += len;
+    h ^= h >> 33;
+    h *= XXH_PRIME2;
+    h ^= h >> 29;
+    h *= XXH_PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+static bool block_is_zero(const uint8_t *data, size_t len)
+{
+    const uint64_t *p = (const uint64_t *) data;
+
+    for (size_t i = 0; i < len / 8; i++)
+        if (p[i])
+            return false;
+    return true;
+}
+
+static off_t block_offset(struct blockstore *s, uint32_t block)
+{
+    return BLOCKSTORE_HEADER_SIZE + (off_t) block * s->block_size;
+}
+
+/* The index: hash -> block, linear probing */
+
+static uint32_t *table_find(struct blockstore *s, uint64_t hash)
+{
+    uint32_t i = hash & s->table_mask;
+
+    while (s->table[i] && s->hashes[s->table[i] - 1] != hash)
+        i = (i + 1) & s->table_mask;
+    return &s->table[i];
+}
+
+static int table_resize(struct blockstore *s, uint32_t size)
+{
+    uint32_t *old = s->table;
+    uint32_t old_size = s->table ? s->table_mask + 1 : 0;
+
+    s->table = calloc(size, sizeof(uint32_t));
+    if (!s->table) {
+        s->table = old;
+        return -1;
+    }
+    s->table_mask = size - 1;
+    for (uint32_t i = 0; i < old_size; i++)
+        if (old[i])
+            *table_find(s, s->hashes[old[i] - 1]) = old[i];
+    free(old);
+    return 0;
+}
+
+/* A block whose hash is already in the index (a collision, or a block
+ * written before the one with the same content was freed) stays out of it */
+static void table_insert(struct blockstore *s, uint32_t block)
+{
+    uint32_t *slot;
+
+    if ((s->table_used + 1) * 2 > s->table_mask + 1)
+        table_resize(s, (s->table_mask + 1) * 2);
+    slot = table_find(s, s->hashes[block]);
+    if (*slot)
+        return;
+    *slot = block + 1;
+    s->table_used++;
+}
+
+static void table_remove(struct blockstore *s, uint32_t block)
+{
+    uint32_t i = s->hashes[block] & s->table_mask, j;
+
+    while (s->table[i] && s->table[i] != block + 1)
+        i = (i + 1) & s->table_mask;
+    if (!s->table[i])
+        return;
+    /* backward shift: move up the entries that probed past the hole */
+    for (j = i;;) {
+        uint32_t home;
+
+        j = (j + 1) & s->table_mask;
+        if (!s->table[j])
+            break;
+        home = s->hashes[s->table[j] - 1] & s->table_mask;
+        if ((j > i && (home <= i || home > j)) ||
+            (j < i && home <= i && home > j)) {
+            s->table[i] = s->table[j];
+            i = j;
+        }
+    }
+    s->table[i] = 0;
+    s->table_used--;
+}
+
+static int blocks_reserve(struct blockstore *s, uint32_t count)
+{
+    uint32_t capacity = s->capacity ? s->capacity : 1024;
+    uint64_t *hashes;
+    uint32_t *refcounts, *free_blocks;
+
+    if (count <= s->capacity)
+        return 0;
+    while (capacity < count)
+        capacity *= 2;
+    hashes = realloc(s->hashes, capacity * sizeof(*hashes));
+    if (hashes)
+        s->hashes = hashes;
+    refcounts = realloc(s->refcounts, capacity * sizeof(*refcounts));
+    if (refcounts)
+        s->refcounts = refcounts;
+    free_blocks = realloc(s->free_blocks, capacity * sizeof(*free_blocks));
+    if (free_blocks)
+        s->free_blocks = free_blocks;
+    if (!hashes || !refcounts || !free_blocks)
+        return -1;
+    memset(s->refcounts + s->capacity, 0,
+           (capacity - s->capacity) * sizeof(*refcounts));
+    s->capacity = capacity;
+    return 0;
+}
+
+/* Counts the references of every map of the directory into refcounts */
+static int count_refs(struct blockstore *s, uint32_t *refcounts)
+{
+    uint32_t *refs = malloc(BLOCKSTORE_SCAN_REFS * sizeof(*refs));
+    DIR *dir = opendir(s->dir);
+    struct dirent *d;
+
+    if (!dir || !refs) {
+        if (dir)
+            closedir(dir);
+        free(refs);
+        return -1;
+    }
+    memset(refcounts, 0, s->count * sizeof(*refcounts));
+    s->stats.refs = 0;
+    s->stats.zero_blocks = 0;
+    while ((d = readdir(dir))) {
+        struct blockstore_map_header header;
+        uint64_t nr_refs, bad = 0;
+        int fd;
+
+        if (d->d_type != DT_REG && d->d_type != DT_UNKNOWN)
+            continue;
+        fd = openat(dirfd(dir), d->d_name, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+        if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+            memcmp(header.magic, BLOCKSTORE_MAP_MAGIC, sizeof(header.magic)) ||
+            header.block_size != s->block_size) {
+            close(fd);
+            continue;
+        }
+        nr_refs = (header.size + s->block_size - 1) / s->block_size;
+        for (uint64_t i = 0; i < nr_refs; i += BLOCKSTORE_SCAN_REFS) {
+            size_t n = nr_refs - i < BLOCKSTORE_SCAN_REFS ? nr_refs - i
+                                                          : BLOCKSTORE_SCAN_REFS;
+            ssize_t len = pread(fd, refs, n * sizeof(*refs),
+                                sizeof(header) + i * sizeof(*refs));
+
+            /* a short map reads as zero blocks */
+            if (len < 0)
+                len = 0;
+            memset((uint8_t *) refs + len, 0, n * sizeof(*refs) - len);
+            for (size_t j = 0; j < n; j++) {
+                if (!refs[j]) {
+                    s->stats.zero_blocks++;
+                } else if (refs[j] > s->count) {
+                    bad++;
+                } else {
+                    refcounts[refs[j] - 1]++;
+                    s->stats.refs++;
+                }
+            }
+        }
+        if (bad)
+            printf("%s/%s: %lu references past the end of the store\n",
+                   s->dir, d->d_name, bad);
+        close(fd);
+    }
+    closedir(dir);
+    free(refs);
+    return 0;
+}
+
+/* The index and the free list from the reference counts */
+static int rebuild(struct blockstore *s)
+{
+    uint32_t size = 1024;
+
+    while (size < s->count * 2)
+        size *= 2;
+    free(s->table);
+    s->table = NULL;
+    s->table_used = 0;
+    if (table_resize(s, size) < 0)
+        return -1;
+    s->nr_free = 0;
+    /* the lowest free blocks get reused first */
+    for (uint32_t b = s->count; b-- > 0;) {
+        if (s->refcounts[b])
+            table_insert(s, b);
+        else
+            s->free_blocks[s->nr_free++] = b;
+    }
+    return 0;
+}
+
+/* Counts the references again, e.g. of maps copied or deleted since the
+ * last count. Returns the number of blocks they freed */
+static int64_t recount(struct blockstore *s)
+{
+    uint32_t *refcounts = calloc(s->capacity ? s->capacity : 1, sizeof(uint32_t));
+    int64_t freed = 0;
+
+    if (!refcounts || count_refs(s, refcounts) < 0) {
+        free(refcounts);
+        return -1;
+    }
+    for (uint32_t b = 0; b < s->count; b++)
+        if (s->refcounts[b] && !refcounts[b])
+            freed++;
+    free(s->refcounts);
+    s->refcounts = refcounts;
+    if (rebuild(s) < 0)
+        return -1;
+    return freed;
+}
+
+static int load_index(struct blockstore *s)
+{
+    struct blockstore_index_header header;
+    char path[sizeof(s->dir) + 16];
+    FILE *f;
+    int ret = -1;
+
+    snprintf(path, sizeof(path), "%s/" BLOCKSTORE_INDEX, s->dir);
+    f = fopen(path, "r");
+    if (!f)
+        return -1;
+    if (fread(&header, sizeof(header), 1, f) == 1 &&
+        !memcmp(header.magic, BLOCKSTORE_INDEX_MAGIC, sizeof(header.magic)) &&
+        header.version == BLOCKSTORE_VERSION &&
+        header.block_size == s->block_size && header.count == s->count &&
+        fread(s->hashes, sizeof(*s->hashes), s->count, f) == s->count)
+        ret = 0;
+    fclose(f);
+    /* stale from now on, until blockstore_close writes it again */
+    unlink(path);
+    return ret;
+}
+
+static int hash_blocks(struct blockstore *s)
+{
+    size_t chunk = 256 * s->block_size;
+    uint8_t *buf = malloc(chunk);
+
+    if (!buf)
+        return -1;
+    for (uint32_t b = 0; b < s->count; b += 256) {
+        uint32_t n = s->count - b < 256 ? s->count - b : 256;
+
+        if (pread(s->fd, buf, (size_t) n * s->block_size, block_offset(s, b)) !=
+            (ssize_t) n * s->block_size) {
+            free(buf);
+            return -1;
+        }
+        for (uint32_t i = 0; i < n; i++)
+            s->hashes[b + i] =
+                block_hash(buf + (size_t) i * s->block_size, s->block_size);
+    }
+    free(buf);
+    return 0;
+}
+
+/* Written to a temporary file first, like the boot trace */
+static void save_index(struct blockstore *s)
+{
+    struct blockstore_index_header header = {.magic = BLOCKSTORE_INDEX_MAGIC,
+                                             .version = BLOCKSTORE_VERSION,
+                                             .block_size = s->block_size,
+                                             .count = s->count};
+    char path[sizeof(s->dir) + 16], tmp[sizeof(s->dir) + 24];
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s/" BLOCKSTORE_INDEX, s->dir);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    f = fopen(tmp, "w");
+    if (!f) {
+        perror("block store index");
+        return;
+    }
+    fwrite(&header, sizeof(header), 1, f);
+    fwrite(s->hashes, sizeof(*s->hashes), s->count, f);
+    if (fclose(f) != 0 || rename(tmp, path) < 0) {
+        perror("block store index");
+        unlink(tmp);
+    }
+}
+
+static int store_load(struct blockstore *s, uint32_t block_size)
+{
+    struct blockstore_header header = {.magic = BLOCKSTORE_MAGIC,
+                                       .version = BLOCKSTORE_VERSION};
+    char path[sizeof(s->dir) + 16];
+    struct stat st;
+
+    snprintf(path, sizeof(path), "%s/" BLOCKSTORE_BLOCKS, s->dir);
+    s->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (s->fd < 0) {
+        perror(path);
+        return -1;
+    }
+    if (flock(s->fd, LOCK_EX | LOCK_NB) < 0) {
+        printf("%s is in use by another process\n", path);
+        return -1;
+    }
+    fstat(s->fd, &st);
+    if (st.st_size == 0) {
+        header.block_size =
+            block_size ? block_size : BLOCKSTORE_DEFAULT_BLOCK_SIZE;
+        if (header.block_size % 512 || header.block_size > BLOCKSTORE_MAX_BLOCK_SIZE ||
+            pwrite(s->fd, &header, sizeof(header), 0) != sizeof(header) ||
+            ftruncate(s->fd, BLOCKSTORE_HEADER_SIZE) < 0) {
+            printf("%s: can't create a store of %u byte blocks\n", path,
+                   header.block_size);
+            unlink(path);
+            return -1;
+        }
+        st.st_size = BLOCKSTORE_HEADER_SIZE;
+    } else if (pread(s->fd, &header, sizeof(header), 0) != sizeof(header) ||
+               memcmp(header.magic, BLOCKSTORE_MAGIC, sizeof(header.magic)) ||
+               header.version != BLOCKSTORE_VERSION || header.block_size % 512 ||
+               header.block_size > BLOCKSTORE_MAX_BLOCK_SIZE) {
+        printf("%s is not a block store\n", path);
+        return -1;
+    }
+    if (block_size && block_size != header.block_size) {
+        printf("%s has blocks of %u bytes\n", path, header.block_size);
+        return -1;
+    }
+    s->block_size = header.block_size;
+    /* a block half written when the host died is dropped */
+    s->count = (st.st_size - BLOCKSTORE_HEADER_SIZE) / s->block_size;
+    s->cmp_buf = malloc(s->block_size);
+    if (!s->cmp_buf || blocks_reserve(s, s->count ? s->count : 1) < 0)
+        return -1;
+    if (load_index(s) < 0 && hash_blocks(s) < 0) {
+        perror(path);
+        return -1;
+    }
+    return recount(s) < 0 ? -1 : 0;
+}
+
+static void store_free(struct blockstore *s)
+{
+    if (s->fd >= 0)
+        close(s->fd);
+    free(s->hashes);
+    free(s->refcounts);
+    free(s->free_blocks);
+    free(s->table);
+    free(s->cmp_buf);
+    free(s);
+}
+
+struct blockstore *blockstore_open(const char *dir, uint32_t block_size)
+{
+    char real[PATH_MAX];
+    struct blockstore *s;
+
+    if (!realpath(dir, real) || strlen(real) >= sizeof(s->dir)) {
+        perror(dir);
+        return NULL;
+    }
+    pthread_mutex_lock(&stores_lock);
+    for (s = stores; s; s = s->next) {
+        if (strcmp(s->dir, real))
+            continue;
+        if (block_size && block_size != s->block_size) {
+            printf("%s has blocks of %u bytes\n", real, s->block_size);
+            s = NULL;
+        } else {
+            s->users++;
+        }
+        pthread_mutex_unlock(&stores_lock);
+        return s;
+    }
+    s = calloc(1, sizeof(*s));
+    if (!s) {
+        pthread_mutex_unlock(&stores_lock);
+        return NULL;
+    }
+    strcpy(s->dir, real);
+    s->fd = -1;
+    pthread_mutex_init(&s->lock, NULL);
+    if (store_load(s, block_size) < 0) {
+        store_free(s);
+        pthread_mutex_unlock(&stores_lock);
+        return NULL;
+    }
+    s->users = 1;
+    s->next = stores;
+    stores = s;
+    pthread_mutex_unlock(&stores_lock);
+    return s;
+}
+
+void blockstore_close(struct blockstore *s)
+{
+    pthread_mutex_lock(&stores_lock);
+    if (--s->users > 0) {
+        pthread_mutex_unlock(&stores_lock);
+        return;
+    }
+    for (struct blockstore **p = &stores; *p; p = &(*p)->next) {
+        if (*p == s) {
+            *p = s->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&stores_lock);
+    save_index(s);
+    store_free(s);
+}
+
+int64_t blockstore_gc(struct blockstore *s)
+{
+    int64_t freed;
+    uint32_t count;
+
+    pthread_mutex_lock(&s->lock);
+    if (recount(s) < 0) {
+        pthread_mutex_unlock(&s->lock);
+        return -1;
+    }
+    freed = s->nr_free;
+    /* the free blocks at the end go, the others become holes */
+    for (count = s->count; count > 0 && !s->refcounts[count - 1]; count--)
+        ;
+    if (count < s->count && ftruncate(s->fd, block_offset(s, count)) == 0) {
+        s->count = count;
+        rebuild(s);
+    }
+    for (uint32_t i = 0; i < s->nr_free; i++)
+        syscall(SYS_fallocate, s->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                block_offset(s, s->free_blocks[i]), (off_t) s->block_size);
+    pthread_mutex_unlock(&s->lock);
+    return freed;
+}
+
+void blockstore_get_stats(struct blockstore *s, struct blockstore_stats *stats)
+{
+    pthread_mutex_lock(&s->lock);
+    *stats = s->stats;
+    stats->blocks = s->count;
+    stats->unique = 0;
+    for (uint32_t b = 0; b < s->count; b++)
+        if (s->refcounts[b])
+            stats->unique++;
+    pthread_mutex_unlock(&s->lock);
+    stats->reads = __atomic_load_n(&s->stats.reads, __ATOMIC_RELAXED);
+}
+
+bool blockstore_is_map(int fd)
+{
+    struct blockstore_map_header header;
+
+    return pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+           !memcmp(header.magic, BLOCKSTORE_MAP_MAGIC, sizeof(header.magic));
+}
+
+static struct blockstore *store_of(const char *path, uint32_t block_size)
+{
+    char *copy = strdup(path);
+    struct blockstore *s;
+
+    if (!copy)
+        return NULL;
+    s = blockstore_open(dirname(copy), block_size);
+    free(copy);
+    return s;
+}
+
+static int image_setup(struct blockstore_image *img, uint64_t size)
+{
+    img->size = size;
+    img->nr_refs = (size + img->store->block_size - 1) / img->store->block_size;
+    img->refs = calloc(img->nr_refs ? img->nr_refs : 1, sizeof(uint32_t));
+    img->buf = malloc(img->store->block_size);
+    return img->refs && img->buf ? 0 : -1;
+}
+
+static void image_free(struct blockstore_image *img)
+{
+    if (img->fd >= 0)
+        close(img->fd);
+    free(img->refs);
+    free(img->buf);
+    if (img->store)
+        blockstore_close(img->store);
+    memset(img, 0, sizeof(*img));
+    img->fd = -1;
+}
+
+/* A new map at path with refs, counted in the store */
+static int map_create(struct blockstore_image *img,
+                      const char *path,
+                      uint64_t size,
+                      const uint32_t *refs)
+{
+    struct blockstore *s = img->store;
+    struct blockstore_map_header header = {.magic = BLOCKSTORE_MAP_MAGIC,
+                                           .version = BLOCKSTORE_VERSION,
+                                           .block_size = s->block_size,
+                                           .size = size};
+    ssize_t len;
+
+    if (image_setup(img, size) < 0)
+        return -1;
+    if (refs)
+        memcpy(img->refs, refs, img->nr_refs * sizeof(*refs));
+    len = img->nr_refs * sizeof(*refs);
+    pthread_mutex_lock(&s->lock);
+    img->fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (img->fd < 0 || pwrite(img->fd, &header, sizeof(header), 0) != sizeof(header) ||
+        pwrite(img->fd, img->refs, len, sizeof(header)) != len) {
+        perror(path);
+        if (img->fd >= 0)
+            unlink(path);
+        pthread_mutex_unlock(&s->lock);
+        return -1;
+    }
+    for (uint64_t i = 0; i < img->nr_refs; i++) {
+        if (img->refs[i]) {
+            s->refcounts[img->refs[i] - 1]++;
+            s->stats.refs++;
+        } else {
+            s->stats.zero_blocks++;
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    return 0;
+}
+
+int blockstore_image_create(struct blockstore_image *img,
+                            const char *path,
+                            uint64_t size,
+                            uint32_t block_size)
+{
+    memset(img, 0, sizeof(*img));
+    img->fd = -1;
+    img->store = store_of(path, block_size);
+    if (!img->store || map_create(img, path, size, NULL) < 0) {
+        image_free(img);
+        return -1;
+    }
+    return 0;
+}
+
+int blockstore_image_clone(struct blockstore_image *src, const char *path)
+{
+    struct blockstore_image img = {.fd = -1};
+    char *copy = strdup(path);
+    char real[PATH_MAX];
+    int ret = -1;
+
+    /* the blocks are shared within a store only */
+    if (copy && realpath(dirname(copy), real) && !strcmp(real, src->store->dir)) {
+        img.store = src->store;
+        pthread_mutex_lock(&stores_lock);
+        img.store->users++;
+        pthread_mutex_unlock(&stores_lock);
+        ret = map_create(&img, path, src->size, src->refs);
+    } else {
+        printf("%s: not in the directory of the store, %s\n", path,
+               src->store->dir);
+    }
+    free(copy);
+    image_free(&img);
+    return ret;
+}
+
+int blockstore_image_open(struct blockstore_image *img, const char *path)
+{
+    struct blockstore_map_header header;
+    ssize_t len;
+
+    memset(img, 0, sizeof(*img));
+    img->fd = open(path, O_RDWR | O_CLOEXEC);
+    if (img->fd < 0 ||
+        pread(img->fd, &header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(header.magic, BLOCKSTORE_MAP_MAGIC, sizeof(header.magic)) ||
+        header.version != BLOCKSTORE_VERSION) {
+        printf("%s is not a block map\n", path);
+        image_free(img);
+        return -1;
+    }
+    img->store = store_of(path, header.block_size);
+    if (!img->store || image_setup(img, header.size) < 0) {
+        image_free(img);
+        return -1;
+    }
+    len = img->nr_refs * sizeof(uint32_t);
+    if (pread(img->fd, img->refs, len, sizeof(header)) != len) {
+        printf("%s is truncated\n", path);
+        image_free(img);
+        return -1;
+    }
+    /* the map may have been copied since the store counted the maps */
+    pthread_mutex_lock(&img->store->lock);
+    if (img->store->users > 1)
+        recount(img->store);
+    for (uint64_t i = 0; i < img->nr_refs; i++) {
+        if (img->refs[i] > img->store->count) {
+            printf("%s: block %lu is past the end of the store\n", path, i);
+            img->refs[i] = 0;
+        }
+    }
+    pthread_mutex_unlock(&img->store->lock);
+    return 0;
+}
+
+void blockstore_image_close(struct blockstore_image *img)
+{
+    image_free(img);
+}
+
+ssize_t blockstore_image_read(struct blockstore_image *img,
+                              void *data,
+                              uint64_t offset,
+                              size_t size)
+{
+    struct blockstore *s = img->store;
+    uint8_t *dst = data;
+    size_t done = 0;
+
+    if (offset >= img->size)
+        return 0;
+    if (size > img->size - offset)
+        size = img->size - offset;
+    while (done < size) {
+        uint64_t block = (offset + done) / s->block_size;
+        size_t in = (offset + done) % s->block_size;
+        size_t len = s->block_size - in;
+        uint32_t ref = img->refs[block];
+        uint64_t n = 1;
+
+        if (len > size - done)
+            len = size - done;
+        /* following blocks stored one after the other go in one read */
+        while (len < size - done && block + n < img->nr_refs &&
+               (ref ? img->refs[block + n] == ref + n : !img->refs[block + n])) {
+            len += size - done - len < s->block_size ? size - done - len
+                                                      : s->block_size;
+            n++;
+        }
+        if (!ref)
+            memset(dst + done, 0, len);
+        else if (pread(s->fd, dst + done, len, block_offset(s, ref - 1) + in) !=
+                 (ssize_t) len)
+            return -1;
+        __atomic_add_fetch(&s->stats.reads, n, __ATOMIC_RELAXED);
+        done += len;
+    }
+    return done;
+}
+
+/* Where the content of buf, hashed to hash, goes instead of old: a block of
+ * the store with the same content, old rewritten when only this image used
+ * it, or a new block. Called with the lock held. Returns the new reference or
+ * -1 */
+static int64_t store_block(struct blockstore *s,
+                           uint32_t old,
+                           const uint8_t *buf,
+                           uint64_t hash)
+{
+    uint32_t found = *table_find(s, hash);
+    uint32_t block;
+
+    s->stats.writes++;
+    if (found && found == old)
+        return old;
+    /* a hash is no proof, the block must be the same */
+    if (found &&
+        pread(s->fd, s->cmp_buf, s->block_size, block_offset(s, found - 1)) ==
+            (ssize_t) s->block_size &&
+        !memcmp(s->cmp_buf, buf, s->block_size)) {
+        s->refcounts[found - 1]++;
+        s->stats.dedup_hits++;
+        return found;
+    }
+    if (old && s->refcounts[old - 1] == 1) {
+        block = old - 1;
+        table_remove(s, block);
+        if (pwrite(s->fd, buf, s->block_size, block_offset(s, block)) !=
+            (ssize_t) s->block_size)
+            return -1;
+        s->hashes[block] = hash;
+        table_insert(s, block);
+        s->stats.new_blocks++;
+        return old;
+    }
+    if (s->nr_free) {
+        block = s->free_blocks[--s->nr_free];
+    } else {
+        if (s->count == UINT32_MAX - 1 || blocks_reserve(s, s->count + 1) < 0)
+            return -1;
+        block = s->count++;
+    }
+    if (pwrite(s->fd, buf, s->block_size, block_offset(s, block)) !=
+        (ssize_t) s->block_size)
+        return -1;
+    s->hashes[block] = hash;
+    s->refcounts[block]++;
+    table_insert(s, block);
+    s->stats.new_blocks++;
+    return block + 1;
+}
+
+static void drop_ref(struct blockstore *s, uint32_t ref)
+{
+    if (!ref) {
+        s->stats.zero_blocks--;
+        return;
+    }
+    s->stats.refs--;
+    if (--s->refcounts[ref - 1])
+        return;
+    table_remove(s, ref - 1);
+    s->free_blocks[s->nr_free++] = ref - 1;
+}
+
+static int image_write_block(struct blockstore_image *img,
+                             uint64_t block,
+                             const uint8_t *buf)
+{
+    struct blockstore *s = img->store;
+    bool zero = block_is_zero(buf, s->block_size);
+    uint64_t hash = zero ? 0 : block_hash(buf, s->block_size);
+    uint32_t old = img->refs[block];
+    int64_t ref = 0;
+
+    pthread_mutex_lock(&s->lock);
+    if (!zero)
+        ref = store_block(s, old, buf, hash);
+    else
+        s->stats.writes++;
+    if (ref < 0) {
+        pthread_mutex_unlock(&s->lock);
+        return -1;
+    }
+    if (ref != old) {
+        if (ref)
+            s->stats.refs++;
+        else
+            s->stats.zero_blocks++;
+        /* on disk before the lock is dropped: a block referenced only in
+         * memory would be freed by a recount */
+        if (pwrite(img->fd, &(uint32_t){ref}, sizeof(uint32_t),
+                   sizeof(struct blockstore_map_header) +
+                       block * sizeof(uint32_t)) != sizeof(uint32_t)) {
+            drop_ref(s, ref);
+            pthread_mutex_unlock(&s->lock);
+            return -1;
+        }
+        drop_ref(s, old);
+        img->refs[block] = ref;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return 0;
+}
+
+ssize_t blockstore_image_write(struct blockstore_image *img,
+                               const void *data,
+                               uint64_t offset,
+                               size_t size)
+{
+    uint32_t block_size = img->store->block_size;
+    const uint8_t *src = data;
+    size_t done = 0;
+
+    if (offset >= img->size)
+        return 0;
+    if (size > img->size - offset)
+        size = img->size - offset;
+    while (done < size) {
+        uint64_t block = (offset + done) / block_size;
+        size_t in = (offset + done) % block_size;
+        size_t len = block_size - in < size - done ? block_size - in : size - done;
+        const uint8_t *buf = src + done;
+
+        /* a partial block: the rest of it comes from the image */
+        if (len < block_size) {
+            ssize_t n = blockstore_image_read(img, img->buf, block * block_size,
+                                              block_size);
+
+            if (n < 0)
+                return -1;
+            memset(img->buf + n, 0, block_size - n);
+            memcpy(img->buf + in, src + done, len);
+            buf = img->buf;
+        }
+        if (image_write_block(img, block, buf) < 0)
+            return -1;
+        done += len;
+    }
+    return done;
+}
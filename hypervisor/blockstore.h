@@ -0,0 +1,127 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+/* Content addressed store of disk blocks, shared by the disk images of a
+ * directory. The images are block maps: a header and one reference per
+ * block of the disk, 0 for a zero block or the block number + 1 in the store.
+ * Equal blocks are stored once, whichever image wrote them, so the disks of
+ * guests installed from the same base share most of their blocks.
+ *
+ * The directory holds:
+ *   blocks        the blocks, after a header of BLOCKSTORE_HEADER_SIZE bytes
+ *   blocks.index  the hash of every block, rebuilt from the blocks when it is
+ *                 missing, e.g. after a crash
+ *   *             the block maps, any name, found by their magic
+ *
+ * The reference counts are not stored: they are counted from the maps when
+ * the store or an image is opened, so a map copied with cp is a clone of the
+ * image (as long as the image is not written meanwhile) and a deleted map
+ * frees its blocks at the next open or blockstore_gc. A write
+ * never changes a block other images reference: it finds the new content in
+ * the store (write time dedup) or writes a block of its own.
+ */
+
+#define BLOCKSTORE_BLOCKS "blocks"
+#define BLOCKSTORE_INDEX "blocks.index"
+#define BLOCKSTORE_MAGIC "RKVMDDB"
+#define BLOCKSTORE_INDEX_MAGIC "RKVMDDX"
+#define BLOCKSTORE_MAP_MAGIC "RKVMMAP"
+#define BLOCKSTORE_VERSION 1
+#define BLOCKSTORE_HEADER_SIZE 4096
+#define BLOCKSTORE_DEFAULT_BLOCK_SIZE 4096
+#define BLOCKSTORE_MAX_BLOCK_SIZE 65536
+
+struct blockstore_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t block_size;
+};
+
+struct blockstore_index_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t count;
+};
+
+struct blockstore_map_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t size; /* of the disk, in bytes */
+};
+
+struct blockstore_stats {
+    uint64_t blocks; /* in the blocks file, used or free */
+    uint64_t unique; /* referenced by at least one map */
+    uint64_t refs; /* non zero blocks of all the maps */
+    uint64_t zero_blocks; /* of all the maps */
+    uint64_t writes; /* blocks written by the images */
+    uint64_t dedup_hits; /* of them, found in the store */
+    uint64_t new_blocks; /* of them, stored */
+    uint64_t reads; /* blocks read by the images */
+};
+
+struct blockstore {
+    char dir[4096];
+    int fd; /* of the blocks file, flock'ed by the process using the store */
+    uint32_t block_size;
+    pthread_mutex_t lock;
+    uint64_t *hashes;
+    uint32_t *refcounts;
+    uint32_t count; /* blocks in the file */
+    uint32_t capacity;
+    uint32_t *table; /* hash -> block + 1, open addressing */
+    uint32_t table_mask;
+    uint32_t table_used;
+    uint32_t *free_blocks;
+    uint32_t nr_free;
+    uint8_t *cmp_buf; /* one block, to compare with under the lock */
+    struct blockstore_stats stats;
+    int users; /* open images and callers of blockstore_open */
+    struct blockstore *next;
+};
+
+struct blockstore_image {
+    struct blockstore *store;
+    int fd; /* of the map */
+    uint64_t size;
+    uint32_t *refs;
+    uint64_t nr_refs;
+    uint8_t *buf; /* one block, for partial writes */
+};
+
+/* The store of dir, shared by all the images of the process, created with
+ * blocks of block_size bytes when missing (0 for the default). Returns NULL
+ * on failure */
+struct blockstore *blockstore_open(const char *dir, uint32_t block_size);
+void blockstore_close(struct blockstore *s);
+/* Frees the blocks no map references any more, e.g. of the maps deleted
+ * since the store was opened, and gives the space of all the free blocks back
+ * to the file system. Returns the number of free blocks or -1 */
+int64_t blockstore_gc(struct blockstore *s);
+void blockstore_get_stats(struct blockstore *s, struct blockstore_stats *stats);
+
+bool blockstore_is_map(int fd);
+/* A zero disk of size bytes in the store of the directory of path */
+int blockstore_image_create(struct blockstore_image *img,
+                            const char *path,
+                            uint64_t size,
+                            uint32_t block_size);
+int blockstore_image_open(struct blockstore_image *img, const char *path);
+/* A new image at path with the blocks of src, nothing copied */
+int blockstore_image_clone(struct blockstore_image *src, const char *path);
+ssize_t blockstore_image_read(struct blockstore_image *img,
+                              void *data,
+                              uint64_t offset,
+                              size_t size);
+ssize_t blockstore_image_write(struct blockstore_image *img,
+                               const void *data,
+                               uint64_t offset,
+                               size_t size);
+void blockstore_image_close(struct blockstore_image *img);
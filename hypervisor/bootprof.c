@@ -0,0 +1,173 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bootprof.h"
+
+static const char* boot_mark_names[BOOT_MARK_COUNT] = {
+    "setup_vm", "load_image", "devices", "load_initrd", "first_run",
+    "first_output", "kernel", "first_blk", "userspace", "ready",
+};
+
+// console lines that mark a step of the guest boot, NULL for the marks seen elsewhere
+static const char* boot_mark_patterns[BOOT_MARK_COUNT] = {
+    [BOOT_KERNEL] = "Linux version",
+    [BOOT_USERSPACE] = "Run /",
+};
+
+static boot_profile_t boot_history[BOOT_PROFILE_HISTORY];
+static uint64_t boot_history_count; // boots recorded so far, the last BOOT_PROFILE_HISTORY are kept
+static pthread_mutex_t boot_history_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t boot_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void boot_profile_start(boot_profile_t* p)
+{
+    memset(p, 0, sizeof(*p));
+    p->start_ns = boot_now_ns();
+}
+
+// called from the vCPU thread and the device threads, the first of them sets the mark
+void boot_profile_mark(boot_profile_t* p, enum boot_mark mark)
+{
+    uint64_t unset = 0;
+
+    if (!p->start_ns || __atomic_load_n(&p->at[mark], __ATOMIC_RELAXED))
+    {
+        return;
+    }
+    __atomic_compare_exchange_n(&p->at[mark], &unset, boot_now_ns() - p->start_ns, false,
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+// only the vCPU thread writes the console, the matching needs no lock
+void boot_profile_console(boot_profile_t* p, char c)
+{
+    if (!p->start_ns)
+    {
+        return;
+    }
+    boot_profile_mark(p, BOOT_FIRST_OUTPUT);
+    for (int i = 0; i < BOOT_MARK_COUNT; i++)
+    {
+        const char* pattern = boot_mark_patterns[i];
+
+        if (!pattern || p->at[i])
+        {
+            continue;
+        }
+        // naive restart like the ready marker, the patterns don't overlap themselves
+        if (pattern[p->matched[i]] != c)
+        {
+            p->matched[i] = 0;
+        }
+        if (pattern[p->matched[i]] == c && !pattern[++p->matched[i]])
+        {
+            boot_profile_mark(p, i);
+        }
+    }
+}
+
+void boot_profile_record(boot_profile_t* p)
+{
+    // a VM that never ran says nothing about the boot
+    if (!__atomic_load_n(&p->at[BOOT_FIRST_RUN], __ATOMIC_RELAXED) ||
+        __atomic_exchange_n(&p->recorded, true, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+    pthread_mutex_lock(&boot_history_lock);
+    for (int i = 0; i < BOOT_MARK_COUNT; i++)
+    {
+        boot_history[boot_history_count % BOOT_PROFILE_HISTORY].at[i] =
+            __atomic_load_n(&p->at[i], __ATOMIC_RELAXED);
+    }
+    boot_history_count++;
+    pthread_mutex_unlock(&boot_history_lock);
+}
+
+void boot_profile_print(const boot_profile_t* p, FILE* f)
+{
+    uint64_t prev = 0;
+
+    fprintf(f, "boot profile, ms after the VM was created:\n");
+    for (int i = 0; i < BOOT_MARK_COUNT; i++)
+    {
+        uint64_t at = __atomic_load_n(&p->at[i], __ATOMIC_RELAXED);
+
+        if (!at)
+        {
+            fprintf(f, "  %-14s %10s\n", boot_mark_names[i], "-");
+            continue;
+        }
+        // the guest marks come in any order, a step only counts from an earlier one
+        fprintf(f, "  %-14s %10.1f  +%.1f\n", boot_mark_names[i], at / 1e6, at > prev ? (at - prev) / 1e6 : 0);
+        if (at > prev)
+        {
+            prev = at;
+        }
+    }
+}
+
+int boot_profile_format(const boot_profile_t* p, char* buf, size_t len)
+{
+    int n = 0;
+
+    for (int i = 0; i < BOOT_MARK_COUNT && (size_t) n < len; i++)
+    {
+        uint64_t at = __atomic_load_n(&p->at[i], __ATOMIC_RELAXED);
+
+        if (at)
+        {
+            n += snprintf(buf + n, len - n, "%s%s_us=%lu", n ? " " : "", boot_mark_names[i], at / 1000);
+        }
+    }
+    return n;
+}
+
+static int boot_cmp_u64(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+
+    return x < y ? -1 : x > y;
+}
+
+// per mark <p50>/<p90>/<p99>/<max> in us, over the recorded boots that reached it
+int boot_profile_format_history(char* buf, size_t len)
+{
+    uint64_t values[BOOT_PROFILE_HISTORY];
+    uint64_t boots;
+    int n;
+
+    pthread_mutex_lock(&boot_history_lock);
+    boots = boot_history_count < BOOT_PROFILE_HISTORY ? boot_history_count : BOOT_PROFILE_HISTORY;
+    n = snprintf(buf, len, "boots=%lu", boot_history_count);
+    for (int i = 0; i < BOOT_MARK_COUNT && (size_t) n < len; i++)
+    {
+        size_t count = 0;
+
+        for (uint64_t j = 0; j < boots; j++)
+        {
+            if (boot_history[j].at[i])
+            {
+                values[count++] = boot_history[j].at[i] / 1000;
+            }
+        }
+        if (!count)
+        {
+            continue;
+        }
+        qsort(values, count, sizeof(values[0]), boot_cmp_u64);
+        n += snprintf(buf + n, len - n, " %s_us=%lu/%lu/%lu/%lu", boot_mark_names[i], values[(count - 1) / 2],
+                      values[(count - 1) * 90 / 100], values[(count - 1) * 99 / 100], values[count - 1]);
+    }
+    pthread_mutex_unlock(&boot_history_lock);
+    return n;
+}
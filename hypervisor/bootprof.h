@@ -0,0 +1,50 @@
+#ifndef BOOTPROF_H
+#define BOOTPROF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define BOOT_PROFILE_HISTORY 256 // boots kept for the percentiles, the oldest ones are dropped
+
+/*
+where the start of a VM goes. the host side marks the end of each step of vm_create, the guest
+side is seen from outside: its first KVM_RUN, its first console byte, lines of the kernel log and
+its first virtio-blk request. with console=ttyS0 the decompressor is silent and the kernel buffers
+its log until the serial console registers, so first_output and kernel come close together; with
+earlyprintk the decompressor prints first and the gap between them is the decompression.
+in the daemon first_run also counts the wait between the create and the start commands
+*/
+enum boot_mark
+{
+    BOOT_SETUP_VM, // KVM VM, memory, vCPU and the serial port
+    BOOT_LOAD_IMAGE, // the kernel image in guest memory
+    BOOT_DEVICES, // the disk image and the virtio devices
+    BOOT_LOAD_INITRD,
+    BOOT_FIRST_RUN, // the first KVM_RUN
+    BOOT_FIRST_OUTPUT, // the first byte on the console
+    BOOT_KERNEL, // "Linux version", the kernel is decompressed and its console up
+    BOOT_FIRST_BLK, // the first virtio-blk request
+    BOOT_USERSPACE, // "Run /", the kernel starts init
+    BOOT_READY, // the ready marker of the VM, if it has one
+    BOOT_MARK_COUNT,
+};
+
+typedef struct boot_profile
+{
+    uint64_t start_ns; // CLOCK_MONOTONIC when vm_create started
+    uint64_t at[BOOT_MARK_COUNT]; // ns after start_ns, 0 until the mark is reached
+    size_t matched[BOOT_MARK_COUNT]; // bytes of the console pattern of a mark matched so far
+    bool recorded; // in the history of the process already
+} boot_profile_t;
+
+void boot_profile_start(boot_profile_t* p);
+void boot_profile_mark(boot_profile_t* p, enum boot_mark mark); // only the first time counts
+void boot_profile_console(boot_profile_t* p, char c); // a byte the guest wrote to the console
+void boot_profile_record(boot_profile_t* p); // adds a started boot to the history, once
+void boot_profile_print(const boot_profile_t* p, FILE* f);
+int boot_profile_format(const boot_profile_t* p, char* buf, size_t len); // one line of key=value
+int boot_profile_format_history(char* buf, size_t len); // percentiles over the recorded boots
+
+#endif // BOOTPROF_H
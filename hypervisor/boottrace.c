@@ -0,0 +1,162 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "boottrace.h"
+
+static uint64_t boot_trace_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Written to a temporary file first, a boot that dies midway leaves no half
+ * a trace behind */
+static void boot_trace_save(struct boot_trace *t)
+{
+    struct boot_trace_header header = {.magic = BOOT_TRACE_MAGIC,
+                                       .version = BOOT_TRACE_VERSION,
+                                       .count = t->count};
+    char tmp[sizeof(t->path) + 8];
+    FILE *f;
+
+    t->recording = false;
+    if (!t->count)
+        return;
+    snprintf(tmp, sizeof(tmp), "%s.tmp", t->path);
+    f = fopen(tmp, "w");
+    if (!f) {
+        perror("boot trace");
+        return;
+    }
+    fwrite(&header, sizeof(header), 1, f);
+    fwrite(t->extents, sizeof(*t->extents), t->count, f);
+    if (fclose(f) != 0 || rename(tmp, t->path) < 0) {
+        perror("boot trace");
+        unlink(tmp);
+    }
+}
+
+static int boot_trace_load(struct boot_trace *t, FILE *f)
+{
+    struct boot_trace_header header;
+
+    if (fread(&header, sizeof(header), 1, f) != 1 ||
+        memcmp(header.magic, BOOT_TRACE_MAGIC, sizeof(header.magic)) ||
+        header.version != BOOT_TRACE_VERSION ||
+        header.count > BOOT_TRACE_MAX_EXTENTS)
+        return -1;
+    if (fread(t->extents, sizeof(*t->extents), header.count, f) != header.count)
+        return -1;
+    t->count = header.count;
+    return 0;
+}
+
+/* In the order the guest read them, so the first blocks it needs are the
+ * first ones in the page cache */
+static void *boot_trace_prefetch(void *arg)
+{
+    struct boot_trace *t = (struct boot_trace *) arg;
+    uint64_t start = boot_trace_now();
+
+    for (uint32_t i = 0; i < t->count; i++) {
+        posix_fadvise(t->fd, t->extents[i].offset, t->extents[i].len,
+                      POSIX_FADV_WILLNEED);
+        __atomic_add_fetch(&t->prefetch_bytes, t->extents[i].len,
+                           __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&t->prefetch_ns, boot_trace_now() - start + 1,
+                     __ATOMIC_RELEASE);
+    return NULL;
+}
+
+int boot_trace_init(struct boot_trace *t,
+                    int fd,
+                    const char *trace_path,
+                    unsigned int secs)
+{
+    FILE *f;
+
+    memset(t, 0, sizeof(*t));
+    if (strlen(trace_path) >= sizeof(t->path))
+        return -1;
+    strcpy(t->path, trace_path);
+    t->fd = fd;
+    t->extents = malloc(BOOT_TRACE_MAX_EXTENTS * sizeof(*t->extents));
+    if (!t->extents)
+        return -1;
+
+    f = fopen(trace_path, "r");
+    if (!f) {
+        t->recording = true;
+        t->deadline_ns = boot_trace_now() + secs * 1000000000ULL;
+        return 0;
+    }
+    if (boot_trace_load(t, f) < 0) {
+        printf("%s is not a boot trace, delete it to record a new one\n",
+               trace_path);
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    if (pthread_create(&t->prefetch_thread, NULL, boot_trace_prefetch, t) != 0)
+        return -1;
+    t->prefetching = true;
+    return 0;
+}
+
+/* Called by the queue thread only. A read that continues the last extent
+ * grows it, a read inside the last one is already there */
+void boot_trace_record(struct boot_trace *t, uint64_t offset, size_t len)
+{
+    struct boot_trace_extent *last =
+        t->count ? &t->extents[t->count - 1] : NULL;
+
+    if (boot_trace_now() > t->deadline_ns ||
+        t->count == BOOT_TRACE_MAX_EXTENTS) {
+        boot_trace_save(t);
+        return;
+    }
+    if (last && offset >= last->offset &&
+        offset + len <= last->offset + last->len)
+        return;
+    if (last && offset == last->offset + last->len &&
+        last->len + len <= UINT32_MAX) {
+        last->len += len;
+        return;
+    }
+    t->extents[t->count++] =
+        (struct boot_trace_extent){.offset = offset, .len = len};
+}
+
+void boot_trace_exit(struct boot_trace *t)
+{
+    if (t->recording)
+        boot_trace_save(t);
+    if (t->prefetching)
+        pthread_join(t->prefetch_thread, NULL);
+    t->prefetching = false;
+    free(t->extents);
+    t->extents = NULL;
+}
+
+void boot_trace_print(struct boot_trace *t)
+{
+    uint64_t ns = __atomic_load_n(&t->prefetch_ns, __ATOMIC_ACQUIRE);
+
+    if (t->recording)
+        printf("Boot trace: recording, %u extents so far\n", t->count);
+    else if (!t->prefetching)
+        printf("Boot trace: recorded %u extents into %s\n", t->count, t->path);
+    else if (ns)
+        printf("Boot trace: prefetched %u extents, %lu KB in %.1f ms\n",
+               t->count, t->prefetch_bytes >> 10, ns / 1e6);
+    else
+        printf("Boot trace: prefetching, %lu KB of %u extents so far\n",
+               __atomic_load_n(&t->prefetch_bytes, __ATOMIC_RELAXED) >> 10,
+               t->count);
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* The disk reads of the first seconds of a boot, kept next to the disk image.
+ * Boots of an image read nearly the same blocks in the same order, so the
+ * first boot records them as extents in the order it first read them and the
+ * boots after it replay the file with readahead() from a thread of their own,
+ * ahead of the guest, which then finds the blocks in the page cache. Delete
+ * the file to record again, e.g. after the image changed.
+ */
+
+#define BOOT_TRACE_SUFFIX ".boottrace"
+#define BOOT_TRACE_MAGIC "RKVMBIO"
+#define BOOT_TRACE_VERSION 1
+#define BOOT_TRACE_MAX_EXTENTS 65536
+
+struct boot_trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+};
+
+struct boot_trace_extent {
+    uint64_t offset;
+    uint32_t len;
+} __attribute__((packed));
+
+struct boot_trace {
+    char path[4096];
+    int fd; /* of the disk image */
+    bool recording;
+    uint64_t deadline_ns; /* recording stops at the first read after it */
+    struct boot_trace_extent *extents;
+    uint32_t count;
+    bool prefetching;
+    pthread_t prefetch_thread;
+    uint64_t prefetch_bytes; /* handed to readahead so far */
+    uint64_t prefetch_ns; /* from the start to the last extent, 0 until done */
+};
+
+/* Starts prefetching when trace_path holds a trace, else records the reads
+ * of the next secs seconds into it. Returns 0 on success */
+int boot_trace_init(struct boot_trace *t,
+                    int fd,
+                    const char *trace_path,
+                    unsigned int secs);
+void boot_trace_record(struct boot_trace *t, uint64_t offset, size_t len);
+/* Writes what was recorded so far, stops the prefetch */
+void boot_trace_exit(struct boot_trace *t);
+void boot_trace_print(struct boot_trace *t);
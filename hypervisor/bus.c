@@ -1,4 +1,5 @@
 #include "bus.h"
+#include "trace.h"
 #include <stddef.h>
 
 /*
@@ -39,6 +40,13 @@ void bus_handle_io(bus_t* bus, void* data, uint8_t is_write, uint64_t addr, uint
     // if a device is found and the address (and the size to be wirten) is within the device's range
     if (dev && addr + size - 1 <= dev->base_addr + dev->len - 1) 
     {
+        if (TRACE_ENABLED())
+        {
+            uint64_t start = trace_now();
+            dev->do_io(dev->owner, data, is_write, addr - dev->base_addr, size);
+            trace_record(TRACE_BUS_IO, size | is_write << 8, addr, trace_now() - start);
+            return;
+        }
         dev->do_io(dev->owner, data, is_write, addr - dev->base_addr, size);
     }
 }
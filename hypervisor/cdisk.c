@@ -0,0 +1,529 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cdisk.h"
+#include "lz4block.h"
+
+static uint64_t cdisk_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t log_offset(uint64_t nr_clusters)
+{
+    uint64_t end = CDISK_HEADER_SIZE + nr_clusters * sizeof(struct cdisk_entry);
+
+    return (end + 4095) & ~4095ULL;
+}
+
+static off_t entry_offset(uint64_t cluster)
+{
+    return CDISK_HEADER_SIZE + cluster * sizeof(struct cdisk_entry);
+}
+
+static bool is_zero(const uint8_t *data, size_t len)
+{
+    const uint64_t *p = (const uint64_t *) data;
+
+    for (size_t i = 0; i < len / 8; i++)
+        if (p[i])
+            return false;
+    return true;
+}
+
+bool cdisk_is_cdisk(int fd)
+{
+    struct cdisk_header header;
+
+    return pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+           !memcmp(header.magic, CDISK_MAGIC, sizeof(header.magic));
+}
+
+int cdisk_create(const char *path, uint64_t size, uint32_t cluster_size)
+{
+    struct cdisk_header header = {.magic = CDISK_MAGIC, .version = CDISK_VERSION,
+                                  .cluster_size = cluster_size ? cluster_size
+                                                               : CDISK_DEFAULT_CLUSTER_SIZE,
+                                  .size = size};
+    int fd;
+
+    if (header.cluster_size % 4096 || header.cluster_size > CDISK_MAX_CLUSTER_SIZE) {
+        printf("%s: clusters of %u bytes, not a multiple of 4096 up to %u\n", path,
+               header.cluster_size, CDISK_MAX_CLUSTER_SIZE);
+        return -1;
+    }
+    header.log_offset = log_offset((size + header.cluster_size - 1) / header.cluster_size);
+    /* the index starts out zero: every cluster is a zero one */
+    fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0 || ftruncate(fd, header.log_offset) < 0 ||
+        pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+        perror(path);
+        if (fd >= 0) {
+            unlink(path);
+            close(fd);
+        }
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+static int load_cluster(struct cdisk *d, uint64_t cluster, uint8_t *buf)
+{
+    struct cdisk_entry *e = &d->index[cluster];
+    uint32_t cluster_size = d->header.cluster_size;
+
+    if (!e->len) {
+        memset(buf, 0, cluster_size);
+        return 0;
+    }
+    if (e->flags & CDISK_ENTRY_RAW)
+        return pread(d->fd, buf, cluster_size, e->offset) == cluster_size ? 0 : -1;
+    if (pread(d->fd, d->cbuf, e->len, e->offset) != e->len ||
+        lz4_decompress(d->cbuf, e->len, buf, cluster_size) != (int) cluster_size) {
+        printf("%s: cluster %lu is damaged\n", d->path, cluster);
+        return -1;
+    }
+    return 0;
+}
+
+/* Appends the cluster to the log at end, e is where it went */
+static int append_cluster(struct cdisk *d, struct cdisk_slot *slot, uint64_t end, struct cdisk_entry *e)
+{
+    uint32_t cluster_size = d->header.cluster_size;
+    const uint8_t *src = d->cbuf;
+
+    *e = (struct cdisk_entry){0};
+    if (is_zero(slot->data, cluster_size))
+        return 0;
+    /* one that saves less than an eighth is not worth a decompression */
+    e->offset = end;
+    e->len = lz4_compress(slot->data, cluster_size, d->cbuf, cluster_size / 8 * 7);
+    if (!e->len) {
+        e->len = cluster_size;
+        e->flags = CDISK_ENTRY_RAW;
+        src = slot->data;
+    }
+    return pwrite(d->fd, src, e->len, e->offset) == e->len ? 0 : -1;
+}
+
+/* Appends the n clusters to the log, then, once they are on disk, points the
+ * index at them: the index never gets ahead of the data when the host dies.
+ * One fdatasync for the lot */
+static int write_back_batch(struct cdisk *d, struct cdisk_slot **slots, int n)
+{
+    struct cdisk_entry e[CDISK_CACHE_CLUSTERS];
+    uint64_t end = d->end;
+
+    for (int i = 0; i < n; i++) {
+        if (append_cluster(d, slots[i], end, &e[i]) < 0)
+            goto fail;
+        end += e[i].len;
+    }
+    if (end != d->end && fdatasync(d->fd) < 0)
+        goto fail;
+    d->end = end;
+    for (int i = 0; i < n; i++) {
+        struct cdisk_entry *old = &d->index[slots[i]->cluster];
+
+        if (pwrite(d->fd, &e[i], sizeof(e[i]), entry_offset(slots[i]->cluster)) != sizeof(e[i]))
+            goto fail;
+        d->stats.stored_bytes += e[i].len;
+        d->stats.stored_bytes -= old->len;
+        d->stats.zero_clusters += !e[i].len;
+        d->stats.zero_clusters -= !old->len;
+        d->stats.write_backs++;
+        *old = e[i];
+        slots[i]->dirty = false;
+        d->nr_dirty--;
+    }
+    return 0;
+
+fail:
+    /* the clusters appended are garbage, the ones left dirty go again */
+    perror(d->path);
+    return -1;
+}
+
+static int write_back(struct cdisk *d, struct cdisk_slot *slot)
+{
+    return write_back_batch(d, &slot, 1);
+}
+
+static struct cdisk_slot *find_slot(struct cdisk *d, uint64_t cluster)
+{
+    for (int i = 0; i < CDISK_CACHE_CLUSTERS; i++)
+        if (d->slots[i].cluster == (int64_t) cluster)
+            return &d->slots[i];
+    return NULL;
+}
+
+/* The slot of the cluster, the least recently used one evicted for it. load:
+ * with the content of the cluster, not needed when it is all overwritten */
+static struct cdisk_slot *get_slot(struct cdisk *d, uint64_t cluster, bool load)
+{
+    struct cdisk_slot *slot = find_slot(d, cluster);
+
+    if (slot) {
+        d->stats.cache_hits++;
+        slot->used = ++d->clock;
+        return slot;
+    }
+    d->stats.cache_misses++;
+    slot = &d->slots[0];
+    for (int i = 0; i < CDISK_CACHE_CLUSTERS && slot->cluster >= 0; i++)
+        if (d->slots[i].cluster < 0 || d->slots[i].used < slot->used)
+            slot = &d->slots[i];
+    if (slot->dirty && write_back(d, slot) < 0)
+        return NULL;
+    if (!slot->data)
+        slot->data = malloc(d->header.cluster_size);
+    slot->cluster = -1;
+    if (!slot->data || (load && load_cluster(d, cluster, slot->data) < 0))
+        return NULL;
+    slot->cluster = cluster;
+    slot->used = ++d->clock;
+    return slot;
+}
+
+ssize_t cdisk_read(struct cdisk *d, void *data, uint64_t offset, size_t size)
+{
+    uint32_t cluster_size = d->header.cluster_size;
+    uint8_t *dst = data;
+    size_t done = 0;
+
+    if (offset >= d->header.size)
+        return 0;
+    if (size > d->header.size - offset)
+        size = d->header.size - offset;
+    pthread_mutex_lock(&d->lock);
+    while (done < size) {
+        uint64_t cluster = (offset + done) / cluster_size;
+        size_t in = (offset + done) % cluster_size;
+        size_t len = cluster_size - in < size - done ? cluster_size - in : size - done;
+        struct cdisk_slot *slot = find_slot(d, cluster);
+
+        /* a whole cluster not in the cache goes straight to the caller: a
+         * scan does not evict the hot clusters */
+        if (!slot && len == cluster_size) {
+            d->stats.cache_misses++;
+            if (load_cluster(d, cluster, dst + done) < 0)
+                break;
+        } else {
+            slot = get_slot(d, cluster, true);
+            if (!slot)
+                break;
+            memcpy(dst + done, slot->data + in, len);
+        }
+        done += len;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return done == size ? (ssize_t) size : -1;
+}
+
+/* Writes back the oldest half of the dirty clusters, one sync for them */
+static void write_back_oldest(struct cdisk *d)
+{
+    struct cdisk_slot *batch[CDISK_MAX_DIRTY / 2];
+    int n = 0;
+
+    while (n < CDISK_MAX_DIRTY / 2) {
+        struct cdisk_slot *oldest = NULL;
+
+        for (int i = 0; i < CDISK_CACHE_CLUSTERS; i++) {
+            struct cdisk_slot *s = &d->slots[i];
+            bool taken = false;
+
+            for (int j = 0; j < n && !taken; j++)
+                taken = batch[j] == s;
+            if (s->dirty && !taken && (!oldest || s->dirty_ns < oldest->dirty_ns))
+                oldest = s;
+        }
+        if (!oldest)
+            break;
+        batch[n++] = oldest;
+    }
+    write_back_batch(d, batch, n);
+}
+
+ssize_t cdisk_write(struct cdisk *d, const void *data, uint64_t offset, size_t size)
+{
+    uint32_t cluster_size = d->header.cluster_size;
+    const uint8_t *src = data;
+    size_t done = 0;
+
+    if (offset >= d->header.size)
+        return 0;
+    if (size > d->header.size - offset)
+        size = d->header.size - offset;
+    pthread_mutex_lock(&d->lock);
+    while (done < size) {
+        uint64_t cluster = (offset + done) / cluster_size;
+        size_t in = (offset + done) % cluster_size;
+        size_t len = cluster_size - in < size - done ? cluster_size - in : size - done;
+        struct cdisk_slot *slot = get_slot(d, cluster, len < cluster_size);
+
+        if (!slot)
+            break;
+        memcpy(slot->data + in, src + done, len);
+        if (!slot->dirty) {
+            slot->dirty = true;
+            slot->dirty_ns = cdisk_now();
+            d->nr_dirty++;
+        }
+        if (d->nr_dirty > CDISK_MAX_DIRTY)
+            write_back_oldest(d);
+        done += len;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return done == size ? (ssize_t) size : -1;
+}
+
+int cdisk_flush(struct cdisk *d)
+{
+    struct cdisk_slot *batch[CDISK_CACHE_CLUSTERS];
+    int n = 0, ret;
+
+    pthread_mutex_lock(&d->lock);
+    for (int i = 0; i < CDISK_CACHE_CLUSTERS; i++)
+        if (d->slots[i].dirty)
+            batch[n++] = &d->slots[i];
+    ret = write_back_batch(d, batch, n);
+    pthread_mutex_unlock(&d->lock);
+    return ret;
+}
+
+/* Copies the live clusters to a new file without the lock, then, with it,
+ * the ones written back meanwhile, and puts the new file in place. Another
+ * compaction running (the flush thread's) fails it with EBUSY */
+int64_t cdisk_compact(struct cdisk *d)
+{
+    uint64_t size = d->nr_clusters * sizeof(struct cdisk_entry);
+    struct cdisk_entry *snap = malloc(size), *index = calloc(1, size);
+    uint8_t *buf = malloc(d->header.cluster_size);
+    char tmp[sizeof(d->path) + 16];
+    uint64_t pos = d->header.log_offset;
+    int64_t freed = -1;
+    bool started = false;
+    int fd = -1;
+
+    if (!snap || !index || !buf)
+        goto out;
+    pthread_mutex_lock(&d->lock);
+    if (d->compacting) {
+        pthread_mutex_unlock(&d->lock);
+        free(snap);
+        free(index);
+        free(buf);
+        errno = EBUSY;
+        return -1;
+    }
+    d->compacting = true;
+    started = true;
+    memcpy(snap, d->index, size);
+    pthread_mutex_unlock(&d->lock);
+
+    snprintf(tmp, sizeof(tmp), "%s.compact", d->path);
+    fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0 || ftruncate(fd, d->header.log_offset) < 0 ||
+        pwrite(fd, &d->header, sizeof(d->header), 0) != sizeof(d->header))
+        goto out;
+    /* the log is append only, the old copies stay where they are */
+    for (uint64_t c = 0; c < d->nr_clusters; c++) {
+        if (!snap[c].len)
+            continue;
+        if (pread(d->fd, buf, snap[c].len, snap[c].offset) != snap[c].len ||
+            pwrite(fd, buf, snap[c].len, pos) != snap[c].len)
+            goto out;
+        index[c] = snap[c];
+        index[c].offset = pos;
+        pos += snap[c].len;
+    }
+
+    pthread_mutex_lock(&d->lock);
+    for (uint64_t c = 0; c < d->nr_clusters; c++) {
+        struct cdisk_entry *e = &d->index[c];
+
+        if (!memcmp(e, &snap[c], sizeof(*e)))
+            continue;
+        index[c] = *e;
+        if (!e->len)
+            continue;
+        if (pread(d->fd, buf, e->len, e->offset) != e->len ||
+            pwrite(fd, buf, e->len, pos) != e->len) {
+            pthread_mutex_unlock(&d->lock);
+            goto out;
+        }
+        index[c].offset = pos;
+        pos += e->len;
+    }
+    if (pwrite(fd, index, size, CDISK_HEADER_SIZE) != (ssize_t) size ||
+        fdatasync(fd) < 0 || rename(tmp, d->path) < 0) {
+        pthread_mutex_unlock(&d->lock);
+        goto out;
+    }
+    close(d->fd);
+    d->fd = fd;
+    fd = -1;
+    memcpy(d->index, index, size);
+    freed = d->end - pos;
+    d->end = pos;
+    d->stats.compactions++;
+    d->stats.compacted_bytes += freed;
+    pthread_mutex_unlock(&d->lock);
+
+out:
+    if (fd >= 0) {
+        perror(tmp);
+        close(fd);
+        unlink(tmp);
+    }
+    if (started) {
+        pthread_mutex_lock(&d->lock);
+        d->compacting = false;
+        pthread_mutex_unlock(&d->lock);
+    }
+    free(snap);
+    free(index);
+    free(buf);
+    return freed;
+}
+
+static bool compaction_due(struct cdisk *d)
+{
+    uint64_t log_bytes = d->end - d->header.log_offset;
+    uint64_t garbage = log_bytes - d->stats.stored_bytes;
+
+    return garbage * 100 > log_bytes * CDISK_COMPACT_PCT &&
+           garbage > (uint64_t) CDISK_COMPACT_MIN_CLUSTERS * d->header.cluster_size;
+}
+
+/* Writes back the clusters dirty for CDISK_FLUSH_MS, and compacts */
+static void *cdisk_flush_thread(void *arg)
+{
+    struct cdisk *d = (struct cdisk *) arg;
+    struct timespec ts;
+
+    pthread_mutex_lock(&d->lock);
+    while (!d->stop) {
+        struct cdisk_slot *batch[CDISK_CACHE_CLUSTERS];
+        uint64_t now;
+        int n = 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        ts.tv_nsec += CDISK_FLUSH_MS / 2 * 1000000L;
+        ts.tv_sec += ts.tv_nsec / 1000000000L;
+        ts.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&d->flush_cond, &d->lock, &ts);
+        now = cdisk_now();
+        for (int i = 0; i < CDISK_CACHE_CLUSTERS && !d->stop; i++)
+            if (d->slots[i].dirty &&
+                now - d->slots[i].dirty_ns >= CDISK_FLUSH_MS * 1000000ULL)
+                batch[n++] = &d->slots[i];
+        if (n)
+            write_back_batch(d, batch, n);
+        if (!d->stop && compaction_due(d)) {
+            pthread_mutex_unlock(&d->lock);
+            cdisk_compact(d);
+            pthread_mutex_lock(&d->lock);
+        }
+    }
+    pthread_mutex_unlock(&d->lock);
+    return NULL;
+}
+
+int cdisk_open(struct cdisk *d, const char *path)
+{
+    pthread_condattr_t attr;
+    struct stat st;
+    uint64_t size;
+
+    memset(d, 0, sizeof(*d));
+    for (int i = 0; i < CDISK_CACHE_CLUSTERS; i++)
+        d->slots[i].cluster = -1;
+    if (strlen(path) >= sizeof(d->path))
+        return -1;
+    strcpy(d->path, path);
+    d->fd = open(path, O_RDWR | O_CLOEXEC);
+    if (d->fd < 0 || fstat(d->fd, &st) < 0 ||
+        pread(d->fd, &d->header, sizeof(d->header), 0) != sizeof(d->header) ||
+        memcmp(d->header.magic, CDISK_MAGIC, sizeof(d->header.magic)) ||
+        d->header.version != CDISK_VERSION || d->header.cluster_size % 4096 ||
+        !d->header.cluster_size || d->header.cluster_size > CDISK_MAX_CLUSTER_SIZE) {
+        printf("%s is not a compressed disk image\n", path);
+        goto fail;
+    }
+    d->nr_clusters = (d->header.size + d->header.cluster_size - 1) / d->header.cluster_size;
+    size = d->nr_clusters * sizeof(struct cdisk_entry);
+    d->index = malloc(size);
+    /* the worst case of LZ4 */
+    d->cbuf = malloc(d->header.cluster_size + d->header.cluster_size / 255 + 16);
+    if (!d->index || !d->cbuf || d->header.log_offset != log_offset(d->nr_clusters) ||
+        pread(d->fd, d->index, size, CDISK_HEADER_SIZE) != (ssize_t) size) {
+        printf("%s is truncated\n", path);
+        goto fail;
+    }
+    d->end = st.st_size > (off_t) d->header.log_offset ? (uint64_t) st.st_size
+                                                        : d->header.log_offset;
+    d->stats.clusters = d->nr_clusters;
+    for (uint64_t c = 0; c < d->nr_clusters; c++) {
+        struct cdisk_entry *e = &d->index[c];
+
+        if (e->len && (e->offset < d->header.log_offset || e->offset + e->len > d->end ||
+                       e->len > d->header.cluster_size)) {
+            printf("%s: the index entry of cluster %lu is damaged\n", path, c);
+            goto fail;
+        }
+        d->stats.stored_bytes += e->len;
+        d->stats.zero_clusters += !e->len;
+    }
+    pthread_mutex_init(&d->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&d->flush_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    if (pthread_create(&d->flush_thread, NULL, cdisk_flush_thread, d) != 0)
+        goto fail;
+    return 0;
+
+fail:
+    if (d->fd >= 0)
+        close(d->fd);
+    free(d->index);
+    free(d->cbuf);
+    return -1;
+}
+
+void cdisk_get_stats(struct cdisk *d, struct cdisk_stats *stats)
+{
+    struct stat st;
+
+    pthread_mutex_lock(&d->lock);
+    *stats = d->stats;
+    stats->log_bytes = d->end - d->header.log_offset;
+    stats->file_bytes = fstat(d->fd, &st) == 0 ? st.st_blocks * 512 : 0;
+    pthread_mutex_unlock(&d->lock);
+}
+
+void cdisk_close(struct cdisk *d)
+{
+    pthread_mutex_lock(&d->lock);
+    d->stop = true;
+    pthread_cond_signal(&d->flush_cond);
+    pthread_mutex_unlock(&d->lock);
+    pthread_join(d->flush_thread, NULL);
+    cdisk_flush(d);
+    for (int i = 0; i < CDISK_CACHE_CLUSTERS; i++)
+        free(d->slots[i].data);
+    close(d->fd);
+    free(d->index);
+    free(d->cbuf);
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+/* Compressed disk image. The disk is cut in clusters, each stored LZ4
+ * compressed (see lz4block.h), or as it is when it does not compress, or not
+ * at all when it is zero. The file is:
+ *
+ *   header        CDISK_HEADER_SIZE bytes
+ *   index         one struct cdisk_entry per cluster: where it is stored
+ *   log           the stored clusters, appended one after the other
+ *
+ * A cluster is never rewritten in place: a write back appends the new one to
+ * the log and points the index at it only once it is on disk (one fdatasync
+ * per batch of write backs). When the host dies, an index entry points at
+ * the new copy or at the old one, never at bytes that were not written; the
+ * writes not written back yet are lost, as those in the cache of a disk the
+ * guest did not flush. The old copies left in the log are collected by compaction,
+ * which copies the live clusters to a new file while the guest runs on and
+ * replaces the image with it.
+ *
+ * A cache of decompressed clusters serves the hot reads and holds the
+ * writes: a dirty cluster is compressed and written back when it is evicted,
+ * when too many clusters are dirty, or CDISK_FLUSH_MS after its first write,
+ * by a thread of its own that also starts the compaction once half of the log
+ * is garbage.
+ */
+
+#define CDISK_MAGIC "RKVMCMP"
+#define CDISK_VERSION 1
+#define CDISK_HEADER_SIZE 4096
+#define CDISK_DEFAULT_CLUSTER_SIZE 65536
+#define CDISK_MAX_CLUSTER_SIZE (1 << 20)
+#define CDISK_CACHE_CLUSTERS 256
+#define CDISK_MAX_DIRTY 64 /* clusters, the others wait for the write backs */
+#define CDISK_FLUSH_MS 1000
+#define CDISK_COMPACT_PCT 50 /* of the log being garbage */
+#define CDISK_COMPACT_MIN_CLUSTERS 64 /* of garbage, a small log is left alone */
+
+#define CDISK_ENTRY_RAW 1 /* stored uncompressed */
+
+struct cdisk_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t cluster_size;
+    uint64_t size; /* of the disk */
+    uint64_t log_offset;
+};
+
+struct cdisk_entry {
+    uint64_t offset;
+    uint32_t len; /* 0 for a zero cluster */
+    uint32_t flags;
+};
+
+struct cdisk_stats {
+    uint64_t clusters;
+    uint64_t zero_clusters;
+    uint64_t stored_bytes; /* of the live clusters */
+    uint64_t log_bytes; /* live and garbage */
+    uint64_t file_bytes; /* allocated on the host */
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t write_backs;
+    uint64_t compactions;
+    uint64_t compacted_bytes; /* garbage given back */
+};
+
+struct cdisk_slot {
+    int64_t cluster; /* -1 for a free slot */
+    uint8_t *data;
+    bool dirty;
+    uint64_t dirty_ns; /* of the first write since the last write back */
+    uint64_t used; /* LRU clock */
+};
+
+struct cdisk {
+    char path[4096];
+    int fd;
+    pthread_mutex_t lock;
+    struct cdisk_header header;
+    struct cdisk_entry *index;
+    uint64_t nr_clusters;
+    uint64_t end; /* of the log */
+    uint8_t *cbuf; /* one compressed cluster */
+    struct cdisk_slot slots[CDISK_CACHE_CLUSTERS];
+    uint64_t clock;
+    unsigned int nr_dirty;
+    struct cdisk_stats stats;
+    pthread_t flush_thread;
+    pthread_cond_t flush_cond;
+    bool stop;
+    bool compacting;
+};
+
+bool cdisk_is_cdisk(int fd);
+/* An empty disk of size bytes. Returns 0 on success */
+int cdisk_create(const char *path, uint64_t size, uint32_t cluster_size);
+int cdisk_open(struct cdisk *d, const char *path);
+ssize_t cdisk_read(struct cdisk *d, void *data, uint64_t offset, size_t size);
+ssize_t cdisk_write(struct cdisk *d, const void *data, uint64_t offset, size_t size);
+/* Writes back every dirty cluster. Returns 0 or -1 */
+int cdisk_flush(struct cdisk *d);
+/* Collects the garbage of the log now. Returns the bytes given back, or -1
+ * with errno EBUSY while a compaction is running already */
+int64_t cdisk_compact(struct cdisk *d);
+void cdisk_get_stats(struct cdisk *d, struct cdisk_stats *stats);
+/* Writes back the dirty clusters */
+void cdisk_close(struct cdisk *d);
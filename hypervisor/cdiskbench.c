@@ -0,0 +1,327 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cdisk.h"
+#include "diskimg.h"
+
+/* Space and throughput of a compressed disk image (cdisk.h) against the same
+ * disk as a plain file, through the diskimg calls virtio-blk makes. The disk
+ * is made up of zero blocks, text, tables of small numbers and random bytes
+ * (already compressed files), or is a copy of a real image given with -f. The
+ * page cache is dropped before the cold reads, the writes of the compressed
+ * image include their write back.
+ */
+
+#define FS_BLOCK 4096
+#define SEQ_CHUNK (1 << 20)
+#define HOT_SET (8 << 20) /* fits in the cluster cache with the default cluster size */
+
+struct cdiskbench {
+    const char *dir;
+    const char *source; /* a real image, NULL for a made up one */
+    uint64_t size;
+    uint32_t cluster_size;
+    unsigned int ops;
+    char raw_path[4096 + 32];
+    char cdisk_path[4096 + 32];
+    uint8_t *buf;
+    int failed;
+};
+
+static const char *const words[] = {
+    "the", "kernel", "module", "package", "install", "config", "device", "driver",
+    "libc", "python3", "share", "usr", "lib", "bin", "version", "error",
+    "return", "static", "struct", "void", "int", "if", "else", "for",
+    "while", "include", "define", "printf", "memory", "network", "file", "system",
+};
+
+static uint64_t bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t mix(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    return x ^ (x >> 33);
+}
+
+static void fill_block(uint8_t *buf, uint64_t seed)
+{
+    uint64_t kind = mix(seed) % 100;
+    uint64_t *p = (uint64_t *) buf;
+    size_t len = 0;
+
+    if (kind < 30) {
+        memset(buf, 0, FS_BLOCK);
+    } else if (kind < 75) {
+        for (uint64_t i = 0; len < FS_BLOCK; i++) {
+            const char *w = words[mix(seed * 1024 + i) % 32];
+            size_t n = strlen(w);
+
+            if (len + n + 1 > FS_BLOCK)
+                n = FS_BLOCK - len - 1;
+            memcpy(buf + len, w, n);
+            len += n;
+            buf[len++] = i % 12 == 11 ? '\n' : ' ';
+        }
+    } else if (kind < 85) {
+        for (size_t i = 0; i < FS_BLOCK / 8; i++)
+            p[i] = (i << 32) | (mix(seed * 512 + i) & 0xff);
+    } else {
+        for (size_t i = 0; i < FS_BLOCK / 8; i++)
+            p[i] = mix(seed * 512 + i);
+    }
+}
+
+static void check(struct cdiskbench *b, bool ok, const char *what)
+{
+    if (!ok) {
+        printf("FAILED: %s\n", what);
+        b->failed = 1;
+    }
+}
+
+static void drop_cache(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+        return;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+static uint64_t disk_usage(const char *path)
+{
+    struct stat st;
+
+    return stat(path, &st) < 0 ? 0 : st.st_blocks * 512;
+}
+
+/* The raw image, written out in full like a real one */
+static void write_raw(struct cdiskbench *b)
+{
+    int src = b->source ? open(b->source, O_RDONLY) : -1;
+    int fd = open(b->raw_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    struct stat st;
+
+    if (b->source && (src < 0 || fstat(src, &st) < 0)) {
+        perror(b->source);
+        exit(1);
+    }
+    if (b->source)
+        b->size = st.st_size / SEQ_CHUNK * SEQ_CHUNK;
+    for (uint64_t off = 0; fd >= 0 && off < b->size; off += SEQ_CHUNK) {
+        if (src >= 0) {
+            if (pread(src, b->buf, SEQ_CHUNK, off) != SEQ_CHUNK)
+                break;
+        } else {
+            for (size_t i = 0; i < SEQ_CHUNK; i += FS_BLOCK)
+                fill_block(b->buf + i, (off + i) / FS_BLOCK);
+        }
+        if (pwrite(fd, b->buf, SEQ_CHUNK, off) != SEQ_CHUNK)
+            break;
+    }
+    if (fd < 0 || fsync(fd) < 0 || !b->size) {
+        perror(b->raw_path);
+        exit(1);
+    }
+    close(fd);
+    if (src >= 0)
+        close(src);
+}
+
+/* The writes of the compressed image are done once written back */
+static void settle(struct diskimg *d)
+{
+    if (d->cdisk)
+        cdisk_flush(d->cdisk);
+}
+
+static double seq_io(struct diskimg *d, uint8_t *buf, bool write)
+{
+    uint64_t start = bench_now();
+
+    for (uint64_t off = 0; off < d->size; off += SEQ_CHUNK) {
+        if (write) {
+            for (size_t i = 0; i < SEQ_CHUNK; i += FS_BLOCK)
+                fill_block(buf + i, 1000000000 + (off + i) / FS_BLOCK);
+            if (diskimg_write(d, buf, off, SEQ_CHUNK) != SEQ_CHUNK)
+                return 0;
+        } else if (diskimg_read(d, buf, off, SEQ_CHUNK) != SEQ_CHUNK) {
+            return 0;
+        }
+    }
+    settle(d);
+    return (d->size >> 20) / ((bench_now() - start) / 1e9);
+}
+
+/* 4K requests at random offsets in the first span bytes of the disk */
+static double random_io(struct cdiskbench *b, struct diskimg *d, uint64_t span, bool write)
+{
+    uint64_t blocks = span / FS_BLOCK;
+    uint64_t start = bench_now();
+
+    for (unsigned int i = 0; i < b->ops; i++) {
+        uint64_t block = mix(i + (write ? 7 : 3) + span) % blocks;
+
+        if (write) {
+            fill_block(b->buf, 2000000000 + i);
+            if (diskimg_write(d, b->buf, block * FS_BLOCK, FS_BLOCK) != FS_BLOCK)
+                return 0;
+        } else if (diskimg_read(d, b->buf, block * FS_BLOCK, FS_BLOCK) != FS_BLOCK) {
+            return 0;
+        }
+    }
+    settle(d);
+    return b->ops / ((bench_now() - start) / 1e9);
+}
+
+static void throughput(struct cdiskbench *b, struct diskimg *d, const char *name, const char *path)
+{
+    double seq_read, cold_read, hot_read, rand_write, seq_write;
+
+    drop_cache(path);
+    seq_read = seq_io(d, b->buf, false);
+    drop_cache(path);
+    cold_read = random_io(b, d, d->size, false);
+    random_io(b, d, HOT_SET, false);
+    hot_read = random_io(b, d, HOT_SET, false);
+    rand_write = random_io(b, d, d->size, true);
+    seq_write = seq_io(d, b->buf, true);
+    printf("%-10s seq read %6.0f MB/s  4K read %7.0f IOPS  hot 4K read %8.0f IOPS  "
+           "4K write %7.0f IOPS  seq write %5.0f MB/s\n",
+           name, seq_read, cold_read, hot_read, rand_write, seq_write);
+    check(b, seq_read && cold_read && hot_read && rand_write && seq_write, name);
+}
+
+static bool same_disks(struct diskimg *a, struct diskimg *c)
+{
+    uint8_t *buf = malloc(SEQ_CHUNK), *buf2 = malloc(SEQ_CHUNK);
+    bool same = buf && buf2 && a->size == c->size;
+
+    for (uint64_t off = 0; same && off < a->size; off += SEQ_CHUNK)
+        same = diskimg_read(a, buf, off, SEQ_CHUNK) == SEQ_CHUNK &&
+               diskimg_read(c, buf2, off, SEQ_CHUNK) == SEQ_CHUNK &&
+               !memcmp(buf, buf2, SEQ_CHUNK);
+    free(buf);
+    free(buf2);
+    return same;
+}
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [-m mbytes] [-c cluster size] [-f image] [-d dir]\n", prog);
+    printf("  -m  disk size in MB (default 256)\n");
+    printf("  -c  cluster size of the compressed image (default %d)\n", CDISK_DEFAULT_CLUSTER_SIZE);
+    printf("  -f  a real disk image to copy instead of a made up one\n");
+    printf("  -d  directory of the disk images (default /tmp)\n");
+}
+
+int main(int argc, char **argv)
+{
+    struct cdiskbench b = {.dir = "/tmp", .size = 256ULL << 20,
+                           .cluster_size = CDISK_DEFAULT_CLUSTER_SIZE, .ops = 20000};
+    struct diskimg raw, cd;
+    struct cdisk_stats stats, before;
+    uint64_t start, raw_bytes;
+    int64_t freed;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:c:f:d:")) != -1) {
+        switch (opt) {
+        case 'm':
+            b.size = strtoull(optarg, NULL, 10) << 20;
+            break;
+        case 'c':
+            b.cluster_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'f':
+            b.source = optarg;
+            break;
+        case 'd':
+            b.dir = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!b.size || b.size < HOT_SET) {
+        usage(argv[0]);
+        return 1;
+    }
+    snprintf(b.raw_path, sizeof(b.raw_path), "%s/cdiskbench.%d.raw", b.dir, getpid());
+    snprintf(b.cdisk_path, sizeof(b.cdisk_path), "%s/cdiskbench.%d.cdisk", b.dir, getpid());
+    b.buf = malloc(SEQ_CHUNK);
+    if (!b.buf)
+        return 1;
+    write_raw(&b);
+    raw_bytes = disk_usage(b.raw_path);
+
+    start = bench_now();
+    if (cdisk_create(b.cdisk_path, b.size, b.cluster_size) < 0 ||
+        diskimg_init(&raw, b.raw_path) < 0 || diskimg_init(&cd, b.cdisk_path) < 0) {
+        unlink(b.raw_path);
+        unlink(b.cdisk_path);
+        return 1;
+    }
+    for (uint64_t off = 0; off < b.size; off += SEQ_CHUNK)
+        if (diskimg_read(&raw, b.buf, off, SEQ_CHUNK) != SEQ_CHUNK ||
+            diskimg_write(&cd, b.buf, off, SEQ_CHUNK) != SEQ_CHUNK)
+            break;
+    settle(&cd);
+    cdisk_get_stats(cd.cdisk, &stats);
+    printf("%lu MB %s disk, %u byte clusters, imported in %.0f ms\n", b.size >> 20,
+           b.source ? b.source : "made up", b.cluster_size, (bench_now() - start) / 1e6);
+    printf("on disk: raw %lu MB, compressed %lu MB (%.2fx)\n", raw_bytes >> 20,
+           stats.file_bytes >> 20, (double) raw_bytes / stats.file_bytes);
+    check(&b, same_disks(&raw, &cd), "the compressed image reads as the raw one");
+
+    throughput(&b, &raw, "raw file", b.raw_path);
+    before = stats;
+    throughput(&b, &cd, "compressed", b.cdisk_path);
+    check(&b, same_disks(&raw, &cd), "the compressed image reads as the raw one after the writes");
+
+    /* the flush thread may have compacted already, or be at it: the
+     * garbage of the writes above is given back either way */
+    cdisk_get_stats(cd.cdisk, &stats);
+    start = bench_now();
+    while ((freed = cdisk_compact(cd.cdisk)) < 0 && errno == EBUSY)
+        usleep(1000);
+    printf("compaction: %lu MB of log, %ld MB of garbage given back in %.0f ms, %lu MB on disk\n",
+           stats.log_bytes >> 20, freed >> 20, (bench_now() - start) / 1e6,
+           disk_usage(b.cdisk_path) >> 20);
+    check(&b, freed >= 0, "compaction");
+    cdisk_get_stats(cd.cdisk, &stats);
+    printf("compactions since the import: %lu, %lu MB given back\n", stats.compactions - before.compactions,
+           (stats.compacted_bytes - before.compacted_bytes) >> 20);
+    check(&b, stats.compacted_bytes > before.compacted_bytes && stats.log_bytes == stats.stored_bytes,
+          "the garbage of the writes given back");
+    check(&b, same_disks(&raw, &cd), "the compressed image reads as the raw one after the compaction");
+    cdisk_get_stats(cd.cdisk, &stats);
+    printf("cluster cache: %lu hits, %lu misses\n", stats.cache_hits, stats.cache_misses);
+
+    diskimg_exit(&raw);
+    diskimg_exit(&cd);
+    unlink(b.raw_path);
+    unlink(b.cdisk_path);
+    free(b.buf);
+    printf(b.failed ? "cdiskbench: FAILED\n" : "cdiskbench: all checks passed\n");
+    return b.failed;
+}
@@ -0,0 +1,154 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cdisk.h"
+
+/* Conversion of disk images from and to the compressed format of cdisk.h,
+ * and its compaction, while no hypervisor uses the image. A running guest
+ * answers "disk" and "disk compact" on its control socket instead.
+ */
+
+#define CDISKTOOL_CHUNK (1 << 20)
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s import [-c cluster size] <raw image> <compressed image>\n", prog);
+    printf("       %s export <compressed image> <raw image>\n", prog);
+    printf("       %s compact <compressed image>\n", prog);
+    printf("       %s stats <compressed image>\n", prog);
+}
+
+static void print_stats(struct cdisk *d)
+{
+    struct cdisk_stats stats;
+
+    cdisk_get_stats(d, &stats);
+    printf("%s: %lu MB disk, %u byte clusters, %lu of %lu zero\n", d->path,
+           d->header.size >> 20, d->header.cluster_size, stats.zero_clusters,
+           stats.clusters);
+    printf("  stored   %8lu KB of clusters, %lu KB of log\n", stats.stored_bytes >> 10,
+           stats.log_bytes >> 10);
+    printf("  on disk  %8lu KB, %.2fx smaller than the disk\n", stats.file_bytes >> 10,
+           stats.file_bytes ? (double) d->header.size / stats.file_bytes : 0.0);
+}
+
+static int cdisk_import(const char *raw, const char *path, uint32_t cluster_size)
+{
+    uint8_t *buf = malloc(CDISKTOOL_CHUNK);
+    struct cdisk d;
+    uint64_t done = 0;
+    struct stat st;
+    ssize_t n = 0;
+    int fd = open(raw, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &st) < 0 || !buf) {
+        perror(raw);
+        return 1;
+    }
+    if (cdisk_create(path, st.st_size, cluster_size) < 0 || cdisk_open(&d, path) < 0)
+        return 1;
+    while (done < (uint64_t) st.st_size &&
+           (n = pread(fd, buf, CDISKTOOL_CHUNK, done)) > 0) {
+        if (cdisk_write(&d, buf, done, n) != n)
+            break;
+        done += n;
+    }
+    if (cdisk_flush(&d) == 0 && done == (uint64_t) st.st_size)
+        print_stats(&d);
+    cdisk_close(&d);
+    close(fd);
+    free(buf);
+    if (done != (uint64_t) st.st_size) {
+        unlink(path);
+        return 1;
+    }
+    return 0;
+}
+
+static int cdisk_export(const char *path, const char *raw)
+{
+    uint8_t *buf = malloc(CDISKTOOL_CHUNK);
+    struct cdisk d;
+    uint64_t done = 0;
+    ssize_t n;
+    int fd;
+
+    if (!buf || cdisk_open(&d, path) < 0)
+        return 1;
+    fd = open(raw, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 || ftruncate(fd, d.header.size) < 0) {
+        perror(raw);
+        cdisk_close(&d);
+        return 1;
+    }
+    while (done < d.header.size && (n = cdisk_read(&d, buf, done, CDISKTOOL_CHUNK)) > 0) {
+        if (pwrite(fd, buf, n, done) != n) {
+            perror(raw);
+            break;
+        }
+        done += n;
+    }
+    n = done == d.header.size ? 0 : 1;
+    cdisk_close(&d);
+    close(fd);
+    free(buf);
+    return n;
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t cluster_size = 0;
+    const char *cmd;
+    struct cdisk d;
+    int64_t freed;
+    int opt;
+
+    if (argc < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+    cmd = argv[1];
+    optind = 2;
+    while ((opt = getopt(argc, argv, "c:")) != -1) {
+        switch (opt) {
+        case 'c':
+            cluster_size = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    argv += optind;
+    argc -= optind;
+
+    if (!strcmp(cmd, "import") && argc == 2)
+        return cdisk_import(argv[0], argv[1], cluster_size);
+    if (!strcmp(cmd, "export") && argc == 2)
+        return cdisk_export(argv[0], argv[1]);
+    if ((!strcmp(cmd, "compact") || !strcmp(cmd, "stats")) && argc == 1) {
+        if (cdisk_open(&d, argv[0]) < 0)
+            return 1;
+        if (!strcmp(cmd, "compact")) {
+            freed = cdisk_compact(&d);
+            if (freed < 0 && errno == EBUSY)
+                printf("a compaction is running already\n");
+            if (freed < 0) {
+                cdisk_close(&d);
+                return 1;
+            }
+            printf("%ld KB of garbage given back\n", freed >> 10);
+        }
+        print_stats(&d);
+        cdisk_close(&d);
+        return 0;
+    }
+    usage(argv[0]);
+    return 1;
+}
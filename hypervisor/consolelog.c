@@ -0,0 +1,255 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "consolelog.h"
+
+static struct console_log_rec *console_log_slot(struct console_log *log, uint64_t seq)
+{
+    return &log->index[seq % log->hdr->nindex];
+}
+
+/* Whether record seq is all there, the header may come from a run that
+ * crashed half way through an append */
+static bool console_log_valid(struct console_log *log, uint64_t seq)
+{
+    struct console_log_hdr *hdr = log->hdr;
+    struct console_log_rec *rec = console_log_slot(log, seq);
+
+    return seq >= hdr->first_seq && seq < hdr->next_seq && rec->seq == seq &&
+           rec->len <= CONSOLE_LOG_MAX_RECORD && rec->off + rec->len <= hdr->data_head &&
+           rec->off + hdr->data_size >= hdr->data_head;
+}
+
+/* The oldest records go until len more bytes fit, and a slot for a new
+ * record with new_rec */
+static void console_log_evict(struct console_log *log, size_t len, bool new_rec)
+{
+    struct console_log_hdr *hdr = log->hdr;
+
+    while (hdr->first_seq < hdr->next_seq) {
+        struct console_log_rec *rec = console_log_slot(log, hdr->first_seq);
+
+        if (!(new_rec && hdr->next_seq - hdr->first_seq >= hdr->nindex) &&
+            rec->off + hdr->data_size >= hdr->data_head + len)
+            break;
+        hdr->first_seq++;
+    }
+}
+
+static void console_log_copy(struct console_log *log, uint64_t off, uint8_t *buf, size_t len, bool to_log)
+{
+    uint64_t size = log->hdr->data_size;
+    size_t pos = off % size;
+    size_t first = len < size - pos ? len : size - pos;
+
+    if (to_log) {
+        memcpy(log->data + pos, buf, first);
+        memcpy(log->data, buf + first, len - first);
+    } else {
+        memcpy(buf, log->data + pos, first);
+        memcpy(buf + first, log->data, len - first);
+    }
+}
+
+static void console_log_reset(struct console_log *log, uint64_t size, uint32_t nindex)
+{
+    memset(log->index, 0, (size_t) nindex * sizeof(struct console_log_rec));
+    *log->hdr = (struct console_log_hdr){
+        .magic = CONSOLE_LOG_MAGIC,
+        .version = CONSOLE_LOG_VERSION,
+        .nindex = nindex,
+        .data_size = size,
+    };
+}
+
+/* Goes on with a log of the same geometry, without what a crash left half
+ * written. The line the last run was in the middle of is not continued */
+static void console_log_resume(struct console_log *log, uint64_t size, uint32_t nindex)
+{
+    struct console_log_hdr *hdr = log->hdr;
+
+    if (hdr->magic != CONSOLE_LOG_MAGIC || hdr->version != CONSOLE_LOG_VERSION ||
+        hdr->data_size != size || hdr->nindex != nindex || hdr->first_seq > hdr->next_seq ||
+        hdr->next_seq - hdr->first_seq > nindex) {
+        console_log_reset(log, size, nindex);
+        return;
+    }
+    while (hdr->first_seq < hdr->next_seq && !console_log_valid(log, hdr->first_seq))
+        hdr->first_seq++;
+    while (hdr->next_seq > hdr->first_seq && !console_log_valid(log, hdr->next_seq - 1))
+        hdr->next_seq--;
+    hdr->open = 0;
+}
+
+int console_log_open(struct console_log *log, const char *path, uint64_t size)
+{
+    struct console_log_hdr hdr = {0};
+    size_t index_size;
+    uint32_t nindex;
+    struct stat st;
+    int fd;
+
+    memset(log, 0, sizeof(*log));
+    log->readonly = !size;
+    if (size && (size < CONSOLE_LOG_MIN_SIZE || size > CONSOLE_LOG_MAX_SIZE)) {
+        fprintf(stderr, "console log: the size is %d KiB to %llu MiB\n",
+                CONSOLE_LOG_MIN_SIZE >> 10, CONSOLE_LOG_MAX_SIZE >> 20);
+        return -1;
+    }
+    fd = open(path, log->readonly ? O_RDONLY | O_CLOEXEC : O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    /* never a file that is something else, e.g. a disk image given by mistake */
+    if ((st.st_size || log->readonly) &&
+        (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || hdr.magic != CONSOLE_LOG_MAGIC ||
+         (log->readonly && (hdr.version != CONSOLE_LOG_VERSION || !hdr.nindex || !hdr.data_size)))) {
+        fprintf(stderr, "%s: not a console log\n", path);
+        close(fd);
+        return -1;
+    }
+    if (log->readonly)
+        size = hdr.data_size;
+    nindex = log->readonly ? hdr.nindex : size / CONSOLE_LOG_AVG_RECORD;
+    index_size = ((size_t) nindex * sizeof(struct console_log_rec) + 4095) & ~(size_t) 4095;
+    log->map_size = CONSOLE_LOG_HDR_SIZE + index_size + size;
+    if (log->readonly ? (uint64_t) st.st_size < log->map_size : ftruncate(fd, log->map_size) < 0) {
+        fprintf(stderr, "%s: %s\n", path, log->readonly ? "truncated console log" : strerror(errno));
+        close(fd);
+        return -1;
+    }
+    log->hdr = mmap(NULL, log->map_size, PROT_READ | (log->readonly ? 0 : PROT_WRITE), MAP_SHARED, fd, 0);
+    close(fd);
+    if (log->hdr == MAP_FAILED) {
+        perror("mmap console log");
+        log->hdr = NULL;
+        return -1;
+    }
+    log->index = (struct console_log_rec *) ((uint8_t *) log->hdr + CONSOLE_LOG_HDR_SIZE);
+    log->data = (uint8_t *) log->index + index_size;
+    if (!log->readonly)
+        console_log_resume(log, size, nindex);
+    log->path = strdup(path);
+    pthread_mutex_init(&log->lock, NULL);
+    return 0;
+}
+
+void console_log_close(struct console_log *log)
+{
+    if (!log->hdr)
+        return;
+    munmap(log->hdr, log->map_size);
+    pthread_mutex_destroy(&log->lock);
+    free(log->path);
+    log->hdr = NULL;
+}
+
+/* A line ends its record, the next output starts a new one. Records of a
+ * line still being written grow in place */
+void console_log_append(struct console_log *log, const void *buf, size_t len)
+{
+    struct console_log_hdr *hdr = log->hdr;
+    const uint8_t *p = buf;
+    struct timespec now;
+
+    if (!hdr || log->readonly)
+        return;
+    clock_gettime(CLOCK_REALTIME, &now);
+    pthread_mutex_lock(&log->lock);
+    while (len) {
+        struct console_log_rec *rec = console_log_slot(log, hdr->next_seq - 1);
+        const uint8_t *nl = memchr(p, '\n', len);
+        size_t n = nl ? (size_t) (nl - p) + 1 : len;
+
+        if (!hdr->open || rec->len == CONSOLE_LOG_MAX_RECORD) {
+            console_log_evict(log, 0, true);
+            rec = console_log_slot(log, hdr->next_seq);
+            *rec = (struct console_log_rec){
+                .seq = hdr->next_seq,
+                .off = hdr->data_head,
+                .time_ns = now.tv_sec * 1000000000ULL + now.tv_nsec,
+            };
+            hdr->next_seq++;
+            hdr->open = 1;
+        }
+        if (n > CONSOLE_LOG_MAX_RECORD - rec->len)
+            n = CONSOLE_LOG_MAX_RECORD - rec->len;
+        console_log_evict(log, n, false);
+        console_log_copy(log, hdr->data_head, (uint8_t *) p, n, true);
+        hdr->data_head += n;
+        rec->len += n;
+        if (p[n - 1] == '\n')
+            hdr->open = 0;
+        p += n;
+        len -= n;
+    }
+    pthread_mutex_unlock(&log->lock);
+}
+
+void console_log_range(struct console_log *log, uint64_t *first, uint64_t *next)
+{
+    pthread_mutex_lock(&log->lock);
+    *first = log->hdr->first_seq;
+    *next = log->hdr->next_seq;
+    pthread_mutex_unlock(&log->lock);
+}
+
+ssize_t console_log_read(struct console_log *log,
+                         uint64_t seq,
+                         struct console_log_rec *rec,
+                         void *buf,
+                         size_t len)
+{
+    pthread_mutex_lock(&log->lock);
+    if (!console_log_valid(log, seq)) {
+        pthread_mutex_unlock(&log->lock);
+        return -1;
+    }
+    *rec = *console_log_slot(log, seq);
+    if (len > rec->len)
+        len = rec->len;
+    console_log_copy(log, rec->off, buf, len, false);
+    pthread_mutex_unlock(&log->lock);
+    return len;
+}
+
+uint64_t console_log_dump(struct console_log *log, uint64_t seq, uint64_t end, FILE *f, bool raw)
+{
+    uint8_t buf[CONSOLE_LOG_MAX_RECORD];
+    struct console_log_rec rec;
+    uint64_t first, next;
+
+    console_log_range(log, &first, &next);
+    if (seq < first)
+        seq = first;
+    if (end > next)
+        end = next;
+    for (; seq < end; seq++) {
+        ssize_t n = console_log_read(log, seq, &rec, buf, sizeof(buf));
+
+        /* overwritten since, by the hypervisor writing the log */
+        if (n < 0)
+            continue;
+        if (!raw) {
+            time_t secs = rec.time_ns / 1000000000;
+            char stamp[32];
+            struct tm tm;
+
+            strftime(stamp, sizeof(stamp), "%F %T", localtime_r(&secs, &tm));
+            fprintf(f, "%lu %s.%06lu ", seq, stamp, rec.time_ns % 1000000000 / 1000);
+        }
+        fwrite(buf, 1, n, f);
+        if (!raw && (!n || buf[n - 1] != '\n'))
+            fputc('\n', f);
+    }
+    return seq;
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+/* The console output of a guest kept in a file mapped into memory: a ring of
+ * records, each a line of output (or a part of a long one) with a sequence
+ * number and the wall clock time of its first byte. The oldest records make
+ * room for new ones. The file outlives the hypervisor, a new run with the
+ * same path and size goes on where the last one stopped, and
+ * build/consolelogdump reads it with or without a running hypervisor.
+ *
+ * The file is a page of header, the index then the data. The index has a
+ * slot per record, record seq is in slot seq % nindex, so finding a record
+ * by its number is one lookup and replaying from any number costs nothing
+ * but the copy. The data is a ring of the bytes of the records.
+ */
+
+#define CONSOLE_LOG_MAGIC 0x474f4c4e4f534e43ULL /* "CNSONLOG" */
+#define CONSOLE_LOG_VERSION 1
+#define CONSOLE_LOG_DEFAULT_SIZE (1 << 20) /* bytes of data */
+#define CONSOLE_LOG_MIN_SIZE (64 << 10)
+#define CONSOLE_LOG_MAX_SIZE (1ULL << 32)
+#define CONSOLE_LOG_MAX_RECORD 256 /* a longer line goes on in the next record */
+#define CONSOLE_LOG_AVG_RECORD 64 /* bytes of data per index slot */
+#define CONSOLE_LOG_HDR_SIZE 4096
+
+struct console_log_hdr {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t nindex; /* slots of the index */
+    uint64_t data_size;
+    uint64_t first_seq; /* the oldest record kept */
+    uint64_t next_seq; /* the number of the next record */
+    uint64_t data_head; /* bytes written since the log was made */
+    uint32_t open; /* the last record takes more bytes until its line ends */
+    uint32_t reserved;
+};
+
+struct console_log_rec {
+    uint64_t seq; /* tells a slot in use from a stale one */
+    uint64_t off; /* of its first byte, in data_head terms */
+    uint64_t time_ns; /* CLOCK_REALTIME of its first byte */
+    uint32_t len;
+    uint32_t reserved;
+};
+
+struct console_log {
+    struct console_log_hdr *hdr;
+    struct console_log_rec *index;
+    uint8_t *data;
+    size_t map_size;
+    bool readonly;
+    char *path;
+    pthread_mutex_t lock; /* the writer against the readers of this process */
+};
+
+/* Opens the log at path with size bytes of data, going on with the records
+ * of a log of the same size already there. A size of 0 opens an existing log
+ * read only. Returns 0 on success */
+int console_log_open(struct console_log *log, const char *path, uint64_t size);
+void console_log_close(struct console_log *log);
+void console_log_append(struct console_log *log, const void *buf, size_t len);
+/* The numbers of the oldest record kept and of the next one */
+void console_log_range(struct console_log *log, uint64_t *first, uint64_t *next);
+/* The record seq into rec, up to len of its bytes into buf. Returns the bytes
+ * copied, -1 when the record is gone already or not written yet */
+ssize_t console_log_read(struct console_log *log,
+                         uint64_t seq,
+                         struct console_log_rec *rec,
+                         void *buf,
+                         size_t len);
+/* Writes the records from seq up to end (excluded) to f, as they were written
+ * with raw or as "<seq> <date time> <line>" lines. Returns the number of the
+ * record after the last one written */
+uint64_t console_log_dump(struct console_log *log, uint64_t seq, uint64_t end, FILE *f, bool raw);
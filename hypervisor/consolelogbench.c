@@ -0,0 +1,226 @@
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "consolelog.h"
+
+/* Checks and speed of the console log (consolelog.h): appends of console
+ * output in the chunks the serial device flushes (its 16 byte FIFO), reads
+ * of records picked at random, the ring wrapping around, a log reopened by a
+ * new run and a file that is not a log. No guest needed.
+ */
+
+#define FIFO_CHUNK 16
+
+struct consolelogbench {
+    char path[4096 + 32];
+    uint64_t size;
+    unsigned int lines;
+    unsigned int reads;
+    int failed;
+};
+
+static uint64_t bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void check(struct consolelogbench *b, bool ok, const char *what)
+{
+    if (!ok) {
+        printf("FAILED: %s\n", what);
+        b->failed = 1;
+    }
+}
+
+/* line i of the made up output, 10 to 120 bytes like a boot log */
+static int make_line(char *buf, unsigned int i)
+{
+    int pad = (i * 2654435761U) % 100;
+
+    return sprintf(buf, "[%8u] %.*s\n", i, pad,
+                   "systemd[1]: Started the unit of the service the test runs, nothing to see here, move on please ok");
+}
+
+static bool record_is_line(struct console_log *log, uint64_t seq)
+{
+    char buf[CONSOLE_LOG_MAX_RECORD], want[256];
+    struct console_log_rec rec;
+    ssize_t n = console_log_read(log, seq, &rec, buf, sizeof(buf));
+    int len = make_line(want, seq);
+
+    return n == len && !memcmp(buf, want, len);
+}
+
+/* Appends the lines as the serial device would, returns the ns per byte */
+static double append_lines(struct console_log *log, unsigned int from, unsigned int to, uint64_t *bytes)
+{
+    static char out[1 << 20];
+    uint64_t start, len = 0;
+
+    *bytes = 0;
+    start = bench_now();
+    for (unsigned int i = from; i < to; i++) {
+        len += make_line(out + len, i);
+        if (len < sizeof(out) - 256 && i + 1 < to)
+            continue;
+        for (uint64_t off = 0; off < len; off += FIFO_CHUNK)
+            console_log_append(log, out + off, len - off < FIFO_CHUNK ? len - off : FIFO_CHUNK);
+        *bytes += len;
+        len = 0;
+    }
+    return (double) (bench_now() - start) / *bytes;
+}
+
+static void checks(struct consolelogbench *b, struct console_log *log)
+{
+    char long_line[1000];
+    uint64_t first, next;
+    struct console_log_rec rec;
+    char buf[CONSOLE_LOG_MAX_RECORD];
+    bool ok = true;
+    FILE *f;
+
+    console_log_range(log, &first, &next);
+    check(b, next == b->lines, "a record per line");
+    check(b, first > 0, "the ring wrapped around");
+    for (uint64_t seq = first; seq < next; seq++)
+        ok &= record_is_line(log, seq);
+    check(b, ok, "the records read back as the lines written");
+    check(b, !first || console_log_read(log, first - 1, &rec, buf, sizeof(buf)) < 0, "an evicted record is gone");
+    check(b, console_log_read(log, next, &rec, buf, sizeof(buf)) < 0, "no record past the last one");
+
+    /* a line longer than a record, written in two appends */
+    memset(long_line, 'x', sizeof(long_line));
+    console_log_append(log, long_line, 500);
+    console_log_append(log, long_line, 500);
+    console_log_append(log, "\n", 1);
+    console_log_range(log, &first, &next);
+    check(b, console_log_read(log, next - 4, &rec, buf, sizeof(buf)) == CONSOLE_LOG_MAX_RECORD &&
+             console_log_read(log, next - 1, &rec, buf, sizeof(buf)) == 1001 - 3 * CONSOLE_LOG_MAX_RECORD &&
+             buf[rec.len - 1] == '\n',
+          "a long line spans records");
+
+    /* the output the guest wrote, back in one piece */
+    f = tmpfile();
+    if (f) {
+        check(b, console_log_dump(log, next - 4, UINT64_MAX, f, true) == next && ftell(f) == 1001, "a raw dump");
+        fclose(f);
+    }
+}
+
+static void reopen_checks(struct consolelogbench *b, struct console_log *log)
+{
+    struct console_log ro;
+    uint64_t first, next, first2, next2;
+    struct console_log_rec rec;
+    char buf[CONSOLE_LOG_MAX_RECORD];
+    FILE *f;
+
+    /* an unfinished line, the next run starts a record of its own */
+    console_log_append(log, "no newline", 10);
+    console_log_range(log, &first, &next);
+    console_log_close(log);
+    check(b, console_log_open(log, b->path, b->size) == 0, "reopen");
+    console_log_range(log, &first2, &next2);
+    check(b, first2 == first && next2 == next, "a reopened log keeps its records");
+    console_log_append(log, "next run\n", 9);
+    check(b, console_log_read(log, next, &rec, buf, sizeof(buf)) == 9, "a new run starts a new record");
+
+    check(b, console_log_open(&ro, b->path, 0) == 0, "a read only open");
+    console_log_range(&ro, &first2, &next2);
+    check(b, next2 == next + 1 && console_log_read(&ro, next, &rec, buf, sizeof(buf)) == 9,
+          "a reader sees the records of the writer");
+    console_log_close(&ro);
+
+    console_log_close(log);
+    check(b, console_log_open(log, b->path, b->size * 2) == 0, "reopen with another size");
+    console_log_range(log, &first2, &next2);
+    check(b, first2 == 0 && next2 == 0, "a log of another size starts over");
+    console_log_close(log);
+
+    /* not a log: left alone */
+    f = fopen(b->path, "w");
+    if (f) {
+        fputs("a disk image, say", f);
+        fclose(f);
+    }
+    check(b, console_log_open(log, b->path, b->size) < 0, "a file that is not a log is refused");
+}
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [-s KiB] [-l lines] [-r reads] [-d dir]\n", prog);
+    printf("  -s  data size of the log (default %d)\n", CONSOLE_LOG_DEFAULT_SIZE >> 10);
+    printf("  -l  lines of console output written (default 200000)\n");
+    printf("  -r  records read at random (default 1000000)\n");
+    printf("  -d  directory of the log (default /tmp)\n");
+}
+
+int main(int argc, char **argv)
+{
+    struct consolelogbench b = {.size = CONSOLE_LOG_DEFAULT_SIZE, .lines = 200000, .reads = 1000000};
+    const char *dir = "/tmp";
+    struct console_log log;
+    uint64_t first, next, bytes, start, sum = 0;
+    char buf[CONSOLE_LOG_MAX_RECORD];
+    struct console_log_rec rec;
+    double ns;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:l:r:d:")) != -1) {
+        switch (opt) {
+        case 's':
+            b.size = strtoull(optarg, NULL, 10) << 10;
+            break;
+        case 'l':
+            b.lines = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            b.reads = strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            dir = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (b.size < CONSOLE_LOG_MIN_SIZE || !b.lines || !b.reads) {
+        usage(argv[0]);
+        return 1;
+    }
+    snprintf(b.path, sizeof(b.path), "%s/consolelogbench.%d.log", dir, getpid());
+    unlink(b.path);
+    if (console_log_open(&log, b.path, b.size) < 0)
+        return 1;
+
+    ns = append_lines(&log, 0, b.lines, &bytes);
+    console_log_range(&log, &first, &next);
+    printf("%u lines, %lu MB in %d byte appends: %.1f ns/byte, %.0f MB/s\n", b.lines, bytes >> 20,
+           FIFO_CHUNK, ns, 1e3 / ns);
+    printf("%lu KB log: records %lu to %lu kept\n", b.size >> 10, first, next - 1);
+
+    start = bench_now();
+    for (unsigned int i = 0; i < b.reads; i++) {
+        uint64_t seq = first + (i * 2654435761ULL) % (next - first);
+        ssize_t n = console_log_read(&log, seq, &rec, buf, sizeof(buf));
+
+        sum += n > 0 ? n : 0;
+    }
+    printf("random reads: %.0f ns per record, %lu MB copied\n", (double) (bench_now() - start) / b.reads,
+           sum >> 20);
+
+    checks(&b, &log);
+    reopen_checks(&b, &log);
+    unlink(b.path);
+    printf(b.failed ? "consolelogbench: FAILED\n" : "consolelogbench: all checks passed\n");
+    return b.failed;
+}
@@ -0,0 +1,83 @@
+#include <getopt.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "consolelog.h"
+
+/* Reader of the console log of a guest (--console-log, console-log= of the
+ * daemon), while its hypervisor runs or after it is gone: the records from a
+ * sequence number on as dated lines, or the output as the guest wrote it.
+ */
+
+#define FOLLOW_INTERVAL_US 200000
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [-s seq] [-n records] [-r] [-f] <console_log>\n", prog);
+    printf("  -s  the first record (default the oldest one kept)\n");
+    printf("  -n  only the last <records> records, instead of -s\n");
+    printf("  -r  the output as the guest wrote it, without the record numbers and times\n");
+    printf("  -f  wait for more output, as tail -f\n");
+    printf("  -i  the range of the records kept only\n");
+}
+
+int main(int argc, char **argv)
+{
+    struct console_log log;
+    uint64_t seq = 0, last = 0, first, next;
+    bool raw = false, follow = false, info = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:n:rfi")) != -1) {
+        switch (opt) {
+        case 's':
+            seq = strtoull(optarg, NULL, 10);
+            break;
+        case 'n':
+            last = strtoull(optarg, NULL, 10);
+            break;
+        case 'r':
+            raw = true;
+            break;
+        case 'f':
+            follow = true;
+            break;
+        case 'i':
+            info = true;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind + 1 != argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (console_log_open(&log, argv[optind], 0) < 0)
+        return 1;
+    console_log_range(&log, &first, &next);
+    if (info) {
+        printf("records %lu to %lu, %lu of %lu bytes of data in use, %lu written\n", first,
+               next ? next - 1 : 0, log.hdr->data_head < log.hdr->data_size ? log.hdr->data_head : log.hdr->data_size,
+               log.hdr->data_size, log.hdr->data_head);
+        console_log_close(&log);
+        return 0;
+    }
+    if (last)
+        seq = next > last ? next - last : 0;
+    for (;;) {
+        /* a line still being written waits for its end, it is printed once */
+        uint64_t end = follow && __atomic_load_n(&log.hdr->open, __ATOMIC_ACQUIRE) ? log.hdr->next_seq - 1 : UINT64_MAX;
+
+        seq = console_log_dump(&log, seq, end, stdout, raw);
+        fflush(stdout);
+        if (!follow)
+            break;
+        usleep(FOLLOW_INTERVAL_US);
+    }
+    console_log_close(&log);
+    return 0;
+}
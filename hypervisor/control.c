@@ -0,0 +1,628 @@
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "control.h"
+#include "trace.h"
+#include "utils.h"
+#include "vm.h"
+
+typedef void (*control_cmd_fn)(guest* g, char* args, char* reply, size_t reply_len);
+
+typedef struct control_cmd
+{
+    const char* name;
+    control_cmd_fn handler;
+} control_cmd_t;
+
+// balloon <MiB>: set the size of the balloon, 0 gives all the memory back to the guest
+static void control_balloon(guest* g, char* args, char* reply, size_t reply_len)
+{
+    char* end;
+    unsigned long mb = strtoul(args, &end, 10);
+
+    if (!g->balloon)
+    {
+        snprintf(reply, reply_len, "error no balloon device\n");
+        return;
+    }
+    if (end == args || mb * VIRTIO_BALLOON_PAGES_PER_MB > GUEST_MEMORY_SIZE >> VIRTIO_BALLOON_PAGE_SHIFT)
+    {
+        snprintf(reply, reply_len, "error invalid balloon size\n");
+        return;
+    }
+
+    virtio_balloon_set_target(&g->virtio_balloon_dev, mb * VIRTIO_BALLOON_PAGES_PER_MB);
+    snprintf(reply, reply_len, "ok\n");
+}
+
+/*
+stats [fresh]: memory counters of the VM, and the usage of its cgroup if it has one, as key=value
+pairs. process_ksm_merging_pages is not the VM's own: KSM counts per process, in the daemon it sums
+up all of its guests. a fresh report of the guest statistics is requested on each call, without
+fresh they are the last ones the guest reported, maybe from its boot. with fresh the answer waits
+up to CONTROL_STATS_WAIT_MS for the new report, guest_stats_fresh=1 tells it came
+*/
+static void control_stats(guest* g, char* args, char* reply, size_t reply_len)
+{
+    struct vm_mem_stats mem_stats;
+    bool fresh = strcmp(args, "fresh") == 0;
+    int len;
+
+    if (!fresh && args[0])
+    {
+        snprintf(reply, reply_len, "error usage: stats [fresh]\n");
+        return;
+    }
+
+    vm_get_mem_stats(g, &mem_stats);
+    len = snprintf(reply, reply_len, "process_ksm_merging_pages=%lu reported_pages=%lu balloon_pages=%lu",
+                   mem_stats.process_ksm_merging_pages, mem_stats.reported_pages, mem_stats.balloon_pages);
+
+    if (g->balloon && len > 0 && (size_t) len < reply_len)
+    {
+        struct virtio_balloon_dev* balloon = &g->virtio_balloon_dev;
+        uint64_t stats[VIRTIO_BALLOON_S_NR];
+        uint64_t gen = virtio_balloon_request_stats(balloon);
+
+        fresh = fresh && virtio_balloon_wait_stats(balloon, gen, CONTROL_STATS_WAIT_MS) == 0;
+        virtio_balloon_get_stats(balloon, stats);
+        len += snprintf(reply + len, reply_len - len,
+                        " guest_stats_fresh=%d balloon_target_mb=%u balloon_actual_mb=%u guest_total_mb=%lu guest_free_mb=%lu guest_available_mb=%lu",
+                        fresh,
+                        __atomic_load_n(&balloon->config.num_pages, __ATOMIC_ACQUIRE) / VIRTIO_BALLOON_PAGES_PER_MB,
+                        __atomic_load_n(&balloon->config.actual, __ATOMIC_ACQUIRE) / VIRTIO_BALLOON_PAGES_PER_MB,
+                        stats[VIRTIO_BALLOON_S_MEMTOT] >> 20,
+                        stats[VIRTIO_BALLOON_S_MEMFREE] >> 20,
+                        stats[VIRTIO_BALLOON_S_AVAIL] >> 20);
+    }
+
+    if (g->cgroup.path[0] && len > 0 && (size_t) len < reply_len)
+    {
+        struct cgroup_usage usage;
+
+        cgroup_get_usage(&g->cgroup, &usage);
+        len += snprintf(reply + len, reply_len - len,
+                        " cpu_usage_usec=%lu cpu_throttled_usec=%lu memory_current_bytes=%lu io_read_bytes=%lu io_write_bytes=%lu",
+                        usage.cpu_usage_usec, usage.cpu_throttled_usec, usage.memory_current, usage.io_rbytes, usage.io_wbytes);
+    }
+
+    if (len > 0 && (size_t) len < reply_len)
+    {
+        snprintf(reply + len, reply_len - len, "\n");
+    }
+}
+
+/*
+vcpu: where the vCPU time went since the guest started, as key=value pairs. idle_pct is the
+share of the time the guest was halted, the way to tell idle guests from busy ones
+*/
+static void control_vcpu(guest* g, char* args, char* reply, size_t reply_len)
+{
+    struct vm_vcpu_stats stats;
+    (void) args;
+
+    vm_get_vcpu_stats(g, &stats);
+    snprintf(reply, reply_len,
+             "wall_ns=%lu run_ns=%lu guest_ns=%lu halt_poll_ns=%lu halt_wait_ns=%lu exit_ns=%lu"
+             " halt_exits=%lu halt_successful_polls=%lu io_exits=%lu mmio_exits=%lu other_exits=%lu"
+             " interrupted=%lu idle_pct=%.1f\n",
+             stats.wall_ns, stats.run_ns, stats.guest_ns, stats.halt_poll_ns, stats.halt_wait_ns, stats.exit_ns,
+             stats.halt_exits, stats.halt_successful_polls, stats.io_exits, stats.mmio_exits, stats.other_exits,
+             stats.interrupted, stats.wall_ns ? 100.0 * stats.halt_wait_ns / stats.wall_ns : 0);
+}
+
+// halt-poll <ns>: how long a halted vCPU polls before it sleeps, 0 stops the polling of an idle guest
+static void control_halt_poll(guest* g, char* args, char* reply, size_t reply_len)
+{
+    char* end;
+    long ns = strtol(args, &end, 10);
+
+    if (end == args || ns < 0)
+    {
+        snprintf(reply, reply_len, "error invalid halt polling time\n");
+        return;
+    }
+    if (vm_set_halt_poll(g, ns) < 0)
+    {
+        snprintf(reply, reply_len, "error KVM_CAP_HALT_POLL failed\n");
+        return;
+    }
+    snprintf(reply, reply_len, "ok\n");
+}
+
+// the disk an optional index at the start of args names, args then moves past it. -1 for no such disk
+static int control_disk_index(guest* g, char** args)
+{
+    char* end;
+    long i = 0;
+
+    if (isdigit((unsigned char) **args))
+    {
+        i = strtol(*args, &end, 10);
+        if (*end && *end != ' ')
+        {
+            return -1;
+        }
+        *args = end + strspn(end, " ");
+    }
+    return i < g->disk_count ? i : -1;
+}
+
+/*
+blk-limit [<disk>] [iops=<n>] [iops-burst=<n>] [bps=<n>] [bps-burst=<n>]: changes the token bucket limits
+of a disk, the first one by default, 0 lifts one, and answers with the limits and the throttle counters as
+key=value pairs. throttled counts the times a request was held back, delayed the requests that were and
+delay_ns their total wait
+*/
+static void control_blk_limit(guest* g, char* args, char* reply, size_t reply_len)
+{
+    int disk = control_disk_index(g, &args);
+    struct throttle* t;
+    struct throttle_limits limits;
+    struct throttle_stats stats;
+
+    if (disk < 0)
+    {
+        snprintf(reply, reply_len, "error no such disk\n");
+        return;
+    }
+    if (g->vhost_user_blk_dev[disk].enable)
+    {
+        snprintf(reply, reply_len, "error the disk is served by a vhost-user backend\n");
+        return;
+    }
+    t = &g->virtio_blk_dev[disk].throttle;
+    throttle_get(t, &limits, &stats);
+    if (*args)
+    {
+        if (throttle_parse(&limits, args) < 0)
+        {
+            snprintf(reply, reply_len, "error invalid limits\n");
+            return;
+        }
+        throttle_set(t, &limits);
+    }
+    snprintf(reply, reply_len,
+             "iops=%lu iops_burst=%lu bps=%lu bps_burst=%lu ops=%lu bytes=%lu throttled=%lu delayed=%lu delay_ns=%lu\n",
+             limits.iops, limits.iops_burst, limits.bps, limits.bps_burst, stats.ops, stats.bytes, stats.throttled,
+             stats.delayed, stats.delay_ns);
+}
+
+// the counters of a compressed disk image, compact: collect the garbage of its log first
+static void control_cdisk(struct cdisk* d, bool compact, char* reply, size_t reply_len)
+{
+    struct cdisk_stats stats;
+    int64_t freed = compact ? cdisk_compact(d) : 0;
+
+    if (freed < 0 && errno == EBUSY)
+    {
+        snprintf(reply, reply_len, "error a compaction is in progress already\n");
+        return;
+    }
+    cdisk_get_stats(d, &stats);
+    snprintf(reply, reply_len,
+             "backend=cdisk size=%lu cluster_size=%u clusters=%lu zero_clusters=%lu stored_bytes=%lu "
+             "log_bytes=%lu file_bytes=%lu ratio=%.2f cache_hits=%lu cache_misses=%lu write_backs=%lu "
+             "compactions=%lu compacted_bytes=%lu compact_freed=%ld\n",
+             d->header.size, d->header.cluster_size, stats.clusters, stats.zero_clusters, stats.stored_bytes,
+             stats.log_bytes, stats.file_bytes,
+             stats.file_bytes ? (double) d->header.size / stats.file_bytes : 0.0, stats.cache_hits,
+             stats.cache_misses, stats.write_backs, stats.compactions, stats.compacted_bytes, freed);
+}
+
+// the counters of the block store of a block map, gc: collect its garbage first
+static void control_blockstore(struct blockstore_image* img, bool gc, char* reply, size_t reply_len)
+{
+    struct blockstore_stats stats;
+    uint64_t zero = 0;
+    int64_t freed = gc ? blockstore_gc(img->store) : 0;
+
+    for (uint64_t i = 0; i < img->nr_refs; i++)
+    {
+        zero += !img->refs[i];
+    }
+    blockstore_get_stats(img->store, &stats);
+    snprintf(reply, reply_len,
+             "backend=blockstore size=%lu block_size=%u image_blocks=%lu image_zero=%lu blocks=%lu unique=%lu "
+             "refs=%lu zero_blocks=%lu dedup_ratio=%.2f writes=%lu dedup_hits=%lu new_blocks=%lu reads=%lu "
+             "gc_free=%ld\n",
+             img->size, img->store->block_size, img->nr_refs, zero, stats.blocks, stats.unique, stats.refs,
+             stats.zero_blocks, stats.unique ? (double) stats.refs / stats.unique : 1.0, stats.writes,
+             stats.dedup_hits, stats.new_blocks, stats.reads, freed);
+}
+
+/*
+disk [<disk>] [gc|compact]: a disk, the first one by default, and the counters of its backend as
+key=value pairs, after its index, the number of disks and the PCI slot and IRQ line of its device.
+for a plain file, cache is how it goes through the host page cache.
+for a block map, the counters of its block store: dedup_ratio is the non zero blocks of all the maps
+over the blocks that hold them. gc frees the blocks of the maps deleted since, gives the space of the
+free blocks back to the file system and answers with their number.
+for a compressed image (cdisk.h), ratio is the size of the disk over the space of the file, and
+compact collects the garbage of its log now. a vhost-user backend keeps its counters to itself
+*/
+static void control_disk(guest* g, char* args, char* reply, size_t reply_len)
+{
+    int disk = control_disk_index(g, &args);
+    struct vhost_user_blk_dev* backend;
+    struct diskimg* d;
+    pci_dev_t* pci_dev;
+    int irq;
+    int n;
+
+    if (disk < 0)
+    {
+        snprintf(reply, reply_len, "error no such disk\n");
+        return;
+    }
+    backend = &g->vhost_user_blk_dev[disk];
+    d = &g->diskimg[disk];
+    if (*args && !(d->cdisk && strcmp(args, "compact") == 0) && !(d->image && strcmp(args, "gc") == 0))
+    {
+        snprintf(reply, reply_len, "error usage: disk [<disk>] [gc|compact]\n");
+        return;
+    }
+    pci_dev = backend->enable ? &backend->virtio_pci_dev.pci_dev : &g->virtio_blk_dev[disk].virtio_pci_dev.pci_dev;
+    irq = backend->enable ? backend->irq_num : g->virtio_blk_dev[disk].irq_num;
+    n = snprintf(reply, reply_len, "disk=%d disks=%d slot=%u irq=%d ", disk, g->disk_count, pci_dev->slot, irq);
+    reply += n;
+    reply_len -= n;
+
+    if (backend->enable)
+    {
+        snprintf(reply, reply_len, "backend=vhost-user socket=%s size=%llu\n", backend->path,
+                 backend->config.capacity << 9);
+    }
+    else if (d->cdisk)
+    {
+        control_cdisk(d->cdisk, *args, reply, reply_len);
+    }
+    else if (d->image)
+    {
+        control_blockstore(d->image, *args, reply, reply_len);
+    }
+    else
+    {
+        snprintf(reply, reply_len, "backend=file size=%zu cache=%s\n", d->size, diskimg_cache_name(d->cache));
+    }
+}
+
+/*
+share: the directory shared over virtio-9p, its tag and the requests the server answered so far.
+errors counts the requests answered with an errno, a guest looking up missing files makes many
+*/
+static void control_share(guest* g, char* args, char* reply, size_t reply_len)
+{
+    struct virtio_9p_dev* dev = &g->virtio_9p_dev;
+    struct p9_stats* st = &dev->server.stats;
+
+    (void) args;
+
+    if (!dev->enable)
+    {
+        snprintf(reply, reply_len, "error no shared directory\n");
+        return;
+    }
+    snprintf(reply, reply_len, "tag=%.*s dir=%s ro=%d slot=%u irq=%d fids=%u requests=%lu errors=%lu read_bytes=%lu write_bytes=%lu\n",
+             dev->config.tag_len, dev->config.tag, dev->path, dev->server.readonly, dev->virtio_pci_dev.pci_dev.slot,
+             dev->irq_num, __atomic_load_n(&dev->server.nfids, __ATOMIC_RELAXED),
+             __atomic_load_n(&st->requests, __ATOMIC_RELAXED), __atomic_load_n(&st->errors, __ATOMIC_RELAXED),
+             __atomic_load_n(&st->read_bytes, __ATOMIC_RELAXED), __atomic_load_n(&st->write_bytes, __ATOMIC_RELAXED));
+}
+
+// text into out with C escapes for what isn't printable, stops before an escape that doesn't fit
+static void control_escape(const uint8_t* text, size_t len, char* out, size_t out_len)
+{
+    size_t n = 0;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        char esc[5];
+        uint8_t c = text[i];
+
+        if (c == '\n' || c == '\r' || c == '\t' || c == '\\')
+        {
+            snprintf(esc, sizeof(esc), "\\%c", c == '\n' ? 'n' : c == '\r' ? 'r' : c == '\t' ? 't' : '\\');
+        }
+        else if (c < 0x20 || c >= 0x7f)
+        {
+            snprintf(esc, sizeof(esc), "\\x%02x", c);
+        }
+        else
+        {
+            snprintf(esc, sizeof(esc), "%c", c);
+        }
+        if (n + strlen(esc) >= out_len)
+        {
+            break;
+        }
+        strcpy(out + n, esc);
+        n += strlen(esc);
+    }
+    out[n] = '\0';
+}
+
+/*
+console-log [read <seq> | dump <seq> <path>]: the console output kept in the log of the guest, see
+consolelog.h. without arguments the records the log holds, first to next-1. read answers with one
+record, its text C escaped as the rest of the line, so a client reconnecting goes on from the last
+record it saw. dump writes
+the records from <seq> on to <path> as dated lines and answers with the number after the last one
+*/
+static void control_console_log(guest* g, char* args, char* reply, size_t reply_len)
+{
+    struct console_log* log = &g->console_log;
+    uint8_t text[CONSOLE_LOG_MAX_RECORD];
+    struct console_log_rec rec;
+    uint64_t first, next, seq;
+    char* end;
+    ssize_t n;
+
+    if (!log->hdr)
+    {
+        snprintf(reply, reply_len, "error no console log\n");
+        return;
+    }
+    console_log_range(log, &first, &next);
+    if (!*args)
+    {
+        snprintf(reply, reply_len, "path=%s size=%lu first=%lu next=%lu bytes=%lu\n", log->path,
+                 log->hdr->data_size, first, next, __atomic_load_n(&log->hdr->data_head, __ATOMIC_RELAXED));
+        return;
+    }
+    if (strncmp(args, "read ", 5) == 0)
+    {
+        seq = strtoull(args + 5, &end, 10);
+        if (end == args + 5 || *end)
+        {
+            snprintf(reply, reply_len, "error usage: console-log [read <seq> | dump <seq> <path>]\n");
+            return;
+        }
+        n = console_log_read(log, seq, &rec, text, sizeof(text));
+        if (n < 0)
+        {
+            snprintf(reply, reply_len, "error no record %lu first=%lu next=%lu\n", seq, first, next);
+            return;
+        }
+        n = snprintf(reply, reply_len, "seq=%lu time_ns=%lu len=%u next=%lu text=", seq, rec.time_ns, rec.len, next);
+        control_escape(text, rec.len, reply + n, reply_len - n - 1);
+        strcat(reply, "\n");
+        return;
+    }
+    if (strncmp(args, "dump ", 5) == 0)
+    {
+        FILE* f;
+
+        seq = strtoull(args + 5, &end, 10);
+        if (end == args + 5 || *end != ' ' || !end[1])
+        {
+            snprintf(reply, reply_len, "error usage: console-log [read <seq> | dump <seq> <path>]\n");
+            return;
+        }
+        if (!(f = fopen(end + 1, "w")))
+        {
+            snprintf(reply, reply_len, "error console-log dump: %s\n", strerror(errno));
+            return;
+        }
+        next = console_log_dump(log, seq, UINT64_MAX, f, false);
+        fclose(f);
+        snprintf(reply, reply_len, "ok next=%lu\n", next);
+        return;
+    }
+    snprintf(reply, reply_len, "error usage: console-log [read <seq> | dump <seq> <path>]\n");
+}
+
+/*
+trace start|stop|dump <path>: the device emulation trace of the whole process, see trace.h.
+dump answers with the number of records written
+*/
+static void control_trace(guest* g, char* args, char* reply, size_t reply_len)
+{
+    (void) g;
+
+    if (strcmp(args, "start") == 0)
+    {
+        trace_start();
+    }
+    else if (strcmp(args, "stop") == 0)
+    {
+        trace_stop();
+    }
+    else if (strncmp(args, "dump ", 5) == 0 && args[5])
+    {
+        int records = trace_dump(args + 5);
+        if (records < 0)
+        {
+            snprintf(reply, reply_len, "error trace dump: %s\n", strerror(errno));
+            return;
+        }
+        snprintf(reply, reply_len, "ok %d\n", records);
+        return;
+    }
+    else
+    {
+        snprintf(reply, reply_len, "error usage: trace start|stop|dump <path>\n");
+        return;
+    }
+    snprintf(reply, reply_len, "ok\n");
+}
+
+/*
+boot: when each step of the start of the guest ended, in us after the VM was created, as key=value
+pairs. the steps not reached (yet) are left out, see bootprof.h
+*/
+static void control_boot(guest* g, char* args, char* reply, size_t reply_len)
+{
+    (void) args;
+
+    if (g == NULL)
+    {
+        snprintf(reply, reply_len, "error no guest\n");
+        return;
+    }
+    boot_profile_format(&g->boot, reply, reply_len);
+    strncat(reply, "\n", reply_len - strlen(reply) - 1);
+}
+
+/*
+boot-stats: the same steps over the boots of the whole process, ready ones and the ones of the
+VMs destroyed since, as <step>_us=<p50>/<p90>/<p99>/<max>
+*/
+static void control_boot_stats(guest* g, char* args, char* reply, size_t reply_len)
+{
+    (void) g;
+    (void) args;
+
+    boot_profile_format_history(reply, reply_len);
+    strncat(reply, "\n", reply_len - strlen(reply) - 1);
+}
+
+static const control_cmd_t control_cmds[] = {
+    {"balloon", control_balloon},
+    {"stats", control_stats},
+    {"vcpu", control_vcpu},
+    {"halt-poll", control_halt_poll},
+    {"blk-limit", control_blk_limit},
+    {"disk", control_disk},
+    {"share", control_share},
+    {"console-log", control_console_log},
+    {"trace", control_trace},
+    {"boot", control_boot},
+    {"boot-stats", control_boot_stats},
+};
+
+// run a single command line on a guest and write its answer into reply
+void control_run_command(guest* g, char* line, char* reply, size_t reply_len)
+{
+    char* args = line + strcspn(line, " ");
+    if (*args)
+    {
+        *args++ = '\0';
+    }
+
+    for (size_t i = 0; i < sizeof(control_cmds) / sizeof(control_cmds[0]); i++)
+    {
+        if (strcmp(line, control_cmds[i].name) == 0)
+        {
+            control_cmds[i].handler(g, args, reply, reply_len);
+            return;
+        }
+    }
+    snprintf(reply, reply_len, "error unknown command\n");
+}
+
+// serve the commands of one client until it disconnects
+static void control_handle_client(control_t* ctl, int fd)
+{
+    char line[CONTROL_MAX_LINE];
+    char reply[CONTROL_MAX_REPLY];
+    size_t len = 0;
+
+    while (1)
+    {
+        ssize_t n = recv(fd, line + len, sizeof(line) - 1 - len, 0);
+        if (n <= 0)
+        {
+            return;
+        }
+        len += n;
+        line[len] = '\0';
+
+        char* newline;
+        while ((newline = strchr(line, '\n')))
+        {
+            *newline = '\0';
+            if (newline > line && newline[-1] == '\r')
+            {
+                newline[-1] = '\0';
+            }
+
+            reply[0] = '\0';
+            control_run_command(ctl->g, line, reply, sizeof(reply));
+            // MSG_NOSIGNAL: a client that went away must not kill the VM with SIGPIPE
+            if (send(fd, reply, strlen(reply), MSG_NOSIGNAL) < 0)
+            {
+                return;
+            }
+
+            len -= newline + 1 - line;
+            memmove(line, newline + 1, len + 1);
+        }
+
+        if (len == sizeof(line) - 1)
+        {
+            return; // line too long
+        }
+    }
+}
+
+static void* control_thread(void* arg)
+{
+    control_t* ctl = (control_t*) arg;
+
+    while (1)
+    {
+        int fd = accept(ctl->listen_fd, NULL, NULL);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            break;
+        }
+        control_handle_client(ctl, fd);
+        close(fd);
+    }
+
+    return NULL;
+}
+
+int control_init(control_t* ctl, guest* g, const char* path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        printf("Control socket path is too long\n");
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    strcpy(ctl->path, path);
+    ctl->g = g;
+
+    ctl->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (ctl->listen_fd < 0)
+    {
+        perror("control socket");
+        return -1;
+    }
+
+    unlink(path); // a socket left behind by a previous run
+    if (bind(ctl->listen_fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 || listen(ctl->listen_fd, 4) < 0)
+    {
+        perror("bind control socket");
+        close(ctl->listen_fd);
+        return -1;
+    }
+    sudo_chown_socket(path);
+
+    pthread_create(&ctl->thread, NULL, control_thread, ctl);
+    printf("Control socket listening on %s\n", path);
+
+    return 0;
+}
+
+void control_exit(control_t* ctl)
+{
+    shutdown(ctl->listen_fd, SHUT_RDWR);
+    pthread_join(ctl->thread, NULL);
+    close(ctl->listen_fd);
+    unlink(ctl->path);
+}
@@ -0,0 +1,29 @@
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <pthread.h>
+#include <sys/un.h>
+
+#include "guest.h"
+
+#define CONTROL_MAX_LINE 256
+#define CONTROL_MAX_REPLY 1024
+#define CONTROL_STATS_WAIT_MS 1000 // for the guest to answer "stats fresh"
+
+/*
+a unix socket that accepts one line text commands (e.g. "balloon 256") and
+answers each of them with one line. used by the ssh server to manage a running VM
+*/
+typedef struct control
+{
+    int listen_fd;
+    char path[sizeof(((struct sockaddr_un*) 0)->sun_path)];
+    pthread_t thread;
+    guest* g;
+} control_t;
+
+int control_init(control_t* ctl, guest* g, const char* path); // returns 0 on success
+void control_exit(control_t* ctl);
+void control_run_command(guest* g, char* line, char* reply, size_t reply_len); // also used by the daemon
+
+#endif // CONTROL_H
@@ -0,0 +1,92 @@
+#include <stdlib.h>
+#include <sys/ioctl.h>
+
+#include "cpu_policy.h"
+
+#define CPUID_MAX_ENTRIES 100
+
+// applies our policy to one of the CPUID entries the host supports
+static void cpu_policy_apply(guest* g, struct kvm_cpuid_entry2* entry)
+{
+    switch (entry->function)
+    {
+        case CPUID_LEAF_FEATURES:
+            entry->ecx |= CPUID_FEATURE_ECX_HYPERVISOR;
+            // the TSC deadline timer is emulated by the in-kernel LAPIC, one MSR write per timer
+            if (!g->no_pv && ioctl(g->kvm_fd, KVM_CHECK_EXTENSION, KVM_CAP_TSC_DEADLINE_TIMER) > 0)
+            {
+                entry->ecx |= CPUID_FEATURE_ECX_TSC_DEADLINE;
+            }
+            else
+            {
+                entry->ecx &= ~CPUID_FEATURE_ECX_TSC_DEADLINE;
+            }
+            break;
+
+        // sets response to the string "KVMKVMKVM"
+        case KVM_CPUID_SIGNATURE:
+            entry->eax = KVM_CPUID_FEATURES;
+            entry->ebx = 0x4b4d564b; // KVMK
+            entry->ecx = 0x564b4d56; // VMKV
+            entry->edx = 0x4d;       // M
+            break;
+
+        case KVM_CPUID_FEATURES:
+            // only the features we know the guest benefits from, and no hints
+            entry->eax = g->no_pv ? 0 : entry->eax & CPU_POLICY_PV_FEATURES;
+            entry->edx = 0;
+            break;
+
+        default:
+            break;
+    }
+}
+
+// needed by the kernel to know if it runs on a vm or bare metal, and which paravirtual features it can use
+void init_cpuid(guest* g)
+{
+    struct {
+        uint32_t nent;
+        uint32_t padding;
+        struct kvm_cpuid_entry2 entries[CPUID_MAX_ENTRIES];
+    } kvm_cpuid;
+
+    kvm_cpuid.nent = CPUID_MAX_ENTRIES;
+    if (ioctl(g->kvm_fd, KVM_GET_SUPPORTED_CPUID, &kvm_cpuid) < 0)
+    {
+        perror("KVM_GET_SUPPORTED_CPUID");
+        return;
+    }
+
+    for (uint32_t i = 0; i < kvm_cpuid.nent; i++)
+    {
+        cpu_policy_apply(g, &kvm_cpuid.entries[i]);
+    }
+
+    if (ioctl(g->vcpu_fd, KVM_SET_CPUID2, &kvm_cpuid) < 0)
+    {
+        perror("KVM_SET_CPUID2");
+    }
+}
+
+#define MSR_IA32_MISC_ENABLE 0x000001a0
+#define MSR_IA32_MISC_ENABLE_FAST_STRING_BIT 0
+#define MSR_IA32_MISC_ENABLE_FAST_STRING \
+    (1ULL << MSR_IA32_MISC_ENABLE_FAST_STRING_BIT)
+
+#define KVM_MSR_ENTRY(_index, _data) \
+    (struct kvm_msr_entry) { .index = _index, .data = _data }
+void init_msrs(guest* g)
+{
+    int ndx = 0;
+    struct kvm_msrs *msrs =
+        calloc(1, sizeof(struct kvm_msrs) + (sizeof(struct kvm_msr_entry) * 1));
+
+    msrs->entries[ndx++] =
+        KVM_MSR_ENTRY(MSR_IA32_MISC_ENABLE, MSR_IA32_MISC_ENABLE_FAST_STRING);
+    msrs->nmsrs = ndx;
+
+    ioctl(g->vcpu_fd, KVM_SET_MSRS, msrs);
+
+    free(msrs);
+}
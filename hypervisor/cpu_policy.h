@@ -0,0 +1,27 @@
+#ifndef CPU_POLICY_H
+#define CPU_POLICY_H
+
+#include <asm/kvm_para.h>
+
+#include "guest.h"
+
+#define CPUID_LEAF_FEATURES 0x1
+#define CPUID_FEATURE_ECX_X2APIC (1U << 21)
+#define CPUID_FEATURE_ECX_TSC_DEADLINE (1U << 24)
+#define CPUID_FEATURE_ECX_HYPERVISOR (1U << 31)
+
+/*
+paravirtual features offered in the KVM_CPUID_FEATURES leaf (when the host supports them):
+kvm-clock instead of PIT/HPET timekeeping, PV EOI to skip the APIC EOI exit,
+PV unhalt and sched yield for paravirtual spinlocks
+*/
+#define CPU_POLICY_PV_FEATURES                                              \
+    ((1U << KVM_FEATURE_CLOCKSOURCE) | (1U << KVM_FEATURE_CLOCKSOURCE2) |   \
+     (1U << KVM_FEATURE_CLOCKSOURCE_STABLE_BIT) | (1U << KVM_FEATURE_PV_EOI) | \
+     (1U << KVM_FEATURE_PV_UNHALT) | (1U << KVM_FEATURE_PV_SCHED_YIELD) |   \
+     (1U << KVM_FEATURE_NOP_IO_DELAY))
+
+void init_cpuid(guest* g);
+void init_msrs(guest* g);
+
+#endif // CPU_POLICY_H
@@ -0,0 +1,795 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "control.h"
+#include "daemon.h"
+#include "utils.h"
+#include "vm.h"
+
+typedef struct daemon_client
+{
+    daemon_t* d;
+    int fd;
+} daemon_client_t;
+
+typedef void (*daemon_cmd_fn)(daemon_t* d, int fd, char* args, char* reply, size_t reply_len);
+
+typedef struct daemon_cmd
+{
+    const char* name;
+    daemon_cmd_fn handler;
+} daemon_cmd_t;
+
+static const char* daemon_state_names[] = {"free", "created", "running", "stopped", "creating", "destroying"};
+
+// the word at *args, which moves past it. returns NULL at the end of the line
+static char* daemon_next_arg(char** args)
+{
+    char* arg = *args + strspn(*args, " ");
+    if (!*arg)
+    {
+        return NULL;
+    }
+    *args = arg + strcspn(arg, " ");
+    if (**args)
+    {
+        *(*args)++ = '\0';
+    }
+    return arg;
+}
+
+// called with d->lock held, the guests being created or destroyed keep their name
+static daemon_vm_t* daemon_find_vm(daemon_t* d, const char* name)
+{
+    for (int i = 0; i < DAEMON_MAX_VMS; i++)
+    {
+        if (d->vms[i].state != DAEMON_VM_FREE && strcmp(d->vms[i].name, name) == 0)
+        {
+            return &d->vms[i];
+        }
+    }
+    return NULL;
+}
+
+static bool daemon_vm_usable(int state)
+{
+    return state == DAEMON_VM_CREATED || state == DAEMON_VM_RUNNING || state == DAEMON_VM_STOPPED;
+}
+
+// the guest called name with a reference that keeps it from being freed, or NULL
+static daemon_vm_t* daemon_get_vm(daemon_t* d, const char* name)
+{
+    daemon_vm_t* vm;
+
+    if (!name)
+    {
+        return NULL;
+    }
+    pthread_mutex_lock(&d->lock);
+    vm = daemon_find_vm(d, name);
+    if (vm && !daemon_vm_usable(__atomic_load_n(&vm->state, __ATOMIC_ACQUIRE)))
+    {
+        vm = NULL;
+    }
+    if (vm)
+    {
+        vm->users++;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return vm;
+}
+
+static void daemon_put_vm(daemon_t* d, daemon_vm_t* vm)
+{
+    pthread_mutex_lock(&d->lock);
+    if (--vm->users == 0)
+    {
+        pthread_cond_broadcast(&d->users_cond);
+    }
+    pthread_mutex_unlock(&d->lock);
+}
+
+static void daemon_set_state(daemon_t* d, daemon_vm_t* vm, int state)
+{
+    pthread_mutex_lock(&d->lock);
+    __atomic_store_n(&vm->state, state, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&d->lock);
+}
+
+static void* daemon_vcpu_thread(void* arg)
+{
+    daemon_vm_t* vm = (daemon_vm_t*) arg;
+    int running = DAEMON_VM_RUNNING;
+
+    run_vm(vm->g);
+    // a guest being destroyed stays out of the table
+    __atomic_compare_exchange_n(&vm->state, &running, DAEMON_VM_STOPPED, false, __ATOMIC_RELEASE,
+                                __ATOMIC_RELAXED);
+    printf("%s: the vCPU stopped\n", vm->name);
+    return NULL;
+}
+
+/*
+takes a usable guest out of the table, called with d->lock held. returns the state it was in for
+daemon_destroy_vm, or DAEMON_VM_FREE if it is being created or destroyed already
+*/
+static int daemon_take_vm(daemon_vm_t* vm)
+{
+    int state = __atomic_load_n(&vm->state, __ATOMIC_ACQUIRE);
+
+    if (!daemon_vm_usable(state))
+    {
+        return DAEMON_VM_FREE;
+    }
+    __atomic_store_n(&vm->state, DAEMON_VM_DESTROYING, __ATOMIC_RELEASE);
+    return state;
+}
+
+// frees the slot of a guest taken out of the table in state, without d->lock held
+static void daemon_destroy_vm(daemon_t* d, daemon_vm_t* vm, int state)
+{
+    if (state == DAEMON_VM_RUNNING)
+    {
+        vm_stop(vm->g, vm->vcpu_thread);
+    }
+    if (vm->vcpu_started)
+    {
+        pthread_join(vm->vcpu_thread, NULL);
+    }
+    // the commands that got the guest before it left the table finish first
+    pthread_mutex_lock(&d->lock);
+    while (vm->users)
+    {
+        pthread_cond_wait(&d->users_cond, &d->lock);
+    }
+    pthread_mutex_unlock(&d->lock);
+    vm_destroy(vm->g);
+    free(vm->g);
+    close(vm->console_fd);
+    close(vm->guest_console_fd);
+    printf("%s: destroyed\n", vm->name);
+    vm->g = NULL;
+    vm->vcpu_started = false;
+    daemon_set_state(d, vm, DAEMON_VM_FREE);
+}
+
+// fills the config of a guest from the options of a create command
+static int daemon_parse_options(daemon_t* d, char* args, struct vm_config* cfg, char* reply, size_t reply_len)
+{
+    char* arg;
+
+    while ((arg = daemon_next_arg(&args)))
+    {
+        char* value = strchr(arg, '=');
+        if (value)
+        {
+            *value++ = '\0';
+        }
+
+        if (strcmp(arg, "ksm") == 0)
+        {
+            cfg->mem_mergeable = true;
+        }
+        else if (strcmp(arg, "balloon") == 0)
+        {
+            cfg->balloon = true;
+        }
+        else if (strcmp(arg, "rng") == 0)
+        {
+            cfg->rng = true;
+        }
+        else if (strcmp(arg, "no-pv") == 0)
+        {
+            cfg->no_pv = true;
+        }
+        else if (strcmp(arg, "boot-32") == 0)
+        {
+            cfg->boot_32 = true;
+        }
+        else if (value && strcmp(arg, "vsock") == 0)
+        {
+            cfg->vsock_path = value;
+        }
+        else if (value && strcmp(arg, "cid") == 0)
+        {
+            cfg->guest_cid = strtoull(value, NULL, 10);
+            if (cfg->guest_cid <= VIRTIO_VSOCK_HOST_CID)
+            {
+                snprintf(reply, reply_len, "error invalid cid\n");
+                return -1;
+            }
+        }
+        else if (value && strcmp(arg, "net") == 0 && strcmp(value, "switch") == 0)
+        {
+            cfg->net_fd = netswitch_add_port(&d->netswitch);
+            if (cfg->net_fd < 0)
+            {
+                snprintf(reply, reply_len, "error no free switch port\n");
+                return -1;
+            }
+        }
+        else if (value && strcmp(arg, "net") == 0)
+        {
+            cfg->net_spec = value;
+        }
+        else if (value && strcmp(arg, "mac") == 0)
+        {
+            uint8_t* mac = cfg->mac;
+            if (sscanf(value, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx", &mac[0], &mac[1], &mac[2], &mac[3], &mac[4], &mac[5]) != 6)
+            {
+                snprintf(reply, reply_len, "error invalid mac\n");
+                return -1;
+            }
+        }
+        else if (value && strcmp(arg, "ready") == 0)
+        {
+            cfg->ready_marker = value;
+        }
+        else if (value && strcmp(arg, "halt-poll") == 0)
+        {
+            char* end;
+            cfg->halt_poll_ns = strtol(value, &end, 10);
+            if (end == value || *end || cfg->halt_poll_ns < 0)
+            {
+                snprintf(reply, reply_len, "error invalid halt-poll\n");
+                return -1;
+            }
+        }
+        else if (value && strcmp(arg, "boot-prefetch") == 0)
+        {
+            char* end;
+            cfg->boot_trace_secs = strtoul(value, &end, 10);
+            if (end == value || *end || !cfg->boot_trace_secs)
+            {
+                snprintf(reply, reply_len, "error invalid boot-prefetch\n");
+                return -1;
+            }
+        }
+        else if (value && strcmp(arg, "disk") == 0)
+        {
+            if (vm_config_add_disk(cfg, value) < 0)
+            {
+                snprintf(reply, reply_len, "error invalid disk, or more than %d disks\n", VM_MAX_DISKS);
+                return -1;
+            }
+        }
+        else if (value && strcmp(arg, "console-log") == 0)
+        {
+            if (vm_config_set_console_log(cfg, value) < 0)
+            {
+                snprintf(reply, reply_len, "error invalid console-log\n");
+                return -1;
+            }
+        }
+        else if (value && strcmp(arg, "share") == 0)
+        {
+            if (vm_config_add_share(cfg, value) < 0)
+            {
+                snprintf(reply, reply_len, "error invalid share\n");
+                return -1;
+            }
+        }
+        else if (value && strcmp(arg, "blk-limit") == 0)
+        {
+            if (throttle_parse(&cfg->blk_limits, value) < 0)
+            {
+                snprintf(reply, reply_len, "error invalid blk-limit\n");
+                return -1;
+            }
+        }
+        else if (!value || vm_config_set_isolation(cfg, arg, value) < 0)
+        {
+            snprintf(reply, reply_len, "error invalid option %s\n", arg);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+create <name> <image> <disk> [options]: builds a guest without running it. the slot is taken
+under the lock, the guest is built without it so the other clients are served meanwhile
+*/
+static void daemon_create(daemon_t* d, int fd, char* args, char* reply, size_t reply_len)
+{
+    daemon_vm_t* vm = NULL;
+    struct vm_config cfg;
+    char name_line[DAEMON_MAX_LINE];
+    char* name_args = name_line;
+    int fds[2];
+    (void) fd;
+
+    strcpy(name_line, args);
+    char* name = daemon_next_arg(&name_args);
+    if (!name || strlen(name) >= DAEMON_MAX_NAME)
+    {
+        snprintf(reply, reply_len, "error usage: create <name> <image> <disk> [options]\n");
+        return;
+    }
+    pthread_mutex_lock(&d->lock);
+    if (daemon_find_vm(d, name))
+    {
+        pthread_mutex_unlock(&d->lock);
+        snprintf(reply, reply_len, "error %s exists\n", name);
+        return;
+    }
+    for (int i = 0; i < DAEMON_MAX_VMS && !vm; i++)
+    {
+        if (d->vms[i].state == DAEMON_VM_FREE)
+        {
+            vm = &d->vms[i];
+        }
+    }
+    if (vm)
+    {
+        strcpy(vm->name, name);
+        __atomic_store_n(&vm->state, DAEMON_VM_CREATING, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&d->lock);
+    if (!vm)
+    {
+        snprintf(reply, reply_len, "error too many VMs\n");
+        return;
+    }
+
+    // the strings of the config point into the copy kept with the guest
+    strcpy(vm->line, args);
+    args = vm->line;
+    daemon_next_arg(&args);
+    vm_config_init(&cfg);
+    cfg.image_path = daemon_next_arg(&args);
+    char* disk = daemon_next_arg(&args);
+    if (!disk)
+    {
+        snprintf(reply, reply_len, "error usage: create <name> <image> <disk> [options]\n");
+        daemon_set_state(d, vm, DAEMON_VM_FREE);
+        return;
+    }
+    if (vm_config_add_disk(&cfg, disk) < 0)
+    {
+        snprintf(reply, reply_len, "error invalid disk %s\n", disk);
+        daemon_set_state(d, vm, DAEMON_VM_FREE);
+        return;
+    }
+    // the pid keeps the guests of two daemons apart, the slot the guests of this one
+    cfg.mac[3] = (getpid() >> 8) & 0xff;
+    cfg.mac[4] = getpid() & 0xff;
+    cfg.mac[5] = vm - d->vms;
+    if (d->cgroup.path[0])
+    {
+        cfg.cgroup_parent = d->cgroup.path;
+        cfg.cgroup_name = name;
+    }
+    if (daemon_parse_options(d, args, &cfg, reply, reply_len) < 0)
+    {
+        if (cfg.net_fd >= 0)
+        {
+            close(cfg.net_fd);
+        }
+        daemon_set_state(d, vm, DAEMON_VM_FREE);
+        return;
+    }
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0)
+    {
+        snprintf(reply, reply_len, "error console socket: %s\n", strerror(errno));
+        if (cfg.net_fd >= 0)
+        {
+            close(cfg.net_fd);
+        }
+        daemon_set_state(d, vm, DAEMON_VM_FREE);
+        return;
+    }
+    // the guest doesn't wait for a console nobody reads
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+
+    vm->guest_console_fd = fds[0];
+    vm->console_fd = fds[1];
+    vm->g = calloc(1, sizeof(guest));
+    if (!vm->g || vm_create(vm->g, &cfg, d->kvm_fd, vm->guest_console_fd) < 0)
+    {
+        if (cfg.net_fd >= 0 && !(vm->g && vm->g->virtio_net_dev.enable))
+        {
+            close(cfg.net_fd); // not handed to a backend yet
+        }
+        snprintf(reply, reply_len, "error creating %s\n", vm->name);
+        if (vm->g)
+        {
+            daemon_destroy_vm(d, vm, DAEMON_VM_CREATED);
+        }
+        else
+        {
+            close(fds[0]);
+            close(fds[1]);
+            daemon_set_state(d, vm, DAEMON_VM_FREE);
+        }
+        return;
+    }
+    daemon_set_state(d, vm, DAEMON_VM_CREATED);
+    printf("%s: created\n", vm->name);
+    snprintf(reply, reply_len, "ok\n");
+}
+
+// start <name>: runs the vCPU of a created guest on a thread of its own
+static void daemon_start(daemon_t* d, int fd, char* args, char* reply, size_t reply_len)
+{
+    char* name = daemon_next_arg(&args);
+    daemon_vm_t* vm;
+    (void) fd;
+
+    pthread_mutex_lock(&d->lock);
+    vm = name ? daemon_find_vm(d, name) : NULL;
+    if (!vm)
+    {
+        snprintf(reply, reply_len, "error no such VM\n");
+    }
+    else if (vm->state != DAEMON_VM_CREATED)
+    {
+        snprintf(reply, reply_len, "error %s is %s\n", vm->name, daemon_state_names[vm->state]);
+    }
+    else
+    {
+        __atomic_store_n(&vm->state, DAEMON_VM_RUNNING, __ATOMIC_RELEASE);
+        vm->vcpu_started = pthread_create(&vm->vcpu_thread, NULL, daemon_vcpu_thread, vm) == 0;
+        if (!vm->vcpu_started)
+        {
+            __atomic_store_n(&vm->state, DAEMON_VM_CREATED, __ATOMIC_RELEASE);
+        }
+        snprintf(reply, reply_len, vm->vcpu_started ? "ok\n" : "error starting the vCPU\n");
+    }
+    pthread_mutex_unlock(&d->lock);
+}
+
+// stop <name>: stops the guest if it still runs, and frees it
+static void daemon_stop(daemon_t* d, int fd, char* args, char* reply, size_t reply_len)
+{
+    char* name = daemon_next_arg(&args);
+    daemon_vm_t* vm;
+    int state = DAEMON_VM_FREE;
+    (void) fd;
+
+    pthread_mutex_lock(&d->lock);
+    vm = name ? daemon_find_vm(d, name) : NULL;
+    if (vm)
+    {
+        state = daemon_take_vm(vm);
+    }
+    pthread_mutex_unlock(&d->lock);
+    if (!vm)
+    {
+        snprintf(reply, reply_len, "error no such VM\n");
+        return;
+    }
+    if (state == DAEMON_VM_FREE)
+    {
+        snprintf(reply, reply_len, "error %s is %s\n", vm->name,
+                 daemon_state_names[__atomic_load_n(&vm->state, __ATOMIC_ACQUIRE)]);
+        return;
+    }
+    daemon_destroy_vm(d, vm, state);
+    snprintf(reply, reply_len, "ok\n");
+}
+
+/*
+console <name>: the answer carries the console socket of the guest. the daemon keeps its own
+reference, so the console outlives the clients that attach to it
+*/
+static void daemon_console(daemon_t* d, int fd, char* args, char* reply, size_t reply_len)
+{
+    char* name = daemon_next_arg(&args);
+    daemon_vm_t* vm = daemon_get_vm(d, name);
+    char msg[] = "ok\n";
+    char control[CMSG_SPACE(sizeof(int))] = {0};
+    struct iovec iov = {.iov_base = msg, .iov_len = strlen(msg)};
+    struct msghdr hdr = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+
+    if (!vm)
+    {
+        snprintf(reply, reply_len, "error no such VM\n");
+        return;
+    }
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &vm->console_fd, sizeof(int));
+    if (sendmsg(fd, &hdr, MSG_NOSIGNAL) < 0)
+    {
+        perror("send console");
+    }
+    daemon_put_vm(d, vm);
+    // the answer went with the fd
+    reply[0] = '\0';
+    (void) reply_len;
+}
+
+// list: name=state of every guest
+static void daemon_list(daemon_t* d, int fd, char* args, char* reply, size_t reply_len)
+{
+    size_t len = 0;
+    (void) fd;
+    (void) args;
+
+    reply[0] = '\0';
+    pthread_mutex_lock(&d->lock);
+    for (int i = 0; i < DAEMON_MAX_VMS && len < reply_len; i++)
+    {
+        int state = __atomic_load_n(&d->vms[i].state, __ATOMIC_ACQUIRE);
+        if (state != DAEMON_VM_FREE)
+        {
+            len += snprintf(reply + len, reply_len - len, "%s%s=%s", len ? " " : "", d->vms[i].name, daemon_state_names[state]);
+        }
+    }
+    pthread_mutex_unlock(&d->lock);
+    if (len < reply_len)
+    {
+        snprintf(reply + len, reply_len - len, "\n");
+    }
+}
+
+// trace start|stop|dump <path>: the trace covers all the guests, it is the control command without a guest
+static void daemon_trace(daemon_t* d, int fd, char* args, char* reply, size_t reply_len)
+{
+    char line[DAEMON_MAX_LINE];
+    (void) d;
+    (void) fd;
+
+    snprintf(line, sizeof(line), "trace %s", args);
+    control_run_command(NULL, line, reply, reply_len);
+}
+
+// boot-stats: percentiles of the boot steps over all the guests, the control command without a guest
+static void daemon_boot_stats(daemon_t* d, int fd, char* args, char* reply, size_t reply_len)
+{
+    char line[] = "boot-stats";
+    (void) d;
+    (void) fd;
+    (void) args;
+
+    control_run_command(NULL, line, reply, reply_len);
+}
+
+static const daemon_cmd_t daemon_cmds[] = {
+    {"create", daemon_create},
+    {"start", daemon_start},
+    {"stop", daemon_stop},
+    {"console", daemon_console},
+    {"list", daemon_list},
+    {"trace", daemon_trace},
+    {"boot-stats", daemon_boot_stats},
+};
+
+// run a single command line and write its answer into reply, the commands take d->lock themselves
+static void daemon_dispatch(daemon_t* d, int fd, char* line, char* reply, size_t reply_len)
+{
+    char* args = line;
+    char* cmd = daemon_next_arg(&args);
+
+    if (!cmd)
+    {
+        snprintf(reply, reply_len, "error empty command\n");
+        return;
+    }
+    for (size_t i = 0; i < sizeof(daemon_cmds) / sizeof(daemon_cmds[0]); i++)
+    {
+        if (strcmp(cmd, daemon_cmds[i].name) == 0)
+        {
+            daemon_cmds[i].handler(d, fd, args, reply, reply_len);
+            return;
+        }
+    }
+
+    // "<command> <name> [args]" goes to the control commands of the guest as "<command> [args]"
+    char* name = daemon_next_arg(&args);
+    daemon_vm_t* vm = daemon_get_vm(d, name);
+    char vm_line[DAEMON_MAX_LINE];
+    if (!vm)
+    {
+        snprintf(reply, reply_len, "error no such VM\n");
+        return;
+    }
+    snprintf(vm_line, sizeof(vm_line), "%s %s", cmd, args);
+    pthread_mutex_lock(&vm->cmd_lock);
+    control_run_command(vm->g, vm_line, reply, reply_len);
+    pthread_mutex_unlock(&vm->cmd_lock);
+    daemon_put_vm(d, vm);
+}
+
+// serve the commands of one client until it disconnects
+static void* daemon_client_thread(void* arg)
+{
+    daemon_client_t* client = (daemon_client_t*) arg;
+    daemon_t* d = client->d;
+    char line[DAEMON_MAX_LINE];
+    char reply[DAEMON_MAX_REPLY];
+    size_t len = 0;
+
+    while (1)
+    {
+        ssize_t n = recv(client->fd, line + len, sizeof(line) - 1 - len, 0);
+        if (n <= 0)
+        {
+            break;
+        }
+        len += n;
+        line[len] = '\0';
+
+        char* newline;
+        while ((newline = strchr(line, '\n')))
+        {
+            *newline = '\0';
+            if (newline > line && newline[-1] == '\r')
+            {
+                newline[-1] = '\0';
+            }
+
+            reply[0] = '\0';
+            daemon_dispatch(d, client->fd, line, reply, sizeof(reply));
+            if (send(client->fd, reply, strlen(reply), MSG_NOSIGNAL) < 0)
+            {
+                goto out;
+            }
+
+            len -= newline + 1 - line;
+            memmove(line, newline + 1, len + 1);
+        }
+
+        if (len == sizeof(line) - 1)
+        {
+            break; // line too long
+        }
+    }
+out:
+    close(client->fd);
+    free(client);
+    return NULL;
+}
+
+static int daemon_listen(daemon_t* d, const char* path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        printf("Daemon socket path is too long\n");
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    strcpy(d->path, path);
+
+    d->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (d->listen_fd < 0)
+    {
+        perror("daemon socket");
+        return -1;
+    }
+
+    unlink(path); // a socket left behind by a previous run
+    if (bind(d->listen_fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 || listen(d->listen_fd, 16) < 0)
+    {
+        perror("bind daemon socket");
+        close(d->listen_fd);
+        return -1;
+    }
+    sudo_chown_socket(path);
+    return 0;
+}
+
+// the daemon moves into a cgroup of its own, the guests get threaded cgroups below it
+static void daemon_init_cgroup(daemon_t* d)
+{
+    char root[PATH_MAX];
+    char name[32];
+
+    snprintf(name, sizeof(name), "daemon-%d", getpid());
+    if (cgroup_root(root, sizeof(root)) < 0 || cgroup_create(&d->cgroup, root, name, false) < 0)
+    {
+        printf("The VMs run without cgroups.\n");
+        return;
+    }
+    if (cgroup_enter(&d->cgroup) < 0)
+    {
+        cgroup_destroy(&d->cgroup);
+        printf("The VMs run without cgroups.\n");
+    }
+}
+
+static void daemon_exit_cgroup(daemon_t* d)
+{
+    if (d->cgroup.path[0])
+    {
+        cgroup_leave(&d->cgroup);
+        cgroup_destroy(&d->cgroup);
+    }
+}
+
+int daemon_run(daemon_t* d, const char* path, const char* switch_path)
+{
+    memset(d, 0, sizeof(*d));
+    pthread_mutex_init(&d->lock, NULL);
+    pthread_cond_init(&d->users_cond, NULL);
+    for (int i = 0; i < DAEMON_MAX_VMS; i++)
+    {
+        pthread_mutex_init(&d->vms[i].cmd_lock, NULL);
+    }
+    // a client that went away must not take all the guests with it
+    signal(SIGPIPE, SIG_IGN);
+
+    d->kvm_fd = open("/dev/kvm", O_RDWR | O_CLOEXEC);
+    if (d->kvm_fd < 0)
+    {
+        perror("open /dev/kvm");
+        return -1;
+    }
+    daemon_init_cgroup(d);
+    if (netswitch_init(&d->netswitch, switch_path) < 0)
+    {
+        printf("Error starting the network switch.\n");
+        daemon_exit_cgroup(d);
+        close(d->kvm_fd);
+        return -1;
+    }
+    if (daemon_listen(d, path) < 0)
+    {
+        netswitch_exit(&d->netswitch);
+        daemon_exit_cgroup(d);
+        close(d->kvm_fd);
+        return -1;
+    }
+    printf("Daemon listening on %s\n", path);
+
+    while (1)
+    {
+        int fd = accept(d->listen_fd, NULL, NULL);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            perror("daemon accept");
+            break;
+        }
+
+        daemon_client_t* client = malloc(sizeof(daemon_client_t));
+        pthread_t thread;
+        client->d = d;
+        client->fd = fd;
+        if (pthread_create(&thread, NULL, daemon_client_thread, client) != 0)
+        {
+            close(fd);
+            free(client);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    for (int i = 0; i < DAEMON_MAX_VMS; i++)
+    {
+        pthread_mutex_lock(&d->lock);
+        int state = daemon_take_vm(&d->vms[i]);
+        pthread_mutex_unlock(&d->lock);
+        if (state != DAEMON_VM_FREE)
+        {
+            daemon_destroy_vm(d, &d->vms[i], state);
+        }
+    }
+    close(d->listen_fd);
+    unlink(d->path);
+    netswitch_exit(&d->netswitch);
+    daemon_exit_cgroup(d);
+    close(d->kvm_fd);
+    return -1;
+}
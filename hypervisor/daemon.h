@@ -0,0 +1,84 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <sys/un.h>
+
+#include "guest.h"
+#include "netswitch.h"
+
+#define DAEMON_MAX_VMS 32
+#define DAEMON_MAX_NAME 64
+#define DAEMON_MAX_LINE 1024
+#define DAEMON_MAX_REPLY 1024
+
+/*
+one long running hypervisor hosting many guests, so a new session costs a create command
+instead of a sudo, an exec and an open of /dev/kvm. it listens on a unix socket for one
+line commands and answers each of them with one line:
+
+  create <name> <image> <disk> [ksm] [balloon] [rng] [no-pv] [boot-32] [vsock=<path>]
+         [cid=<cid>] [net=<tap:ifname|switch:path|switch>] [mac=<mac>] [ready=<text>] [halt-poll=<ns>]
+         [blk-limit=iops=<n>,iops-burst=<n>,bps=<n>,bps-burst=<n>] [boot-prefetch=<secs>] [disk=<disk>]...
+         [share=<dir>[,tag=<tag>][,ro]] [console-log=<path>[,size=<KiB>]]
+         [cpu-max=<quota_us>/<period_us>] [vcpu-cpus=<cpu list>] [io-cpus=<cpu list>] [numa=<node>]
+  start <name>
+  stop <name>                 stops the guest and frees it
+  console <name>              answers "ok" with the console socket of the guest attached (SCM_RIGHTS)
+  list
+  trace start|stop|dump <path> the device emulation trace of all the guests, see trace.h
+  boot-stats                  percentiles of the boot steps over all the guests, see bootprof.h
+  <command> <name> [args]     a command of the per VM control socket, e.g. "balloon vm1 256" or "vcpu vm1"
+
+a disk is a path with an optional ,cache=writeback|writethrough|none, disk= adds one more virtio-blk
+device, see vm_config_add_disk. share= is a host directory the guest mounts over virtio-9p, see
+vm_config_add_share. console-log= keeps the console output of the guest in a file whether or not a
+client is attached, the console-log command replays it, see consolelog.h. net=switch joins the
+switch of the daemon, which connects its guests to each other.
+the daemon runs in a cgroup of its own and each guest in a threaded cgroup below it, see isolation.h.
+each guest is a thread group of its own: its vCPU thread, the serial thread and the device threads
+*/
+
+enum daemon_vm_state
+{
+    DAEMON_VM_FREE,
+    DAEMON_VM_CREATED,
+    DAEMON_VM_RUNNING,
+    DAEMON_VM_STOPPED, // run_vm returned, the guest powered off or crashed
+    DAEMON_VM_CREATING, // the name and the slot are taken, vm_create runs without the lock
+    DAEMON_VM_DESTROYING, // out of the table, the teardown runs without the lock
+};
+
+typedef struct daemon_vm
+{
+    char name[DAEMON_MAX_NAME];
+    int state; // enum daemon_vm_state, the vCPU thread sets DAEMON_VM_STOPPED
+    int users; // clients running a command on the guest, the teardown waits for them
+    pthread_mutex_t cmd_lock; // one control command at a time on the guest
+    bool vcpu_started;
+    guest* g;
+    int console_fd; // our end of the console socket, the one handed to clients
+    int guest_console_fd; // the serial device end
+    pthread_t vcpu_thread;
+    char line[DAEMON_MAX_LINE]; // the create command, the paths of the guest point into it
+} daemon_vm_t;
+
+typedef struct daemon
+{
+    int listen_fd;
+    int kvm_fd; // shared by all the guests
+    char path[sizeof(((struct sockaddr_un*) 0)->sun_path)];
+    // the vms table, clients are served on threads of their own. held to look a guest up or
+    // change its state, never while a guest is built or torn down
+    pthread_mutex_t lock;
+    pthread_cond_t users_cond; // a guest has no users left
+    daemon_vm_t vms[DAEMON_MAX_VMS];
+    struct netswitch netswitch;
+    cgroup_t cgroup; // no path when cgroup v2 is not available
+} daemon_t;
+
+// serves clients until an error, switch_path is where other hypervisors join the switch or NULL
+int daemon_run(daemon_t* d, const char* path, const char* switch_path);
+
+#endif // DAEMON_H
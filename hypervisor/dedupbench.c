@@ -0,0 +1,381 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blockstore.h"
+#include "diskimg.h"
+
+/* Throughput of a disk backed by a block map of a block store against the
+ * same disk as a plain file, through the diskimg calls virtio-blk makes, and
+ * the space a store saves on the disks of many guests cloned from one base
+ * image. The base image is made up: a quarter zero blocks, a tenth blocks it
+ * holds many times (the same files in many places) and unique blocks. The
+ * page cache is dropped before the reads.
+ */
+
+#define FS_BLOCK 4096
+#define SEQ_CHUNK (1 << 20)
+
+struct dedupbench {
+    char dir[4096];
+    uint64_t size;
+    uint32_t block_size;
+    unsigned int images;
+    unsigned int unique_pct; /* of the disk, written by each guest on its own */
+    unsigned int ops;
+    uint8_t *buf;
+    int failed;
+};
+
+static uint64_t bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t mix(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    return x ^ (x >> 33);
+}
+
+static void fill_block(uint8_t *buf, uint64_t seed)
+{
+    uint64_t *p = (uint64_t *) buf;
+
+    for (size_t i = 0; i < FS_BLOCK / 8; i++)
+        p[i] = seed ? mix(seed * 512 + i) : 0;
+}
+
+/* The content of a block of the base image */
+static uint64_t base_seed(uint64_t block)
+{
+    uint64_t r = mix(block) % 100;
+
+    if (r < 25)
+        return 0;
+    if (r < 35)
+        return 1 + mix(block + 1) % 64;
+    return 1000 + block;
+}
+
+static void path_of(struct dedupbench *b, char *path, const char *name)
+{
+    snprintf(path, 4096 + 64, "%s/%s", b->dir, name);
+}
+
+static void check(struct dedupbench *b, bool ok, const char *what)
+{
+    if (!ok) {
+        printf("FAILED: %s\n", what);
+        b->failed = 1;
+    }
+}
+
+static void drop_cache(struct dedupbench *b, const char *name)
+{
+    char path[4096 + 64];
+    int fd;
+
+    path_of(b, path, name);
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+static void write_base(struct dedupbench *b, const char *path)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+    for (uint64_t off = 0; fd >= 0 && off < b->size; off += SEQ_CHUNK) {
+        for (size_t i = 0; i < SEQ_CHUNK; i += FS_BLOCK)
+            fill_block(b->buf + i, base_seed((off + i) / FS_BLOCK));
+        if (pwrite(fd, b->buf, SEQ_CHUNK, off) != SEQ_CHUNK)
+            break;
+    }
+    if (fd < 0 || fsync(fd) < 0) {
+        perror(path);
+        exit(1);
+    }
+    close(fd);
+}
+
+static double seq_read(struct diskimg *d, uint8_t *buf)
+{
+    uint64_t start = bench_now();
+
+    for (uint64_t off = 0; off < d->size; off += SEQ_CHUNK)
+        if (diskimg_read(d, buf, off, SEQ_CHUNK) != SEQ_CHUNK)
+            return 0;
+    return (d->size >> 20) / ((bench_now() - start) / 1e9);
+}
+
+static double seq_write(struct diskimg *d, uint8_t *buf)
+{
+    uint64_t start = bench_now();
+
+    for (uint64_t off = 0; off < d->size; off += SEQ_CHUNK) {
+        for (size_t i = 0; i < SEQ_CHUNK; i += FS_BLOCK)
+            fill_block(buf + i, 2000000000 + (off + i) / FS_BLOCK);
+        if (diskimg_write(d, buf, off, SEQ_CHUNK) != SEQ_CHUNK)
+            return 0;
+    }
+    return (d->size >> 20) / ((bench_now() - start) / 1e9);
+}
+
+/* 4K requests at random offsets, the writes of new content */
+static double random_io(struct dedupbench *b, struct diskimg *d, bool write)
+{
+    uint64_t blocks = d->size / FS_BLOCK;
+    uint64_t start = bench_now();
+
+    for (unsigned int i = 0; i < b->ops; i++) {
+        uint64_t block = mix(i + (write ? 7 : 3)) % blocks;
+
+        if (write) {
+            fill_block(b->buf, 1000000000 + i);
+            if (diskimg_write(d, b->buf, block * FS_BLOCK, FS_BLOCK) != FS_BLOCK)
+                return 0;
+        } else if (diskimg_read(d, b->buf, block * FS_BLOCK, FS_BLOCK) != FS_BLOCK) {
+            return 0;
+        }
+    }
+    return b->ops / ((bench_now() - start) / 1e9);
+}
+
+static void throughput(struct dedupbench *b,
+                       struct diskimg *d,
+                       const char *name,
+                       const char *const *files)
+{
+    double read_mbs, write_mbs, read_iops, write_iops;
+
+    for (const char *const *f = files; *f; f++)
+        drop_cache(b, *f);
+    read_mbs = seq_read(d, b->buf);
+    for (const char *const *f = files; *f; f++)
+        drop_cache(b, *f);
+    read_iops = random_io(b, d, false);
+    write_iops = random_io(b, d, true);
+    write_mbs = seq_write(d, b->buf);
+    printf("%-10s seq read %7.0f MB/s  4K read %8.0f IOPS  4K write %8.0f IOPS  seq write %7.0f MB/s\n",
+           name, read_mbs, read_iops, write_iops, write_mbs);
+    check(b, read_mbs && read_iops && write_iops && write_mbs, name);
+}
+
+static bool same_disks(struct diskimg *a, struct diskimg *c)
+{
+    uint8_t *buf = malloc(SEQ_CHUNK), *buf2 = malloc(SEQ_CHUNK);
+    bool same = buf && buf2 && a->size == c->size;
+
+    for (uint64_t off = 0; same && off < a->size; off += SEQ_CHUNK)
+        same = diskimg_read(a, buf, off, SEQ_CHUNK) == SEQ_CHUNK &&
+               diskimg_read(c, buf2, off, SEQ_CHUNK) == SEQ_CHUNK &&
+               !memcmp(buf, buf2, SEQ_CHUNK);
+    free(buf);
+    free(buf2);
+    return same;
+}
+
+static uint64_t disk_usage(const char *path)
+{
+    struct stat st;
+
+    return stat(path, &st) < 0 ? 0 : st.st_blocks * 512;
+}
+
+/* The raw file and a clone of the base map, put through the same requests,
+ * read back the same */
+static void bench_throughput(struct dedupbench *b)
+{
+    static const char *const raw_files[] = {"disk.raw", NULL};
+    static const char *const map_files[] = {"vm.map", BLOCKSTORE_BLOCKS, NULL};
+    char raw_path[4096 + 64], base_path[4096 + 64], vm_path[4096 + 64];
+    struct blockstore_image base;
+    struct diskimg raw, map;
+    uint64_t start;
+
+    path_of(b, raw_path, "disk.raw");
+    path_of(b, base_path, "base.map");
+    path_of(b, vm_path, "vm.map");
+    write_base(b, raw_path);
+
+    start = bench_now();
+    if (blockstore_image_create(&base, base_path, b->size, b->block_size) < 0) {
+        b->failed = 1;
+        return;
+    }
+    for (uint64_t off = 0; off < b->size; off += SEQ_CHUNK)
+        for (size_t i = 0; i < SEQ_CHUNK; i += FS_BLOCK) {
+            fill_block(b->buf, base_seed((off + i) / FS_BLOCK));
+            blockstore_image_write(&base, b->buf, off + i, FS_BLOCK);
+        }
+    printf("%lu MB base image imported in %.0f ms, %u byte blocks\n",
+           b->size >> 20, (bench_now() - start) / 1e6, b->block_size);
+    check(b, blockstore_image_clone(&base, vm_path) == 0, "clone of the base image");
+    blockstore_image_close(&base);
+
+    if (diskimg_init(&raw, raw_path) < 0 || diskimg_init(&map, vm_path) < 0) {
+        b->failed = 1;
+        return;
+    }
+    check(b, same_disks(&raw, &map), "the map reads as the raw image");
+    throughput(b, &raw, "raw file", raw_files);
+    throughput(b, &map, "block map", map_files);
+    check(b, same_disks(&raw, &map), "the map reads as the raw image after the writes");
+    diskimg_exit(&raw);
+    diskimg_exit(&map);
+    unlink(raw_path);
+    unlink(vm_path);
+}
+
+/* Guests cloned from the base, each writing some blocks of its own and the
+ * same update as the others */
+static void bench_dedup(struct dedupbench *b)
+{
+    char base_path[4096 + 64], path[4096 + 64], blocks_path[4096 + 64];
+    struct blockstore_stats stats;
+    struct blockstore_image base, img;
+    uint64_t blocks = b->size / FS_BLOCK, used;
+    int64_t freed;
+
+    path_of(b, base_path, "base.map");
+    path_of(b, blocks_path, BLOCKSTORE_BLOCKS);
+    if (blockstore_image_open(&base, base_path) < 0) {
+        b->failed = 1;
+        return;
+    }
+    blockstore_gc(base.store);
+    for (unsigned int n = 0; n < b->images; n++) {
+        char name[64];
+
+        snprintf(name, sizeof(name), "guest%u.map", n);
+        path_of(b, path, name);
+        if (blockstore_image_clone(&base, path) < 0 ||
+            blockstore_image_open(&img, path) < 0) {
+            b->failed = 1;
+            return;
+        }
+        for (uint64_t i = 0; i < blocks * b->unique_pct / 100; i++) {
+            fill_block(b->buf, 3000000000ULL + n * blocks + i);
+            blockstore_image_write(&img, b->buf, mix(n * blocks + i) % blocks * FS_BLOCK,
+                                   FS_BLOCK);
+        }
+        /* the same package update in every guest */
+        for (uint64_t i = 0; i < blocks / 50; i++) {
+            fill_block(b->buf, 4000000000ULL + i);
+            blockstore_image_write(&img, b->buf, (blocks / 2 + i) * FS_BLOCK, FS_BLOCK);
+        }
+        blockstore_image_close(&img);
+    }
+    blockstore_get_stats(base.store, &stats);
+    used = disk_usage(blocks_path);
+    printf("%u guests of %lu MB, %u%% of the disk written by each, 2%% the same in all\n",
+           b->images, b->size >> 20, b->unique_pct);
+    printf("  as raw files  %6lu MB on disk, the base image and a copy of it per guest\n",
+           (b->images + 1) * b->size >> 20);
+    printf("  block store   %6lu MB on disk, %lu blocks stored for %lu non zero blocks\n",
+           used >> 20, stats.unique, stats.refs);
+    printf("  dedup ratio   %.2f, %lu of %lu block writes found in the store\n",
+           (double) stats.refs / stats.unique, stats.dedup_hits, stats.writes);
+    check(b, stats.unique < stats.refs, "blocks shared between the guests");
+
+    for (unsigned int n = 0; n < b->images; n++) {
+        char name[64];
+
+        snprintf(name, sizeof(name), "guest%u.map", n);
+        path_of(b, path, name);
+        unlink(path);
+    }
+    freed = blockstore_gc(base.store);
+    printf("  guests deleted: %ld blocks given back, %lu MB on disk\n", freed,
+           disk_usage(blocks_path) >> 20);
+    check(b, disk_usage(blocks_path) < used, "gc gives the space back");
+    blockstore_image_close(&base);
+}
+
+static void cleanup(struct dedupbench *b)
+{
+    DIR *dir = opendir(b->dir);
+    struct dirent *d;
+
+    while (dir && (d = readdir(dir)))
+        if (d->d_name[0] != '.')
+            unlinkat(dirfd(dir), d->d_name, 0);
+    if (dir)
+        closedir(dir);
+    rmdir(b->dir);
+}
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [-m mbytes] [-b block size] [-n guests] [-u percent] [-d dir]\n", prog);
+    printf("  -m  disk size in MB (default 256)\n");
+    printf("  -b  block size of the store, 4096 to 65536 (default 4096)\n");
+    printf("  -n  guests cloned from the base image (default 8)\n");
+    printf("  -u  of the disk, blocks each guest writes on its own (default 5)\n");
+    printf("  -d  directory of the disk images (default /tmp)\n");
+}
+
+int main(int argc, char **argv)
+{
+    struct dedupbench b = {.size = 256ULL << 20, .block_size = 4096, .images = 8,
+                           .unique_pct = 5, .ops = 20000};
+    const char *dir = "/tmp";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:b:n:u:d:")) != -1) {
+        switch (opt) {
+        case 'm':
+            b.size = strtoull(optarg, NULL, 10) << 20;
+            break;
+        case 'b':
+            b.block_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            b.images = strtoul(optarg, NULL, 10);
+            break;
+        case 'u':
+            b.unique_pct = strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            dir = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!b.size || b.block_size < FS_BLOCK || b.block_size > BLOCKSTORE_MAX_BLOCK_SIZE ||
+        b.unique_pct > 100) {
+        usage(argv[0]);
+        return 1;
+    }
+    snprintf(b.dir, sizeof(b.dir), "%s/dedupbench.%d", dir, getpid());
+    b.buf = malloc(SEQ_CHUNK);
+    if (!b.buf || mkdir(b.dir, 0700) < 0) {
+        perror(b.dir);
+        return 1;
+    }
+    bench_throughput(&b);
+    if (!b.failed)
+        bench_dedup(&b);
+    cleanup(&b);
+    free(b.buf);
+    printf(b.failed ? "dedupbench: FAILED\n" : "dedupbench: all checks passed\n");
+    return b.failed;
+}
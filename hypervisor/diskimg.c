@@ -1,14 +1,30 @@
 #include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 #include "diskimg.h"
 
+#define DISKIMG_CACHE_OPT ",cache="
+
+static const char *const cache_names[] = {
+    [DISKIMG_CACHE_WRITEBACK] = "writeback",
+    [DISKIMG_CACHE_WRITETHROUGH] = "writethrough",
+    [DISKIMG_CACHE_NONE] = "none",
+};
+
 ssize_t diskimg_read(struct diskimg *diskimg,
                      void *data,
                      off_t offset,
                      size_t size)
 {
+    if (diskimg->image)
+        return blockstore_image_read(diskimg->image, data, offset, size);
+    if (diskimg->cdisk)
+        return cdisk_read(diskimg->cdisk, data, offset, size);
+    if (diskimg->traced && diskimg->boot_trace.recording)
+        boot_trace_record(&diskimg->boot_trace, offset, size);
     lseek(diskimg->fd, offset, SEEK_SET);
     return read(diskimg->fd, data, size);
 }
@@ -18,22 +34,137 @@ ssize_t diskimg_write(struct diskimg *diskimg,
                       off_t offset,
                       size_t size)
 {
+    if (diskimg->image)
+        return blockstore_image_write(diskimg->image, data, offset, size);
+    if (diskimg->cdisk)
+        return cdisk_write(diskimg->cdisk, data, offset, size);
     lseek(diskimg->fd, offset, SEEK_SET);
     return write(diskimg->fd, data, size);
 }
 
-int diskimg_init(struct diskimg *diskimg, const char *file_path)
+int diskimg_open(struct diskimg *diskimg,
+                 const char *file_path,
+                 enum diskimg_cache cache)
 {
+    int flags = O_RDWR;
+
+    diskimg->traced = false;
+    diskimg->image = NULL;
+    diskimg->cdisk = NULL;
+    diskimg->cache = cache;
     diskimg->fd = open(file_path, O_RDWR);
     if (diskimg->fd < 0)
         return -1;
+    if (cache != DISKIMG_CACHE_WRITEBACK) {
+        /* a block store and a compressed image do their own I/O on their
+         * files */
+        if (blockstore_is_map(diskimg->fd) || cdisk_is_cdisk(diskimg->fd)) {
+            fprintf(stderr, "%s: cache=%s takes a plain disk image file\n",
+                    file_path, cache_names[cache]);
+            close(diskimg->fd);
+            return -1;
+        }
+        /* the magic is read into an unaligned buffer first. O_DIRECT is
+         * only declared with _GNU_SOURCE */
+        flags |= cache == DISKIMG_CACHE_NONE ? __O_DIRECT : O_DSYNC;
+        close(diskimg->fd);
+        diskimg->fd = open(file_path, flags);
+        if (diskimg->fd < 0)
+            return -1;
+    }
+    if (blockstore_is_map(diskimg->fd)) {
+        diskimg->image = malloc(sizeof(*diskimg->image));
+        if (!diskimg->image ||
+            blockstore_image_open(diskimg->image, file_path) < 0) {
+            free(diskimg->image);
+            diskimg->image = NULL;
+            close(diskimg->fd);
+            return -1;
+        }
+        diskimg->size = diskimg->image->size;
+        return 0;
+    }
+    if (cdisk_is_cdisk(diskimg->fd)) {
+        diskimg->cdisk = malloc(sizeof(*diskimg->cdisk));
+        if (!diskimg->cdisk || cdisk_open(diskimg->cdisk, file_path) < 0) {
+            free(diskimg->cdisk);
+            diskimg->cdisk = NULL;
+            close(diskimg->fd);
+            return -1;
+        }
+        diskimg->size = diskimg->cdisk->header.size;
+        return 0;
+    }
     struct stat st;
     fstat(diskimg->fd, &st);
     diskimg->size = st.st_size;
     return 0;
 }
 
+int diskimg_init(struct diskimg *diskimg, const char *file_path)
+{
+    return diskimg_open(diskimg, file_path, DISKIMG_CACHE_WRITEBACK);
+}
+
+int diskimg_parse_cache(const char *name, enum diskimg_cache *cache)
+{
+    for (size_t i = 0; i < sizeof(cache_names) / sizeof(cache_names[0]); i++) {
+        if (strcmp(name, cache_names[i]) == 0) {
+            *cache = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int diskimg_parse_path(char *path, enum diskimg_cache *cache)
+{
+    char *opt = strstr(path, DISKIMG_CACHE_OPT);
+
+    *cache = DISKIMG_CACHE_WRITEBACK;
+    if (!opt)
+        return 0;
+    *opt = '\0';
+    return diskimg_parse_cache(opt + strlen(DISKIMG_CACHE_OPT), cache);
+}
+
+const char *diskimg_cache_name(enum diskimg_cache cache)
+{
+    return cache_names[cache];
+}
+
+int diskimg_boot_trace(struct diskimg *diskimg,
+                       const char *file_path,
+                       unsigned int secs)
+{
+    char path[sizeof(diskimg->boot_trace.path)];
+
+    /* the trace holds offsets of the file, not of the disk, and prefetches
+     * into the page cache */
+    if (diskimg->image || diskimg->cdisk || diskimg->cache == DISKIMG_CACHE_NONE)
+        return -1;
+    if (snprintf(path, sizeof(path), "%s" BOOT_TRACE_SUFFIX, file_path) >=
+            (int) sizeof(path) ||
+        boot_trace_init(&diskimg->boot_trace, diskimg->fd, path, secs) < 0)
+        return -1;
+    diskimg->traced = true;
+    return 0;
+}
+
 void diskimg_exit(struct diskimg *diskimg)
 {
+    if (diskimg->traced)
+        boot_trace_exit(&diskimg->boot_trace);
+    diskimg->traced = false;
+    if (diskimg->image) {
+        blockstore_image_close(diskimg->image);
+        free(diskimg->image);
+        diskimg->image = NULL;
+    }
+    if (diskimg->cdisk) {
+        cdisk_close(diskimg->cdisk);
+        free(diskimg->cdisk);
+        diskimg->cdisk = NULL;
+    }
     close(diskimg->fd);
 }
@@ -1,12 +1,32 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stdlib.h>
 
-/* simple backed by disk image file */
+#include "blockstore.h"
+#include "boottrace.h"
+#include "cdisk.h"
+
+/* simple backed by disk image file, by a block map of a block store (see
+ * blockstore.h) or by a compressed disk image (see cdisk.h), told apart by
+ * their magic */
+
+/* what the host page cache does for a plain file */
+enum diskimg_cache {
+    DISKIMG_CACHE_WRITEBACK, /* writes are done once in the page cache */
+    DISKIMG_CACHE_WRITETHROUGH, /* writes are done once on the disk (O_DSYNC) */
+    DISKIMG_CACHE_NONE, /* around the page cache (O_DIRECT), the guest has to
+                           align its buffers to the logical block size */
+};
 
 struct diskimg {
     int fd;
     size_t size;
+    enum diskimg_cache cache;
+    struct blockstore_image *image; /* NULL for a plain file */
+    struct cdisk *cdisk; /* NULL for a plain file */
+    bool traced; /* boot reads recorded or prefetched, see boottrace.h */
+    struct boot_trace boot_trace;
 };
 
 ssize_t diskimg_read(struct diskimg *diskimg,
@@ -18,4 +38,20 @@ ssize_t diskimg_write(struct diskimg *diskimg,
                       off_t offset,
                       size_t size);
 int diskimg_init(struct diskimg *diskimg, const char *file_path);
+/* diskimg_init with a cache policy other than write-back, which only plain
+ * files take */
+int diskimg_open(struct diskimg *diskimg,
+                 const char *file_path,
+                 enum diskimg_cache cache);
+/* Cuts a ,cache=writeback|writethrough|none suffix off a disk path. Returns
+ * -1 for an unknown policy */
+int diskimg_parse_path(char *path, enum diskimg_cache *cache);
+int diskimg_parse_cache(const char *name, enum diskimg_cache *cache);
+const char *diskimg_cache_name(enum diskimg_cache cache);
+/* Records the reads of the next secs seconds into <file_path>.boottrace, or
+ * prefetches them when that file exists. Plain files through the page cache
+ * only */
+int diskimg_boot_trace(struct diskimg *diskimg,
+                       const char *file_path,
+                       unsigned int secs);
 void diskimg_exit(struct diskimg *diskimg);
@@ -1,4 +1,6 @@
 #include "guest.h"
+#include "trace.h"
+#include "vm.h"
 
 int vm_irq_line(guest* v, int irq, int level)
 {
@@ -7,6 +9,7 @@ int vm_irq_line(guest* v, int irq, int level)
         .level = level,
     };
 
+    TRACE(TRACE_IRQ, irq, level, 0);
     if (ioctl(v->vm_fd, KVM_IRQ_LINE, &irq_level) < 0)
     {
         printf("Failed to set the status of an IRQ line");
@@ -15,3 +18,56 @@ int vm_irq_line(guest* v, int irq, int level)
 
     return 0;
 }
+
+int vm_irq_alloc(guest* v)
+{
+    static const int irqs[] = VM_PCI_IRQS;
+
+    for (size_t i = 0; i < sizeof(irqs) / sizeof(irqs[0]); i++)
+    {
+        if (!(v->irqs_used & (1U << irqs[i])))
+        {
+            v->irqs_used |= 1U << irqs[i];
+            return irqs[i];
+        }
+    }
+    return -1;
+}
+
+// the guest memory is mapped at guest physical address 0, so it is a plain offset
+void* vm_guest_to_host(guest* v, uint64_t guest_addr)
+{
+    return (void *) ((uintptr_t) v->mem + guest_addr);
+}
+
+// check that a guest supplied buffer lies completely inside the guest memory
+bool vm_guest_range_valid(guest* v, uint64_t guest_addr, uint64_t len)
+{
+    (void) v;
+    return guest_addr < GUEST_MEMORY_SIZE && len <= GUEST_MEMORY_SIZE - guest_addr;
+}
+
+void vm_ioeventfd_register(guest* v, int fd, unsigned long long addr, int len, int flags)
+{
+    struct kvm_ioeventfd ioeventfd = {
+        .fd = fd,
+        .addr = addr,
+        .len = len,
+        .flags = flags,
+    };
+
+    if (ioctl(v->vm_fd, KVM_IOEVENTFD, &ioeventfd) < 0)
+        perror("Failed to set the status of IOEVENTFD");
+}
+
+void vm_irqfd_register(guest* v, int fd, int gsi, int flags)
+{
+    struct kvm_irqfd irqfd = {
+        .fd = fd,
+        .gsi = gsi,
+        .flags = flags,
+    };
+
+    if (ioctl(v->vm_fd, KVM_IRQFD, &irqfd) < 0)
+        perror("Failed to set the status of IRQFD");
+}
@@ -2,28 +2,95 @@
 #define GUEST_H
 
 #include <linux/kvm.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <sys/ioctl.h>
+#include <time.h>
 
 #include "serial_dev.h"
+#include "bootprof.h"
 #include "bus.h"
 #include "pci.h"
 #include "virtio-blk.h"
+#include "virtio-balloon.h"
+#include "virtio-vsock.h"
+#include "virtio-net.h"
+#include "virtio-rng.h"
+#include "virtio-9p.h"
+#include "vhost-user-blk.h"
 #include "diskimg.h"
+#include "consolelog.h"
+#include "kvm_stats.h"
+#include "isolation.h"
+
+/*
+IRQ lines of the PIC that no fixed device and no legacy device Linux probes for takes, handed out to
+PCI devices by vm_irq_alloc. VIRTIO_BLK_IRQ comes first, so a guest with one disk keeps its line
+*/
+#define VM_PCI_IRQS {VIRTIO_BLK_IRQ, 5, 7, 6, 3}
+#define VM_MAX_DISKS 4 // virtio-blk devices, each takes a line of VM_PCI_IRQS
+
+// time and exits of the vCPU thread, written by run_vm only and read from other threads
+struct vcpu_acct {
+    uint64_t run_ns; // inside KVM_RUN: the guest running, polling or halted
+    uint64_t exit_ns; // handling exits in userspace
+    uint64_t io_exits;
+    uint64_t mmio_exits;
+    uint64_t other_exits;
+    uint64_t interrupted; // KVM_RUN returned for a signal
+};
 
 typedef struct guest {
     int kvm_fd;
     int vm_fd;
     int vcpu_fd;
+    bool kvm_fd_shared; // kvm_fd belongs to the daemon, not to this guest
+    struct kvm_run* run;
+    size_t run_size;
+    bool stop; // set by vm_stop, run_vm returns
     void* mem;
+    bool mem_shared; // mem is the memfd mem_fd mapped shared, a vhost-user backend maps it too
+    int mem_fd;
     struct serial_dev serial;
+    struct console_log console_log; // of the serial output, no mapping when the VM has none
     bus_t io_bus;
     bus_t mmio_bus;
     pci_t pci;
-    struct virtio_blk_dev virtio_blk_dev;
-    struct diskimg diskimg;
+    uint32_t irqs_used; // the lines of VM_PCI_IRQS vm_irq_alloc handed out
+    int disk_count;
+    struct virtio_blk_dev virtio_blk_dev[VM_MAX_DISKS];
+    struct diskimg diskimg[VM_MAX_DISKS];
+    struct vhost_user_blk_dev vhost_user_blk_dev[VM_MAX_DISKS]; // instead of virtio_blk_dev for a disk path naming a backend
+    struct virtio_balloon_dev virtio_balloon_dev;
+    struct virtio_vsock_dev virtio_vsock_dev;
+    struct virtio_net_dev virtio_net_dev;
+    struct netbackend netbackend;
+    struct virtio_rng_dev virtio_rng_dev;
+    struct virtio_9p_dev virtio_9p_dev;
+    bool mem_mergeable; // mark the guest memory as MADV_MERGEABLE for KSM
+    bool balloon; // attach a virtio-balloon device
+    bool rng; // attach a virtio-rng device
+    bool no_pv; // hide the paravirtual CPU features (to compare against them)
+    bool boot_32; // start a bzImage in 32-bit protected mode (to compare against the 64-bit entry)
+    kvm_stats_t vcpu_stats;
+    long halt_poll_ns; // KVM_CAP_HALT_POLL of the VM, -1 for the kernel default
+    struct vcpu_acct acct;
+    cgroup_t cgroup; // no path when the VM has no cgroup of its own
+    int numa_node; // the guest memory is bound to it, -1 for no binding
+    bool pin_vcpu;
+    bool pin_io;
+    cpu_mask_t vcpu_cpus;
+    cpu_mask_t io_cpus; // the device threads
+    struct timespec run_start;
+    boot_profile_t boot; // where the start of the VM went, see bootprof.h
 } guest;
 
 int vm_irq_line(guest* v, int irq, int level);
+int vm_irq_alloc(guest* v); // a free line of VM_PCI_IRQS, -1 when they are all taken
+void* vm_guest_to_host(guest* v, uint64_t guest_addr);
+bool vm_guest_range_valid(guest* v, uint64_t guest_addr, uint64_t len);
+void vm_ioeventfd_register(guest* v, int fd, unsigned long long addr, int len, int flags);
+void vm_irqfd_register(guest* v, int fd, int gsi, int flags);
 
 #endif // GUEST_H
\ No newline at end of file
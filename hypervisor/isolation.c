@@ -0,0 +1,339 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/mempolicy.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "isolation.h"
+
+// where the cgroup2 hierarchy is mounted, /sys/fs/cgroup on most systems
+static int cgroup_mount(char* path, size_t len)
+{
+    char line[PATH_MAX + 128];
+    FILE* f = fopen("/proc/self/mounts", "r");
+    int ret = -1;
+
+    if (!f)
+    {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f))
+    {
+        char dir[PATH_MAX];
+        char type[32];
+        if (sscanf(line, "%*s %4095s %31s", dir, type) == 2 && strcmp(type, "cgroup2") == 0)
+        {
+            snprintf(path, len, "%s", dir);
+            ret = 0;
+            break;
+        }
+    }
+    fclose(f);
+    return ret;
+}
+
+static int cgroup_write_file(const char* dir, const char* file, const char* value)
+{
+    char path[PATH_MAX];
+    int fd;
+    ssize_t n;
+
+    if ((size_t) snprintf(path, sizeof(path), "%s/%s", dir, file) >= sizeof(path))
+    {
+        return -1; // the file can't be named, the cgroup doesn't have it
+    }
+    fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    n = write(fd, value, strlen(value));
+    close(fd);
+    return n < 0 ? -1 : 0;
+}
+
+// controllers the parent doesn't have are skipped, the VM works without them
+static void cgroup_enable_controllers(const char* dir, const char* const* controllers)
+{
+    for (int i = 0; controllers[i]; i++)
+    {
+        cgroup_write_file(dir, "cgroup.subtree_control", controllers[i]);
+    }
+}
+
+int cgroup_root(char* path, size_t len)
+{
+    static const char* const controllers[] = {"+cpu", "+cpuset", "+memory", "+io", "+pids", NULL};
+    char mount[PATH_MAX];
+
+    if (cgroup_mount(mount, sizeof(mount)) < 0)
+    {
+        printf("cgroup v2 is not mounted\n");
+        return -1;
+    }
+    snprintf(path, len, "%s/%s", mount, CGROUP_ROOT_NAME);
+    if (mkdir(path, 0755) < 0 && errno != EEXIST)
+    {
+        perror("mkdir cgroup");
+        return -1;
+    }
+    cgroup_enable_controllers(mount, controllers);
+    cgroup_enable_controllers(path, controllers);
+    return 0;
+}
+
+int cgroup_create(cgroup_t* cg, const char* parent, const char* name, bool threaded)
+{
+    static const char* const threaded_controllers[] = {"+cpu", "+cpuset", "+pids", NULL};
+
+    if ((size_t) snprintf(cg->path, sizeof(cg->path), "%s/%s", parent, name) >= sizeof(cg->path))
+    {
+        cg->path[0] = '\0';
+        return -1;
+    }
+    if (mkdir(cg->path, 0755) < 0 && errno != EEXIST)
+    {
+        perror("mkdir cgroup");
+        cg->path[0] = '\0';
+        return -1;
+    }
+    cg->threaded = threaded;
+    if (threaded)
+    {
+        if (cgroup_write_file(cg->path, "cgroup.type", "threaded") < 0)
+        {
+            perror("cgroup threaded");
+            cgroup_destroy(cg);
+            return -1;
+        }
+        // the parent becomes a threaded domain, which hands out the threaded controllers only
+        cgroup_enable_controllers(parent, threaded_controllers);
+    }
+    return 0;
+}
+
+int cgroup_write(cgroup_t* cg, const char* file, const char* value)
+{
+    if (cgroup_write_file(cg->path, file, value) < 0)
+    {
+        fprintf(stderr, "cgroup %s \"%s\": %s\n", file, value, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// the cgroup of the calling thread
+static int cgroup_current(char* path, size_t len)
+{
+    char mount[PATH_MAX];
+    char line[PATH_MAX];
+    FILE* f;
+    int ret = -1;
+
+    if (cgroup_mount(mount, sizeof(mount)) < 0)
+    {
+        return -1;
+    }
+    f = fopen("/proc/thread-self/cgroup", "r");
+    if (!f)
+    {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f))
+    {
+        // the cgroup2 line is "0::<path>"
+        if (strncmp(line, "0::", 3) == 0)
+        {
+            line[strcspn(line, "\n")] = '\0';
+            snprintf(path, len, "%s%s", mount, strcmp(line + 3, "/") ? line + 3 : "");
+            ret = 0;
+            break;
+        }
+    }
+    fclose(f);
+    return ret;
+}
+
+// "0" is the writer itself
+static int cgroup_attach(const char* path, bool threaded)
+{
+    if (cgroup_write_file(path, threaded ? "cgroup.threads" : "cgroup.procs", "0") < 0)
+    {
+        fprintf(stderr, "join cgroup %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int cgroup_enter(cgroup_t* cg)
+{
+    if (cgroup_current(cg->origin, sizeof(cg->origin)) < 0)
+    {
+        cg->origin[0] = '\0';
+    }
+    return cgroup_attach(cg->path, cg->threaded);
+}
+
+int cgroup_leave(cgroup_t* cg)
+{
+    if (!cg->origin[0])
+    {
+        return -1;
+    }
+    return cgroup_attach(cg->origin, cg->threaded);
+}
+
+// the value of "<key> <value>" or "<key>=<value>" in a cgroup file
+static uint64_t cgroup_read_key(const char* text, const char* key)
+{
+    size_t key_len = strlen(key);
+    uint64_t sum = 0;
+
+    for (const char* p = text; (p = strstr(p, key)); p += key_len)
+    {
+        if ((p == text || p[-1] == ' ' || p[-1] == '\n') && (p[key_len] == ' ' || p[key_len] == '='))
+        {
+            sum += strtoull(p + key_len + 1, NULL, 10);
+        }
+    }
+    return sum;
+}
+
+static int cgroup_read_file(cgroup_t* cg, const char* file, char* buf, size_t len)
+{
+    char path[PATH_MAX];
+    int fd;
+    ssize_t n;
+
+    if ((size_t) snprintf(path, sizeof(path), "%s/%s", cg->path, file) >= sizeof(path))
+    {
+        return -1; // the file can't be named, the cgroup doesn't have it
+    }
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    n = read(fd, buf, len - 1);
+    close(fd);
+    buf[n < 0 ? 0 : n] = '\0';
+    return n < 0 ? -1 : 0;
+}
+
+void cgroup_get_usage(cgroup_t* cg, struct cgroup_usage* usage)
+{
+    char buf[4096];
+
+    memset(usage, 0, sizeof(*usage));
+    if (cgroup_read_file(cg, "cpu.stat", buf, sizeof(buf)) == 0)
+    {
+        usage->cpu_usage_usec = cgroup_read_key(buf, "usage_usec");
+        usage->cpu_throttled_usec = cgroup_read_key(buf, "throttled_usec");
+    }
+    if (cgroup_read_file(cg, "memory.current", buf, sizeof(buf)) == 0)
+    {
+        usage->memory_current = strtoull(buf, NULL, 10);
+    }
+    // one line per device, summed up
+    if (cgroup_read_file(cg, "io.stat", buf, sizeof(buf)) == 0)
+    {
+        usage->io_rbytes = cgroup_read_key(buf, "rbytes");
+        usage->io_wbytes = cgroup_read_key(buf, "wbytes");
+    }
+}
+
+void cgroup_destroy(cgroup_t* cg)
+{
+    if (!cg->path[0])
+    {
+        return;
+    }
+    if (rmdir(cg->path) < 0)
+    {
+        perror("rmdir cgroup");
+    }
+    cg->path[0] = '\0';
+}
+
+int cpu_mask_parse(const char* list, cpu_mask_t* mask)
+{
+    const int bits_per_word = 8 * sizeof(unsigned long);
+    const char* p = list;
+
+    memset(mask, 0, sizeof(*mask));
+    while (*p)
+    {
+        char* end;
+        unsigned long first = strtoul(p, &end, 10);
+        unsigned long last = first;
+
+        if (end == p)
+        {
+            return -1;
+        }
+        if (*end == '-')
+        {
+            p = end + 1;
+            last = strtoul(p, &end, 10);
+            if (end == p)
+            {
+                return -1;
+            }
+        }
+        if (last < first || last >= CPU_MASK_MAX_CPUS || (*end && *end != ','))
+        {
+            return -1;
+        }
+        for (unsigned long cpu = first; cpu <= last; cpu++)
+        {
+            mask->bits[cpu / bits_per_word] |= 1UL << (cpu % bits_per_word);
+        }
+        p = *end ? end + 1 : end;
+    }
+    return 0;
+}
+
+int cpu_mask_pin_self(const cpu_mask_t* mask)
+{
+    // pid 0 is the calling thread
+    if (syscall(SYS_sched_setaffinity, 0, sizeof(mask->bits), mask->bits) < 0)
+    {
+        perror("sched_setaffinity");
+        return -1;
+    }
+    return 0;
+}
+
+int cpu_mask_get_self(cpu_mask_t* mask)
+{
+    memset(mask, 0, sizeof(*mask));
+    if (syscall(SYS_sched_getaffinity, 0, sizeof(mask->bits), mask->bits) < 0)
+    {
+        perror("sched_getaffinity");
+        return -1;
+    }
+    return 0;
+}
+
+// the memory must not be touched yet, mbind doesn't move pages that already exist
+int numa_bind(void* addr, size_t len, int node)
+{
+    cpu_mask_t nodes = {0}; // a node mask has the same layout as a CPU mask
+    const int bits_per_word = 8 * sizeof(unsigned long);
+
+    if (node < 0 || node >= CPU_MASK_MAX_CPUS)
+    {
+        return -1;
+    }
+    nodes.bits[node / bits_per_word] = 1UL << (node % bits_per_word);
+    if (syscall(SYS_mbind, addr, len, MPOL_BIND, nodes.bits, sizeof(nodes.bits) * 8 + 1, 0) < 0)
+    {
+        perror("mbind");
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,54 @@
+#ifndef ISOLATION_H
+#define ISOLATION_H
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define CGROUP_ROOT_NAME "remotekvm"
+#define CPU_MASK_MAX_CPUS 1024
+
+/*
+a cgroup v2 of one VM, below <cgroup2 mount>/remotekvm.
+standalone a VM is a process of its own and the whole process joins the cgroup. in the daemon
+the VMs are threads of one process, so their cgroups are threaded children of the daemon cgroup:
+only the threaded controllers (cpu, cpuset, pids) work per VM there, the memory and io
+controllers only see the daemon as a whole
+*/
+typedef struct cgroup
+{
+    char path[PATH_MAX]; // empty when the VM has no cgroup
+    char origin[PATH_MAX]; // where cgroup_enter took the caller from
+    bool threaded;
+} cgroup_t;
+
+struct cgroup_usage
+{
+    uint64_t cpu_usage_usec;
+    uint64_t cpu_throttled_usec;
+    uint64_t memory_current; // bytes, 0 without the memory controller
+    uint64_t io_rbytes;
+    uint64_t io_wbytes;
+};
+
+// a set of host CPUs, as sched_setaffinity takes it
+typedef struct cpu_mask
+{
+    unsigned long bits[CPU_MASK_MAX_CPUS / (8 * sizeof(unsigned long))];
+} cpu_mask_t;
+
+int cgroup_root(char* path, size_t len); // creates <cgroup2 mount>/remotekvm, returns 0 on success
+int cgroup_create(cgroup_t* cg, const char* parent, const char* name, bool threaded); // returns 0 on success
+int cgroup_write(cgroup_t* cg, const char* file, const char* value); // returns 0 on success
+int cgroup_enter(cgroup_t* cg); // moves the calling thread, or the whole process if not threaded
+int cgroup_leave(cgroup_t* cg); // back to where cgroup_enter took the caller from
+void cgroup_get_usage(cgroup_t* cg, struct cgroup_usage* usage);
+void cgroup_destroy(cgroup_t* cg); // the cgroup has to be empty
+
+int cpu_mask_parse(const char* list, cpu_mask_t* mask); // "0-3,6", returns 0 on success
+int cpu_mask_pin_self(const cpu_mask_t* mask); // returns 0 on success
+int cpu_mask_get_self(cpu_mask_t* mask); // returns 0 on success
+int numa_bind(void* addr, size_t len, int node); // returns 0 on success
+
+#endif // ISOLATION_H
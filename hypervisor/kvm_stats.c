@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "kvm_stats.h"
+
+int kvm_stats_init(kvm_stats_t* stats, int fd)
+{
+    stats->descs = NULL;
+    stats->fd = ioctl(fd, KVM_GET_STATS_FD, NULL);
+    if (stats->fd < 0)
+    {
+        perror("KVM_GET_STATS_FD");
+        return -1;
+    }
+
+    if (pread(stats->fd, &stats->header, sizeof(stats->header), 0) != sizeof(stats->header))
+    {
+        perror("read kvm stats header");
+        goto err;
+    }
+
+    // the descriptors and their names never change, so they are read once
+    stats->desc_size = sizeof(struct kvm_stats_desc) + stats->header.name_size;
+    size_t descs_len = stats->desc_size * stats->header.num_desc;
+    stats->descs = malloc(descs_len);
+    if (!stats->descs || pread(stats->fd, stats->descs, descs_len, stats->header.desc_offset) != (ssize_t) descs_len)
+    {
+        perror("read kvm stats descriptors");
+        goto err;
+    }
+
+    return 0;
+
+err:
+    free(stats->descs);
+    stats->descs = NULL;
+    close(stats->fd);
+    stats->fd = -1;
+    return -1;
+}
+
+int kvm_stats_read(kvm_stats_t* stats, const char* name, uint64_t* value)
+{
+    if (stats->fd < 0)
+    {
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < stats->header.num_desc; i++)
+    {
+        struct kvm_stats_desc* desc = (struct kvm_stats_desc*) ((char*) stats->descs + i * stats->desc_size);
+        if (strcmp(desc->name, name) != 0)
+        {
+            continue;
+        }
+        // histograms have more than one value, the first one is enough for us
+        if (pread(stats->fd, value, sizeof(*value), stats->header.data_offset + desc->offset) != sizeof(*value))
+        {
+            return -1;
+        }
+        return 0;
+    }
+
+    return -1;
+}
+
+void kvm_stats_exit(kvm_stats_t* stats)
+{
+    if (stats->fd < 0)
+    {
+        return;
+    }
+    free(stats->descs);
+    close(stats->fd);
+    stats->fd = -1;
+}
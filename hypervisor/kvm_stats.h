@@ -0,0 +1,23 @@
+#ifndef KVM_STATS_H
+#define KVM_STATS_H
+
+#include <linux/kvm.h>
+#include <stdint.h>
+
+/*
+reader of the binary statistics KVM keeps for a VM or a vCPU (KVM_GET_STATS_FD).
+these count what the kernel handles itself (e.g. timer and APIC exits), which never reach run_vm
+*/
+typedef struct kvm_stats
+{
+    int fd;
+    struct kvm_stats_header header;
+    void* descs; // header.num_desc descriptors, each followed by its name
+    size_t desc_size;
+} kvm_stats_t;
+
+int kvm_stats_init(kvm_stats_t* stats, int fd); // fd of the VM or vCPU, returns 0 on success
+int kvm_stats_read(kvm_stats_t* stats, const char* name, uint64_t* value); // returns 0 on success
+void kvm_stats_exit(kvm_stats_t* stats);
+
+#endif // KVM_STATS_H
@@ -0,0 +1,155 @@
+#include <string.h>
+
+#include "lz4block.h"
+
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5 /* a block ends with at least 5 literals */
+#define LZ4_MF_LIMIT 12 /* and no match starts in its last 12 bytes */
+#define LZ4_MAX_OFFSET 65535
+#define LZ4_HASH_LOG 13
+#define LZ4_SKIP_TRIGGER 6 /* the step grows every 64 bytes without a match */
+
+static uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t lz4_hash(uint32_t seq)
+{
+    return (seq * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+/* 15 in the token, then bytes of 255 and the rest */
+static int put_length(uint8_t *dst, int op, int len)
+{
+    for (len -= 15; len >= 255; len -= 255)
+        dst[op++] = 255;
+    dst[op++] = len;
+    return op;
+}
+
+static int put_sequence(uint8_t *dst,
+                        int op,
+                        int dst_cap,
+                        const uint8_t *literals,
+                        int lit_len,
+                        int offset,
+                        int match_len)
+{
+    int ml = match_len - LZ4_MIN_MATCH;
+    int need = 1 + lit_len + lit_len / 255 + 1 + (offset ? 2 + ml / 255 + 1 : 0);
+    uint8_t *token = &dst[op];
+
+    if (op + need > dst_cap)
+        return -1;
+    op++;
+    *token = (lit_len < 15 ? lit_len : 15) << 4;
+    if (lit_len >= 15)
+        op = put_length(dst, op, lit_len);
+    memcpy(dst + op, literals, lit_len);
+    op += lit_len;
+    if (!offset)
+        return op;
+    dst[op++] = offset & 0xff;
+    dst[op++] = offset >> 8;
+    *token |= ml < 15 ? ml : 15;
+    if (ml >= 15)
+        op = put_length(dst, op, ml);
+    return op;
+}
+
+int lz4_compress(const uint8_t *src, int src_len, uint8_t *dst, int dst_cap)
+{
+    uint32_t table[1 << LZ4_HASH_LOG] = {0};
+    int mf_limit = src_len - LZ4_MF_LIMIT;
+    int match_limit = src_len - LZ4_LAST_LITERALS;
+    int anchor = 0, ip = 0, op = 0;
+
+    while (ip < mf_limit) {
+        uint32_t seq = read32(src + ip);
+        uint32_t h = lz4_hash(seq);
+        int ref = table[h];
+        int len = LZ4_MIN_MATCH;
+
+        table[h] = ip;
+        if (ref >= ip || ip - ref > LZ4_MAX_OFFSET || read32(src + ref) != seq) {
+            ip += 1 + ((ip - anchor) >> LZ4_SKIP_TRIGGER);
+            continue;
+        }
+        while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+            ip--;
+            ref--;
+            len++;
+        }
+        while (ip + len < match_limit && src[ip + len] == src[ref + len])
+            len++;
+        op = put_sequence(dst, op, dst_cap, src + anchor, ip - anchor, ip - ref, len);
+        if (op < 0)
+            return 0;
+        ip += len;
+        anchor = ip;
+        /* the match may go on right after this one */
+        if (ip - 2 > 0 && ip < mf_limit)
+            table[lz4_hash(read32(src + ip - 2))] = ip - 2;
+    }
+    op = put_sequence(dst, op, dst_cap, src + anchor, src_len - anchor, 0, 0);
+    return op < 0 ? 0 : op;
+}
+
+static int get_length(const uint8_t *src, int src_len, int *ip, int len)
+{
+    uint8_t b;
+
+    do {
+        if (*ip >= src_len)
+            return -1;
+        b = src[(*ip)++];
+        len += b;
+    } while (b == 255);
+    return len;
+}
+
+int lz4_decompress(const uint8_t *src, int src_len, uint8_t *dst, int dst_cap)
+{
+    int ip = 0, op = 0;
+
+    while (ip < src_len) {
+        uint8_t token = src[ip++];
+        int lit_len = token >> 4, match_len = token & 15, offset;
+
+        if (lit_len == 15 && (lit_len = get_length(src, src_len, &ip, 15)) < 0)
+            return -1;
+        if (lit_len > src_len - ip || lit_len > dst_cap - op)
+            return -1;
+        memcpy(dst + op, src + ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+        /* the last sequence has literals only */
+        if (ip == src_len)
+            break;
+        if (src_len - ip < 2)
+            return -1;
+        offset = src[ip] | src[ip + 1] << 8;
+        ip += 2;
+        if (!offset || offset > op)
+            return -1;
+        if (match_len == 15 &&
+            (match_len = get_length(src, src_len, &ip, 15)) < 0)
+            return -1;
+        match_len += LZ4_MIN_MATCH;
+        if (match_len > dst_cap - op)
+            return -1;
+        if (offset >= match_len) {
+            memcpy(dst + op, dst + op - offset, match_len);
+        } else {
+            /* overlapping: the match repeats the last offset bytes */
+            for (int i = 0; i < match_len; i++)
+                dst[op + i] = dst[op - offset + i];
+        }
+        op += match_len;
+    }
+    return op;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdint.h>
+
+/* The LZ4 block format (no frame), compatible with LZ4_compress_default and
+ * LZ4_decompress_safe of liblz4: a greedy compressor with a hash table of the
+ * last position of each 4 byte sequence, and a decompressor that checks every
+ * length and offset against its buffers, so a damaged block fails instead of
+ * writing past them.
+ */
+
+/* Returns the compressed size, or 0 when it would not fit in dst_cap */
+int lz4_compress(const uint8_t *src, int src_len, uint8_t *dst, int dst_cap);
+/* Returns the decompressed size, or -1 for a damaged block or one that would
+ * not fit in dst_cap */
+int lz4_decompress(const uint8_t *src, int src_len, uint8_t *dst, int dst_cap);
@@ -1,40 +1,302 @@
+#include <getopt.h>
+
 #include "serial.h"
 #include "bus.h"
+#include "control.h"
+#include "daemon.h"
 #include "guest.h"
+#include "netswitch.h"
+#include "trace.h"
 #include "vm.h"
 
-int main(int argc, char** argv) 
+static const char* trace_path;
+
+// also runs on Ctrl-A x, which exits from the serial thread
+static void main_dump_trace(void)
 {
-    if (argc < 2) {
-        printf("Usage: %s <image_path>\n", argv[0]);
-        return 1;
+    int records;
+
+    trace_stop();
+    records = trace_dump(trace_path);
+    if (records >= 0)
+    {
+        printf("%d trace records written to %s\n", records, trace_path);
     }
+}
+
+static void usage(const char* prog)
+{
+    printf("Usage: %s [options] <image_path> <disk_path> [<disk_path>...]\n", prog);
+    printf("       <disk_path> is a disk image file, or a block map of the block store of its directory\n");
+    printf("       (see blockstore.h and build/blkstore), or vhost-user:<socket_path> for a disk served by\n");
+    printf("       a vhost-user backend such as build/vhostblkd. Each one is a virtio-blk device of its own,\n");
+    printf("       up to %d, the first is the boot disk. A ,cache=writeback|writethrough|none suffix picks\n", VM_MAX_DISKS);
+    printf("       how a plain file goes through the host page cache (writeback by default)\n");
+    printf("       %s --daemon <socket_path> [--net-switch <socket_path>]\n", prog);
+    printf("      --cpu-max <quota_us>[/<period_us>]  cgroup v2 cpu.max of the VM\n");
+    printf("      --memory-max <MiB>  cgroup v2 memory.max of the VM\n");
+    printf("      --io-max <major>:<minor>,rbps=<n>,wbps=<n>,riops=<n>,wiops=<n>  cgroup v2 io.max of the VM\n");
+    printf("      --vcpu-cpus <cpu_list>  pin the vCPU thread, e.g. 2-3\n");
+    printf("      --io-cpus <cpu_list>  pin the device threads\n");
+    printf("      --numa <node>  allocate the guest memory on a NUMA node\n");
+    printf("  -d, --daemon <socket_path>  host many VMs, created and run through commands on a unix socket\n");
+    printf("  -k, --ksm        mark the guest memory as mergeable for KSM\n");
+    printf("  -b, --balloon    attach a virtio-balloon device with free page reporting\n");
+    printf("  -c, --control <socket_path>  listen for control commands on a unix socket\n");
+    printf("  -n, --no-pv      hide kvm-clock, PV EOI, PV spinlocks and the TSC deadline timer\n");
+    printf("  -B, --boot-32    enter a bzImage through its 32-bit entry even when it has a 64-bit one\n");
+    printf("  -v, --vsock <socket_path>  attach a virtio-vsock device, host connections go through\n");
+    printf("                   <socket_path> (\"CONNECT <port>\") and guest connections to <socket_path>_<port>\n");
+    printf("  -i, --cid <cid>  guest cid of the vsock device (default %d)\n", VIRTIO_VSOCK_DEFAULT_GUEST_CID);
+    printf("  -N, --net <tap:ifname|switch:socket_path>  attach a virtio-net device to a tap interface\n");
+    printf("                   or to the switch of another hypervisor\n");
+    printf("  -S, --net-switch <socket_path>  run a switch that other hypervisors join through\n");
+    printf("                   <socket_path>, the guest joins it too unless --net is given\n");
+    printf("  -m, --mac <xx:xx:xx:xx:xx:xx>  MAC address of the virtio-net device\n");
+    printf("  -r, --rng        attach a virtio-rng device fed from the host getrandom()\n");
+    printf("  -s, --share <dir>[,tag=<tag>][,ro]  share a host directory through a virtio-9p device, the\n");
+    printf("                   guest mounts it with mount -t 9p -o trans=virtio,version=9p2000.L <tag> <mnt>\n");
+    printf("                   (tag %s by default), ro refuses every change\n", VM_SHARE_TAG);
+    printf("  -H, --halt-poll-ns <ns>  how long a halted vCPU polls for a wake up before it sleeps\n");
+    printf("                   (KVM_CAP_HALT_POLL), 0 turns polling off\n");
+    printf("  -L, --blk-limit iops=<n>,iops-burst=<n>,bps=<n>,bps-burst=<n>  token bucket limits of\n");
+    printf("                   each disk, any of them, a burst defaults to one second of its rate\n");
+    printf("  -P, --boot-prefetch <secs>  record the boot disk reads of the first <secs> of the boot into\n");
+    printf("                   <disk_path>%s, later boots prefetch them\n", BOOT_TRACE_SUFFIX);
+    printf("  -T, --trace <path>  trace the device emulation from the start and write the trace to\n");
+    printf("                   <path> on exit, decoded by build/tracedump\n");
+    printf("  -l, --console-log <path>[,size=<KiB>]  keep the last <KiB> (default %d) of console output in\n", CONSOLE_LOG_DEFAULT_SIZE >> 10);
+    printf("                   <path>, across runs, read by build/consolelogdump\n");
+    printf("  -R, --ready-marker <text>  print the time from the first vCPU run until the guest\n");
+    printf("                   writes <text> to the console\n");
+}
 
-    guest vm;
+int main(int argc, char** argv) 
+{
+    static const struct option long_options[] = {
+        {"ksm", no_argument, NULL, 'k'},
+        {"balloon", no_argument, NULL, 'b'},
+        {"control", required_argument, NULL, 'c'},
+        {"no-pv", no_argument, NULL, 'n'},
+        {"boot-32", no_argument, NULL, 'B'},
+        {"vsock", required_argument, NULL, 'v'},
+        {"cid", required_argument, NULL, 'i'},
+        {"net", required_argument, NULL, 'N'},
+        {"net-switch", required_argument, NULL, 'S'},
+        {"mac", required_argument, NULL, 'm'},
+        {"rng", no_argument, NULL, 'r'},
+        {"share", required_argument, NULL, 's'},
+        {"ready-marker", required_argument, NULL, 'R'},
+        {"console-log", required_argument, NULL, 'l'},
+        {"daemon", required_argument, NULL, 'd'},
+        {"halt-poll-ns", required_argument, NULL, 'H'},
+        {"trace", required_argument, NULL, 'T'},
+        {"blk-limit", required_argument, NULL, 'L'},
+        {"boot-prefetch", required_argument, NULL, 'P'},
+        // isolation options, handled by vm_config_set_isolation under their names
+        {"cpu-max", required_argument, NULL, 0},
+        {"memory-max", required_argument, NULL, 0},
+        {"io-max", required_argument, NULL, 0},
+        {"vcpu-cpus", required_argument, NULL, 0},
+        {"io-cpus", required_argument, NULL, 0},
+        {"numa", required_argument, NULL, 0},
+        {NULL, 0, NULL, 0},
+    };
+    guest vm = {0};
+    struct vm_config cfg;
+    control_t control;
+    const char* control_path = NULL;
+    const char* switch_path = NULL;
+    const char* daemon_path = NULL;
+    struct netswitch netswitch;
+    char cgroup_name[32];
+    int option_index;
+    int opt;
 
-    setup_vm(&vm);
-    serial_init(&vm.serial, &vm.io_bus);
+    vm_config_init(&cfg);
 
-    if (load_image(&vm, argv[1]) != 0) {
-        printf("Error loading image - Check if the image path is correct\n");
+    while ((opt = getopt_long(argc, argv, "kbc:nBv:i:N:S:m:rs:R:l:d:H:T:L:P:", long_options, &option_index)) != -1) {
+        switch (opt) {
+        case 0:
+            if (vm_config_set_isolation(&cfg, long_options[option_index].name, optarg) < 0) {
+                printf("Invalid --%s %s\n", long_options[option_index].name, optarg);
+                return 1;
+            }
+            break;
+        case 'k':
+            cfg.mem_mergeable = true;
+            break;
+        case 'b':
+            cfg.balloon = true;
+            break;
+        case 'c':
+            control_path = optarg;
+            break;
+        case 'n':
+            cfg.no_pv = true;
+            break;
+        case 'B':
+            cfg.boot_32 = true;
+            break;
+        case 'v':
+            cfg.vsock_path = optarg;
+            break;
+        case 'i':
+            cfg.guest_cid = strtoull(optarg, NULL, 10);
+            if (cfg.guest_cid <= VIRTIO_VSOCK_HOST_CID) {
+                printf("The guest cid must be above %d\n", VIRTIO_VSOCK_HOST_CID);
+                return 1;
+            }
+            break;
+        case 'N':
+            cfg.net_spec = optarg;
+            break;
+        case 'S':
+            switch_path = optarg;
+            break;
+        case 'm':
+            if (sscanf(optarg, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx", &cfg.mac[0], &cfg.mac[1], &cfg.mac[2], &cfg.mac[3], &cfg.mac[4], &cfg.mac[5]) != 6) {
+                printf("Invalid MAC address %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'r':
+            cfg.rng = true;
+            break;
+        case 's':
+            if (vm_config_add_share(&cfg, optarg) < 0) {
+                printf("Invalid share %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'R':
+            cfg.ready_marker = optarg;
+            break;
+        case 'l':
+            if (vm_config_set_console_log(&cfg, optarg) < 0) {
+                printf("Invalid console log %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'd':
+            daemon_path = optarg;
+            break;
+        case 'T':
+            trace_path = optarg;
+            break;
+        case 'P':
+        {
+            char* end;
+            cfg.boot_trace_secs = strtoul(optarg, &end, 10);
+            if (end == optarg || *end || !cfg.boot_trace_secs) {
+                printf("Invalid boot prefetch time %s\n", optarg);
+                return 1;
+            }
+            break;
+        }
+        case 'L':
+            if (throttle_parse(&cfg.blk_limits, optarg) < 0) {
+                printf("Invalid disk limits %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'H':
+        {
+            char* end;
+            cfg.halt_poll_ns = strtol(optarg, &end, 10);
+            if (end == optarg || *end || cfg.halt_poll_ns < 0) {
+                printf("Invalid halt polling time %s\n", optarg);
+                return 1;
+            }
+            break;
+        }
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (daemon_path)
+    {
+        static daemon_t d;
+        return daemon_run(&d, daemon_path, switch_path) < 0 ? 1 : 0;
+    }
+
+    if (argc - optind < 2) {
+        usage(argv[0]);
         return 1;
     }
+    cfg.image_path = argv[optind];
+    for (int i = optind + 1; i < argc; i++)
+    {
+        if (vm_config_add_disk(&cfg, argv[i]) < 0)
+        {
+            printf("Invalid disk %s, or more than %d disks\n", argv[i], VM_MAX_DISKS);
+            return 1;
+        }
+    }
+    if (cfg.cpu_max[0] || cfg.memory_max || cfg.io_max[0])
+    {
+        snprintf(cgroup_name, sizeof(cgroup_name), "vm-%d", getpid());
+        cfg.cgroup_name = cgroup_name;
+    }
 
-    if (diskimg_init(&vm.diskimg, argv[2]) < 0)
+    if (switch_path && netswitch_init(&netswitch, switch_path) < 0)
     {
-        printf("Error initializing disk image.\n");
+        printf("Error starting the network switch.\n");
         return -1;
     }
-    virtio_blk_init_pci(&vm.virtio_blk_dev, &vm.diskimg, &vm.pci, &vm.io_bus, &vm.mmio_bus);
-    load_initrd(&vm, INITRD_PATH);
+    if (switch_path && !cfg.net_spec)
+    {
+        cfg.net_fd = netswitch_add_port(&netswitch);
+        if (cfg.net_fd < 0)
+        {
+            return -1;
+        }
+    }
+    if (trace_path)
+    {
+        trace_start();
+        atexit(main_dump_trace);
+    }
+    if (vm_create(&vm, &cfg, -1, -1) < 0)
+    {
+        return 1;
+    }
 
+    if (control_path && control_init(&control, &vm, control_path) < 0)
+    {
+        control_path = NULL;
+    }
 
     run_vm(&vm);
 
-    close(vm.kvm_fd);
-    close(vm.vm_fd);
-    close(vm.vcpu_fd);
-    munmap(vm.mem, GUEST_MEMORY_SIZE);
+    if (control_path)
+    {
+        control_exit(&control);
+    }
+
+    boot_profile_print(&vm.boot, stdout);
+    if (vm.diskimg[0].traced)
+    {
+        boot_trace_print(&vm.diskimg[0].boot_trace);
+    }
+    vm_print_exit_stats(&vm);
+
+    struct vm_mem_stats mem_stats;
+    vm_get_mem_stats(&vm, &mem_stats);
+    printf("KSM merged pages: %lu, free pages reported by the guest: %lu\n",
+           mem_stats.process_ksm_merging_pages, mem_stats.reported_pages);
+
+    virtio_rng_print_stats(&vm.virtio_rng_dev);
+    virtio_9p_print_stats(&vm.virtio_9p_dev);
+    virtio_net_print_stats(&vm.virtio_net_dev);
+    vm_destroy(&vm);
+    if (switch_path)
+    {
+        netswitch_print_stats(&netswitch);
+        netswitch_exit(&netswitch);
+    }
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,488 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/userfaultfd.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "memsnap.h"
+
+#define PAGEMAP_PRESENT (1ULL << 63)
+#define PAGEMAP_SWAPPED (1ULL << 62)
+#define PAGEMAP_CHUNK 512 // entries read at once
+
+static uint64_t memsnap_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static bool memsnap_bit(const uint8_t* bitmap, size_t page)
+{
+    return bitmap[page / 8] & (1 << (page % 8));
+}
+
+static bool memsnap_page_is_zero(const uint8_t* page)
+{
+    const uint64_t* p = (const uint64_t*) page;
+
+    for (size_t i = 0; i < MEMSNAP_PAGE_SIZE / sizeof(*p); i++)
+    {
+        if (p[i])
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// the pages that hold data: the ones the kernel has for the guest, in memory or swapped, not zero
+static void memsnap_find_present(const uint8_t* mem, size_t pages, uint8_t* present)
+{
+    int pagemap = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+    uint64_t entries[PAGEMAP_CHUNK];
+
+    for (size_t page = 0; page < pages; page += PAGEMAP_CHUNK)
+    {
+        size_t n = pages - page < PAGEMAP_CHUNK ? pages - page : PAGEMAP_CHUNK;
+        off_t off = ((uintptr_t) mem / MEMSNAP_PAGE_SIZE + page) * sizeof(uint64_t);
+
+        // without pagemap every page is read, the untouched ones as zero pages
+        if (pagemap < 0 || pread(pagemap, entries, n * sizeof(uint64_t), off) != (ssize_t) (n * sizeof(uint64_t)))
+        {
+            memset(entries, 0xff, sizeof(entries));
+        }
+        for (size_t i = 0; i < n; i++)
+        {
+            if ((entries[i] & (PAGEMAP_PRESENT | PAGEMAP_SWAPPED)) &&
+                !memsnap_page_is_zero(mem + (page + i) * MEMSNAP_PAGE_SIZE))
+            {
+                present[(page + i) / 8] |= 1 << ((page + i) % 8);
+            }
+        }
+    }
+    if (pagemap >= 0)
+    {
+        close(pagemap);
+    }
+}
+
+int memsnap_save(const char* path, const void* mem, size_t size, const uint64_t* hot)
+{
+    size_t pages = size / MEMSNAP_PAGE_SIZE;
+    size_t bitmap_len = (pages + 7) / 8;
+    struct memsnap_header hdr = {.magic = MEMSNAP_MAGIC, .version = MEMSNAP_VERSION,
+                                 .page_size = MEMSNAP_PAGE_SIZE, .mem_size = size};
+    uint8_t* present = calloc(bitmap_len, 1);
+    uint32_t* hot_list = malloc(pages * sizeof(uint32_t));
+    int ret = -1;
+    int fd = -1;
+
+    if (!present || !hot_list)
+    {
+        goto out;
+    }
+    for (size_t page = 0; hot && page < pages; page++)
+    {
+        if (hot[page / 64] & (1ULL << (page % 64)))
+        {
+            hot_list[hdr.nr_hot++] = page;
+        }
+    }
+    memsnap_find_present(mem, pages, present);
+    hdr.hot_offset = MEMSNAP_PAGE_SIZE;
+    hdr.present_offset = hdr.hot_offset + hdr.nr_hot * sizeof(uint32_t);
+    hdr.data_offset = (hdr.present_offset + bitmap_len + MEMSNAP_PAGE_SIZE - 1) & ~(uint64_t) (MEMSNAP_PAGE_SIZE - 1);
+
+    // a sparse file, the pages without data stay holes
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0 || ftruncate(fd, hdr.data_offset + size) < 0 ||
+        pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        pwrite(fd, hot_list, hdr.nr_hot * sizeof(uint32_t), hdr.hot_offset) != (ssize_t) (hdr.nr_hot * sizeof(uint32_t)) ||
+        pwrite(fd, present, bitmap_len, hdr.present_offset) != (ssize_t) bitmap_len)
+    {
+        goto out;
+    }
+    for (size_t page = 0; page < pages;)
+    {
+        size_t run = 0;
+
+        while (page + run < pages && memsnap_bit(present, page + run))
+        {
+            run++;
+        }
+        if (run && pwrite(fd, (const uint8_t*) mem + page * MEMSNAP_PAGE_SIZE, run * MEMSNAP_PAGE_SIZE,
+                          hdr.data_offset + page * MEMSNAP_PAGE_SIZE) != (ssize_t) (run * MEMSNAP_PAGE_SIZE))
+        {
+            goto out;
+        }
+        page += run ? run : 1;
+    }
+    ret = 0;
+
+out:
+    if (ret < 0)
+    {
+        perror("memory snapshot");
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    free(present);
+    free(hot_list);
+    return ret;
+}
+
+// the header, hot pages and bitmap of a snapshot of a memory of this size. returns the fd or -1
+static int memsnap_open(const char* path, size_t size, struct memsnap_header* hdr, uint32_t** hot, uint8_t** present)
+{
+    size_t bitmap_len = (size / MEMSNAP_PAGE_SIZE + 7) / 8;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    *hot = NULL;
+    *present = NULL;
+    if (fd < 0)
+    {
+        perror(path);
+        return -1;
+    }
+    if (pread(fd, hdr, sizeof(*hdr), 0) != sizeof(*hdr) || memcmp(hdr->magic, MEMSNAP_MAGIC, sizeof(hdr->magic)) ||
+        hdr->version != MEMSNAP_VERSION || hdr->page_size != MEMSNAP_PAGE_SIZE || hdr->mem_size != size ||
+        hdr->nr_hot > size / MEMSNAP_PAGE_SIZE)
+    {
+        printf("%s is not a snapshot of %zu MiB of memory\n", path, size >> 20);
+        close(fd);
+        return -1;
+    }
+    *hot = malloc(hdr->nr_hot * sizeof(uint32_t) + 1);
+    *present = malloc(bitmap_len);
+    if (!*hot || !*present ||
+        pread(fd, *hot, hdr->nr_hot * sizeof(uint32_t), hdr->hot_offset) != (ssize_t) (hdr->nr_hot * sizeof(uint32_t)) ||
+        pread(fd, *present, bitmap_len, hdr->present_offset) != (ssize_t) bitmap_len)
+    {
+        printf("%s is truncated\n", path);
+        free(*hot);
+        free(*present);
+        close(fd);
+        return -1;
+    }
+    for (uint64_t i = 0; i < hdr->nr_hot; i++)
+    {
+        if ((*hot)[i] >= size / MEMSNAP_PAGE_SIZE)
+        {
+            (*hot)[i] = 0;
+        }
+    }
+    return fd;
+}
+
+int memsnap_restore(const char* path, void* mem, size_t size)
+{
+    size_t pages = size / MEMSNAP_PAGE_SIZE;
+    struct memsnap_header hdr;
+    uint32_t* hot;
+    uint8_t* present;
+    int ret = 0;
+    int fd = memsnap_open(path, size, &hdr, &hot, &present);
+
+    if (fd < 0)
+    {
+        return -1;
+    }
+    for (size_t page = 0; page < pages && !ret;)
+    {
+        size_t run = 0;
+
+        while (page + run < pages && memsnap_bit(present, page + run))
+        {
+            run++;
+        }
+        if (run && pread(fd, (uint8_t*) mem + page * MEMSNAP_PAGE_SIZE, run * MEMSNAP_PAGE_SIZE,
+                         hdr.data_offset + page * MEMSNAP_PAGE_SIZE) != (ssize_t) (run * MEMSNAP_PAGE_SIZE))
+        {
+            perror("memory snapshot restore");
+            ret = -1;
+        }
+        page += run ? run : 1;
+    }
+    free(hot);
+    free(present);
+    close(fd);
+    return ret;
+}
+
+static void memsnap_fail(memsnap_restore_t* r, int err)
+{
+    int none = 0;
+
+    __atomic_compare_exchange_n(&r->error, &none, err, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+/*
+puts the pages [page, page + n) in place from buf, or as zero pages when buf is NULL. the other
+thread may have put some of them already: the kernel stops at the first one, which is skipped
+*/
+static int memsnap_fill(memsnap_restore_t* r, size_t page, size_t n, const uint8_t* buf)
+{
+    uint64_t start = (uintptr_t) r->mem + page * MEMSNAP_PAGE_SIZE;
+    uint64_t len = n * MEMSNAP_PAGE_SIZE;
+    uint64_t off = 0;
+
+    while (off < len)
+    {
+        int64_t moved;
+        int ret;
+
+        if (buf)
+        {
+            struct uffdio_copy copy = {.dst = start + off, .src = (uintptr_t) buf + off, .len = len - off};
+            ret = ioctl(r->uffd, UFFDIO_COPY, &copy);
+            moved = copy.copy;
+        }
+        else
+        {
+            struct uffdio_zeropage zero = {.range = {.start = start + off, .len = len - off}};
+            ret = ioctl(r->uffd, UFFDIO_ZEROPAGE, &zero);
+            moved = zero.zeropage;
+        }
+        if (ret == 0)
+        {
+            moved = len - off;
+        }
+        else if (errno == EEXIST)
+        {
+            moved = MEMSNAP_PAGE_SIZE;
+        }
+        else if (errno != EAGAIN)
+        {
+            return -errno;
+        }
+        else if (moved <= 0)
+        {
+            continue; // the mappings changed under the copy, try again
+        }
+        for (uint64_t p = off / MEMSNAP_PAGE_SIZE; p < (off + moved) / MEMSNAP_PAGE_SIZE; p++)
+        {
+            __atomic_store_n(&r->done[page + p], 1, __ATOMIC_RELEASE);
+        }
+        off += moved;
+    }
+    return 0;
+}
+
+// pages [page, page + n) all hold data or all are zero
+static int memsnap_fill_from_file(memsnap_restore_t* r, size_t page, size_t n, uint8_t* buf)
+{
+    size_t len = n * MEMSNAP_PAGE_SIZE;
+
+    if (!memsnap_bit(r->present, page))
+    {
+        return memsnap_fill(r, page, n, NULL);
+    }
+    if (pread(r->snap_fd, buf, len, r->hdr.data_offset + page * MEMSNAP_PAGE_SIZE) != (ssize_t) len)
+    {
+        return -EIO;
+    }
+    return memsnap_fill(r, page, n, buf);
+}
+
+// the pages the guest touches before the stream got to them, one at a time
+static void* memsnap_fault_thread(void* arg)
+{
+    memsnap_restore_t* r = (memsnap_restore_t*) arg;
+    struct pollfd fds[] = {
+        {.fd = r->uffd, .events = POLLIN},
+        {.fd = r->stop_fd, .events = POLLIN},
+    };
+    uint8_t* buf = aligned_alloc(MEMSNAP_PAGE_SIZE, MEMSNAP_PAGE_SIZE);
+    struct uffd_msg msg;
+
+    while (buf && poll(fds, 2, -1) > 0 && !(fds[1].revents & POLLIN))
+    {
+        while (read(r->uffd, &msg, sizeof(msg)) == sizeof(msg))
+        {
+            uint64_t addr = msg.arg.pagefault.address & ~(uint64_t) (MEMSNAP_PAGE_SIZE - 1);
+            size_t page = (addr - (uintptr_t) r->mem) / MEMSNAP_PAGE_SIZE;
+            int err;
+
+            if (msg.event != UFFD_EVENT_PAGEFAULT)
+            {
+                continue;
+            }
+            // the stream put it in place after the fault was queued
+            if (__atomic_load_n(&r->done[page], __ATOMIC_ACQUIRE))
+            {
+                struct uffdio_range range = {.start = addr, .len = MEMSNAP_PAGE_SIZE};
+                ioctl(r->uffd, UFFDIO_WAKE, &range);
+                continue;
+            }
+            err = memsnap_fill_from_file(r, page, 1, buf);
+            if (err < 0)
+            {
+                memsnap_fail(r, -err);
+            }
+            __atomic_add_fetch(&r->faults, 1, __ATOMIC_RELAXED);
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+// the pages of a run: not in place yet, in a row, and all with data or all without
+static size_t memsnap_run(memsnap_restore_t* r, size_t page, size_t pages)
+{
+    bool present = memsnap_bit(r->present, page);
+    size_t n = 1;
+
+    while (n < MEMSNAP_STREAM_PAGES && page + n < pages && memsnap_bit(r->present, page + n) == present &&
+           !__atomic_load_n(&r->done[page + n], __ATOMIC_ACQUIRE))
+    {
+        n++;
+    }
+    return n;
+}
+
+// every page, the hot ones first, in runs of up to MEMSNAP_STREAM_PAGES
+static void* memsnap_stream_thread(void* arg)
+{
+    memsnap_restore_t* r = (memsnap_restore_t*) arg;
+    size_t pages = r->size / MEMSNAP_PAGE_SIZE;
+    uint8_t* buf = aligned_alloc(MEMSNAP_PAGE_SIZE, MEMSNAP_STREAM_PAGES * MEMSNAP_PAGE_SIZE);
+    int err = buf ? 0 : -ENOMEM;
+
+    for (uint64_t i = 0; i < r->hdr.nr_hot && !err;)
+    {
+        size_t page = r->hot[i];
+        size_t n = 1;
+
+        // hot pages next to each other go in one read
+        while (i + n < r->hdr.nr_hot && n < MEMSNAP_STREAM_PAGES && r->hot[i + n] == page + n &&
+               memsnap_bit(r->present, page + n) == memsnap_bit(r->present, page))
+        {
+            n++;
+        }
+        if (!__atomic_load_n(&r->done[page], __ATOMIC_ACQUIRE))
+        {
+            err = memsnap_fill_from_file(r, page, n, buf);
+            __atomic_add_fetch(&r->streamed, n, __ATOMIC_RELAXED);
+        }
+        i += n;
+    }
+    __atomic_store_n(&r->hot_ns, memsnap_now() - r->start_ns, __ATOMIC_RELEASE);
+
+    for (size_t page = 0; page < pages && !err;)
+    {
+        size_t n;
+
+        if (__atomic_load_n(&r->done[page], __ATOMIC_ACQUIRE))
+        {
+            page++;
+            continue;
+        }
+        n = memsnap_run(r, page, pages);
+        err = memsnap_fill_from_file(r, page, n, buf);
+        __atomic_add_fetch(&r->streamed, n, __ATOMIC_RELAXED);
+        page += n;
+    }
+    if (err < 0)
+    {
+        memsnap_fail(r, -err);
+    }
+    __atomic_store_n(&r->done_ns, memsnap_now() - r->start_ns, __ATOMIC_RELEASE);
+    free(buf);
+    return NULL;
+}
+
+int memsnap_restore_lazy(memsnap_restore_t* r, const char* path, void* mem, size_t size)
+{
+    struct uffdio_api api = {.api = UFFD_API};
+    struct uffdio_register reg = {
+        .range = {.start = (uintptr_t) mem, .len = size},
+        .mode = UFFDIO_REGISTER_MODE_MISSING,
+    };
+
+    memset(r, 0, sizeof(*r));
+    r->start_ns = memsnap_now();
+    r->mem = mem;
+    r->size = size;
+    r->uffd = -1;
+    r->stop_fd = -1;
+    r->snap_fd = memsnap_open(path, size, &r->hdr, &r->hot, &r->present);
+    if (r->snap_fd < 0)
+    {
+        return -1;
+    }
+    r->done = calloc(size / MEMSNAP_PAGE_SIZE, 1);
+    // not UFFD_USER_MODE_ONLY: KVM faults the guest memory in from the kernel
+    r->uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    r->stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (!r->done || r->uffd < 0 || r->stop_fd < 0 || ioctl(r->uffd, UFFDIO_API, &api) < 0 ||
+        ioctl(r->uffd, UFFDIO_REGISTER, &reg) < 0)
+    {
+        perror("userfaultfd");
+        goto fail;
+    }
+    if (pthread_create(&r->fault_thread, NULL, memsnap_fault_thread, r) != 0)
+    {
+        goto fail;
+    }
+    if (pthread_create(&r->stream_thread, NULL, memsnap_stream_thread, r) != 0)
+    {
+        uint64_t n = 1;
+        if (write(r->stop_fd, &n, sizeof(n)) < 0)
+        {
+            perror("memory snapshot restore");
+        }
+        pthread_join(r->fault_thread, NULL);
+        goto fail;
+    }
+    return 0;
+
+fail:
+    if (r->uffd >= 0)
+    {
+        close(r->uffd);
+    }
+    if (r->stop_fd >= 0)
+    {
+        close(r->stop_fd);
+    }
+    close(r->snap_fd);
+    free(r->done);
+    free(r->hot);
+    free(r->present);
+    return -1;
+}
+
+int memsnap_restore_wait(memsnap_restore_t* r)
+{
+    struct uffdio_range range = {.start = (uintptr_t) r->mem, .len = r->size};
+    uint64_t n = 1;
+
+    pthread_join(r->stream_thread, NULL);
+    if (ioctl(r->uffd, UFFDIO_UNREGISTER, &range) < 0)
+    {
+        memsnap_fail(r, errno);
+    }
+    if (write(r->stop_fd, &n, sizeof(n)) < 0)
+    {
+        memsnap_fail(r, errno);
+    }
+    pthread_join(r->fault_thread, NULL);
+    close(r->uffd);
+    close(r->stop_fd);
+    close(r->snap_fd);
+    free(r->done);
+    free(r->hot);
+    free(r->present);
+    return r->error;
+}
@@ -0,0 +1,66 @@
+#ifndef MEMSNAP_H
+#define MEMSNAP_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define MEMSNAP_MAGIC "RKVMMEM"
+#define MEMSNAP_VERSION 1
+#define MEMSNAP_PAGE_SIZE 4096
+#define MEMSNAP_STREAM_PAGES 64 // pages per read of the streaming thread
+
+/*
+snapshot of the guest memory, and its restore. the file is the header, the hot pages, a bitmap of
+the pages that hold data and the data itself, page n at data_offset + n * page size; pages the
+guest never touched, or left zero, are holes and come back as zero pages.
+
+the lazy restore registers the guest memory with userfaultfd and returns at once, the guest runs
+while a thread streams the pages in, the hot ones first, and another one serves the pages the
+guest (or KVM on its behalf) touches before they arrived. the hot pages are a bitmap in the
+KVM_GET_DIRTY_LOG layout, e.g. the pages the guest wrote in the last moments before the snapshot
+*/
+struct memsnap_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t page_size;
+    uint64_t mem_size;
+    uint64_t nr_hot;
+    uint64_t hot_offset; // uint32_t page numbers
+    uint64_t present_offset; // one bit per page
+    uint64_t data_offset;
+};
+
+typedef struct memsnap_restore
+{
+    int snap_fd;
+    int uffd;
+    int stop_fd; // wakes the fault thread
+    uint8_t* mem;
+    size_t size;
+    struct memsnap_header hdr;
+    uint32_t* hot;
+    uint8_t* present;
+    uint8_t* done; // one byte per page, set once the page is in place
+    pthread_t fault_thread;
+    pthread_t stream_thread;
+    int error; // errno of the first failure, the guest can't run on
+    uint64_t faults; // pages served to a fault
+    uint64_t streamed; // pages put in place by the streaming thread
+    uint64_t start_ns;
+    uint64_t hot_ns; // from the start until the hot pages were in, 0 before
+    uint64_t done_ns; // until every page was in
+} memsnap_restore_t;
+
+// hot: one bit per page to put first on restore, NULL for none. returns 0 on success
+int memsnap_save(const char* path, const void* mem, size_t size, const uint64_t* hot);
+// reads the whole snapshot into mem before it returns. returns 0 on success
+int memsnap_restore(const char* path, void* mem, size_t size);
+// mem: anonymous memory nothing touched yet. returns 0 once the guest may run on it
+int memsnap_restore_lazy(memsnap_restore_t* r, const char* path, void* mem, size_t size);
+// until every page is in, then mem is plain memory again. returns 0 or the errno of a failure
+int memsnap_restore_wait(memsnap_restore_t* r);
+
+#endif // MEMSNAP_H
@@ -0,0 +1,162 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/if.h>
+#include <linux/if_tun.h>
+#include <linux/virtio_net.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "netbackend.h"
+
+/* room for a few full sized packets on each side of a switch port */
+#define NETBACKEND_SOCK_BUF_SIZE (4 * 1024 * 1024)
+
+static ssize_t netbackend_tap_send(struct netbackend *be,
+                                   const struct iovec *iov,
+                                   int niov)
+{
+    return writev(be->fd, iov, niov);
+}
+
+static ssize_t netbackend_tap_recv(struct netbackend *be,
+                                   const struct iovec *iov,
+                                   int niov)
+{
+    return readv(be->fd, iov, niov);
+}
+
+/* The tap device segments and checksums what the guest can't take */
+static void netbackend_tap_set_offload(struct netbackend *be,
+                                       uint64_t guest_offloads)
+{
+    unsigned int offload = 0;
+
+    if (guest_offloads & (1ULL << VIRTIO_NET_F_GUEST_CSUM)) {
+        offload |= TUN_F_CSUM;
+        if (guest_offloads & (1ULL << VIRTIO_NET_F_GUEST_TSO4))
+            offload |= TUN_F_TSO4;
+        if (guest_offloads & (1ULL << VIRTIO_NET_F_GUEST_TSO6))
+            offload |= TUN_F_TSO6;
+        if (guest_offloads & (1ULL << VIRTIO_NET_F_GUEST_ECN))
+            offload |= TUN_F_TSO_ECN;
+    }
+    if (ioctl(be->fd, TUNSETOFFLOAD, offload) < 0)
+        perror("TUNSETOFFLOAD");
+}
+
+static const struct netbackend_ops tap_ops = {
+    .send = netbackend_tap_send,
+    .recv = netbackend_tap_recv,
+    .set_offload = netbackend_tap_set_offload,
+};
+
+static ssize_t netbackend_sock_send(struct netbackend *be,
+                                    const struct iovec *iov,
+                                    int niov)
+{
+    struct msghdr msg = {.msg_iov = (struct iovec *) iov, .msg_iovlen = niov};
+
+    return sendmsg(be->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+static ssize_t netbackend_sock_recv(struct netbackend *be,
+                                    const struct iovec *iov,
+                                    int niov)
+{
+    struct msghdr msg = {.msg_iov = (struct iovec *) iov, .msg_iovlen = niov};
+
+    return recvmsg(be->fd, &msg, MSG_DONTWAIT | MSG_TRUNC);
+}
+
+static ssize_t netbackend_sock_peek_len(struct netbackend *be)
+{
+    return recv(be->fd, NULL, 0, MSG_DONTWAIT | MSG_PEEK | MSG_TRUNC);
+}
+
+/* Switch ports carry the packets as they are. A guest that can't take an
+ * offload gets it completed by the device.
+ */
+static const struct netbackend_ops sock_ops = {
+    .send = netbackend_sock_send,
+    .recv = netbackend_sock_recv,
+    .peek_len = netbackend_sock_peek_len,
+};
+
+/* spec is "tap:<ifname>" or "switch:<socket_path>" */
+int netbackend_init(struct netbackend *be, const char *spec)
+{
+    if (strncmp(spec, "tap:", 4) == 0)
+        return netbackend_init_tap(be, spec + 4);
+    if (strncmp(spec, "switch:", 7) == 0)
+        return netbackend_init_switch(be, spec + 7);
+    fprintf(stderr, "Unknown network backend %s\n", spec);
+    return -1;
+}
+
+int netbackend_init_tap(struct netbackend *be, const char *ifname)
+{
+    struct ifreq ifr = {.ifr_flags = IFF_TAP | IFF_NO_PI | IFF_VNET_HDR};
+    int hdr_len = sizeof(struct virtio_net_hdr_v1);
+
+    if (strlen(ifname) >= sizeof(ifr.ifr_name)) {
+        fprintf(stderr, "Tap interface name is too long\n");
+        return -1;
+    }
+    strcpy(ifr.ifr_name, ifname);
+    be->fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (be->fd < 0) {
+        perror("open /dev/net/tun");
+        return -1;
+    }
+    if (ioctl(be->fd, TUNSETIFF, &ifr) < 0 ||
+        ioctl(be->fd, TUNSETVNETHDRSZ, &hdr_len) < 0) {
+        perror("tap setup");
+        close(be->fd);
+        return -1;
+    }
+    be->ops = &tap_ops;
+    return 0;
+}
+
+/* Join a switch of another hypervisor process through its socket */
+int netbackend_init_switch(struct netbackend *be, const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Switch socket path is too long\n");
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        perror("connect to the switch");
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    netbackend_init_fd(be, fd);
+    return 0;
+}
+
+/* A packet socket, e.g. the device end of an in-process switch port */
+void netbackend_init_fd(struct netbackend *be, int fd)
+{
+    int size = NETBACKEND_SOCK_BUF_SIZE;
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    be->fd = fd;
+    be->ops = &sock_ops;
+}
+
+void netbackend_exit(struct netbackend *be)
+{
+    close(be->fd);
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* Packet backend of virtio-net. Every packet sent or received starts with a
+ * struct virtio_net_hdr_v1, so checksum and segmentation offloads pass through
+ * the backend as they are.
+ */
+
+struct netbackend;
+
+struct netbackend_ops {
+    /* returns the packet length, -1 with errno set on error or EAGAIN */
+    ssize_t (*send)(struct netbackend *be, const struct iovec *iov, int niov);
+    /* returns the packet length, which is larger than the buffers when the
+     * packet was truncated */
+    ssize_t (*recv)(struct netbackend *be, const struct iovec *iov, int niov);
+    /* length of the next packet, -1 if the backend can't tell */
+    ssize_t (*peek_len)(struct netbackend *be);
+    /* the guest accepts packets with these VIRTIO_NET_F_GUEST_* offloads */
+    void (*set_offload)(struct netbackend *be, uint64_t guest_offloads);
+};
+
+struct netbackend {
+    int fd; /* non-blocking, polled by the device */
+    const struct netbackend_ops *ops;
+};
+
+int netbackend_init(struct netbackend *be, const char *spec);
+int netbackend_init_tap(struct netbackend *be, const char *ifname);
+int netbackend_init_switch(struct netbackend *be, const char *path);
+void netbackend_init_fd(struct netbackend *be, int fd);
+void netbackend_exit(struct netbackend *be);
@@ -0,0 +1,169 @@
+#include <getopt.h>
+#include <linux/virtio_net.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "netswitch.h"
+
+/* Throughput of the userspace switch between two guests. Each side is a
+ * switch port driven the way a virtio-net device drives it: one packet with
+ * its virtio_net_hdr_v1 per message. No guest or external network is needed.
+ */
+
+struct netbench_peer {
+    int fd;
+    uint8_t mac[ETH_ALEN];
+    uint64_t packets;
+    uint64_t bytes;
+};
+
+static volatile bool bench_stop = false;
+
+static double netbench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void netbench_build(uint8_t *pkt,
+                           size_t len,
+                           const uint8_t *dst,
+                           const uint8_t *src,
+                           bool gso)
+{
+    struct virtio_net_hdr_v1 *hdr = (struct virtio_net_hdr_v1 *) pkt;
+    uint8_t *eth = pkt + sizeof(*hdr);
+
+    memset(pkt, 0, len);
+    if (gso) {
+        /* what a guest with TSO sends: one large TCP segment to be cut
+         * by whoever can't take it whole */
+        hdr->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        hdr->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+        hdr->hdr_len = ETH_HLEN + 20 + 20;
+        hdr->gso_size = ETH_DATA_LEN - 40;
+        hdr->csum_start = ETH_HLEN + 20;
+        hdr->csum_offset = 16;
+    }
+    memcpy(eth, dst, ETH_ALEN);
+    memcpy(eth + ETH_ALEN, src, ETH_ALEN);
+    eth[12] = 0x08; /* IPv4 */
+    eth[13] = 0x00;
+}
+
+static void *netbench_receiver(void *arg)
+{
+    struct netbench_peer *peer = (struct netbench_peer *) arg;
+    struct timeval timeout = {.tv_usec = 100000};
+    uint8_t *buf = malloc(NETSWITCH_MAX_PACKET);
+
+    setsockopt(peer->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    while (1) {
+        ssize_t n = recv(peer->fd, buf, NETSWITCH_MAX_PACKET, 0);
+        if (n > 0) {
+            peer->packets++;
+            peer->bytes += n - sizeof(struct virtio_net_hdr_v1);
+        } else if (bench_stop) {
+            break;
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [-s frame_size] [-t seconds] [-g]\n", prog);
+    printf("  -s  ethernet frame size (default 1514)\n");
+    printf("  -t  duration in seconds (default 5)\n");
+    printf("  -g  send 64KB TCP segmentation offload frames, as guests with TSO do\n");
+}
+
+int main(int argc, char **argv)
+{
+    struct netswitch sw;
+    struct netbench_peer a = {.mac = {0x52, 0x54, 0x00, 0, 0, 1}};
+    struct netbench_peer b = {.mac = {0x52, 0x54, 0x00, 0, 0, 2}};
+    size_t frame_size = ETH_FRAME_LEN;
+    double seconds = 5;
+    bool gso = false;
+    pthread_t receiver;
+    uint8_t *pkt;
+    size_t len;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:t:g")) != -1) {
+        switch (opt) {
+        case 's':
+            frame_size = strtoul(optarg, NULL, 10);
+            break;
+        case 't':
+            seconds = atof(optarg);
+            break;
+        case 'g':
+            gso = true;
+            frame_size = 65536 - 2;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    len = sizeof(struct virtio_net_hdr_v1) + frame_size;
+    if (frame_size < ETH_ZLEN || len > NETSWITCH_MAX_PACKET) {
+        printf("The frame size must be between %d and %zu\n", ETH_ZLEN,
+               NETSWITCH_MAX_PACKET - sizeof(struct virtio_net_hdr_v1));
+        return 1;
+    }
+
+    if (netswitch_init(&sw, NULL) < 0)
+        return 1;
+    a.fd = netswitch_add_port(&sw);
+    b.fd = netswitch_add_port(&sw);
+    if (a.fd < 0 || b.fd < 0)
+        return 1;
+
+    /* b announces itself so the switch learns where its MAC is */
+    pkt = malloc(len);
+    netbench_build(pkt, sizeof(struct virtio_net_hdr_v1) + ETH_ZLEN,
+                   (const uint8_t[]){0xff, 0xff, 0xff, 0xff, 0xff, 0xff},
+                   b.mac, false);
+    send(b.fd, pkt, sizeof(struct virtio_net_hdr_v1) + ETH_ZLEN, 0);
+    recv(a.fd, pkt, len, 0);
+
+    pthread_create(&receiver, NULL, netbench_receiver, &b);
+    netbench_build(pkt, len, b.mac, a.mac, gso);
+    double start = netbench_now(), elapsed;
+    do {
+        for (int i = 0; i < 64; i++) {
+            if (send(a.fd, pkt, len, 0) == (ssize_t) len) {
+                a.packets++;
+                a.bytes += frame_size;
+            }
+        }
+        elapsed = netbench_now() - start;
+    } while (elapsed < seconds);
+    bench_stop = true;
+    pthread_join(receiver, NULL);
+
+    printf("frame size %zu%s, %.1f s\n", frame_size, gso ? " (TSO)" : "",
+           elapsed);
+    printf("sent     %lu packets\n", a.packets);
+    printf("received %lu packets, %.3f Mpps, %.2f Gbit/s\n", b.packets,
+           b.packets / elapsed / 1e6, b.bytes * 8 / elapsed / 1e9);
+    printf("dropped  %lu packets (%.2f%%)\n", a.packets - b.packets,
+           a.packets ? 100.0 * (a.packets - b.packets) / a.packets : 0);
+
+    close(a.fd);
+    close(b.fd);
+    netswitch_exit(&sw);
+    free(pkt);
+    return 0;
+}
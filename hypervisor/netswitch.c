@@ -0,0 +1,292 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "netswitch.h"
+#include "utils.h"
+
+#define NETSWITCH_TAG_LISTEN NETSWITCH_MAX_PORTS
+#define NETSWITCH_TAG_STOP (NETSWITCH_MAX_PORTS + 1)
+#define NETSWITCH_MAX_EVENTS 16
+/* packets taken from one port before the others get a turn */
+#define NETSWITCH_BURST 64
+#define NETSWITCH_SOCK_BUF_SIZE (4 * 1024 * 1024)
+#define NETSWITCH_HDR_LEN 12
+
+static struct netswitch_fdb_entry *netswitch_fdb_slot(struct netswitch *sw,
+                                                      const uint8_t *mac)
+{
+    unsigned int hash = 0;
+
+    for (int i = 0; i < ETH_ALEN; i++)
+        hash = hash * 31 + mac[i];
+    return &sw->fdb[hash % NETSWITCH_FDB_SIZE];
+}
+
+static void netswitch_learn(struct netswitch *sw, const uint8_t *mac, int port)
+{
+    struct netswitch_fdb_entry *entry;
+
+    if (mac[0] & 1) /* a multicast source is bogus */
+        return;
+    entry = netswitch_fdb_slot(sw, mac);
+    memcpy(entry->mac, mac, ETH_ALEN);
+    entry->port = port;
+}
+
+/* returns -1 when the destination has to be flooded */
+static int netswitch_lookup(struct netswitch *sw, const uint8_t *mac)
+{
+    struct netswitch_fdb_entry *entry = netswitch_fdb_slot(sw, mac);
+
+    if (mac[0] & 1 || entry->port < 0 || memcmp(entry->mac, mac, ETH_ALEN))
+        return -1;
+    return entry->port;
+}
+
+/* The switch doesn't queue: a full port drops the packet like a congested
+ * link would, and TCP in the guests backs off.
+ */
+static void netswitch_output(struct netswitch *sw, int port, size_t len)
+{
+    struct netswitch_port *p = &sw->ports[port];
+    int fd = __atomic_load_n(&p->fd, __ATOMIC_ACQUIRE);
+
+    if (fd < 0)
+        return;
+    if (send(fd, sw->buf, len, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+        p->tx_dropped++;
+    else
+        p->tx_packets++;
+}
+
+static void netswitch_forward(struct netswitch *sw, int in_port, size_t len)
+{
+    const uint8_t *eth = sw->buf + NETSWITCH_HDR_LEN;
+    int out_port;
+
+    netswitch_learn(sw, eth + ETH_ALEN, in_port);
+    out_port = netswitch_lookup(sw, eth);
+    if (out_port >= 0) {
+        if (out_port != in_port)
+            netswitch_output(sw, out_port, len);
+        return;
+    }
+    for (int i = 0; i < NETSWITCH_MAX_PORTS; i++) {
+        if (i != in_port)
+            netswitch_output(sw, i, len);
+    }
+}
+
+static void netswitch_del_port(struct netswitch *sw, int port)
+{
+    struct netswitch_port *p = &sw->ports[port];
+
+    for (int i = 0; i < NETSWITCH_FDB_SIZE; i++) {
+        if (sw->fdb[i].port == port)
+            sw->fdb[i].port = -1;
+    }
+    close(p->fd);
+    pthread_mutex_lock(&sw->ports_lock);
+    __atomic_store_n(&p->fd, -1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&sw->ports_lock);
+}
+
+static void netswitch_port_input(struct netswitch *sw, int port)
+{
+    struct netswitch_port *p = &sw->ports[port];
+
+    for (int i = 0; i < NETSWITCH_BURST; i++) {
+        ssize_t n = recv(p->fd, sw->buf, NETSWITCH_MAX_PACKET,
+                         MSG_DONTWAIT | MSG_TRUNC);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EINTR)
+                netswitch_del_port(sw, port);
+            return;
+        }
+        if (n == 0) { /* seqpacket EOF: the device went away */
+            netswitch_del_port(sw, port);
+            return;
+        }
+        p->rx_packets++;
+        p->rx_bytes += n;
+        if (n < NETSWITCH_HDR_LEN + ETH_HLEN || n > NETSWITCH_MAX_PACKET)
+            continue;
+        netswitch_forward(sw, port, n);
+    }
+}
+
+static int netswitch_attach(struct netswitch *sw, int fd)
+{
+    int size = NETSWITCH_SOCK_BUF_SIZE;
+    int port = -1;
+
+    pthread_mutex_lock(&sw->ports_lock);
+    for (int i = 0; i < NETSWITCH_MAX_PORTS; i++) {
+        if (sw->ports[i].fd < 0) {
+            port = i;
+            break;
+        }
+    }
+    if (port >= 0) {
+        struct epoll_event ev = {.events = EPOLLIN, .data.u32 = port};
+
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+        sw->ports[port] = (struct netswitch_port){.fd = fd};
+        epoll_ctl(sw->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    }
+    pthread_mutex_unlock(&sw->ports_lock);
+    return port;
+}
+
+static void netswitch_accept(struct netswitch *sw)
+{
+    int fd = accept(sw->listen_fd, NULL, NULL);
+
+    if (fd < 0)
+        return;
+    if (netswitch_attach(sw, fd) < 0) {
+        fprintf(stderr, "switch: no free port\n");
+        close(fd);
+    }
+}
+
+static void *netswitch_thread(void *arg)
+{
+    struct netswitch *sw = (struct netswitch *) arg;
+    struct epoll_event events[NETSWITCH_MAX_EVENTS];
+
+    while (1) {
+        int n = epoll_wait(sw->epoll_fd, events, NETSWITCH_MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("switch epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            uint32_t tag = events[i].data.u32;
+
+            if (tag == NETSWITCH_TAG_STOP)
+                return NULL;
+            if (tag == NETSWITCH_TAG_LISTEN)
+                netswitch_accept(sw);
+            else if (sw->ports[tag].fd >= 0)
+                netswitch_port_input(sw, tag);
+        }
+    }
+    return NULL;
+}
+
+/* path is where other hypervisors can connect to the switch, or NULL */
+static int netswitch_listen(struct netswitch *sw, const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    struct epoll_event ev = {.events = EPOLLIN,
+                             .data.u32 = NETSWITCH_TAG_LISTEN};
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Switch socket path is too long\n");
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    strcpy(sw->path, path);
+    sw->listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sw->listen_fd < 0) {
+        perror("switch socket");
+        return -1;
+    }
+    unlink(path); /* a socket left behind by a previous run */
+    if (bind(sw->listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        listen(sw->listen_fd, NETSWITCH_MAX_PORTS) < 0) {
+        perror("bind switch socket");
+        close(sw->listen_fd);
+        sw->listen_fd = -1;
+        return -1;
+    }
+    sudo_chown_socket(path);
+    epoll_ctl(sw->epoll_fd, EPOLL_CTL_ADD, sw->listen_fd, &ev);
+    return 0;
+}
+
+int netswitch_init(struct netswitch *sw, const char *path)
+{
+    struct epoll_event ev = {.events = EPOLLIN, .data.u32 = NETSWITCH_TAG_STOP};
+
+    for (int i = 0; i < NETSWITCH_MAX_PORTS; i++)
+        sw->ports[i].fd = -1;
+    for (int i = 0; i < NETSWITCH_FDB_SIZE; i++)
+        sw->fdb[i].port = -1;
+    pthread_mutex_init(&sw->ports_lock, NULL);
+    sw->listen_fd = -1;
+    sw->buf = malloc(NETSWITCH_MAX_PACKET);
+    sw->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    sw->stop_fd = eventfd(0, EFD_CLOEXEC);
+    epoll_ctl(sw->epoll_fd, EPOLL_CTL_ADD, sw->stop_fd, &ev);
+
+    if (path && netswitch_listen(sw, path) < 0) {
+        close(sw->stop_fd);
+        close(sw->epoll_fd);
+        free(sw->buf);
+        return -1;
+    }
+    pthread_create(&sw->thread, NULL, netswitch_thread, sw);
+    return 0;
+}
+
+/* Returns the device end of a new port, -1 if the switch is full */
+int netswitch_add_port(struct netswitch *sw)
+{
+    int fds[2];
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0) {
+        perror("switch socketpair");
+        return -1;
+    }
+    if (netswitch_attach(sw, fds[0]) < 0) {
+        fprintf(stderr, "switch: no free port\n");
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    return fds[1];
+}
+
+void netswitch_print_stats(struct netswitch *sw)
+{
+    for (int i = 0; i < NETSWITCH_MAX_PORTS; i++) {
+        struct netswitch_port *p = &sw->ports[i];
+
+        if (!p->rx_packets && !p->tx_packets && !p->tx_dropped)
+            continue;
+        printf("switch port %d: rx %lu packets %lu bytes, tx %lu packets, "
+               "%lu dropped\n",
+               i, p->rx_packets, p->rx_bytes, p->tx_packets, p->tx_dropped);
+    }
+}
+
+void netswitch_exit(struct netswitch *sw)
+{
+    uint64_t n = 1;
+
+    if (write(sw->stop_fd, &n, sizeof(n)) < 0)
+        perror("switch stop");
+    pthread_join(sw->thread, NULL);
+    for (int i = 0; i < NETSWITCH_MAX_PORTS; i++) {
+        if (sw->ports[i].fd >= 0)
+            close(sw->ports[i].fd);
+    }
+    if (sw->listen_fd >= 0) {
+        close(sw->listen_fd);
+        unlink(sw->path);
+    }
+    close(sw->stop_fd);
+    close(sw->epoll_fd);
+    free(sw->buf);
+}
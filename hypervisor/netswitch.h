@@ -0,0 +1,49 @@
+#pragma once
+
+#include <linux/if_ether.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/un.h>
+
+/* Learning L2 switch between virtio-net devices. Each port is a
+ * SOCK_SEQPACKET socket carrying one packet, with its virtio_net_hdr_v1, per
+ * message. Ports are socketpairs for the devices of this process, or
+ * connections to the switch socket for the devices of other hypervisors.
+ */
+
+#define NETSWITCH_MAX_PORTS 16
+#define NETSWITCH_FDB_SIZE 256
+/* virtio_net_hdr_v1 and the largest segmentation offload frame */
+#define NETSWITCH_MAX_PACKET (12 + 65536 + 64)
+
+struct netswitch_port {
+    int fd; /* -1 when the port is free */
+    uint64_t rx_packets;
+    uint64_t rx_bytes;
+    uint64_t tx_packets;
+    uint64_t tx_dropped;
+};
+
+/* where a MAC address was last seen */
+struct netswitch_fdb_entry {
+    uint8_t mac[ETH_ALEN];
+    int port; /* -1 when the entry is free */
+};
+
+struct netswitch {
+    struct netswitch_port ports[NETSWITCH_MAX_PORTS];
+    struct netswitch_fdb_entry fdb[NETSWITCH_FDB_SIZE];
+    pthread_mutex_t ports_lock; /* port allocation */
+    int epoll_fd;
+    int listen_fd; /* -1 without a switch socket */
+    int stop_fd;
+    char path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+    pthread_t thread;
+    uint8_t *buf;
+};
+
+int netswitch_init(struct netswitch *sw, const char *path);
+int netswitch_add_port(struct netswitch *sw);
+void netswitch_print_stats(struct netswitch *sw);
+void netswitch_exit(struct netswitch *sw);
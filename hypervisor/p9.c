@@ -0,0 +1,1184 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/openat2.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+#include "p9.h"
+
+/* O_PATH is only declared with _GNU_SOURCE */
+#define P9_O_PATH __O_PATH
+/* what a client may ask of Tlopen and Tlcreate, O_SYNC has the bits of
+ * O_DSYNC */
+#define P9_OPEN_FLAGS (O_ACCMODE | O_TRUNC | O_APPEND | O_SYNC)
+#define P9_RW_HDR_SIZE 11 /* size[4] type[1] tag[2] count[4] of Rread */
+#define P9_TWRITE_HDR_SIZE 23 /* header, fid[4] offset[8] count[4] */
+#define P9_MAX_IOV 64
+
+/* a message being read or written, err once it ran past its end */
+struct p9_msg {
+    uint8_t *p;
+    size_t left;
+    bool err;
+};
+
+/* one request and its reply */
+struct p9_call {
+    struct p9_msg in; /* after the header */
+    struct p9_msg out; /* after the header */
+    const struct iovec *req;
+    int nreq;
+    const struct iovec *reply;
+    int nreply;
+    size_t req_len;
+    size_t reply_len;
+    uint32_t data; /* bytes of an Rread already in reply after its header */
+};
+
+static void *msg_take(struct p9_msg *m, size_t len)
+{
+    void *p = m->p;
+
+    if (m->err || len > m->left) {
+        m->err = true;
+        return NULL;
+    }
+    m->p += len;
+    m->left -= len;
+    return p;
+}
+
+static uint64_t get_n(struct p9_msg *m, size_t len)
+{
+    uint64_t v = 0;
+    void *p = msg_take(m, len);
+
+    /* the wire is little endian, as the host */
+    if (p)
+        memcpy(&v, p, len);
+    return v;
+}
+
+#define get16(m) ((uint16_t) get_n(m, 2))
+#define get32(m) ((uint32_t) get_n(m, 4))
+#define get64(m) get_n(m, 8)
+
+/* A string of the message into buf, NUL terminated */
+static void get_str(struct p9_msg *m, char *buf, size_t size)
+{
+    uint16_t len = get16(m);
+    char *p = msg_take(m, len);
+
+    buf[0] = '\0';
+    if (!p || len >= size || memchr(p, '\0', len)) {
+        m->err = true;
+        return;
+    }
+    memcpy(buf, p, len);
+    buf[len] = '\0';
+}
+
+static void put_n(struct p9_msg *m, uint64_t v, size_t len)
+{
+    void *p = msg_take(m, len);
+
+    if (p)
+        memcpy(p, &v, len);
+}
+
+#define put8(m, v) put_n(m, v, 1)
+#define put16(m, v) put_n(m, v, 2)
+#define put32(m, v) put_n(m, v, 4)
+#define put64(m, v) put_n(m, v, 8)
+
+static void put_str(struct p9_msg *m, const char *str)
+{
+    size_t len = strlen(str);
+    void *p;
+
+    put16(m, len);
+    if ((p = msg_take(m, len)))
+        memcpy(p, str, len);
+}
+
+static void put_qid(struct p9_msg *m, mode_t mode, uint64_t ino)
+{
+    put8(m, S_ISDIR(mode) ? P9_QTDIR : S_ISLNK(mode) ? P9_QTSYMLINK : 0);
+    put32(m, 0);
+    put64(m, ino);
+}
+
+/* Builds in out the part of iov that starts at offset, at most len bytes.
+ * Returns the number of iovecs */
+static int iov_slice(const struct iovec *iov,
+                     int n,
+                     size_t offset,
+                     size_t len,
+                     struct iovec *out)
+{
+    int nout = 0;
+
+    for (int i = 0; i < n && len && nout < P9_MAX_IOV; i++) {
+        if (offset >= iov[i].iov_len) {
+            offset -= iov[i].iov_len;
+            continue;
+        }
+        out[nout].iov_base = (uint8_t *) iov[i].iov_base + offset;
+        out[nout].iov_len = iov[i].iov_len - offset < len ? iov[i].iov_len - offset : len;
+        len -= out[nout].iov_len;
+        offset = 0;
+        nout++;
+    }
+    return nout;
+}
+
+static size_t iov_total(const struct iovec *iov, int n)
+{
+    size_t len = 0;
+
+    for (int i = 0; i < n; i++)
+        len += iov[i].iov_len;
+    return len;
+}
+
+static size_t iov_copy(const struct iovec *iov, int n, void *buf, size_t len, bool to_iov)
+{
+    struct iovec part[P9_MAX_IOV];
+    int nparts = iov_slice(iov, n, 0, len, part);
+    size_t copied = 0;
+
+    for (int i = 0; i < nparts; i++) {
+        if (to_iov)
+            memcpy(part[i].iov_base, (uint8_t *) buf + copied, part[i].iov_len);
+        else
+            memcpy((uint8_t *) buf + copied, part[i].iov_base, part[i].iov_len);
+        copied += part[i].iov_len;
+    }
+    return copied;
+}
+
+static struct p9_fid **fid_slot(struct p9_server *s, uint32_t fid)
+{
+    struct p9_fid **f = &s->fids[fid % P9_FID_BUCKETS];
+
+    while (*f && (*f)->fid != fid)
+        f = &(*f)->next;
+    return f;
+}
+
+static struct p9_fid *fid_get(struct p9_server *s, uint32_t fid)
+{
+    return *fid_slot(s, fid);
+}
+
+/* NULL when the fid is taken or there are too many of them */
+static struct p9_fid *fid_new(struct p9_server *s, uint32_t fid, const char *path, uint32_t uid)
+{
+    struct p9_fid **slot = fid_slot(s, fid);
+    struct p9_fid *f;
+
+    if (*slot || fid == P9_NOFID || s->nfids == P9_MAX_FIDS || !(f = calloc(1, sizeof(*f))))
+        return NULL;
+    if (!(f->path = strdup(path))) {
+        free(f);
+        return NULL;
+    }
+    f->fid = fid;
+    f->uid = uid;
+    f->fd = -1;
+    *slot = f;
+    s->nfids++;
+    return f;
+}
+
+static void fid_close(struct p9_fid *f)
+{
+    if (f->dir)
+        closedir(f->dir);
+    if (f->fd >= 0)
+        close(f->fd);
+    f->dir = NULL;
+    f->fd = -1;
+}
+
+static int fid_free(struct p9_server *s, uint32_t fid)
+{
+    struct p9_fid **slot = fid_slot(s, fid);
+    struct p9_fid *f = *slot;
+
+    if (!f)
+        return -EBADF;
+    *slot = f->next;
+    fid_close(f);
+    free(f->path);
+    free(f);
+    s->nfids--;
+    return 0;
+}
+
+static void fid_free_all(struct p9_server *s)
+{
+    for (int i = 0; i < P9_FID_BUCKETS; i++) {
+        while (s->fids[i])
+            fid_free(s, s->fids[i]->fid);
+    }
+}
+
+/* A path beneath the root, never through a symlink. Returns the fd or
+ * -errno */
+static int p9_open(struct p9_server *s, const char *path, int flags, mode_t mode)
+{
+    struct open_how how = {
+        .flags = flags | O_CLOEXEC | O_NOFOLLOW,
+        .mode = (flags & O_CREAT) ? mode & 07777 : 0,
+        .resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS,
+    };
+    long fd = syscall(SYS_openat2, s->root_fd, path, &how, sizeof(how));
+
+    return fd < 0 ? -errno : fd;
+}
+
+static int p9_stat(struct p9_server *s, const char *path, struct stat *st)
+{
+    int fd = p9_open(s, path, P9_O_PATH, 0);
+    int r;
+
+    if (fd < 0)
+        return fd;
+    r = fstat(fd, st) < 0 ? -errno : 0;
+    close(fd);
+    return r;
+}
+
+/* The directory a path is in, opened, and the name of the path in it */
+static int p9_open_parent(struct p9_server *s, const char *path, const char **name)
+{
+    char parent[PATH_MAX];
+    const char *slash = strrchr(path, '/');
+
+    if (!slash) {
+        *name = path;
+        return p9_open(s, ".", P9_O_PATH | O_DIRECTORY, 0);
+    }
+    memcpy(parent, path, slash - path);
+    parent[slash - path] = '\0';
+    *name = slash + 1;
+    return p9_open(s, parent, P9_O_PATH | O_DIRECTORY, 0);
+}
+
+static int p9_open_dir(struct p9_server *s, struct p9_fid *f)
+{
+    return p9_open(s, f->path, P9_O_PATH | O_DIRECTORY, 0);
+}
+
+/* a name of an entry of a directory, nothing that moves elsewhere */
+static bool valid_name(const char *name)
+{
+    return *name && !strchr(name, '/') && strcmp(name, ".") && strcmp(name, "..");
+}
+
+/* path/name into out, ".." goes up a level but not above the root */
+static int path_join(char *out, const char *path, const char *name)
+{
+    if (strcmp(name, "..") == 0) {
+        char *slash;
+
+        strcpy(out, path);
+        slash = strrchr(out, '/');
+        if (slash)
+            *slash = '\0';
+        else
+            strcpy(out, ".");
+        return 0;
+    }
+    if (!valid_name(name))
+        return -ENOENT;
+    if (snprintf(out, PATH_MAX, "%s/%s", path, name) >= PATH_MAX)
+        return -ENAMETOOLONG;
+    if (strcmp(path, ".") == 0)
+        memmove(out, out + 2, strlen(out + 2) + 1);
+    return 0;
+}
+
+/* The fids at a path or beneath it follow it to its new place */
+static void fids_rename(struct p9_server *s, const char *from, const char *to)
+{
+    size_t len = strlen(from);
+
+    for (int i = 0; i < P9_FID_BUCKETS; i++) {
+        for (struct p9_fid *f = s->fids[i]; f; f = f->next) {
+            char *path;
+
+            if (strncmp(f->path, from, len) || (f->path[len] && f->path[len] != '/'))
+                continue;
+            if (!(path = malloc(strlen(to) + strlen(f->path + len) + 1)))
+                continue;
+            strcpy(path, to);
+            strcat(path, f->path + len);
+            free(f->path);
+            f->path = path;
+        }
+    }
+}
+
+/* A new entry of a writable share belongs to the user the client acts for,
+ * as far as the hypervisor can give it away */
+static void p9_chown_new(int dirfd, const char *name, uint32_t uid, uint32_t gid)
+{
+    if (geteuid() == 0 && fchownat(dirfd, name, uid, gid, AT_SYMLINK_NOFOLLOW) < 0)
+        perror("9p chown");
+}
+
+static int p9_reply_entry(struct p9_call *c, int dirfd, const char *name)
+{
+    struct stat st;
+
+    if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+        return -errno;
+    put_qid(&c->out, st.st_mode, st.st_ino);
+    return 0;
+}
+
+static int p9_version(struct p9_server *s, struct p9_call *c)
+{
+    uint32_t msize = get32(&c->in);
+    char version[32];
+
+    get_str(&c->in, version, sizeof(version));
+    if (c->in.err || msize < P9_HDR_SIZE + P9_TWRITE_HDR_SIZE)
+        return -EINVAL;
+    /* a new session */
+    fid_free_all(s);
+    s->msize = msize < P9_MAX_MSIZE ? msize : P9_MAX_MSIZE;
+    put32(&c->out, s->msize);
+    put_str(&c->out, strcmp(version, P9_VERSION) == 0 ? P9_VERSION : "unknown");
+    return 0;
+}
+
+static int p9_attach(struct p9_server *s, struct p9_call *c)
+{
+    uint32_t fid = get32(&c->in);
+    char uname[256], aname[256];
+    uint32_t uid;
+    struct stat st;
+
+    msg_take(&c->in, 4); /* afid, no authentication */
+    get_str(&c->in, uname, sizeof(uname));
+    get_str(&c->in, aname, sizeof(aname));
+    uid = get32(&c->in);
+    if (c->in.err)
+        return -EINVAL;
+    if (fstat(s->root_fd, &st) < 0)
+        return -errno;
+    if (!fid_new(s, fid, ".", uid))
+        return -EEXIST;
+    put_qid(&c->out, st.st_mode, st.st_ino);
+    return 0;
+}
+
+static int p9_walk(struct p9_server *s, struct p9_call *c)
+{
+    uint32_t fid = get32(&c->in), newfid = get32(&c->in);
+    uint16_t nwname = get16(&c->in);
+    struct p9_fid *f = fid_get(s, fid);
+    char path[PATH_MAX], next[PATH_MAX], name[NAME_MAX + 1];
+    uint8_t *nwqid;
+    uint16_t i;
+
+    if (c->in.err || nwname > P9_MAX_WALK)
+        return -EINVAL;
+    if (!f)
+        return -EBADF;
+    if (newfid != fid && fid_get(s, newfid))
+        return -EEXIST;
+    strcpy(path, f->path);
+    nwqid = msg_take(&c->out, 2);
+    for (i = 0; i < nwname; i++) {
+        struct stat st;
+        int r;
+
+        get_str(&c->in, name, sizeof(name));
+        if (c->in.err)
+            return -EINVAL;
+        r = path_join(next, path, name);
+        if (!r)
+            r = p9_stat(s, next, &st);
+        /* the names walked so far, but an error for the first one */
+        if (r < 0 && !i)
+            return r;
+        if (r < 0)
+            break;
+        put_qid(&c->out, st.st_mode, st.st_ino);
+        strcpy(path, next);
+        if (i + 1 < nwname && !S_ISDIR(st.st_mode)) {
+            i++;
+            break;
+        }
+    }
+    if (nwqid)
+        memcpy(nwqid, &i, sizeof(i));
+    if (i < nwname)
+        return 0;
+    if (newfid == fid) {
+        char *copy = strdup(path);
+
+        if (!copy)
+            return -ENOMEM;
+        free(f->path);
+        f->path = copy;
+        return 0;
+    }
+    return fid_new(s, newfid, path, f->uid) ? 0 : -ENOMEM;
+}
+
+static int p9_getattr(struct p9_server *s, struct p9_call *c)
+{
+    struct p9_fid *f = fid_get(s, get32(&c->in));
+    struct stat st;
+    int r;
+
+    msg_take(&c->in, 8); /* the mask, the client gets the basic ones */
+    if (!f)
+        return -EBADF;
+    /* an open file may have no path anymore */
+    r = f->fd >= 0 ? (fstat(f->fd, &st) < 0 ? -errno : 0) : p9_stat(s, f->path, &st);
+    if (r < 0)
+        return r;
+    put64(&c->out, P9_GETATTR_BASIC);
+    put_qid(&c->out, st.st_mode, st.st_ino);
+    put32(&c->out, st.st_mode);
+    put32(&c->out, st.st_uid);
+    put32(&c->out, st.st_gid);
+    put64(&c->out, st.st_nlink);
+    put64(&c->out, st.st_rdev);
+    put64(&c->out, st.st_size);
+    put64(&c->out, st.st_blksize);
+    put64(&c->out, st.st_blocks);
+    put64(&c->out, st.st_atim.tv_sec);
+    put64(&c->out, st.st_atim.tv_nsec);
+    put64(&c->out, st.st_mtim.tv_sec);
+    put64(&c->out, st.st_mtim.tv_nsec);
+    put64(&c->out, st.st_ctim.tv_sec);
+    put64(&c->out, st.st_ctim.tv_nsec);
+    put64(&c->out, 0); /* btime */
+    put64(&c->out, 0);
+    put64(&c->out, 0); /* gen */
+    put64(&c->out, 0); /* data_version */
+    return 0;
+}
+
+static int p9_setattr(struct p9_server *s, struct p9_call *c)
+{
+    struct p9_fid *f = fid_get(s, get32(&c->in));
+    uint32_t valid = get32(&c->in), mode = get32(&c->in);
+    uint32_t uid = get32(&c->in), gid = get32(&c->in);
+    uint64_t size = get64(&c->in);
+    struct timespec times[2];
+    const char *name;
+    int dirfd, r = 0;
+
+    times[0].tv_sec = get64(&c->in);
+    times[0].tv_nsec = get64(&c->in);
+    times[1].tv_sec = get64(&c->in);
+    times[1].tv_nsec = get64(&c->in);
+    if (c->in.err)
+        return -EINVAL;
+    if (!f)
+        return -EBADF;
+    if (s->readonly)
+        return -EROFS;
+    if ((dirfd = p9_open_parent(s, f->path, &name)) < 0)
+        return dirfd;
+
+    if (valid & P9_SETATTR_MODE) {
+        /* no fchmodat() that leaves a symlink alone, the fd is the file */
+        int fd = p9_open(s, f->path, P9_O_PATH, 0);
+        char proc[32];
+        struct stat st;
+
+        if (fd < 0 || fstat(fd, &st) < 0)
+            r = fd < 0 ? fd : -errno;
+        snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+        if (!r && !S_ISLNK(st.st_mode) && chmod(proc, mode & 07777) < 0)
+            r = -errno;
+        if (fd >= 0)
+            close(fd);
+    }
+    if (!r && (valid & (P9_SETATTR_UID | P9_SETATTR_GID)) &&
+        fchownat(dirfd, name, (valid & P9_SETATTR_UID) ? uid : (uid_t) -1,
+                 (valid & P9_SETATTR_GID) ? gid : (gid_t) -1, AT_SYMLINK_NOFOLLOW) < 0)
+        r = -errno;
+    if (!r && (valid & P9_SETATTR_SIZE)) {
+        int fd = p9_open(s, f->path, O_WRONLY | O_NONBLOCK, 0);
+
+        if (fd < 0)
+            r = fd;
+        else if (ftruncate(fd, size) < 0)
+            r = -errno;
+        if (fd >= 0)
+            close(fd);
+    }
+    if (!r && (valid & (P9_SETATTR_ATIME | P9_SETATTR_MTIME))) {
+        if (!(valid & P9_SETATTR_ATIME))
+            times[0].tv_nsec = UTIME_OMIT;
+        else if (!(valid & P9_SETATTR_ATIME_SET))
+            times[0].tv_nsec = UTIME_NOW;
+        if (!(valid & P9_SETATTR_MTIME))
+            times[1].tv_nsec = UTIME_OMIT;
+        else if (!(valid & P9_SETATTR_MTIME_SET))
+            times[1].tv_nsec = UTIME_NOW;
+        if (utimensat(dirfd, name, times, AT_SYMLINK_NOFOLLOW) < 0)
+            r = -errno;
+    }
+    close(dirfd);
+    return r;
+}
+
+/* Only files and directories are opened, a device node in the share is not
+ * a way to the devices of the host */
+static int p9_opened(struct p9_call *c, struct p9_fid *f, int fd)
+{
+    struct stat st;
+
+    if (fd < 0)
+        return fd;
+    if (fstat(fd, &st) < 0 || !(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode))) {
+        close(fd);
+        return -EPERM;
+    }
+    f->fd = fd;
+    put_qid(&c->out, st.st_mode, st.st_ino);
+    put32(&c->out, 0); /* iounit, the client goes by msize */
+    return 0;
+}
+
+static int p9_lopen(struct p9_server *s, struct p9_call *c)
+{
+    struct p9_fid *f = fid_get(s, get32(&c->in));
+    int flags = get32(&c->in) & P9_OPEN_FLAGS;
+
+    if (c->in.err)
+        return -EINVAL;
+    if (!f)
+        return -EBADF;
+    if (f->fd >= 0)
+        return -EINVAL;
+    if (s->readonly && ((flags & O_ACCMODE) != O_RDONLY || (flags & O_TRUNC)))
+        return -EROFS;
+    /* no blocking on a FIFO, p9_opened() turns it away */
+    return p9_opened(c, f, p9_open(s, f->path, flags | O_NONBLOCK, 0));
+}
+
+static int p9_lcreate(struct p9_server *s, struct p9_call *c)
+{
+    struct p9_fid *f = fid_get(s, get32(&c->in));
+    char name[NAME_MAX + 1], path[PATH_MAX];
+    int flags, dirfd, r;
+    uint32_t mode, gid;
+
+    get_str(&c->in, name, sizeof(name));
+    flags = get32(&c->in) & (P9_OPEN_FLAGS | O_EXCL);
+    mode = get32(&c->in);
+    gid = get32(&c->in);
+    if (c->in.err || !valid_name(name))
+        return -EINVAL;
+    if (!f)
+        return -EBADF;
+    if (f->fd >= 0)
+        return -EINVAL;
+    if (s->readonly)
+        return -EROFS;
+    if ((r = path_join(path, f->path, name)) < 0)
+        return r;
+    if ((r = p9_opened(c, f, p9_open(s, path, flags | O_CREAT | O_NONBLOCK, mode))) < 0)
+        return r;
+    if ((dirfd = p9_open_dir(s, f)) >= 0) {
+        p9_chown_new(dirfd, name, f->uid, gid);
+        close(dirfd);
+    }
+    /* the fid is the new file now */
+    free(f->path);
+    f->path = strdup(path);
+    return f->path ? 0 : -ENOMEM;
+}
+
+static int p9_symlink(struct p9_server *s, struct p9_call *c)
+{
+    struct p9_fid *f = fid_get(s, get32(&c->in));
+    char name[NAME_MAX + 1], target[PATH_MAX];
+    uint32_t gid;
+    int dirfd, r = 0;
+
+    get_str(&c->in, name, sizeof(name));
+    get_str(&c->in, target, sizeof(target));
+    gid = get32(&c->in);
+    if (c->in.err || !valid_name(name))
+        return -EINVAL;
+    if (!f)
+        return -EBADF;
+    if (s->readonly)
+        return -EROFS;
+    /* the target is only ever read back by the client, never followed */
+    if ((dirfd = p9_open_dir(s, f)) < 0)
+        return dirfd;
+    if (symlinkat(target, dirfd, name) < 0)
+        r = -errno;
+    if (!r) {
+        p9_chown_new(dirfd, name, f->uid, gid);
+        r = p9_reply_entry(c, dirfd, name);
+    }
+    close(dirfd);
+    return r;
+}
+
+static int p9_mknod(struct p9_server *s, struct p9_call *c)
+{
+    struct p9_fid *f = fid_get(s, get32(&c->in));
+    char name[NAME_MAX + 1];
+    uint32_t mode, gid;
+    int dirfd, r = 0;
+
+    get_str(&c->in, name, sizeof(name));
+    mode = get32(&c->in);
+    msg_take(&c->in, 8); /* major, minor */
+    gid = get32(&c->in);
+    if (c->in.err || !valid_name(name))
+        return -EINVAL;
+    if (!f)
+        return -EBADF;
+    if (s->readonly)
+        return -EROFS;
+    /* no device nodes on the host */
+    if (!S_ISFIFO(mode) && !S_ISSOCK(mode) && !S_ISREG(mode))
+        return -EPERM;
+    if ((dirfd = p9_open_dir(s, f)) < 0)
+        return dirfd;
+    if (mknodat(dirfd, name, mode, 0) < 0)
+        r = -errno;
+    if (!r) {
+        p9_chown_new(dirfd, name, f->uid, gid);
+        r = p9_reply_entry(c, dirfd, name);
+    }
+    close(dirfd);
+    return r;
+}
+
+static int p9_mkdir(struct p9_server *s, struct p9_call *c)
+{
+    struct p9_fid *f = fid_get(s, get32(&c->in));
+    char name[NAME_MAX + 1];
+    uint32_t mode, gid;
+    int dirfd, r = 0;
+
+    get_str(&c->in, name, sizeof(name));
+    mode = get32(&c->in);
+    gid = get32(&c->in);
+    if (c->in.err || !valid_name(name))
+        return -EINVAL;
+    if (!f)
+        return -EBADF;
+    if (s->readonly)
+        return -EROFS;
+    if ((dirfd = p9_open_dir(s, f)) < 0)
+        return dirfd;
+    if (mkdirat(dirfd, name, mode & 07777) < 0)
+        r = -errno;
+    if (!r) {
+        p9_chown_new(dirfd, name, f->uid, gid);
+        r = p9_reply_entry(c, dirfd, name);
+    }
+    close(dirfd);
+    return r;
+}
+
+static int p9_readlink(struct p9_server *s, struct p9_call *c)
+{
+    struct p9_fid *f = fid_get(s, get32(&c->in));
+    char target[PATH_MAX];
+    ssize_t len;
+    int fd;
+
+    if (!f)
+        return -EBADF;
+    if ((fd = p9_open(s, f->path, P9_O_PATH, 0)) < 0)
+        return fd;
+    /* an empty name is the link the O_PATH fd is on */
+    len = readlinkat(fd, "", target, sizeof(target) - 1);
+    close(fd);
+    if (len < 0)
+        return -errno;
+    target[len] = '\0';
+    put_str(&c->out, target);
+    return 0;
+}
+
+static int p9_statfs(struct p9_server *s, struct p9_call *c)
+{
+    struct statfs st;
+    uint64_t fsid;
+
+    if (!fid_get(s, get32(&c->in)))
+        return -EBADF;
+    if (fstatfs(s->root_fd, &st) < 0)
+        return -errno;
+    memcpy(&fsid, &st.f_fsid, sizeof(fsid));
+    put32(&c->out, st.f_type);
+    put32(&c->out, st.f_bsize);
+    put64(&c->out, st.f_blocks);
+    put64(&c->out, st.f_bfree);
+    put64(&c->out, st.f_bavail);
+    put64(&c->out, st.f_files);
+    put64(&c->out, st.f_ffree);
+    put64(&c->out, fsid);
+    put32(&c->out, st.f_namelen);
+    return 0;
+}
+
+static int p9_readdir(struct p9_server *s, struct p9_call *c)
+{
+    struct p9_fid *f = fid_get(s, get32(&c->in));
+    uint64_t offset = get64(&c->in);
+    uint32_t count = get32(&c->in), used = 0;
+    struct dirent *de;
+    uint8_t *countp;
+
+    if (c->in.err)
+        return -EINVAL;
+    if (!f || f->fd < 0)
+        return -EBADF;
+    if (!f->dir) {
+        /* a dup, the DIR closes its own fd */
+        int fd = dup(f->fd);
+
+        if (fd < 0)
+            return -errno;
+        if (!(f->dir = fdopendir(fd))) {
+            close(fd);
+            return -errno;
+        }
+    }
+    /* the offset is where the last entry the client got ends */
+    if (offset)
+        seekdir(f->dir, offset);
+    else
+        rewinddir(f->dir);
+    if (count > c->out.left - 4)
+        count = c->out.left - 4;
+    countp = msg_take(&c->out, 4);
+    errno = 0;
+    while ((de = readdir(f->dir))) {
+        size_t len = P9_QID_SIZE + 8 + 1 + 2 + strlen(de->d_name);
+
+        if (used + len > count)
+            break;
+        put_qid(&c->out, de->d_type == DT_DIR ? S_IFDIR : de->d_type == DT_LNK ? S_IFLNK : 0,
+                de->d_ino);
+        put64(&c->out, telldir(f->dir));
+        put8(&c->out, de->d_type);
+        put_str(&c->out, de->d_name);
+        used += len;
+    }
+    if (!de && errno)
+        return -errno;
+    if (countp)
+        memcpy(countp, &used, sizeof(used));
+    return 0;
+}
+
+static int p9_fsync(struct p9_server *s, struct p9_call *c)
+{
+    struct p9_fid *f = fid_get(s, get32(&c->in));
+    uint32_t datasync = get32(&c->in);
+
+    if (!f || f->fd < 0)
+        return -EBADF;
+    if ((datasync ? fdatasync(f->fd) : fsync(f->fd)) < 0)
+        return -errno;
+    return 0;
+}
+
+/* Locks are the client's business, one client shares nothing with others
+ * the server would know of */
+static int p9_lock(struct p9_server *s, struct p9_call *c)
+{
+    if (!fid_get(s, get32(&c->in)))
+        return -EBADF;
+    put8(&c->out, 0); /* P9_LOCK_SUCCESS */
+    return 0;
+}
+
+static int p9_getlock(struct p9_server *s, struct p9_call *c)
+{
+    char client_id[256];
+    uint64_t start, length;
+    uint32_t proc_id;
+
+    if (!fid_get(s, get32(&c->in)))
+        return -EBADF;
+    msg_take(&c->in, 1); /* type */
+    start = get64(&c->in);
+    length = get64(&c->in);
+    proc_id = get32(&c->in);
+    get_str(&c->in, client_id, sizeof(client_id));
+    if (c->in.err)
+        return -EINVAL;
+    put8(&c->out, 2); /* P9_LOCK_TYPE_UNLCK, nobody holds it */
+    put64(&c->out, start);
+    put64(&c->out, length);
+    put32(&c->out, proc_id);
+    put_str(&c->out, client_id);
+    return 0;
+}
+
+static int p9_link(struct p9_server *s, struct p9_call *c)
+{
+    struct p9_fid *dir = fid_get(s, get32(&c->in));
+    struct p9_fid *f = fid_get(s, get32(&c->in));
+    char name[NAME_MAX + 1];
+    const char *oldname;
+    int dirfd, olddirfd, r = 0;
+
+    get_str(&c->in, name, sizeof(name));
+    if (c->in.err || !valid_name(name))
+        return -EINVAL;
+    if (!dir || !f)
+        return -EBADF;
+    if (s->readonly)
+        return -EROFS;
+    if ((olddirfd = p9_open_parent(s, f->path, &oldname)) < 0)
+        return olddirfd;
+    if ((dirfd = p9_open_dir(s, dir)) < 0) {
+        close(olddirfd);
+        return dirfd;
+    }
+    if (linkat(olddirfd, oldname, dirfd, name, 0) < 0)
+        r = -errno;
+    close(dirfd);
+    close(olddirfd);
+    return r;
+}
+
+/* Moves from to dir/name and the fids along with it */
+static int p9_move(struct p9_server *s, const char *from, struct p9_fid *dir, const char *name)
+{
+    char to[PATH_MAX];
+    const char *oldname;
+    int dirfd, olddirfd, r;
+
+    if (!valid_name(name))
+        return -EINVAL;
+    if ((r = path_join(to, dir->path, name)) < 0)
+        return r;
+    if ((olddirfd = p9_open_parent(s, from, &oldname)) < 0)
+        return olddirfd;
+    if ((dirfd = p9_open_dir(s, dir)) < 0) {
+        close(olddirfd);
+        return dirfd;
+    }
+    if (renameat(olddirfd, oldname, dirfd, name) < 0)
+        r = -errno;
+    close(dirfd);
+    close(olddirfd);
+    if (!r)
+        fids_rename(s, from, to);
+    return r;
+}
+
+static int p9_rename(struct p9_server *s, struct p9_call *c)
+{
+    struct p9_fid *f = fid_get(s, get32(&c->in));
+    struct p9_fid *dir = fid_get(s, get32(&c->in));
+    char name[NAME_MAX + 1], from[PATH_MAX];
+
+    get_str(&c->in, name, sizeof(name));
+    if (c->in.err)
+        return -EINVAL;
+    if (!f || !dir)
+        return -EBADF;
+    if (s->readonly)
+        return -EROFS;
+    /* the path of f changes under it */
+    strcpy(from, f->path);
+    return p9_move(s, from, dir, name);
+}
+
+static int p9_renameat(struct p9_server *s, struct p9_call *c)
+{
+    struct p9_fid *olddir = fid_get(s, get32(&c->in));
+    char oldname[NAME_MAX + 1], newname[NAME_MAX + 1], from[PATH_MAX];
+    struct p9_fid *dir;
+    int r;
+
+    get_str(&c->in, oldname, sizeof(oldname));
+    dir = fid_get(s, get32(&c->in));
+    get_str(&c->in, newname, sizeof(newname));
+    if (c->in.err || !valid_name(oldname))
+        return -EINVAL;
+    if (!olddir || !dir)
+        return -EBADF;
+    if (s->readonly)
+        return -EROFS;
+    if ((r = path_join(from, olddir->path, oldname)) < 0)
+        return r;
+    return p9_move(s, from, dir, newname);
+}
+
+static int p9_unlinkat(struct p9_server *s, struct p9_call *c)
+{
+    struct p9_fid *dir = fid_get(s, get32(&c->in));
+    char name[NAME_MAX + 1];
+    uint32_t flags;
+    int dirfd, r = 0;
+
+    get_str(&c->in, name, sizeof(name));
+    flags = get32(&c->in);
+    if (c->in.err || !valid_name(name))
+        return -EINVAL;
+    if (!dir)
+        return -EBADF;
+    if (s->readonly)
+        return -EROFS;
+    if ((dirfd = p9_open_dir(s, dir)) < 0)
+        return dirfd;
+    if (unlinkat(dirfd, name, flags & AT_REMOVEDIR) < 0)
+        r = -errno;
+    close(dirfd);
+    return r;
+}
+
+/* Removes the file of the fid, which is clunked either way */
+static int p9_remove(struct p9_server *s, struct p9_call *c)
+{
+    uint32_t fid = get32(&c->in);
+    struct p9_fid *f = fid_get(s, fid);
+    const char *name;
+    struct stat st;
+    int dirfd, r;
+
+    if (!f)
+        return -EBADF;
+    if (s->readonly)
+        r = -EROFS;
+    else if ((r = dirfd = p9_open_parent(s, f->path, &name)) >= 0) {
+        r = 0;
+        if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) < 0 ||
+            unlinkat(dirfd, name, S_ISDIR(st.st_mode) ? AT_REMOVEDIR : 0) < 0)
+            r = -errno;
+        close(dirfd);
+    }
+    fid_free(s, fid);
+    return r;
+}
+
+static int p9_read(struct p9_server *s, struct p9_call *c)
+{
+    struct p9_fid *f = fid_get(s, get32(&c->in));
+    uint64_t offset = get64(&c->in);
+    uint32_t count = get32(&c->in);
+    struct iovec iov[P9_MAX_IOV];
+    int niov;
+    ssize_t n;
+
+    if (c->in.err)
+        return -EINVAL;
+    if (!f || f->fd < 0)
+        return -EBADF;
+    if (count > s->msize - P9_RW_HDR_SIZE)
+        count = s->msize - P9_RW_HDR_SIZE;
+    if (c->reply_len < P9_RW_HDR_SIZE)
+        return -EINVAL;
+    if (count > c->reply_len - P9_RW_HDR_SIZE)
+        count = c->reply_len - P9_RW_HDR_SIZE;
+    /* straight into the buffers of the reply, behind its header */
+    niov = iov_slice(c->reply, c->nreply, P9_RW_HDR_SIZE, count, iov);
+    if ((n = preadv(f->fd, iov, niov, offset)) < 0)
+        return -errno;
+    put32(&c->out, n);
+    c->data = n;
+    s->stats.read_bytes += n;
+    return 0;
+}
+
+static int p9_write(struct p9_server *s, struct p9_call *c)
+{
+    struct p9_fid *f = fid_get(s, get32(&c->in));
+    uint64_t offset = get64(&c->in);
+    uint32_t count = get32(&c->in);
+    struct iovec iov[P9_MAX_IOV];
+    int niov;
+    ssize_t n;
+
+    if (c->in.err || P9_TWRITE_HDR_SIZE + (size_t) count > c->req_len)
+        return -EINVAL;
+    if (!f || f->fd < 0)
+        return -EBADF;
+    if (s->readonly)
+        return -EROFS;
+    /* straight from the buffers of the request */
+    niov = iov_slice(c->req, c->nreq, P9_TWRITE_HDR_SIZE, count, iov);
+    if ((n = pwritev(f->fd, iov, niov, offset)) < 0)
+        return -errno;
+    put32(&c->out, n);
+    s->stats.write_bytes += n;
+    return 0;
+}
+
+static int p9_clunk(struct p9_server *s, struct p9_call *c)
+{
+    return fid_free(s, get32(&c->in));
+}
+
+static int p9_dispatch(struct p9_server *s, uint8_t type, struct p9_call *c)
+{
+    switch (type) {
+    case P9_TVERSION:
+        return p9_version(s, c);
+    case P9_TATTACH:
+        return p9_attach(s, c);
+    case P9_TWALK:
+        return p9_walk(s, c);
+    case P9_TGETATTR:
+        return p9_getattr(s, c);
+    case P9_TSETATTR:
+        return p9_setattr(s, c);
+    case P9_TLOPEN:
+        return p9_lopen(s, c);
+    case P9_TLCREATE:
+        return p9_lcreate(s, c);
+    case P9_TSYMLINK:
+        return p9_symlink(s, c);
+    case P9_TMKNOD:
+        return p9_mknod(s, c);
+    case P9_TMKDIR:
+        return p9_mkdir(s, c);
+    case P9_TREADLINK:
+        return p9_readlink(s, c);
+    case P9_TSTATFS:
+        return p9_statfs(s, c);
+    case P9_TREADDIR:
+        return p9_readdir(s, c);
+    case P9_TFSYNC:
+        return p9_fsync(s, c);
+    case P9_TLOCK:
+        return p9_lock(s, c);
+    case P9_TGETLOCK:
+        return p9_getlock(s, c);
+    case P9_TLINK:
+        return p9_link(s, c);
+    case P9_TRENAME:
+        return p9_rename(s, c);
+    case P9_TRENAMEAT:
+        return p9_renameat(s, c);
+    case P9_TUNLINKAT:
+        return p9_unlinkat(s, c);
+    case P9_TREMOVE:
+        return p9_remove(s, c);
+    case P9_TREAD:
+        return p9_read(s, c);
+    case P9_TWRITE:
+        return p9_write(s, c);
+    case P9_TCLUNK:
+        return p9_clunk(s, c);
+    case P9_TFLUSH:
+        /* requests are served one at a time, none is left to cancel */
+        return 0;
+    default:
+        /* Tauth and the xattrs among them */
+        return -EOPNOTSUPP;
+    }
+}
+
+uint32_t p9_server_handle(struct p9_server *s,
+                          const struct iovec *req,
+                          int nreq,
+                          const struct iovec *reply,
+                          int nreply)
+{
+    struct p9_call c = {
+        .req = req,
+        .nreq = nreq,
+        .reply = reply,
+        .nreply = nreply,
+        .reply_len = iov_total(reply, nreply),
+    };
+    size_t avail = iov_total(req, nreq), copy;
+    uint32_t size, out_len;
+    uint16_t tag;
+    uint8_t type;
+    int r;
+
+    if (iov_copy(req, nreq, s->req, P9_HDR_SIZE, false) < P9_HDR_SIZE)
+        return 0;
+    memcpy(&size, s->req, 4);
+    type = s->req[4];
+    memcpy(&tag, s->req + 5, 2);
+    if (size < P9_HDR_SIZE || size > avail || c.reply_len < P9_HDR_SIZE + 4)
+        return 0;
+    c.req_len = size;
+    /* the data of a Twrite stays where it is */
+    copy = type == P9_TWRITE ? P9_TWRITE_HDR_SIZE : size;
+    if (copy > size)
+        copy = size;
+    if (copy > s->msize)
+        copy = s->msize;
+    iov_copy(req, nreq, s->req, copy, false);
+    c.in = (struct p9_msg){.p = s->req + P9_HDR_SIZE, .left = copy - P9_HDR_SIZE};
+    /* the reply is built here, but for the data of an Rread */
+    out_len = c.reply_len < s->msize ? c.reply_len : s->msize;
+    c.out = (struct p9_msg){.p = s->reply + P9_HDR_SIZE, .left = out_len - P9_HDR_SIZE};
+
+    s->stats.requests++;
+    r = p9_dispatch(s, type, &c);
+    if (!r && c.out.err)
+        r = -ENOBUFS;
+    if (r < 0) {
+        s->stats.errors++;
+        c.data = 0;
+        c.out = (struct p9_msg){.p = s->reply + P9_HDR_SIZE, .left = 4};
+        put32(&c.out, -r);
+        type = P9_RLERROR - 1;
+    }
+    out_len = c.out.p - s->reply;
+    size = out_len + c.data;
+    memcpy(s->reply, &size, 4);
+    s->reply[4] = type + 1;
+    memcpy(s->reply + 5, &tag, 2);
+    iov_copy(reply, nreply, s->reply, out_len, true);
+    return size;
+}
+
+int p9_server_init(struct p9_server *s, const char *root, bool readonly)
+{
+    memset(s, 0, sizeof(*s));
+    s->readonly = readonly;
+    s->msize = P9_MAX_MSIZE;
+    s->root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (s->root_fd < 0) {
+        perror(root);
+        return -1;
+    }
+    s->req = malloc(P9_MAX_MSIZE);
+    s->reply = malloc(P9_MAX_MSIZE);
+    if (!s->req || !s->reply) {
+        p9_server_exit(s);
+        return -1;
+    }
+    return 0;
+}
+
+void p9_server_exit(struct p9_server *s)
+{
+    fid_free_all(s);
+    free(s->req);
+    free(s->reply);
+    if (s->root_fd >= 0)
+        close(s->root_fd);
+    s->req = s->reply = NULL;
+    s->root_fd = -1;
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <dirent.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/* A 9P2000.L server over a host directory, what a Linux guest mounts with
+ * "mount -t 9p -o trans=virtio,version=9p2000.L <tag> <dir>" (see
+ * virtio-9p.h for the transport). Paths are resolved by openat2() beneath
+ * the directory without following symlinks, the client resolves those
+ * itself, so nothing outside of the directory is reachable. Files are
+ * accessed with the credentials of the hypervisor.
+ *
+ * Reads and writes go between the file and the buffers of the request
+ * directly (preadv/pwritev on the iovecs of the transport), the data is
+ * not copied through the server.
+ */
+
+#define P9_VERSION "9P2000.L"
+#define P9_MAX_MSIZE (64 * 1024) /* fits a chain of VIRTQ_CHAIN_MAX_IOV pages */
+#define P9_HDR_SIZE 7 /* size[4] type[1] tag[2] */
+#define P9_NOFID 0xffffffffU
+#define P9_FID_BUCKETS 256
+#define P9_MAX_FIDS 65536
+
+/* message types of 9P2000.L, a reply is its request + 1 */
+enum p9_type {
+    P9_RLERROR = 7,
+    P9_TSTATFS = 8,
+    P9_TLOPEN = 12,
+    P9_TLCREATE = 14,
+    P9_TSYMLINK = 16,
+    P9_TMKNOD = 18,
+    P9_TRENAME = 20,
+    P9_TREADLINK = 22,
+    P9_TGETATTR = 24,
+    P9_TSETATTR = 26,
+    P9_TXATTRWALK = 30,
+    P9_TXATTRCREATE = 32,
+    P9_TREADDIR = 40,
+    P9_TFSYNC = 50,
+    P9_TLOCK = 52,
+    P9_TGETLOCK = 54,
+    P9_TLINK = 70,
+    P9_TMKDIR = 72,
+    P9_TRENAMEAT = 74,
+    P9_TUNLINKAT = 76,
+    P9_TVERSION = 100,
+    P9_TAUTH = 102,
+    P9_TATTACH = 104,
+    P9_TFLUSH = 108,
+    P9_TWALK = 110,
+    P9_TREAD = 116,
+    P9_TWRITE = 118,
+    P9_TCLUNK = 120,
+    P9_TREMOVE = 122,
+};
+
+#define P9_QTDIR 0x80
+#define P9_QTSYMLINK 0x02
+#define P9_QID_SIZE 13 /* type[1] version[4] path[8] */
+#define P9_MAX_WALK 16 /* names of one Twalk */
+
+/* valid bits of Tsetattr */
+#define P9_SETATTR_MODE 0x1
+#define P9_SETATTR_UID 0x2
+#define P9_SETATTR_GID 0x4
+#define P9_SETATTR_SIZE 0x8
+#define P9_SETATTR_ATIME 0x10
+#define P9_SETATTR_MTIME 0x20
+#define P9_SETATTR_ATIME_SET 0x80
+#define P9_SETATTR_MTIME_SET 0x100
+#define P9_GETATTR_BASIC 0x7ffULL
+
+struct p9_fid {
+    uint32_t fid;
+    char *path; /* beneath the root, "." for the root itself */
+    uint32_t uid; /* the client acts for, from Tattach */
+    int fd; /* -1 until Tlopen or Tlcreate */
+    DIR *dir; /* a directory being read */
+    struct p9_fid *next; /* in its bucket */
+};
+
+struct p9_stats {
+    uint64_t requests;
+    uint64_t errors; /* Rlerror replies */
+    uint64_t read_bytes;
+    uint64_t write_bytes;
+};
+
+/* Serves one client, from one thread */
+struct p9_server {
+    int root_fd;
+    bool readonly;
+    uint32_t msize; /* agreed on by Tversion */
+    uint32_t nfids;
+    struct p9_fid *fids[P9_FID_BUCKETS];
+    uint8_t *req; /* the request, but the data of a Twrite */
+    uint8_t *reply; /* the reply, but the data of an Rread */
+    struct p9_stats stats;
+};
+
+/* Returns 0 on success */
+int p9_server_init(struct p9_server *s, const char *root, bool readonly);
+void p9_server_exit(struct p9_server *s);
+/* Serves the request in req and writes the reply into reply. Returns the
+ * length of the reply, 0 for a request too short to answer */
+uint32_t p9_server_handle(struct p9_server *s,
+                          const struct iovec *req,
+                          int nreq,
+                          const struct iovec *reply,
+                          int nreply);
@@ -0,0 +1,451 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "p9.h"
+
+/* Checks and throughput of the 9P2000.L server behind virtio-9p, driven with
+ * the messages the Linux client sends, no guest needed. The replies land in
+ * scattered buffers as they do in a descriptor chain. The checks cover the
+ * calls a mount, ls, cp, mv and rm make and the ways out of the shared
+ * directory the server has to refuse. The throughput is that of Tread and
+ * Twrite of msize against pread and pwrite of the same sizes on the file.
+ */
+
+#define BENCH_MSIZE P9_MAX_MSIZE
+#define BENCH_CHUNK (BENCH_MSIZE - 23) /* the data of a Twrite of msize */
+#define ROOT_FID 1
+
+struct p9bench {
+    struct p9_server server;
+    char dir[4096];
+    uint64_t size;
+    uint8_t tx[BENCH_MSIZE];
+    uint8_t rx[BENCH_MSIZE];
+    size_t tx_len;
+    uint8_t *rp; /* the next field of the reply in rx */
+    uint32_t rx_len;
+    uint8_t *data; /* of Tread and Twrite */
+    int failed;
+};
+
+static uint64_t bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void check(struct p9bench *b, bool ok, const char *what)
+{
+    if (!ok) {
+        printf("FAILED: %s\n", what);
+        b->failed = 1;
+    }
+}
+
+static void tx_begin(struct p9bench *b)
+{
+    b->tx_len = P9_HDR_SIZE;
+}
+
+static void tx_n(struct p9bench *b, uint64_t v, size_t len)
+{
+    memcpy(b->tx + b->tx_len, &v, len);
+    b->tx_len += len;
+}
+
+static void tx_str(struct p9bench *b, const char *str)
+{
+    tx_n(b, strlen(str), 2);
+    memcpy(b->tx + b->tx_len, str, strlen(str));
+    b->tx_len += strlen(str);
+}
+
+static uint64_t rx_n(struct p9bench *b, size_t len)
+{
+    uint64_t v = 0;
+
+    memcpy(&v, b->rp, len);
+    b->rp += len;
+    return v;
+}
+
+/* Sends the message built since tx_begin, with data behind it for a
+ * Twrite. The reply goes into three buffers, the first one shorter than a
+ * header. Returns the type of the reply */
+static uint8_t call(struct p9bench *b, uint8_t type, const void *data, uint32_t data_len)
+{
+    uint32_t size = b->tx_len + data_len;
+    uint16_t tag = 1;
+    struct iovec req[2] = {
+        {.iov_base = b->tx, .iov_len = b->tx_len},
+        {.iov_base = (void *) data, .iov_len = data_len},
+    };
+    struct iovec reply[3] = {
+        {.iov_base = b->rx, .iov_len = 3},
+        {.iov_base = b->rx + 3, .iov_len = 100},
+        {.iov_base = b->rx + 103, .iov_len = sizeof(b->rx) - 103},
+    };
+
+    memcpy(b->tx, &size, 4);
+    b->tx[4] = type;
+    memcpy(b->tx + 5, &tag, 2);
+    b->rx_len = p9_server_handle(&b->server, req, data_len ? 2 : 1, reply, 3);
+    b->rp = b->rx + P9_HDR_SIZE;
+    if (b->rx_len < P9_HDR_SIZE || memcmp(b->rx + 5, &tag, 2))
+        return 0;
+    return b->rx[4];
+}
+
+/* 0 on success, the errno of an Rlerror */
+static int call_err(struct p9bench *b, uint8_t type)
+{
+    uint8_t rtype = call(b, type, NULL, 0);
+
+    if (rtype == P9_RLERROR)
+        return rx_n(b, 4);
+    return rtype == type + 1 ? 0 : -1;
+}
+
+static int walk(struct p9bench *b, uint32_t fid, uint32_t newfid, int n, const char **names, int *nwqid)
+{
+    int r;
+
+    tx_begin(b);
+    tx_n(b, fid, 4);
+    tx_n(b, newfid, 4);
+    tx_n(b, n, 2);
+    for (int i = 0; i < n; i++)
+        tx_str(b, names[i]);
+    r = call_err(b, P9_TWALK);
+    if (!r && nwqid)
+        *nwqid = rx_n(b, 2);
+    return r;
+}
+
+static int walk1(struct p9bench *b, uint32_t newfid, const char *name)
+{
+    int nwqid = 0;
+    int r = walk(b, ROOT_FID, newfid, name ? 1 : 0, &name, &nwqid);
+
+    return r ? r : (name && nwqid != 1 ? ENOENT : 0);
+}
+
+static int clunk(struct p9bench *b, uint32_t fid)
+{
+    tx_begin(b);
+    tx_n(b, fid, 4);
+    return call_err(b, P9_TCLUNK);
+}
+
+static int lopen(struct p9bench *b, uint32_t fid, uint32_t flags)
+{
+    tx_begin(b);
+    tx_n(b, fid, 4);
+    tx_n(b, flags, 4);
+    return call_err(b, P9_TLOPEN);
+}
+
+static int lcreate(struct p9bench *b, uint32_t fid, const char *name)
+{
+    tx_begin(b);
+    tx_n(b, fid, 4);
+    tx_str(b, name);
+    tx_n(b, O_RDWR, 4);
+    tx_n(b, 0644, 4);
+    tx_n(b, getgid(), 4);
+    return call_err(b, P9_TLCREATE);
+}
+
+static int mkdir_at(struct p9bench *b, uint32_t fid, const char *name)
+{
+    tx_begin(b);
+    tx_n(b, fid, 4);
+    tx_str(b, name);
+    tx_n(b, 0755, 4);
+    tx_n(b, getgid(), 4);
+    return call_err(b, P9_TMKDIR);
+}
+
+static int unlink_at(struct p9bench *b, uint32_t fid, const char *name, uint32_t flags)
+{
+    tx_begin(b);
+    tx_n(b, fid, 4);
+    tx_str(b, name);
+    tx_n(b, flags, 4);
+    return call_err(b, P9_TUNLINKAT);
+}
+
+/* Returns the bytes written, -errno */
+static int64_t p9_write(struct p9bench *b, uint32_t fid, uint64_t offset, const void *data, uint32_t len)
+{
+    uint8_t rtype;
+
+    tx_begin(b);
+    tx_n(b, fid, 4);
+    tx_n(b, offset, 8);
+    tx_n(b, len, 4);
+    rtype = call(b, P9_TWRITE, data, len);
+    if (rtype != P9_TWRITE + 1)
+        return rtype == P9_RLERROR ? -(int64_t) rx_n(b, 4) : -EPROTO;
+    return rx_n(b, 4);
+}
+
+/* Returns the bytes read, which are at b->rp, -errno */
+static int64_t p9_read(struct p9bench *b, uint32_t fid, uint64_t offset, uint32_t len)
+{
+    uint8_t rtype;
+
+    tx_begin(b);
+    tx_n(b, fid, 4);
+    tx_n(b, offset, 8);
+    tx_n(b, len, 4);
+    rtype = call(b, P9_TREAD, NULL, 0);
+    if (rtype != P9_TREAD + 1)
+        return rtype == P9_RLERROR ? -(int64_t) rx_n(b, 4) : -EPROTO;
+    return rx_n(b, 4);
+}
+
+static uint64_t getattr_size(struct p9bench *b, uint32_t fid)
+{
+    tx_begin(b);
+    tx_n(b, fid, 4);
+    tx_n(b, P9_GETATTR_BASIC, 8);
+    if (call_err(b, P9_TGETATTR))
+        return UINT64_MAX;
+    /* valid, qid, mode, uid, gid, nlink, rdev, then size */
+    b->rp += 8 + P9_QID_SIZE + 12 + 16;
+    return rx_n(b, 8);
+}
+
+/* Whether a directory read from the start names all of names */
+static bool readdir_has(struct p9bench *b, uint32_t fid, const char **names, int n)
+{
+    int found = 0;
+    uint32_t count;
+    uint8_t *end;
+
+    tx_begin(b);
+    tx_n(b, fid, 4);
+    tx_n(b, 0, 8);
+    tx_n(b, 8192, 4);
+    if (call_err(b, P9_TREADDIR))
+        return false;
+    count = rx_n(b, 4);
+    end = b->rp + count;
+    while (b->rp < end) {
+        uint16_t len;
+
+        b->rp += P9_QID_SIZE + 8 + 1;
+        len = rx_n(b, 2);
+        for (int i = 0; i < n; i++)
+            if (strlen(names[i]) == len && !memcmp(b->rp, names[i], len))
+                found++;
+        b->rp += len;
+    }
+    return found == n;
+}
+
+static void checks(struct p9bench *b)
+{
+    const char *escape[] = {"escape", "passwd"};
+    const char *up[] = {"..", "..", "etc"};
+    const char *moved[] = {"dir", "b.txt"};
+    const char *both[] = {"a.txt", "dir"};
+    char path[4096 + 32];
+    int nwqid = 0;
+
+    tx_begin(b);
+    tx_n(b, BENCH_MSIZE * 2, 4);
+    tx_str(b, "9P2000.L");
+    check(b, call_err(b, P9_TVERSION) == 0 && rx_n(b, 4) == BENCH_MSIZE, "Tversion");
+    tx_begin(b);
+    tx_n(b, ROOT_FID, 4);
+    tx_n(b, P9_NOFID, 4);
+    tx_str(b, "root");
+    tx_str(b, "");
+    tx_n(b, getuid(), 4);
+    check(b, call_err(b, P9_TATTACH) == 0 && rx_n(b, 1) == P9_QTDIR, "Tattach");
+
+    check(b, walk1(b, 2, "missing") == ENOENT, "a walk to a missing file fails");
+    check(b, walk1(b, 2, NULL) == 0 && lcreate(b, 2, "a.txt") == 0, "Tlcreate");
+    check(b, p9_write(b, 2, 0, "hello 9p", 8) == 8, "Twrite");
+    check(b, walk1(b, 3, "a.txt") == 0 && lopen(b, 3, O_RDONLY) == 0, "Tlopen");
+    check(b, p9_read(b, 3, 0, 100) == 8 && !memcmp(b->rp, "hello 9p", 8), "Tread");
+    check(b, getattr_size(b, 3) == 8, "Tgetattr");
+    check(b, walk1(b, 4, NULL) == 0 && mkdir_at(b, 4, "dir") == 0, "Tmkdir");
+    check(b, lopen(b, 4, O_RDONLY | O_DIRECTORY) == 0 && readdir_has(b, 4, both, 2), "Treaddir");
+
+    /* a.txt to dir/b.txt, the open fid of a.txt follows it */
+    tx_begin(b);
+    tx_n(b, ROOT_FID, 4);
+    tx_str(b, "a.txt");
+    tx_n(b, ROOT_FID, 4);
+    tx_str(b, "b.txt");
+    check(b, call_err(b, P9_TRENAMEAT) == 0, "Trenameat");
+    check(b, walk1(b, 5, "dir") == 0, "a walk to a directory");
+    tx_begin(b);
+    tx_n(b, 3, 4);
+    tx_n(b, 5, 4);
+    tx_str(b, "b.txt");
+    check(b, call_err(b, P9_TRENAME) == 0, "Trename");
+    check(b, walk(b, ROOT_FID, 6, 2, moved, &nwqid) == 0 && nwqid == 2 && getattr_size(b, 6) == 8,
+          "a walk to the renamed file");
+    clunk(b, 6);
+    check(b, walk(b, 3, 6, 0, NULL, NULL) == 0 && getattr_size(b, 6) == 8, "a fid follows its file");
+
+    /* nothing beyond the shared directory */
+    snprintf(path, sizeof(path), "%s/escape", b->dir);
+    check(b, symlink("/etc", path) == 0, "symlink");
+    check(b, walk(b, ROOT_FID, 7, 2, escape, &nwqid) != 0 || nwqid < 2, "a walk through a symlink is refused");
+    check(b, walk1(b, 7, "escape") == 0 && lopen(b, 7, O_RDONLY) == ELOOP, "a symlink is not opened");
+    check(b, walk(b, ROOT_FID, 8, 3, up, &nwqid) != 0 || nwqid < 3, "\"..\" stays in the shared directory");
+    tx_begin(b);
+    tx_n(b, ROOT_FID, 4);
+    tx_str(b, "sda");
+    tx_n(b, S_IFBLK | 0600, 4);
+    tx_n(b, 8, 4);
+    tx_n(b, 0, 4);
+    tx_n(b, getgid(), 4);
+    check(b, call_err(b, P9_TMKNOD) == EPERM, "no device nodes");
+    tx_begin(b);
+    tx_n(b, ROOT_FID, 4);
+    tx_str(b, "../x");
+    tx_n(b, O_RDWR, 4);
+    tx_n(b, 0644, 4);
+    tx_n(b, getgid(), 4);
+    check(b, walk1(b, 9, NULL) == 0 && call_err(b, P9_TLCREATE) == EINVAL, "no names with a slash");
+
+    check(b, unlink_at(b, 5, "b.txt", 0) == 0, "Tunlinkat of a file");
+    check(b, unlink_at(b, ROOT_FID, "dir", AT_REMOVEDIR) == 0, "Tunlinkat of a directory");
+    check(b, unlink_at(b, ROOT_FID, "escape", 0) == 0, "Tunlinkat of a symlink");
+    for (uint32_t fid = 2; fid < 10; fid++)
+        clunk(b, fid);
+    check(b, b->server.nfids == 1, "Tclunk");
+}
+
+static void readonly_checks(struct p9bench *b)
+{
+    struct p9_server rw = b->server;
+
+    if (p9_server_init(&b->server, b->dir, true) < 0) {
+        b->server = rw;
+        check(b, false, "a read only server");
+        return;
+    }
+    tx_begin(b);
+    tx_n(b, ROOT_FID, 4);
+    tx_n(b, P9_NOFID, 4);
+    tx_str(b, "root");
+    tx_str(b, "");
+    tx_n(b, getuid(), 4);
+    call_err(b, P9_TATTACH);
+    check(b, walk1(b, 2, NULL) == 0 && lcreate(b, 2, "ro.txt") == EROFS, "a read only share refuses Tlcreate");
+    check(b, mkdir_at(b, ROOT_FID, "ro") == EROFS, "a read only share refuses Tmkdir");
+    check(b, walk1(b, 3, "big") == 0 && lopen(b, 3, O_RDWR) == EROFS, "a read only share refuses writers");
+    p9_server_exit(&b->server);
+    b->server = rw;
+}
+
+static void throughput(struct p9bench *b)
+{
+    char path[4096 + 32];
+    uint64_t start, ns[4];
+    uint32_t chunk = BENCH_CHUNK;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/big", b->dir);
+    fd = open(path, O_RDWR);
+    check(b, fd >= 0 && walk1(b, 10, "big") == 0 && lopen(b, 10, O_RDWR) == 0, "Tlopen of the big file");
+    for (int i = 0; i < 2; i++) {
+        bool ok = true;
+
+        start = bench_now();
+        for (uint64_t off = 0; off + chunk <= b->size; off += chunk)
+            ok &= (i ? pwrite(fd, b->data, chunk, off) : p9_write(b, 10, off, b->data, chunk)) == chunk;
+        ns[i] = bench_now() - start;
+        check(b, ok, i ? "pwrite" : "Twrite of msize");
+    }
+    for (int i = 0; i < 2; i++) {
+        bool ok = true;
+
+        start = bench_now();
+        for (uint64_t off = 0; off + chunk <= b->size; off += chunk)
+            ok &= (i ? pread(fd, b->data, chunk, off) : p9_read(b, 10, off, chunk)) == chunk;
+        ns[2 + i] = bench_now() - start;
+        check(b, ok, i ? "pread" : "Tread of msize");
+    }
+    printf("%lu MB in %u byte requests, MB/s:\n", b->size >> 20, chunk);
+    printf("  write: 9p %.0f, pwrite %.0f\n", b->size / 1e6 / (ns[0] / 1e9), b->size / 1e6 / (ns[1] / 1e9));
+    printf("  read:  9p %.0f, pread %.0f\n", b->size / 1e6 / (ns[2] / 1e9), b->size / 1e6 / (ns[3] / 1e9));
+    clunk(b, 10);
+    if (fd >= 0)
+        close(fd);
+}
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [-m <MiB>] [-d <dir>]\n", prog);
+    printf("  -m  size of the file read and written (default 256)\n");
+    printf("  -d  directory the shared directory is made in (default /tmp)\n");
+}
+
+int main(int argc, char **argv)
+{
+    static struct p9bench b = {.size = 256ULL << 20};
+    const char *parent = "/tmp";
+    char path[4096 + 32];
+    int opt, fd;
+
+    while ((opt = getopt(argc, argv, "m:d:")) != -1) {
+        switch (opt) {
+        case 'm':
+            b.size = strtoull(optarg, NULL, 10) << 20;
+            break;
+        case 'd':
+            parent = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!b.size) {
+        usage(argv[0]);
+        return 1;
+    }
+    snprintf(b.dir, sizeof(b.dir), "%s/p9bench.XXXXXX", parent);
+    if (!mkdtemp(b.dir)) {
+        perror(b.dir);
+        return 1;
+    }
+    snprintf(path, sizeof(path), "%s/big", b.dir);
+    b.data = malloc(BENCH_CHUNK);
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (!b.data || fd < 0 || ftruncate(fd, b.size) < 0 || p9_server_init(&b.server, b.dir, false) < 0) {
+        perror("p9bench");
+        return 1;
+    }
+    close(fd);
+    memset(b.data, 0x9b, BENCH_CHUNK);
+
+    checks(&b);
+    readonly_checks(&b);
+    throughput(&b);
+    printf("%lu requests, %lu errors\n", b.server.stats.requests, b.server.stats.errors);
+
+    p9_server_exit(&b.server);
+    unlink(path);
+    rmdir(b.dir);
+    free(b.data);
+    printf(b.failed ? "p9bench: FAILED\n" : "p9bench: all checks passed\n");
+    return b.failed;
+}
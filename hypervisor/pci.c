@@ -1,7 +1,9 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "pci.h"
+#include "trace.h"
 #include "utils.h"
 
 /**
@@ -187,6 +189,8 @@ static void pci_config_read(pci_dev_t* dev, void* data, uint64_t offset, uint8_t
 static void pci_config_do_io(void* owner, void* data, uint8_t is_write, uint64_t offset, uint8_t size)
 {
     pci_dev_t* dev = (pci_dev_t*) owner;
+    uint32_t value = 0;
+
     if (is_write)
     {
         pci_config_write(dev, data, offset, size);
@@ -195,6 +199,8 @@ static void pci_config_do_io(void* owner, void* data, uint8_t is_write, uint64_t
     {
         pci_config_read(dev, data, offset, size);
     }
+    memcpy(&value, data, size < sizeof(value) ? size : sizeof(value));
+    TRACE(TRACE_PCI_CONFIG, offset | size << 16 | is_write << 24, value, dev->hdr.device_id);
 }
 
 /**
@@ -215,11 +221,35 @@ static void pci_data_io(void* owner, void* data, uint8_t is_write, uint64_t offs
     pci_t* pci = (pci_t*) owner;
     if (pci->pci_addr.enable_bit) 
     {
-        uint64_t addr = (pci->pci_addr.value | offset) & ~(PCI_ADDR_ENABLE_BIT);
+        uint64_t addr = PCI_ECAM_OFFSET(pci->pci_addr.bus_num, pci->pci_addr.dev_num, pci->pci_addr.func_num) |
+                        (pci->pci_addr.reg_num << 2 | offset);
         bus_handle_io(&pci->pci_bus, data, is_write, addr, size);
     }
 }
 
+/**
+ * @brief Handles MMIO access to the ECAM window.
+ *
+ *  The offset in the window is the offset on the PCI bus, so one access is one lookup of the
+ *  device, without the address register. Reads of a missing function return all ones.
+ *
+ * @param owner Pointer to the pci_t structure (PCI bus controller).
+ * @param data Pointer to the data being read or written.
+ * @param is_write Boolean flag indicating whether the operation is a write (1) or a read (0).
+ * @param offset Byte offset within the ECAM window.
+ * @param size Number of bytes being accessed.
+ */
+static void pci_ecam_io(void* owner, void* data, uint8_t is_write, uint64_t offset, uint8_t size)
+{
+    pci_t* pci = (pci_t*) owner;
+
+    if (!is_write)
+    {
+        memset(data, 0xff, size);
+    }
+    bus_handle_io(&pci->pci_bus, data, is_write, offset, size);
+}
+
 /**
  * @brief Handles MMIO access to PCI devices directly.
  *
@@ -253,7 +283,7 @@ void pci_set_bar(pci_dev_t* dev, uint8_t bar_num, uint32_t bar_size, bool is_io_
 {
     /* TODO: mem type, prefetch */
     /* FIXME: bar_size must be power of 2 */
-    printf("[SET BAR] bar: %d bar_size: 0x%x is_io_space: %d\n", bar_num, bar_size, is_io_space);
+    TRACE(TRACE_PCI_BAR, bar_num | is_io_space << 8, bar_size, dev->hdr.device_id);
     dev->hdr.bars[bar_num] = is_io_space;
     dev->bar_size[bar_num] = bar_size;
     dev->bar_is_io_space[bar_num] = is_io_space;
@@ -282,24 +312,64 @@ void pci_dev_init(pci_dev_t* dev, pci_t* pci, bus_t* io_bus, bus_t* mmio_bus)
 /**
  * @brief Registers a PCI device with the PCI bus.
  *
- *  This function registers the device's configuration space with the PCI bus.
+ *  This function registers the device's configuration space with the PCI bus, at the lowest
+ *  device number of bus 0 that is free.
  *
  * @param dev Pointer to the pci_dev_t structure representing the PCI device.
+ * @return 0 on success, -1 when all the device numbers of bus 0 are taken.
  */
-void pci_dev_register(pci_dev_t* dev)
+int pci_dev_register(pci_dev_t* dev)
 {
     /* FIXEME: It just simplifies the registration on pci bus 0 */
-    /* FIXEME: dev_num might exceed 32 */
-    union pci_config_address addr = {.dev_num = dev->pci_bus->dev_count};
-    dev_init(&dev->config_dev, addr.value, PCI_CFG_SPACE_SIZE, dev, pci_config_do_io);
+    pci_t* pci = container_of(dev->pci_bus, pci_t, pci_bus);
+    int slot = 0;
+
+    // the device count of the bus goes down when a device leaves it, so it can't name a free slot
+    while (slot < PCI_MAX_SLOTS && (pci->slots & (1U << slot)))
+    {
+        slot++;
+    }
+    if (slot == PCI_MAX_SLOTS)
+    {
+        printf("No free slot on PCI bus 0\n");
+        return -1;
+    }
+    pci->slots |= 1U << slot;
+    dev->slot = slot;
+    dev_init(&dev->config_dev, PCI_ECAM_OFFSET(0, slot, 0), PCI_CFG_SPACE_EXP_SIZE, dev,
+             pci_config_do_io);
     bus_register_dev(dev->pci_bus, &dev->config_dev);
+    return 0;
+}
+
+/**
+ * @brief Registers the host bridge as device 0.
+ *
+ *  Linux checks for a host bridge before it trusts the config ports, and without ACPI it finds
+ *  the ECAM window in the PCIEXBAR of a known one. The window is fixed, writing PCIEXBAR does not
+ *  move it.
+ *
+ * @param pci Pointer to the pci_t structure (PCI bus controller).
+ */
+static void pci_host_bridge_init(pci_t* pci)
+{
+    pci_dev_t* dev = &pci->host_bridge;
+    uint32_t pciexbar = PCI_ECAM_START | PCI_PCIEXBAR_64M | PCI_PCIEXBAR_EN;
+
+    pci_dev_init(dev, pci, NULL, NULL); // no BARs
+    dev->hdr.vendor_id = PCI_HOST_BRIDGE_VENDOR_ID;
+    dev->hdr.device_id = PCI_HOST_BRIDGE_DEVICE_ID;
+    dev->hdr.class_id.class_id = PCI_HOST_BRIDGE_CLASS << 8;
+    dev->hdr.header_type = PCI_HEADER_TYPE_NORMAL;
+    memcpy((uint8_t*) &dev->hdr + PCI_HOST_BRIDGE_PCIEXBAR, &pciexbar, sizeof(pciexbar));
+    pci_dev_register(dev);
 }
 
 /**
  * @brief Initializes the PCI bus controller.
  *
  *  This function initializes the PCI bus controller, including the address register,
- *  the data register, and the MMIO region.
+ *  the data register, the ECAM window, the MMIO region and the host bridge.
  *
  * @param pci Pointer to the pci_t structure to initialize.
  */
@@ -307,6 +377,9 @@ void pci_init(pci_t* pci)
 {
     dev_init(&pci->pci_addr_dev, PCI_CONFIG_ADDR, sizeof(uint32_t), pci, pci_address_io);
     dev_init(&pci->pci_data_dev, PCI_CONFIG_DATA, sizeof(uint32_t), pci, pci_data_io);
+    dev_init(&pci->pci_ecam_dev, PCI_ECAM_START, PCI_ECAM_SIZE, pci, pci_ecam_io);
     dev_init(&pci->pci_mmio_dev, 0, PCI_MMIO_SIZE, pci, pci_mmio_io); // FIXME: might be useless because we only support x86
     bus_init(&pci->pci_bus);
+    pci->slots = 0;
+    pci_host_bridge_init(pci);
 }
\ No newline at end of file
@@ -12,6 +12,22 @@
 #define PCI_STD_NUM_BARS 6
 #define PCI_CFG_HDR_SIZE 64
 #define PCI_ADDR_ENABLE_BIT (1UL << 31)
+#define PCI_MAX_SLOTS 32 // device numbers of a bus
+
+/*
+ECAM (MMCONFIG): the 4K config space of every function mapped in one MMIO window, one exit per
+access instead of two port exits. the window is the PCIEXBAR of an 82945G host bridge, which
+Linux reads when there are no ACPI tables, and it is reserved in the e820 map
+*/
+#define PCI_ECAM_START 0xe0000000UL // on a 256M boundary, as the 945G wants it
+#define PCI_ECAM_SIZE (64UL << 20) // the smallest window PCIEXBAR describes, buses 0 to 63
+#define PCI_ECAM_OFFSET(bus, dev, func) (((uint64_t) (bus) << 20) | ((dev) << 15) | ((func) << 12))
+#define PCI_HOST_BRIDGE_VENDOR_ID 0x8086
+#define PCI_HOST_BRIDGE_DEVICE_ID 0x2770 // 82945G/GZ/P/PL memory controller hub
+#define PCI_HOST_BRIDGE_CLASS 0x060000 // bridge, host
+#define PCI_HOST_BRIDGE_PCIEXBAR 0x48
+#define PCI_PCIEXBAR_EN (1 << 0)
+#define PCI_PCIEXBAR_64M (2 << 1)
 
 typedef union pci_config_address
 {
@@ -69,6 +85,7 @@ typedef struct pci_config_hdr {
     uint8_t min_grant;         // Offset 0x3E
     uint8_t max_latency;       // Offset 0x3F
     uint8_t caps_space[PCI_CFG_SPACE_SIZE - PCI_CFG_HDR_SIZE];
+    uint8_t ext_caps_space[PCI_CFG_SPACE_EXP_SIZE - PCI_CFG_SPACE_SIZE]; // only through ECAM
 } pci_config_hdr_t;
 
 #pragma pack(pop) // Restore default padding
@@ -80,10 +97,11 @@ typedef struct pci_dev
     bool bar_active[PCI_STD_NUM_BARS];
     bool bar_is_io_space[PCI_STD_NUM_BARS];
     device_t space_dev[PCI_STD_NUM_BARS];
-    device_t config_dev;
+    device_t config_dev; // at its ECAM offset on the pci bus
     struct bus *io_bus;
     struct bus *mmio_bus;
     struct bus *pci_bus;
+    uint8_t slot; // the device number on bus 0, set by pci_dev_register
 } pci_dev_t;
 
 typedef struct pci 
@@ -93,10 +111,13 @@ typedef struct pci
     device_t pci_data_dev;
     device_t pci_addr_dev;
     device_t pci_mmio_dev;
+    device_t pci_ecam_dev; // PCI_ECAM_START on the MMIO bus
+    pci_dev_t host_bridge; // 00:00.0
+    uint32_t slots; // a bit per device number of bus 0 that is taken
 } pci_t;
 
 void pci_set_bar(struct pci_dev *dev, uint8_t bar, uint32_t bar_size, bool is_io_space, dev_io_fn do_io);
 void pci_set_status(struct pci_dev *dev, uint16_t status);
-void pci_dev_register(struct pci_dev *dev);
+int pci_dev_register(struct pci_dev *dev); // returns 0 on success, -1 when bus 0 is full
 void pci_dev_init(struct pci_dev *dev, struct pci *pci, struct bus *io_bus, struct bus *mmio_bus);
 void pci_init(struct pci *pci);
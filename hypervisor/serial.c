@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <linux/serial_reg.h>
 #include <poll.h>
 #include <signal.h>
@@ -6,9 +7,14 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
 #include <unistd.h>
 #include <pthread.h>
 
+#include "consolelog.h"
 #include "err.h"
 #include "serial.h"
 #include "utils.h"
@@ -17,94 +23,333 @@
 #define IO_WRITE8(data, value) ((uint8_t *) data)[0] = value
 
 
-static serial_dev_priv_t serial_dev_priv = {
+static const serial_dev_priv_t serial_dev_priv_init = {
     .iir = UART_IIR_NO_INT,
+    .dll = 1, /* 115200 baud */
     .mcr = UART_MCR_OUT2,
     .lsr = UART_LSR_TEMT | UART_LSR_THRE,
     .msr = UART_MSR_DCD | UART_MSR_DSR | UART_MSR_CTS,
-    .lock = PTHREAD_MUTEX_INITIALIZER,
-    .cond = PTHREAD_COND_INITIALIZER,
 };
 
-/* FIXME: This implementation is incomplete */
+/* Report how long the guest took from the first KVM_RUN to printing the ready
+ * marker on the console, the boot-to-ready delay. The console also feeds the
+ * boot profile of the guest, which is complete once the marker shows up.
+ */
+static void serial_check_ready(serial_dev_t* s, char c)
+{
+    const char* marker = s->ready_marker;
+
+    boot_profile_console(&container_of(s, guest, serial)->boot, c);
+    if (!marker || !marker[s->ready_matched])
+        return;
+    /* naive restart, the markers are short and rarely self-overlapping */
+    if (marker[s->ready_matched] != c)
+        s->ready_matched = 0;
+    if (marker[s->ready_matched] == c)
+        s->ready_matched++;
+    if (!marker[s->ready_matched]) {
+        guest* g = container_of(s, guest, serial);
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        fprintf(stderr, "\nboot-to-ready: %.1f ms\n",
+                (now.tv_sec - g->run_start.tv_sec) * 1e3 +
+                    (now.tv_nsec - g->run_start.tv_nsec) / 1e6);
+        boot_profile_mark(&g->boot, BOOT_READY);
+        boot_profile_record(&g->boot);
+    }
+}
+
+/* RX bytes that raise the data available interrupt, 1 without the FIFO */
+static unsigned int serial_rx_trigger(serial_dev_priv_t* priv)
+{
+    uint8_t fcr = __atomic_load_n(&priv->fcr, __ATOMIC_RELAXED);
+
+    if (!(fcr & UART_FCR_ENABLE_FIFO))
+        return 1;
+    switch (fcr & UART_FCR_TRIGGER_MASK) {
+    case UART_FCR_TRIGGER_4:
+        return 4;
+    case UART_FCR_TRIGGER_8:
+        return 8;
+    case UART_FCR_TRIGGER_14:
+        return 14;
+    default:
+        return 1;
+    }
+}
+
+/* LSR with UART_LSR_DR reflecting the rx ring and THRE/TEMT the TX FIFO */
+static uint8_t serial_lsr(serial_dev_priv_t* priv)
+{
+    uint8_t lsr = __atomic_load_n(&priv->lsr, __ATOMIC_ACQUIRE);
+
+    if (ring_used(&priv->rx_ring))
+        lsr |= UART_LSR_DR;
+    if (priv->tx_len)
+        lsr &= ~(UART_LSR_TEMT | UART_LSR_THRE);
+    return lsr;
+}
+
+/* Called with priv->lock held: the serial thread and the vCPU both update the
+ * IRQ line, and the last one to evaluate the registers has to win.
+ * The sources in the 16550A order of priority: received data at the trigger
+ * level, the character timeout, then the THRE interrupt. The line status
+ * and modem status interrupts never happen here.
+ */
 static void serial_update_irq(serial_dev_t* s)
 {
     serial_dev_priv_t* priv = (serial_dev_priv_t*) s->priv;
+    unsigned int used = ring_used(&priv->rx_ring);
     uint8_t iir = UART_IIR_NO_INT;
 
-    /* If enable receiver data interrupt and receiver data ready */
-    if ((priv->ier & UART_IER_RDI) && (priv->lsr & UART_LSR_DR))
+    if ((priv->ier & UART_IER_RDI) && used >= serial_rx_trigger(priv))
         iir = UART_IIR_RDI;
-    /* If enable transmiter data interrupt and transmiter empty */
-    else if ((priv->ier & UART_IER_THRI) && (priv->lsr & UART_LSR_TEMT))
+    else if ((priv->ier & UART_IER_RDI) && used && priv->rx_timeout)
+        iir = UART_IIR_RX_TIMEOUT;
+    else if ((priv->ier & UART_IER_THRI) && priv->thri_pending)
         iir = UART_IIR_THRI;
 
-    __atomic_store_n(&priv->iir, iir | 0xc0, __ATOMIC_RELEASE);
+    /* 0xc0 stands for FIFO enabled */
+    if (priv->fcr & UART_FCR_ENABLE_FIFO)
+        iir |= 0xc0;
+    __atomic_store_n(&priv->iir, iir, __ATOMIC_RELEASE);
 
+    if (priv->irq_level == !(iir & UART_IIR_NO_INT))
+        return;
+    priv->irq_level = !(iir & UART_IIR_NO_INT);
     /* FIXME: the return error of vm_irq_line should be handled */
     vm_irq_line(container_of(s, guest, serial), s->irq_num,
-                iir == UART_IIR_NO_INT ? 0 /* inactive */ : 1 /* active */);
+                priv->irq_level ? 1 /* active */ : 0 /* inactive */);
 }
 
-static int serial_readable(serial_dev_t* s, int timeout)
+static void serial_update_irq_locked(serial_dev_t* s)
 {
-    struct pollfd pollfd = (struct pollfd){
-        .fd = s->infd,
-        .events = POLLIN,
-    };
-    return (poll(&pollfd, 1, timeout) > 0) && (pollfd.revents & POLLIN);
+    serial_dev_priv_t* priv = (serial_dev_priv_t*) s->priv;
+
+    pthread_mutex_lock(&priv->lock);
+    serial_update_irq(s);
+    pthread_mutex_unlock(&priv->lock);
 }
 
-/* global state to stop the loop of thread */
-static volatile bool thread_stop = false;
+/* Arm timer_fd to expire after n character times at the current baud rate,
+ * 10 bits per character and 115200 baud for a divisor of 1.
+ */
+static void serial_arm_timer(serial_dev_priv_t* priv, int timer_fd, unsigned int n)
+{
+    unsigned int divisor = priv->dll | (priv->dlm << 8);
+    uint64_t ns = n * 10ULL * 1000000000ULL * (divisor ? divisor : 1) / 115200;
+    struct itimerspec its = {
+        .it_value = {.tv_sec = ns / 1000000000ULL, .tv_nsec = ns % 1000000000ULL},
+    };
 
-static void* serial_thread(serial_dev_t* s)
+    if (timerfd_settime(timer_fd, 0, &its, NULL) < 0)
+        perror("serial timer");
+}
+
+/* Write the TX FIFO out, the guest then sees the transmitter empty.
+ * Called with priv->lock held.
+ */
+static void serial_tx_flush(serial_dev_t* s)
 {
     serial_dev_priv_t* priv = (serial_dev_priv_t*) s->priv;
-    while (!__atomic_load_n(&thread_stop, __ATOMIC_RELAXED)) {
-        if (!serial_readable(s, -1))
-            continue;
-        pthread_mutex_lock(&priv->lock);
-        if (fifo_is_full(&priv->rx_buf)) {
-            /* stdin is readable, but the rx_buf is full.
-             * Wait for notification.
-             */
-            pthread_cond_wait(&priv->cond, &priv->lock);
-        }
-        serial_console(s);
-        pthread_mutex_unlock(&priv->lock);
+
+    if (!priv->tx_len)
+        return;
+    /* whether or not anybody reads the console now */
+    if (s->log)
+        console_log_append(s->log, priv->tx_fifo, priv->tx_len);
+    if (s->stdio) {
+        fwrite(priv->tx_fifo, 1, priv->tx_len, stdout);
+        fflush(stdout);
+    } else if (write(s->outfd, priv->tx_fifo, priv->tx_len) < 0 &&
+               errno != EAGAIN) {
+        /* a console socket nobody reads loses the output instead of
+         * stalling the vCPU */
+        perror("serial write");
     }
+    priv->tx_len = 0;
+    priv->thri_pending = true;
+}
 
-    return NULL;
+static bool serial_stopped(serial_dev_t* s)
+{
+    serial_dev_priv_t* priv = (serial_dev_priv_t*) s->priv;
+
+    return __atomic_load_n(&priv->stop, __ATOMIC_RELAXED);
 }
 
 #define TERMINAL_ESCAPE_CHAR 0x01
 #define TERMINAL_EXIT_CHAR 'x'
 
-void serial_console(serial_dev_t *s)
+/* Drop the terminal escape sequences from the input read in place, Ctrl-A x
+ * ends the process. Returns the bytes left for the guest.
+ */
+static unsigned int serial_filter_escape(serial_dev_t* s, uint8_t* buf, unsigned int len)
 {
-    serial_dev_priv_t* priv = (serial_dev_priv_t*) s->priv;
-    static bool escaped = false;
+    unsigned int out = 0;
 
-    while (!fifo_is_full(&priv->rx_buf) && serial_readable(s, 0)) {
-        char c;
-        if (read(s->infd, &c, 1) == -1)
-            break;
-        if (escaped && c == TERMINAL_EXIT_CHAR) {
+    if (!s->stdio)
+        return len;
+    for (unsigned int i = 0; i < len; i++) {
+        uint8_t c = buf[i];
+        if (s->escaped && c == TERMINAL_EXIT_CHAR) {
             /* Terminate */
             fprintf(stderr, "\n");
             exit(0);
         }
-        if (!escaped && c == TERMINAL_ESCAPE_CHAR) {
-            escaped = true;
+        if (!s->escaped && c == TERMINAL_ESCAPE_CHAR) {
+            s->escaped = true;
             continue;
         }
-        escaped = false;
-        if (!fifo_put(&priv->rx_buf, c))
-            break;
-        __atomic_store_n(&priv->lsr, priv->lsr | UART_LSR_DR, __ATOMIC_RELEASE);
+        s->escaped = false;
+        buf[out++] = c;
     }
+    return out;
+}
+
+/* Publish n bytes written into the rx ring. Only a ring that was below the
+ * trigger level needs the IRQ line updated: otherwise the vCPU has yet to
+ * drain the older bytes and sees the new ones before it finds the ring empty.
+ * Bytes that stay below the trigger level are announced by the character
+ * timeout, 4 character times later.
+ */
+static void serial_rx_publish(serial_dev_t* s, unsigned int n)
+{
+    serial_dev_priv_t* priv = (serial_dev_priv_t*) s->priv;
+    unsigned int old_tail = priv->rx_ring.tail;
+    unsigned int trigger = serial_rx_trigger(priv);
+    unsigned int old_used;
+
+    ring_produce(&priv->rx_ring, n);
+    /* the tail store has to be visible before head is read, as in serial_in */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    old_used = old_tail - __atomic_load_n(&priv->rx_ring.head, __ATOMIC_RELAXED);
+    if (old_used < trigger)
+        serial_update_irq_locked(s);
+    if (old_used + n < trigger)
+        serial_arm_timer(priv, priv->rx_timer_fd, 4);
+}
+
+/* The character timeout of the RX FIFO and the deadline of the TX FIFO */
+static void serial_timers_expired(serial_dev_t* s, bool rx, bool tx)
+{
+    serial_dev_priv_t* priv = (serial_dev_priv_t*) s->priv;
+    uint64_t count;
+
+    if (rx && read(priv->rx_timer_fd, &count, sizeof(count)) < 0)
+        rx = false;
+    if (tx && read(priv->tx_timer_fd, &count, sizeof(count)) < 0)
+        tx = false;
+    pthread_mutex_lock(&priv->lock);
+    if (rx) {
+        unsigned int used = ring_used(&priv->rx_ring);
+        priv->rx_timeout = used && used < serial_rx_trigger(priv);
+    }
+    if (tx)
+        serial_tx_flush(s);
     serial_update_irq(s);
+    pthread_mutex_unlock(&priv->lock);
+}
+
+/* Wakes the serial thread up if it sleeps on a full ring, once there is room
+ * for a bulk read again or the guest cleared the FIFO. */
+static void serial_rx_wake(serial_dev_priv_t* priv)
+{
+    uint64_t n = 1;
+
+    if (__atomic_load_n(&priv->rx_parked, __ATOMIC_RELAXED) &&
+        __atomic_exchange_n(&priv->rx_parked, false, __ATOMIC_SEQ_CST) &&
+        write(priv->rx_space_fd, &n, sizeof(n)) < 0)
+        perror("serial rx space");
+}
+
+/* Reads the console input in bulk into the rx ring and runs the FIFO timers.
+ * On a full ring it sleeps on rx_space_fd until the guest drained half of it.
+ */
+static void* serial_thread(serial_dev_t* s)
+{
+    serial_dev_priv_t* priv = (serial_dev_priv_t*) s->priv;
+    bool eof = false;
+
+    while (!serial_stopped(s)) {
+        uint8_t* buf;
+        unsigned int space = ring_write_space(&priv->rx_ring, &buf);
+
+        if (!space) {
+            __atomic_store_n(&priv->rx_parked, true, __ATOMIC_SEQ_CST);
+            /* the guest may have drained the ring before it could see the
+             * flag, as in serial_rx_read */
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            space = ring_write_space(&priv->rx_ring, &buf);
+            if (space)
+                __atomic_store_n(&priv->rx_parked, false, __ATOMIC_RELAXED);
+        }
+        /* fd -1 is skipped by poll, a closed input would be readable forever */
+        struct pollfd pollfd[4] = {
+            {.fd = space ? (eof ? -1 : s->infd) : priv->rx_space_fd, .events = POLLIN},
+            {.fd = priv->rx_timer_fd, .events = POLLIN},
+            {.fd = priv->tx_timer_fd, .events = POLLIN},
+            {.fd = s->stopfd, .events = POLLIN},
+        };
+        ssize_t n;
+
+        if (poll(pollfd, 4, -1) <= 0)
+            continue;
+        if ((pollfd[1].revents | pollfd[2].revents) & POLLIN)
+            serial_timers_expired(s, pollfd[1].revents & POLLIN,
+                                  pollfd[2].revents & POLLIN);
+        if (!(pollfd[0].revents & (POLLIN | POLLHUP)))
+            continue;
+        if (!space) {
+            uint64_t count;
+            if (read(priv->rx_space_fd, &count, sizeof(count)) < 0)
+                perror("serial rx space");
+            continue;
+        }
+        n = read(s->infd, buf, space);
+        if (n <= 0) {
+            if (n == 0 || (errno != EAGAIN && errno != EINTR))
+                eof = true;
+            continue;
+        }
+        n = serial_filter_escape(s, buf, n);
+        if (n)
+            serial_rx_publish(s, n);
+    }
+
+    return NULL;
+}
+
+/* The guest reads UART_RX: one byte off the ring, without the lock unless the
+ * interrupt state changes, the ring drops below the trigger level or empties.
+ */
+static void serial_rx_read(serial_dev_t* s, void* data)
+{
+    serial_dev_priv_t* priv = (serial_dev_priv_t*) s->priv;
+    unsigned int trigger = serial_rx_trigger(priv);
+    unsigned int used;
+    uint8_t value;
+
+    if (ring_get(&priv->rx_ring, &value))
+        IO_WRITE8(data, value);
+    /* the head store has to be visible before tail is read, as in
+     * serial_rx_publish, or both sides could miss the IRQ update */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    used = ring_used(&priv->rx_ring);
+    if (!used || used + 1 == trigger || priv->rx_timeout) {
+        pthread_mutex_lock(&priv->lock);
+        /* reading the FIFO restarts the character timeout */
+        if (priv->rx_timeout && used)
+            serial_arm_timer(priv, priv->rx_timer_fd, 4);
+        priv->rx_timeout = false;
+        serial_update_irq(s);
+        pthread_mutex_unlock(&priv->lock);
+    }
+    /* wake the serial thread up if it waits on a full ring, once half of it
+     * is free it can read in bulk again */
+    if (used <= RING_LEN / 2)
+        serial_rx_wake(priv);
 }
 
 static void serial_in(serial_dev_t* s, uint16_t offset, void* data)
@@ -114,27 +359,10 @@ static void serial_in(serial_dev_t* s, uint16_t offset, void* data)
 
     switch (offset) {
     case UART_RX:
-        if (priv->lcr & UART_LCR_DLAB) {
+        if (priv->lcr & UART_LCR_DLAB)
             IO_WRITE8(data, priv->dll);
-        } else {
-            pthread_mutex_lock(&priv->lock);
-            if (fifo_get(&priv->rx_buf, value))
-                IO_WRITE8(data, value);
-
-            if (fifo_is_empty(&priv->rx_buf)) {
-                priv->lsr &= ~UART_LSR_DR;
-                serial_update_irq(s);
-            }
-            /* The worker thread waits on the condition variable when rx_buf is
-             * full and stdin is still readable. Notify the worker thread when
-             * the capacity of the buffer drops to its half size, so the worker
-             * thread can read up to half of the buffer size before it is
-             * blocked again.
-             */
-            if (fifo_capacity(&priv->rx_buf) == FIFO_LEN / 2)
-                pthread_cond_signal(&priv->cond);
-            pthread_mutex_unlock(&priv->lock);
-        }
+        else
+            serial_rx_read(s, data);
         break;
     case UART_IER:
         if (priv->lcr & UART_LCR_DLAB)
@@ -143,8 +371,17 @@ static void serial_in(serial_dev_t* s, uint16_t offset, void* data)
             IO_WRITE8(data, priv->ier);
         break;
     case UART_IIR:
-        value = __atomic_load_n(&priv->iir, __ATOMIC_ACQUIRE);
-        IO_WRITE8(data, value | 0xc0); /* 0xc0 stands for FIFO enabled */
+        pthread_mutex_lock(&priv->lock);
+        serial_tx_flush(s);
+        serial_update_irq(s);
+        value = priv->iir;
+        IO_WRITE8(data, value);
+        /* reading IIR acknowledges the THRE interrupt */
+        if ((value & UART_IIR_ID) == UART_IIR_THRI) {
+            priv->thri_pending = false;
+            serial_update_irq(s);
+        }
+        pthread_mutex_unlock(&priv->lock);
         break;
     case UART_LCR:
         IO_WRITE8(data, priv->lcr);
@@ -153,8 +390,14 @@ static void serial_in(serial_dev_t* s, uint16_t offset, void* data)
         IO_WRITE8(data, priv->mcr);
         break;
     case UART_LSR:
-        value = __atomic_load_n(&priv->lsr, __ATOMIC_ACQUIRE);
-        IO_WRITE8(data, priv->lsr);
+        /* the guest polls THRE before it writes, e.g. the printk console */
+        pthread_mutex_lock(&priv->lock);
+        if (priv->tx_len) {
+            serial_tx_flush(s);
+            serial_update_irq(s);
+        }
+        IO_WRITE8(data, serial_lsr(priv));
+        pthread_mutex_unlock(&priv->lock);
         break;
     case UART_MSR:
         IO_WRITE8(data, priv->msr);
@@ -167,27 +410,72 @@ static void serial_in(serial_dev_t* s, uint16_t offset, void* data)
     }
 }
 
+/* The guest writes UART_TX. Without the FIFO each byte goes out on its own,
+ * with it the THRE interrupt comes once per 16 bytes.
+ */
+static void serial_tx_write(serial_dev_t* s, void* data)
+{
+    serial_dev_priv_t* priv = (serial_dev_priv_t*) s->priv;
+
+    serial_check_ready(s, ((char*) data)[0]);
+    pthread_mutex_lock(&priv->lock);
+    priv->thri_pending = false;
+    priv->tx_fifo[priv->tx_len++] = IO_READ8(data);
+    if (!(priv->fcr & UART_FCR_ENABLE_FIFO) || priv->tx_len == SERIAL_FIFO_LEN)
+        serial_tx_flush(s);
+    else if (priv->tx_len == 1)
+        serial_arm_timer(priv, priv->tx_timer_fd, SERIAL_FIFO_LEN);
+    serial_update_irq(s);
+    pthread_mutex_unlock(&priv->lock);
+}
+
+static void serial_fcr_write(serial_dev_t* s, uint8_t fcr)
+{
+    serial_dev_priv_t* priv = (serial_dev_priv_t*) s->priv;
+
+    pthread_mutex_lock(&priv->lock);
+    if (fcr & UART_FCR_CLEAR_RCVR) {
+        /* the vCPU is the consumer, dropping the ring is moving head */
+        __atomic_store_n(&priv->rx_ring.head,
+                         __atomic_load_n(&priv->rx_ring.tail, __ATOMIC_ACQUIRE),
+                         __ATOMIC_RELEASE);
+        priv->rx_timeout = false;
+        /* the guest reads nothing more, serial_rx_read would never wake it */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        serial_rx_wake(priv);
+    }
+    if (fcr & UART_FCR_CLEAR_XMIT && priv->tx_len) {
+        priv->tx_len = 0;
+        priv->thri_pending = true;
+    }
+    /* the clear bits are self clearing, the 64 byte FIFO of the 16750 stays
+     * off so the guest detects a 16550A */
+    __atomic_store_n(&priv->fcr,
+                     fcr & (UART_FCR_ENABLE_FIFO | UART_FCR_TRIGGER_MASK),
+                     __ATOMIC_RELAXED);
+    serial_update_irq(s);
+    pthread_mutex_unlock(&priv->lock);
+}
+
 static void serial_out(serial_dev_t* s, uint16_t offset, void* data)
 {
     serial_dev_priv_t* priv = (serial_dev_priv_t*) s->priv;
 
     switch (offset) {
     case UART_TX:
-        if (priv->lcr & UART_LCR_DLAB) {
+        if (priv->lcr & UART_LCR_DLAB)
             priv->dll = IO_READ8(data);
-        } else {
-            putchar(((char*) data)[0]);
-            fflush(stdout);
-            pthread_mutex_lock(&priv->lock);
-            priv->lsr |= (UART_LSR_TEMT | UART_LSR_THRE); /* flush TX */
-            serial_update_irq(s);
-            pthread_mutex_unlock(&priv->lock);
-        }
+        else
+            serial_tx_write(s, data);
         break;
     case UART_IER:
         if (!(priv->lcr & UART_LCR_DLAB)) {
             pthread_mutex_lock(&priv->lock);
-            priv->ier = IO_READ8(data);
+            /* enabling the THRE interrupt with the transmitter empty raises it */
+            if ((IO_READ8(data) & ~priv->ier & UART_IER_THRI) && !priv->tx_len)
+                priv->thri_pending = true;
+            /* bits 4-7 are always 0 on a 16550A */
+            priv->ier = IO_READ8(data) & 0x0f;
             serial_update_irq(s);
             pthread_mutex_unlock(&priv->lock);
         } else {
@@ -195,7 +483,7 @@ static void serial_out(serial_dev_t* s, uint16_t offset, void* data)
         }
         break;
     case UART_FCR:
-        priv->fcr = IO_READ8(data);
+        serial_fcr_write(s, IO_READ8(data));
         break;
     case UART_LCR:
         priv->lcr = IO_READ8(data);
@@ -214,7 +502,6 @@ static void serial_out(serial_dev_t* s, uint16_t offset, void* data)
     }
 }
 
-
 void serial_handle_io(void* owner,
                              void* data,
                              uint8_t is_write,
@@ -228,13 +515,20 @@ void serial_handle_io(void* owner,
     serial_op(s, offset, data);
 }
 
-int serial_init(serial_dev_t *s, bus_t *bus)
+static int serial_setup(serial_dev_t* s, bus_t* bus)
 {
-    *s = (serial_dev_t){
-        .priv = (void*) &serial_dev_priv,
-        .infd = STDIN_FILENO,
-        .irq_num = SERIAL_IRQ,
-    };
+    serial_dev_priv_t* priv = malloc(sizeof(serial_dev_priv_t));
+
+    if (!priv)
+        return -1;
+    *priv = serial_dev_priv_init;
+    pthread_mutex_init(&priv->lock, NULL);
+    priv->rx_space_fd = eventfd(0, EFD_CLOEXEC);
+    priv->rx_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    priv->tx_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    s->priv = priv;
+    s->irq_num = SERIAL_IRQ;
+    s->stopfd = eventfd(0, EFD_CLOEXEC);
     pthread_create(&s->worker_tid, NULL, (void*) serial_thread, (void*) s);
 
     dev_init(&s->dev, COM1_PORT_BASE, COM1_PORT_LEN, s, serial_handle_io);
@@ -243,8 +537,42 @@ int serial_init(serial_dev_t *s, bus_t *bus)
     return 0;
 }
 
+/* The console is the terminal the hypervisor runs in */
+int serial_init(serial_dev_t *s, bus_t *bus)
+{
+    *s = (serial_dev_t){
+        .infd = STDIN_FILENO,
+        .outfd = STDOUT_FILENO,
+        .stdio = true,
+    };
+    return serial_setup(s, bus);
+}
+
+/* The console is a socket, e.g. the one the daemon hands out to clients */
+int serial_init_fd(serial_dev_t *s, bus_t *bus, int fd)
+{
+    *s = (serial_dev_t){
+        .infd = fd,
+        .outfd = fd,
+    };
+    return serial_setup(s, bus);
+}
+
 void serial_exit(serial_dev_t* s)
 {
-    __atomic_store_n(&thread_stop, true, __ATOMIC_RELAXED);
+    serial_dev_priv_t* priv = (serial_dev_priv_t*) s->priv;
+    uint64_t n = 1;
+
+    pthread_mutex_lock(&priv->lock);
+    serial_tx_flush(s);
+    pthread_mutex_unlock(&priv->lock);
+    __atomic_store_n(&priv->stop, true, __ATOMIC_RELAXED);
+    if (write(s->stopfd, &n, sizeof(n)) < 0)
+        perror("serial stop");
     pthread_join(s->worker_tid, NULL);
+    close(s->stopfd);
+    close(priv->rx_space_fd);
+    close(priv->rx_timer_fd);
+    close(priv->tx_timer_fd);
+    free(priv);
 }
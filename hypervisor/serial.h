@@ -14,8 +14,8 @@
 #define SERIAL_IRQ 4
 
 
-void serial_console(serial_dev_t* s);
 int serial_init(serial_dev_t* s, bus_t* bus);
+int serial_init_fd(serial_dev_t* s, bus_t* bus, int fd);
 void serial_exit(serial_dev_t* s);
 void serial_handle_io(void* owner,
                              void* data,
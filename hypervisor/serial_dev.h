@@ -2,6 +2,7 @@
 #define SERIAL_DEV_H
 
 #include <pthread.h>
+#include <stdbool.h>
 #include "bus.h"
 
 #define COM1_PORT_BASE 0x03f8
@@ -9,13 +10,21 @@
 #define SERIAL_IRQ 4
 
 typedef struct serial_dev serial_dev_t;
+struct console_log;
 
 struct serial_dev {
     void* priv;
     pthread_t worker_tid;
     int infd; /* file descriptor for serial input */
+    int outfd; /* file descriptor for serial output */
+    int stopfd; /* eventfd that wakes the worker thread up to exit */
+    bool stdio; /* the console is the terminal, Ctrl-A x ends the process */
+    bool escaped;
     device_t dev;
     int irq_num;
+    const char* ready_marker; /* console text that marks the guest as booted */
+    size_t ready_matched; /* bytes of the marker matched so far */
+    struct console_log* log; /* keeps the output for later, NULL for none */
 };
 
 #endif // SERIAL_DEV_H
\ No newline at end of file
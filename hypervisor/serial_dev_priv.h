@@ -2,9 +2,12 @@
 #define SERIAL_DEV_PRIV_H
 
 #include <pthread.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include "utils.h"
 
+#define SERIAL_FIFO_LEN 16 /* the 16550A FIFOs */
+
 typedef struct serial_dev_priv {
     uint8_t dll;
     uint8_t dlm;
@@ -17,9 +20,26 @@ typedef struct serial_dev_priv {
     uint8_t msr;
     uint8_t scr;
 
-    struct fifo rx_buf;
-    pthread_mutex_t lock;
-    pthread_cond_t cond;
+    /* console input, filled by the serial thread and drained by the vCPU
+     * reading UART_RX. UART_LSR_DR is derived from it instead of stored in lsr
+     */
+    struct ring rx_ring;
+    int rx_space_fd; /* eventfd, the vCPU wakes the serial thread up on a full ring */
+    bool rx_parked; /* the serial thread sleeps on rx_space_fd */
+    int rx_timer_fd; /* timerfd of the character timeout */
+    bool rx_timeout; /* character timeout indication pending */
+
+    /* the TX FIFO, written out in one go when full, when the guest looks at
+     * IIR or LSR, or a few character times after its first byte (tx_timer_fd)
+     */
+    uint8_t tx_fifo[SERIAL_FIFO_LEN];
+    unsigned int tx_len;
+    int tx_timer_fd;
+    bool thri_pending; /* THRE interrupt: the TX FIFO became empty */
+
+    bool irq_level; /* last level of the IRQ line, only changes reach KVM */
+    pthread_mutex_t lock; /* the registers and the IRQ line, not the ring */
+    bool stop;
 } serial_dev_priv_t;
 
 #endif // SERIAL_DEV_PRIV_H
\ No newline at end of file
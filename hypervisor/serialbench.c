@@ -0,0 +1,265 @@
+#include <getopt.h>
+#include <linux/serial_reg.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "guest.h"
+#include "serial.h"
+
+/* Interrupts per KB of console traffic through the emulated 16550A, with
+ * the FIFO off and at each RX trigger level. The guest side is this thread
+ * driving the UART registers the way the Linux 8250 driver does, the host
+ * side a console socket, so no VM is needed.
+ *
+ * The host sends the input a character at a time at the line rate, as a
+ * real line delivers it: handed over in one write, the whole chunk would be
+ * in the receiver at the first interrupt whatever the trigger level.
+ */
+
+#define LINE_RATE 11520 /* characters per second at 115200 baud, 10 bits each */
+
+struct serialbench {
+    guest *g;
+    int host_fd;
+    size_t total;
+    size_t chunk;
+    size_t done; /* bytes the other side has taken */
+    bool tx; /* the guest sends, the host receives */
+    unsigned int rate; /* characters per second the host sends, 0 for no pacing */
+    unsigned long timeouts; /* RX interrupts for the character timeout */
+};
+
+static int bench_irq_level;
+static unsigned long bench_irq_raised;
+
+/* The serial device raises its IRQ line here instead of in KVM */
+int vm_irq_line(guest *v, int irq, int level)
+{
+    (void) v;
+    (void) irq;
+    if (level && !__atomic_load_n(&bench_irq_level, __ATOMIC_RELAXED))
+        __atomic_add_fetch(&bench_irq_raised, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&bench_irq_level, level, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static uint8_t uart_in(struct serialbench *b, int offset)
+{
+    uint8_t value = 0;
+
+    bus_handle_io(&b->g->io_bus, &value, 0, COM1_PORT_BASE + offset, 1);
+    return value;
+}
+
+static void uart_out(struct serialbench *b, int offset, uint8_t value)
+{
+    bus_handle_io(&b->g->io_bus, &value, 1, COM1_PORT_BASE + offset, 1);
+}
+
+/* Sends n bytes of buf, a character every 1/rate s from deadline on */
+static bool serialbench_send(struct serialbench *b, const char *buf, size_t n, struct timespec *deadline)
+{
+    if (!b->rate)
+        return write(b->host_fd, buf, n) == (ssize_t) n;
+    for (size_t i = 0; i < n; i++) {
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, NULL);
+        if (write(b->host_fd, buf + i, 1) != 1)
+            return false;
+        deadline->tv_nsec += 1000000000L / b->rate;
+        deadline->tv_sec += deadline->tv_nsec / 1000000000L;
+        deadline->tv_nsec %= 1000000000L;
+    }
+    return true;
+}
+
+/* The host types or pastes: one chunk at a time, each once the guest took
+ * the previous one, or reads what the guest sends */
+static void *serialbench_host(void *arg)
+{
+    struct serialbench *b = (struct serialbench *) arg;
+    char *buf = calloc(1, b->chunk);
+    struct timespec deadline;
+    size_t sent = 0;
+
+    /* the default slack of 50 us is most of a character time */
+    prctl(PR_SET_TIMERSLACK, 1);
+    while (sent < b->total) {
+        size_t n = b->total - sent < b->chunk ? b->total - sent : b->chunk;
+        if (b->tx) {
+            ssize_t r = read(b->host_fd, buf, b->chunk);
+            if (r <= 0)
+                break;
+            sent += r;
+            __atomic_store_n(&b->done, sent, __ATOMIC_RELEASE);
+            continue;
+        }
+        memset(buf, 'a' + sent % 26, n);
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        if (!serialbench_send(b, buf, n, &deadline))
+            break;
+        sent += n;
+        while (__atomic_load_n(&b->done, __ATOMIC_ACQUIRE) < sent)
+            sched_yield();
+    }
+    free(buf);
+    return NULL;
+}
+
+/* serial8250_startup and serial8250_set_termios, short of the probing */
+static void serialbench_startup(struct serialbench *b, uint8_t fcr)
+{
+    uart_out(b, UART_LCR, UART_LCR_DLAB);
+    uart_out(b, UART_DLL, 1);
+    uart_out(b, UART_DLM, 0);
+    uart_out(b, UART_LCR, UART_LCR_WLEN8);
+    uart_out(b, UART_FCR, fcr | UART_FCR_CLEAR_RCVR | UART_FCR_CLEAR_XMIT);
+    uart_out(b, UART_IER, b->tx ? UART_IER_THRI : UART_IER_RDI);
+}
+
+/* One interrupt, as serial8250_handle_irq takes it: up to 256 received bytes,
+ * then up to tx_loadsz bytes to send */
+static size_t serialbench_handle_irq(struct serialbench *b, size_t tx_loadsz, size_t done)
+{
+    uint8_t iir = uart_in(b, UART_IIR), lsr;
+    int budget = 256;
+
+    if (iir & UART_IIR_NO_INT)
+        return done;
+    if ((iir & UART_IIR_ID) == UART_IIR_RX_TIMEOUT)
+        b->timeouts++;
+    lsr = uart_in(b, UART_LSR);
+    while ((lsr & UART_LSR_DR) && budget--) {
+        uart_in(b, UART_RX);
+        done++;
+        lsr = uart_in(b, UART_LSR);
+    }
+    __atomic_store_n(&b->done, done, __ATOMIC_RELEASE);
+    if (b->tx && (lsr & UART_LSR_THRE)) {
+        for (size_t i = 0; i < tx_loadsz && done < b->total; i++)
+            uart_out(b, UART_TX, 'a' + done++ % 26);
+        /* __stop_tx: nothing left to send */
+        if (done == b->total)
+            uart_out(b, UART_IER, 0);
+    }
+    return done;
+}
+
+struct serialbench_result {
+    double irqs_per_kb;
+    double timeouts_per_kb;
+};
+
+static struct serialbench_result serialbench_run(bool tx, uint8_t fcr, size_t total, size_t chunk, unsigned int rate)
+{
+    struct serialbench b = {.total = total, .chunk = chunk, .tx = tx, .rate = rate};
+    size_t tx_loadsz = (fcr & UART_FCR_ENABLE_FIFO) ? 16 : 1;
+    unsigned long irqs = 0;
+    size_t done = 0;
+    pthread_t host;
+    int fds[2];
+
+    b.g = calloc(1, sizeof(guest));
+    if (!b.g || socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        perror("serialbench");
+        exit(1);
+    }
+    b.host_fd = fds[0];
+    bus_init(&b.g->io_bus);
+    serial_init_fd(&b.g->serial, &b.g->io_bus, fds[1]);
+    __atomic_store_n(&bench_irq_level, 0, __ATOMIC_RELAXED);
+    serialbench_startup(&b, fcr);
+    __atomic_store_n(&bench_irq_raised, 0, __ATOMIC_RELAXED);
+
+    pthread_create(&host, NULL, serialbench_host, &b);
+    while ((tx ? __atomic_load_n(&b.done, __ATOMIC_ACQUIRE) : done) < total) {
+        /* the guest runs until the line is raised, then takes the interrupt
+         * and keeps taking it while the line stays up (level triggered) */
+        if (!__atomic_load_n(&bench_irq_level, __ATOMIC_ACQUIRE)) {
+            sched_yield();
+            continue;
+        }
+        irqs++;
+        done = serialbench_handle_irq(&b, tx_loadsz, done);
+    }
+    pthread_join(host, NULL);
+
+    serial_exit(&b.g->serial);
+    close(fds[0]);
+    close(fds[1]);
+    free(b.g);
+    return (struct serialbench_result){irqs * 1024.0 / total, b.timeouts * 1024.0 / total};
+}
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [-s kbytes] [-c chunk] [-r rate]\n", prog);
+    printf("  -s  console traffic in KB each way (default 16)\n");
+    printf("  -c  bytes the host sends in a row, 1 for typing (default 64, a paste)\n");
+    printf("  -r  characters per second the host sends, 0 for as fast as the guest takes them\n");
+    printf("      (default %d, the line rate at 115200 baud)\n", LINE_RATE);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct {
+        const char *name;
+        uint8_t fcr;
+    } modes[] = {
+        {"no FIFO", 0},
+        {"FIFO, trigger 1", UART_FCR_ENABLE_FIFO | UART_FCR_TRIGGER_1},
+        {"FIFO, trigger 4", UART_FCR_ENABLE_FIFO | UART_FCR_TRIGGER_4},
+        {"FIFO, trigger 8", UART_FCR_ENABLE_FIFO | UART_FCR_TRIGGER_8},
+        {"FIFO, trigger 14", UART_FCR_ENABLE_FIFO | UART_FCR_TRIGGER_14},
+    };
+    struct serialbench_result no_fifo = {0};
+    size_t total = 16 * 1024;
+    size_t chunk = 64;
+    unsigned int rate = LINE_RATE;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:c:r:")) != -1) {
+        switch (opt) {
+        case 's':
+            total = strtoul(optarg, NULL, 10) * 1024;
+            break;
+        case 'c':
+            chunk = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            rate = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!total || !chunk) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (rate)
+        printf("%zu KB each way, host chunks of %zu bytes at %u chars/s\n", total / 1024, chunk, rate);
+    else
+        printf("%zu KB each way, host chunks of %zu bytes in one write\n", total / 1024, chunk);
+    printf("%-18s %14s %14s %14s %14s\n", "", "RX irqs/KB", "RX timeouts/KB", "RX vs no FIFO", "TX irqs/KB");
+    for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+        struct serialbench_result rx = serialbench_run(false, modes[i].fcr, total, chunk, rate);
+        struct serialbench_result tx = serialbench_run(true, modes[i].fcr, total, chunk, rate);
+        int saved;
+
+        if (!i)
+            no_fifo = rx;
+        saved = (int) (100.0 * (rx.irqs_per_kb - no_fifo.irqs_per_kb) / no_fifo.irqs_per_kb);
+        printf("%-18s %14.1f %14.1f %13d%% %14.1f\n", modes[i].name, rx.irqs_per_kb, rx.timeouts_per_kb, saved,
+               tx.irqs_per_kb);
+    }
+    return 0;
+}
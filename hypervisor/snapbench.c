@@ -0,0 +1,246 @@
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "memsnap.h"
+
+/* Time until a guest restored from a memory snapshot runs again, and until it
+ * has its working set back: restored eagerly, lazily with userfaultfd, and
+ * lazily with the hot pages recorded at snapshot time streamed first. The
+ * guest is this thread touching the guest memory the way a vCPU would after
+ * the resume, its hot pages first, so no VM is needed. The snapshot is taken
+ * out of the page cache before each restore.
+ */
+
+struct snapbench {
+    size_t size;
+    size_t pages;
+    unsigned int touched_pct; /* of the pages, the ones the guest wrote */
+    unsigned int hot_pct; /* of the touched pages, the ones it uses on resume */
+    uint64_t *hot; /* bitmap, KVM_GET_DIRTY_LOG layout */
+    uint32_t *hot_list; /* in the order the guest touches them */
+    size_t nr_hot;
+    char path[4096];
+    char cold_path[4096]; /* the same snapshot without hot pages */
+};
+
+static uint64_t bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t page_stamp(size_t page)
+{
+    return (page + 1) * 0x9e3779b97f4a7c15ULL;
+}
+
+static bool page_touched(struct snapbench *b, size_t page)
+{
+    return page_stamp(page) % 100 < b->touched_pct;
+}
+
+static uint8_t *guest_mem(size_t size)
+{
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    if (mem == MAP_FAILED) {
+        perror("snapbench");
+        exit(1);
+    }
+    return mem;
+}
+
+static void drop_cache(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+        return;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+/* Every touched page holds its stamp, every other page is zero */
+static size_t check_mem(struct snapbench *b, const uint8_t *mem)
+{
+    size_t bad = 0;
+
+    for (size_t page = 0; page < b->pages; page++) {
+        const uint64_t *p = (const uint64_t *) (mem + page * MEMSNAP_PAGE_SIZE);
+        uint64_t want = page_touched(b, page) ? page_stamp(page) : 0;
+        size_t last = MEMSNAP_PAGE_SIZE / sizeof(*p) - 1;
+
+        if (p[0] != want || p[last / 2] != want || p[last] != want)
+            bad++;
+    }
+    return bad;
+}
+
+/* The guest before the snapshot: writes the touched pages, and picks the hot
+ * ones among them */
+static uint8_t *snapbench_guest(struct snapbench *b)
+{
+    uint8_t *mem = guest_mem(b->size);
+
+    b->hot = calloc((b->pages + 63) / 64, sizeof(uint64_t));
+    b->hot_list = malloc(b->pages * sizeof(uint32_t));
+    if (!b->hot || !b->hot_list) {
+        perror("snapbench");
+        exit(1);
+    }
+    srand(1);
+    for (size_t page = 0; page < b->pages; page++) {
+        uint64_t *p = (uint64_t *) (mem + page * MEMSNAP_PAGE_SIZE);
+
+        if (!page_touched(b, page))
+            continue;
+        for (size_t i = 0; i < MEMSNAP_PAGE_SIZE / sizeof(*p); i++)
+            p[i] = page_stamp(page);
+        if ((unsigned int) rand() % 100 < b->hot_pct) {
+            b->hot[page / 64] |= 1ULL << (page % 64);
+            b->hot_list[b->nr_hot++] = page;
+        }
+    }
+    /* the guest does not use its working set in address order */
+    for (size_t i = b->nr_hot; i > 1; i--) {
+        size_t j = (size_t) rand() % i;
+        uint32_t tmp = b->hot_list[i - 1];
+
+        b->hot_list[i - 1] = b->hot_list[j];
+        b->hot_list[j] = tmp;
+    }
+    return mem;
+}
+
+/* The guest after the resume: reads its hot pages. Returns the ns it took */
+static uint64_t touch_hot(struct snapbench *b, const uint8_t *mem)
+{
+    uint64_t start = bench_now();
+    volatile uint64_t sum = 0;
+
+    for (size_t i = 0; i < b->nr_hot; i++)
+        sum += *(const uint64_t *) (mem + b->hot_list[i] * (size_t) MEMSNAP_PAGE_SIZE);
+    (void) sum;
+    return bench_now() - start;
+}
+
+static int snapbench_eager(struct snapbench *b)
+{
+    uint8_t *mem = guest_mem(b->size);
+    uint64_t start, resume_ns, hot_ns;
+    size_t bad;
+
+    drop_cache(b->path);
+    start = bench_now();
+    if (memsnap_restore(b->path, mem, b->size) < 0)
+        return -1;
+    resume_ns = bench_now() - start;
+    hot_ns = touch_hot(b, mem);
+    bad = check_mem(b, mem);
+    printf("%-22s resume %8.1f ms  working set %8.1f ms  all pages %8.1f ms  %s\n",
+           "eager", resume_ns / 1e6, (resume_ns + hot_ns) / 1e6, resume_ns / 1e6,
+           bad ? "BAD" : "ok");
+    munmap(mem, b->size);
+    return bad ? -1 : 0;
+}
+
+static int snapbench_lazy(struct snapbench *b, const char *name, const char *path)
+{
+    uint8_t *mem = guest_mem(b->size);
+    memsnap_restore_t r;
+    uint64_t start, resume_ns, hot_ns;
+    size_t bad;
+    int err;
+
+    drop_cache(path);
+    start = bench_now();
+    if (memsnap_restore_lazy(&r, path, mem, b->size) < 0)
+        return -1;
+    resume_ns = bench_now() - start;
+    hot_ns = touch_hot(b, mem);
+    err = memsnap_restore_wait(&r);
+    bad = check_mem(b, mem);
+    printf("%-22s resume %8.1f ms  working set %8.1f ms  all pages %8.1f ms  %s\n",
+           name, resume_ns / 1e6, (resume_ns + hot_ns) / 1e6, r.done_ns / 1e6,
+           err || bad ? "BAD" : "ok");
+    printf("%-22s %lu pages served to faults, %lu streamed\n", "", r.faults,
+           r.streamed);
+    munmap(mem, b->size);
+    return err || bad ? -1 : 0;
+}
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [-m mbytes] [-d dir] [-t percent] [-w percent]\n", prog);
+    printf("  -m  guest memory in MB (default 512)\n");
+    printf("  -d  directory of the snapshot files (default /tmp)\n");
+    printf("  -t  pages the guest wrote before the snapshot (default 50)\n");
+    printf("  -w  of those, the working set it uses on resume (default 5)\n");
+}
+
+int main(int argc, char **argv)
+{
+    struct snapbench b = {.size = 512UL << 20, .touched_pct = 50, .hot_pct = 5};
+    const char *dir = "/tmp";
+    uint8_t *mem;
+    uint64_t start;
+    int ret = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:d:t:w:")) != -1) {
+        switch (opt) {
+        case 'm':
+            b.size = strtoul(optarg, NULL, 10) << 20;
+            break;
+        case 'd':
+            dir = optarg;
+            break;
+        case 't':
+            b.touched_pct = strtoul(optarg, NULL, 10);
+            break;
+        case 'w':
+            b.hot_pct = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!b.size || b.touched_pct > 100 || b.hot_pct > 100) {
+        usage(argv[0]);
+        return 1;
+    }
+    b.pages = b.size / MEMSNAP_PAGE_SIZE;
+    snprintf(b.path, sizeof(b.path), "%s/snapbench.mem", dir);
+    snprintf(b.cold_path, sizeof(b.cold_path), "%s/snapbench-nohot.mem", dir);
+
+    mem = snapbench_guest(&b);
+    start = bench_now();
+    if (memsnap_save(b.path, mem, b.size, b.hot) < 0 ||
+        memsnap_save(b.cold_path, mem, b.size, NULL) < 0)
+        return 1;
+    printf("%zu MB guest, %u%% written, %zu hot pages, %.1f ms per snapshot\n",
+           b.size >> 20, b.touched_pct, b.nr_hot, (bench_now() - start) / 2e6);
+    munmap(mem, b.size);
+
+    if (snapbench_eager(&b) < 0 ||
+        snapbench_lazy(&b, "lazy", b.cold_path) < 0 ||
+        snapbench_lazy(&b, "lazy, hot pages first", b.path) < 0)
+        ret = 1;
+
+    unlink(b.path);
+    unlink(b.cold_path);
+    free(b.hot);
+    free(b.hot_list);
+    return ret;
+}
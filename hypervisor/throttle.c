@@ -0,0 +1,150 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "throttle.h"
+
+#define NSEC_PER_SEC 1000000000ULL
+
+static uint64_t throttle_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* A new limit starts with a full bucket */
+static void bucket_set(struct token_bucket *b, uint64_t rate, uint64_t burst,
+                       uint64_t now)
+{
+    b->rate = rate;
+    b->burst = burst ? burst : rate;
+    b->tokens = b->burst;
+    b->last_ns = now;
+}
+
+static void bucket_fill(struct token_bucket *b, uint64_t now)
+{
+    if (!b->rate)
+        return;
+    b->tokens += (double) b->rate * (now - b->last_ns) / NSEC_PER_SEC;
+    if (b->tokens > b->burst)
+        b->tokens = b->burst;
+    b->last_ns = now;
+}
+
+/* ns until the bucket holds cost tokens, or all of its burst */
+static uint64_t bucket_wait(struct token_bucket *b, uint64_t cost)
+{
+    double need = cost < b->burst ? cost : b->burst;
+
+    if (!b->rate || b->tokens >= need)
+        return 0;
+    return (need - b->tokens) * NSEC_PER_SEC / b->rate + 1;
+}
+
+void throttle_init(struct throttle *t)
+{
+    memset(t, 0, sizeof(*t));
+    pthread_mutex_init(&t->lock, NULL);
+}
+
+void throttle_set(struct throttle *t, const struct throttle_limits *limits)
+{
+    uint64_t now = throttle_now();
+
+    pthread_mutex_lock(&t->lock);
+    t->limits = *limits;
+    bucket_set(&t->ops, limits->iops, limits->iops_burst, now);
+    bucket_set(&t->bytes, limits->bps, limits->bps_burst, now);
+    pthread_mutex_unlock(&t->lock);
+}
+
+void throttle_get(struct throttle *t,
+                  struct throttle_limits *limits,
+                  struct throttle_stats *stats)
+{
+    pthread_mutex_lock(&t->lock);
+    *limits = t->limits;
+    *stats = t->stats;
+    pthread_mutex_unlock(&t->lock);
+}
+
+uint64_t throttle_admit(struct throttle *t, uint64_t bytes)
+{
+    uint64_t now, wait, bytes_wait;
+
+    pthread_mutex_lock(&t->lock);
+    if (!t->ops.rate && !t->bytes.rate) {
+        t->stats.ops++;
+        t->stats.bytes += bytes;
+        pthread_mutex_unlock(&t->lock);
+        return 0;
+    }
+    now = throttle_now();
+    bucket_fill(&t->ops, now);
+    bucket_fill(&t->bytes, now);
+    wait = bucket_wait(&t->ops, 1);
+    bytes_wait = bucket_wait(&t->bytes, bytes);
+    if (bytes_wait > wait)
+        wait = bytes_wait;
+    if (wait) {
+        if (!t->held_since_ns) {
+            t->held_since_ns = now;
+            t->stats.delayed++;
+        }
+        t->stats.throttled++;
+    } else {
+        if (t->ops.rate)
+            t->ops.tokens -= 1;
+        if (t->bytes.rate)
+            t->bytes.tokens -= bytes;
+        if (t->held_since_ns) {
+            t->stats.delay_ns += now - t->held_since_ns;
+            t->held_since_ns = 0;
+        }
+        t->stats.ops++;
+        t->stats.bytes += bytes;
+    }
+    pthread_mutex_unlock(&t->lock);
+    return wait;
+}
+
+int throttle_parse(struct throttle_limits *limits, const char *spec)
+{
+    struct throttle_limits l = *limits;
+    char *copy = strdup(spec), *save = NULL;
+    int ret = 0;
+
+    if (!copy)
+        return -1;
+    for (char *kv = strtok_r(copy, ", ", &save); kv && !ret;
+         kv = strtok_r(NULL, ", ", &save)) {
+        char *value = strchr(kv, '='), *end;
+        uint64_t n;
+
+        if (!value) {
+            ret = -1;
+            break;
+        }
+        *value++ = '\0';
+        n = strtoull(value, &end, 10);
+        if (end == value || *end)
+            ret = -1;
+        else if (!strcmp(kv, "iops"))
+            l.iops = n;
+        else if (!strcmp(kv, "iops-burst"))
+            l.iops_burst = n;
+        else if (!strcmp(kv, "bps"))
+            l.bps = n;
+        else if (!strcmp(kv, "bps-burst"))
+            l.bps_burst = n;
+        else
+            ret = -1;
+    }
+    free(copy);
+    if (!ret)
+        *limits = l;
+    return ret;
+}
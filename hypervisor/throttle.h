@@ -0,0 +1,57 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* I/O limits of a device as two token buckets, one of requests and one of
+ * bytes. A bucket fills at its rate up to its burst and a request takes its
+ * tokens from both; when one is short, the device leaves the request in the
+ * ring and retries it after throttle_admit's delay, so its queue thread never
+ * sleeps on a limit. A request larger than the burst goes once the bucket is
+ * full and leaves it in debt, so any size gets through.
+ */
+
+struct throttle_limits {
+    uint64_t iops; /* 0 for no limit */
+    uint64_t iops_burst; /* 0 for one second of iops */
+    uint64_t bps;
+    uint64_t bps_burst;
+};
+
+struct throttle_stats {
+    uint64_t ops; /* requests admitted */
+    uint64_t bytes;
+    uint64_t throttled; /* times a request was held back */
+    uint64_t delayed; /* requests held back at least once */
+    uint64_t delay_ns; /* time those requests waited in the ring */
+};
+
+struct token_bucket {
+    uint64_t rate; /* tokens per second, 0 for no limit */
+    uint64_t burst;
+    double tokens; /* below 0 after a request larger than the burst */
+    uint64_t last_ns;
+};
+
+struct throttle {
+    pthread_mutex_t lock; /* the queue thread against the control socket */
+    struct throttle_limits limits;
+    struct token_bucket ops;
+    struct token_bucket bytes;
+    struct throttle_stats stats;
+    uint64_t held_since_ns; /* when the request at the head was first held back */
+};
+
+void throttle_init(struct throttle *t);
+void throttle_set(struct throttle *t, const struct throttle_limits *limits);
+void throttle_get(struct throttle *t,
+                  struct throttle_limits *limits,
+                  struct throttle_stats *stats);
+/* Takes the tokens of a request and returns 0, or returns how many ns to wait
+ * before asking again */
+uint64_t throttle_admit(struct throttle *t, uint64_t bytes);
+/* "iops=<n>,iops-burst=<n>,bps=<n>,bps-burst=<n>", any of them, separated by
+ * commas or spaces. Keys left out keep their value in limits; returns 0 on
+ * success */
+int throttle_parse(struct throttle_limits *limits, const char *spec);
@@ -0,0 +1,193 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define TRACE_RING_MASK (TRACE_RING_LEN - 1)
+
+// one per thread, only its thread writes records, trace_dump reads them behind head
+typedef struct trace_ring
+{
+    uint64_t head; // records written so far, the last TRACE_RING_LEN of them are kept
+    uint32_t tid;
+    char comm[16];
+    bool exited; // the thread is gone, the ring goes to the next new thread
+    trace_record_t records[TRACE_RING_LEN];
+} trace_ring_t;
+
+bool trace_enabled = false;
+
+static trace_ring_t* trace_rings[TRACE_MAX_THREADS];
+static int trace_ring_count;
+static uint64_t trace_tsc_hz;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER; // the rings table, not the records
+static pthread_once_t trace_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trace_key; // marks the ring of an exiting thread
+static __thread trace_ring_t* trace_ring;
+static __thread bool trace_ring_full; // no ring left for this thread, don't ask again
+
+static void trace_thread_exit(void* ring)
+{
+    __atomic_store_n(&((trace_ring_t*) ring)->exited, true, __ATOMIC_RELEASE);
+}
+
+static void trace_key_init(void)
+{
+    pthread_key_create(&trace_key, trace_thread_exit);
+}
+
+static void trace_ring_name(trace_ring_t* ring)
+{
+    int fd = open("/proc/thread-self/comm", O_RDONLY | O_CLOEXEC);
+    ssize_t n = fd < 0 ? -1 : read(fd, ring->comm, sizeof(ring->comm) - 1);
+
+    ring->comm[n > 0 ? n : 0] = '\0';
+    ring->comm[strcspn(ring->comm, "\n")] = '\0';
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+}
+
+// the ring of the calling thread, taken on its first record
+static trace_ring_t* trace_ring_get(void)
+{
+    trace_ring_t* ring = NULL;
+
+    if (trace_ring_full)
+    {
+        return NULL;
+    }
+    pthread_once(&trace_key_once, trace_key_init);
+    pthread_mutex_lock(&trace_lock);
+    for (int i = 0; i < trace_ring_count && !ring; i++)
+    {
+        if (__atomic_load_n(&trace_rings[i]->exited, __ATOMIC_ACQUIRE))
+        {
+            ring = trace_rings[i];
+        }
+    }
+    if (!ring && trace_ring_count < TRACE_MAX_THREADS)
+    {
+        ring = malloc(sizeof(*ring));
+        if (ring)
+        {
+            trace_rings[trace_ring_count++] = ring;
+        }
+    }
+    if (ring)
+    {
+        ring->tid = syscall(SYS_gettid);
+        trace_ring_name(ring);
+        __atomic_store_n(&ring->head, 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&ring->exited, false, __ATOMIC_RELEASE);
+        pthread_setspecific(trace_key, ring);
+    }
+    pthread_mutex_unlock(&trace_lock);
+
+    trace_ring = ring;
+    trace_ring_full = !ring;
+    return ring;
+}
+
+void trace_record(uint32_t event, uint32_t a, uint64_t b, uint64_t c)
+{
+    trace_ring_t* ring = trace_ring ? trace_ring : trace_ring_get();
+    trace_record_t* record;
+    uint64_t head;
+
+    if (!ring)
+    {
+        return;
+    }
+    head = ring->head;
+    record = &ring->records[head & TRACE_RING_MASK];
+    record->tsc = trace_now();
+    record->event = event;
+    record->a = a;
+    record->b = b;
+    record->c = c;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// TSC ticks per second, against CLOCK_MONOTONIC over 20 ms
+static uint64_t trace_calibrate_tsc(void)
+{
+    struct timespec start, now, delay = {.tv_nsec = 20000000};
+    uint64_t tsc_start, tsc_end;
+    double seconds;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    tsc_start = trace_now();
+    nanosleep(&delay, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    tsc_end = trace_now();
+    seconds = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+    return (tsc_end - tsc_start) / seconds;
+}
+
+void trace_start(void)
+{
+    if (!trace_tsc_hz)
+    {
+        trace_tsc_hz = trace_calibrate_tsc();
+    }
+    __atomic_store_n(&trace_enabled, true, __ATOMIC_RELEASE);
+}
+
+void trace_stop(void)
+{
+    __atomic_store_n(&trace_enabled, false, __ATOMIC_RELEASE);
+}
+
+/*
+the rings are copied while their threads keep recording, so the oldest records of a busy ring
+may be overwritten as they are written out: stop the trace first for an exact dump
+*/
+int trace_dump(const char* path)
+{
+    struct trace_header header = {.magic = TRACE_MAGIC, .version = TRACE_VERSION};
+    FILE* f = fopen(path, "w");
+    int total = 0;
+
+    if (!f)
+    {
+        perror("open trace dump");
+        return -1;
+    }
+
+    pthread_mutex_lock(&trace_lock);
+    header.threads = trace_ring_count;
+    header.tsc_hz = trace_tsc_hz;
+    fwrite(&header, sizeof(header), 1, f);
+    for (int i = 0; i < trace_ring_count; i++)
+    {
+        trace_ring_t* ring = trace_rings[i];
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint32_t count = head < TRACE_RING_LEN ? head : TRACE_RING_LEN;
+        uint32_t first = (head - count) & TRACE_RING_MASK;
+        uint32_t part = TRACE_RING_LEN - first < count ? TRACE_RING_LEN - first : count;
+        struct trace_thread_header thread = {.tid = ring->tid, .count = count};
+
+        memcpy(thread.comm, ring->comm, sizeof(thread.comm));
+        fwrite(&thread, sizeof(thread), 1, f);
+        // the ring wraps around at most once
+        fwrite(&ring->records[first], sizeof(trace_record_t), part, f);
+        fwrite(ring->records, sizeof(trace_record_t), count - part, f);
+        total += count;
+    }
+    pthread_mutex_unlock(&trace_lock);
+
+    if (fclose(f) != 0)
+    {
+        perror("write trace dump");
+        return -1;
+    }
+    return total;
+}
@@ -0,0 +1,81 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <x86intrin.h>
+
+#define TRACE_RING_LEN 65536 // records per thread, a power of 2
+#define TRACE_MAX_THREADS 256
+#define TRACE_MAGIC "RKVMTRC"
+#define TRACE_VERSION 1
+#define TRACE_EXIT_INTERRUPTED 0xffffffff // KVM_RUN returned for a signal
+
+/*
+binary trace of the device emulation, for bugs and slowdowns printf can't catch.
+each thread records into a ring of its own, without locks, with TSC timestamps; the rings are
+only allocated once tracing starts and a disabled TRACE() is a load and a branch.
+trace_dump writes the rings to a file, build/tracedump decodes it into a timeline and latencies
+*/
+enum trace_event
+{
+    TRACE_VCPU_RUN, // entering KVM_RUN
+    TRACE_VCPU_EXIT, // a: exit reason or TRACE_EXIT_INTERRUPTED, b: port or guest physical address
+    TRACE_BUS_IO, // a: size | is_write << 8, b: address, c: TSC ticks in the device
+    TRACE_PCI_CONFIG, // a: offset | size << 16 | is_write << 24, b: value, c: device id
+    TRACE_PCI_BAR, // a: bar | is_io << 8, b: size, c: device id
+    TRACE_VQ_AVAIL, // a: buffer id, b: the virtq
+    TRACE_VQ_USED, // a: buffer id, b: the virtq, c: bytes written
+    TRACE_IRQ, // a: irq line, b: level (1 for the edge of an irqfd)
+    TRACE_EVENT_COUNT,
+};
+
+typedef struct trace_record
+{
+    uint64_t tsc;
+    uint32_t event; // enum trace_event
+    uint32_t a;
+    uint64_t b;
+    uint64_t c;
+} trace_record_t;
+
+// the dump file: a header, then per thread a trace_thread_header and its records, oldest first
+struct trace_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t threads;
+    uint64_t tsc_hz;
+};
+
+struct trace_thread_header
+{
+    uint32_t tid;
+    char comm[16];
+    uint32_t count;
+};
+
+extern bool trace_enabled;
+
+#define TRACE_ENABLED() __builtin_expect(__atomic_load_n(&trace_enabled, __ATOMIC_RELAXED), 0)
+
+#define TRACE(event, a, b, c)                         \
+    do                                                \
+    {                                                 \
+        if (TRACE_ENABLED())                          \
+        {                                             \
+            trace_record((event), (a), (b), (c));     \
+        }                                             \
+    } while (0)
+
+static inline uint64_t trace_now(void)
+{
+    return __rdtsc();
+}
+
+void trace_record(uint32_t event, uint32_t a, uint64_t b, uint64_t c);
+void trace_start(void);
+void trace_stop(void);
+int trace_dump(const char* path); // returns the number of records written, -1 on failure
+
+#endif // TRACE_H
@@ -0,0 +1,349 @@
+#include <getopt.h>
+#include <linux/kvm.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+/* Decoder of the trace the hypervisor dumps (--trace, or "trace dump" on the
+ * control and daemon sockets): a timeline of the events of all the threads
+ * and where the time went, per exit reason, device address and virtqueue.
+ */
+
+struct tracedump_record {
+    trace_record_t r;
+    unsigned int thread;
+};
+
+struct tracedump_thread {
+    struct trace_thread_header header;
+    uint64_t run_tsc; /* last TRACE_VCPU_RUN */
+    uint64_t exit_tsc; /* last TRACE_VCPU_EXIT */
+    uint32_t exit_reason;
+};
+
+/* count, total and maximum of a latency, in TSC ticks */
+struct tracedump_stat {
+    uint64_t key;
+    uint64_t count;
+    uint64_t total;
+    uint64_t max;
+    uint64_t guest_total; /* vCPU exits: time in the guest before the exit */
+};
+
+struct tracedump_table {
+    struct tracedump_stat *stats;
+    size_t len;
+    size_t cap;
+};
+
+/* an avail descriptor waiting for its used one */
+struct tracedump_pending {
+    uint64_t vq;
+    uint32_t id;
+    uint64_t tsc;
+};
+
+static double tsc_hz;
+
+static double ticks_us(uint64_t ticks)
+{
+    return ticks * 1e6 / tsc_hz;
+}
+
+static struct tracedump_stat *table_get(struct tracedump_table *t, uint64_t key)
+{
+    for (size_t i = 0; i < t->len; i++) {
+        if (t->stats[i].key == key)
+            return &t->stats[i];
+    }
+    if (t->len == t->cap) {
+        t->cap = t->cap ? t->cap * 2 : 64;
+        t->stats = realloc(t->stats, t->cap * sizeof(*t->stats));
+        if (!t->stats) {
+            perror("tracedump");
+            exit(1);
+        }
+    }
+    t->stats[t->len] = (struct tracedump_stat){.key = key};
+    return &t->stats[t->len++];
+}
+
+static void stat_add(struct tracedump_stat *s, uint64_t ticks)
+{
+    s->count++;
+    s->total += ticks;
+    if (ticks > s->max)
+        s->max = ticks;
+}
+
+static int stat_by_total(const void *a, const void *b)
+{
+    const struct tracedump_stat *x = a, *y = b;
+
+    return x->total < y->total ? 1 : x->total > y->total ? -1 : 0;
+}
+
+static int record_by_tsc(const void *a, const void *b)
+{
+    const struct tracedump_record *x = a, *y = b;
+
+    return x->r.tsc < y->r.tsc ? -1 : x->r.tsc > y->r.tsc ? 1 : 0;
+}
+
+static const char *exit_reason_name(uint32_t reason)
+{
+    static char buf[32];
+
+    switch (reason) {
+    case KVM_EXIT_IO:
+        return "io";
+    case KVM_EXIT_MMIO:
+        return "mmio";
+    case KVM_EXIT_HLT:
+        return "hlt";
+    case KVM_EXIT_DEBUG:
+        return "debug";
+    case KVM_EXIT_SHUTDOWN:
+        return "shutdown";
+    case KVM_EXIT_INTERNAL_ERROR:
+        return "internal_error";
+    case KVM_EXIT_FAIL_ENTRY:
+        return "fail_entry";
+    case KVM_EXIT_SYSTEM_EVENT:
+        return "system_event";
+    case TRACE_EXIT_INTERRUPTED:
+        return "interrupted";
+    default:
+        snprintf(buf, sizeof(buf), "reason_%u", reason);
+        return buf;
+    }
+}
+
+static void print_event(const trace_record_t *r, char *buf, size_t len)
+{
+    switch (r->event) {
+    case TRACE_VCPU_RUN:
+        snprintf(buf, len, "vcpu run");
+        break;
+    case TRACE_VCPU_EXIT:
+        snprintf(buf, len, "vcpu exit %s 0x%lx", exit_reason_name(r->a), r->b);
+        break;
+    case TRACE_BUS_IO:
+        snprintf(buf, len, "bus %s 0x%lx size %u, %.3f us", (r->a >> 8) ? "write" : "read",
+                 r->b, r->a & 0xff, ticks_us(r->c));
+        break;
+    case TRACE_PCI_CONFIG:
+        snprintf(buf, len, "pci config %s device 0x%lx offset 0x%x size %u value 0x%lx",
+                 (r->a >> 24) ? "write" : "read", r->c, r->a & 0xffff, (r->a >> 16) & 0xff, r->b);
+        break;
+    case TRACE_PCI_BAR:
+        snprintf(buf, len, "pci bar %u device 0x%lx size 0x%lx %s", r->a & 0xff, r->c, r->b,
+                 (r->a >> 8) ? "io" : "memory");
+        break;
+    case TRACE_VQ_AVAIL:
+        snprintf(buf, len, "vq 0x%lx avail id %u", r->b, r->a);
+        break;
+    case TRACE_VQ_USED:
+        snprintf(buf, len, "vq 0x%lx used id %u len %lu", r->b, r->a, r->c);
+        break;
+    case TRACE_IRQ:
+        snprintf(buf, len, "irq %u level %lu", r->a, r->b);
+        break;
+    default:
+        snprintf(buf, len, "event %u", r->event);
+        break;
+    }
+}
+
+static void print_table(const char *title,
+                        const char *key_title,
+                        struct tracedump_table *t,
+                        size_t limit,
+                        void (*print_key)(uint64_t key, char *buf, size_t len))
+{
+    char key[64];
+
+    if (!t->len)
+        return;
+    qsort(t->stats, t->len, sizeof(*t->stats), stat_by_total);
+    printf("\n%s\n", title);
+    printf("  %-24s %10s %12s %12s %12s\n", key_title, "count", "total us", "mean us",
+           "max us");
+    for (size_t i = 0; i < t->len && i < limit; i++) {
+        struct tracedump_stat *s = &t->stats[i];
+        print_key(s->key, key, sizeof(key));
+        printf("  %-24s %10lu %12.1f %12.3f %12.3f\n", key, s->count, ticks_us(s->total),
+               ticks_us(s->total) / s->count, ticks_us(s->max));
+    }
+}
+
+static void print_reason(uint64_t key, char *buf, size_t len)
+{
+    snprintf(buf, len, "%s", exit_reason_name(key));
+}
+
+static void print_addr(uint64_t key, char *buf, size_t len)
+{
+    snprintf(buf, len, "0x%lx", key);
+}
+
+static void print_irq(uint64_t key, char *buf, size_t len)
+{
+    snprintf(buf, len, "irq %lu", key);
+}
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [-t] [-n records] <trace_file>\n", prog);
+    printf("  -t  print the timeline of all the threads before the summary\n");
+    printf("  -n  at most this many timeline records (default all)\n");
+}
+
+int main(int argc, char **argv)
+{
+    struct tracedump_table exits = {0}, bus = {0}, vqs = {0}, irqs = {0};
+    struct tracedump_pending *pending = NULL;
+    size_t npending = 0, pending_cap = 0;
+    struct tracedump_thread *threads;
+    struct tracedump_record *records = NULL;
+    struct trace_header header;
+    size_t count = 0, limit = (size_t) -1;
+    bool timeline = false;
+    FILE *f;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "tn:")) != -1) {
+        switch (opt) {
+        case 't':
+            timeline = true;
+            break;
+        case 'n':
+            limit = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    f = fopen(argv[optind], "r");
+    if (!f) {
+        perror(argv[optind]);
+        return 1;
+    }
+    if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) ||
+        header.version != TRACE_VERSION) {
+        printf("%s is not a trace of this hypervisor\n", argv[optind]);
+        return 1;
+    }
+    tsc_hz = header.tsc_hz ? header.tsc_hz : 1e9;
+
+    threads = calloc(header.threads ? header.threads : 1, sizeof(*threads));
+    for (unsigned int i = 0; i < header.threads; i++) {
+        struct trace_thread_header *th = &threads[i].header;
+        if (fread(th, sizeof(*th), 1, f) != 1) {
+            printf("truncated trace\n");
+            return 1;
+        }
+        records = realloc(records, (count + th->count) * sizeof(*records));
+        for (uint32_t j = 0; j < th->count; j++) {
+            if (fread(&records[count].r, sizeof(trace_record_t), 1, f) != 1) {
+                printf("truncated trace\n");
+                return 1;
+            }
+            records[count++].thread = i;
+        }
+    }
+    fclose(f);
+    if (!count) {
+        printf("no records\n");
+        return 0;
+    }
+    qsort(records, count, sizeof(*records), record_by_tsc);
+
+    printf("%zu records over %.3f ms, TSC at %.3f GHz\n", count,
+           ticks_us(records[count - 1].r.tsc - records[0].r.tsc) / 1e3, tsc_hz / 1e9);
+    for (unsigned int i = 0; i < header.threads; i++)
+        printf("  thread %-8u %-16s %8u records\n", threads[i].header.tid, threads[i].header.comm,
+               threads[i].header.count);
+    if (timeline)
+        printf("\n%12s  %-8s %s\n", "us", "thread", "event");
+
+    for (size_t i = 0; i < count; i++) {
+        const trace_record_t *r = &records[i].r;
+        struct tracedump_thread *t = &threads[records[i].thread];
+
+        if (timeline && i < limit) {
+            char event[128];
+            print_event(r, event, sizeof(event));
+            printf("%12.3f  %-8u %s\n", ticks_us(r->tsc - records[0].r.tsc), t->header.tid, event);
+        }
+
+        switch (r->event) {
+        case TRACE_VCPU_RUN:
+            /* the exit was handled, in userspace, since the previous exit */
+            if (t->exit_tsc)
+                stat_add(table_get(&exits, t->exit_reason), r->tsc - t->exit_tsc);
+            t->run_tsc = r->tsc;
+            t->exit_tsc = 0;
+            break;
+        case TRACE_VCPU_EXIT:
+            t->exit_tsc = r->tsc;
+            t->exit_reason = r->a;
+            if (t->run_tsc)
+                table_get(&exits, r->a)->guest_total += r->tsc - t->run_tsc;
+            break;
+        case TRACE_BUS_IO:
+            stat_add(table_get(&bus, r->b), r->c);
+            break;
+        case TRACE_VQ_AVAIL: {
+            bool found = false;
+            /* a chain records each of its descriptors, the first one counts */
+            for (size_t j = 0; j < npending && !found; j++)
+                found = pending[j].vq == r->b && pending[j].id == r->a;
+            if (found)
+                break;
+            if (npending == pending_cap) {
+                pending_cap = pending_cap ? pending_cap * 2 : 256;
+                pending = realloc(pending, pending_cap * sizeof(*pending));
+            }
+            pending[npending++] = (struct tracedump_pending){.vq = r->b, .id = r->a, .tsc = r->tsc};
+            break;
+        }
+        case TRACE_VQ_USED:
+            for (size_t j = 0; j < npending; j++) {
+                if (pending[j].vq == r->b && pending[j].id == r->a) {
+                    stat_add(table_get(&vqs, r->b), r->tsc - pending[j].tsc);
+                    pending[j] = pending[--npending];
+                    break;
+                }
+            }
+            break;
+        case TRACE_IRQ:
+            if (r->b)
+                stat_add(table_get(&irqs, r->a), 0);
+            break;
+        }
+    }
+
+    print_table("userspace handling of vCPU exits, from the exit to the next KVM_RUN", "exit reason",
+                &exits, (size_t) -1, print_reason);
+    for (size_t i = 0; i < exits.len; i++)
+        printf("  %-24s %.1f us in the guest before these exits\n", exit_reason_name(exits.stats[i].key),
+               ticks_us(exits.stats[i].guest_total));
+    print_table("time in the device per bus address, the 20 busiest", "address", &bus, 20, print_addr);
+    print_table("virtqueue latency, from avail to used", "virtq", &vqs, (size_t) -1, print_addr);
+    if (npending)
+        printf("  %zu buffers still in flight\n", npending);
+    print_table("interrupts raised", "line", &irqs, (size_t) -1, print_irq);
+
+    free(pending);
+    free(records);
+    free(threads);
+    return 0;
+}
@@ -1,44 +1,79 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #define container_of(ptr, type, member)               \
     ({                                                \
         void *__mptr = (void *) (ptr);                \
         ((type *) (__mptr - offsetof(type, member))); \
     })
 
-#define FIFO_LEN 64
-#define FIFO_MASK (FIFO_LEN - 1)
+/* A byte ring with a single producer and a single consumer. The producer only
+ * moves tail and the consumer only moves head, so neither side takes a lock:
+ * the release store of an index publishes the bytes (or the free slots) behind
+ * it to the other side.
+ */
+#define RING_LEN 4096
+#define RING_MASK (RING_LEN - 1)
 
-struct fifo {
-    unsigned int data[FIFO_LEN];
+struct ring {
+    uint8_t data[RING_LEN];
     unsigned int head, tail;
 };
 
-#define fifo_is_empty(fifo) ((fifo)->head == (fifo)->tail)
+/* Producer: the free contiguous bytes at the tail, to be filled in place */
+static inline unsigned int ring_write_space(struct ring *r, uint8_t **ptr)
+{
+    unsigned int tail = r->tail;
+    unsigned int used = tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    unsigned int contiguous = RING_LEN - (tail & RING_MASK);
 
-#define fifo_is_full(fifo) ((fifo)->tail - (fifo)->head > FIFO_MASK)
+    *ptr = &r->data[tail & RING_MASK];
+    return RING_LEN - used < contiguous ? RING_LEN - used : contiguous;
+}
 
-#define fifo_capacity(fifo) ((fifo)->tail - (fifo)->head)
+/* Producer: publish n bytes written at the tail */
+static inline void ring_produce(struct ring *r, unsigned int n)
+{
+    __atomic_store_n(&r->tail, r->tail + n, __ATOMIC_RELEASE);
+}
 
-#define fifo_put(fifo, value)                               \
-    ({                                                      \
-        unsigned int __ret = !fifo_is_full(fifo);           \
-        if (__ret) {                                        \
-            (fifo)->data[(fifo)->tail & FIFO_MASK] = value; \
-            (fifo)->tail++;                                 \
-        }                                                   \
-        __ret;                                              \
-    })
+/* Consumer: take one byte, false when the ring is empty */
+static inline bool ring_get(struct ring *r, uint8_t *value)
+{
+    unsigned int head = r->head;
 
-#define fifo_get(fifo, value)                               \
-    ({                                                      \
-        unsigned int __ret = !fifo_is_empty(fifo);          \
-        if (__ret) {                                        \
-            value = (fifo)->data[(fifo)->head & FIFO_MASK]; \
-            (fifo)->head++;                                 \
-        }                                                   \
-        __ret;                                              \
-    })
+    if (head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE))
+        return false;
+    *value = r->data[head & RING_MASK];
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/* Either side: the bytes in the ring */
+static inline unsigned int ring_used(struct ring *r)
+{
+    return __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) -
+           __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+}
+
+/* The hypervisor runs under sudo, so the sockets it creates are handed to the
+ * user that ran sudo (the ssh server) instead of being left to root only.
+ */
+static inline void sudo_chown_socket(const char *path)
+{
+    const char *uid = getenv("SUDO_UID");
+    const char *gid = getenv("SUDO_GID");
+
+    if (uid && gid && chown(path, atoi(uid), atoi(gid)) < 0)
+        perror("chown socket");
+    chmod(path, 0660);
+}
 
 #endif
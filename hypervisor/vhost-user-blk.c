@@ -0,0 +1,301 @@
+#include <linux/virtio_config.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "vhost-user-blk.h"
+#include "vhost-user.h"
+#include "vm.h"
+
+/* The device features of the backend (bits 0 to 23) go to the guest, of the
+ * transport features only those virtq.c has: no indirect descriptors, no
+ * event index */
+#define VHOST_USER_BLK_FEATURES                                                \
+    (((1ULL << 24) - 1) | 1ULL << VIRTIO_F_VERSION_1 | 1ULL << VIRTIO_F_RING_PACKED)
+#define VHOST_USER_BLK_PROTOCOL_FEATURES                                       \
+    (1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK | 1ULL << VHOST_USER_PROTOCOL_F_CONFIG)
+
+const char *vhost_user_blk_path(const char *disk_path)
+{
+    size_t len = strlen(VHOST_USER_BLK_PREFIX);
+
+    return strncmp(disk_path, VHOST_USER_BLK_PREFIX, len) ? NULL : disk_path + len;
+}
+
+/* A request, and the reply of a get. The other requests are acked when the
+ * backend can, so a failure shows up where it happened. Returns 0 or -1 */
+static int vhost_user_blk_call(struct vhost_user_blk_dev *dev,
+                               struct vhost_user_msg *msg,
+                               const int *fds,
+                               int nfds,
+                               bool get)
+{
+    uint32_t request = msg->request;
+    bool ack = !get && (dev->protocol_features &
+                        (1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK));
+    int rfds[VHOST_USER_MAX_FDS], nr;
+
+    if (ack)
+        msg->flags |= VHOST_USER_FLAG_NEED_REPLY;
+    if (vhost_user_send(dev->sock, msg, fds, nfds) < 0)
+        return -1;
+    if (!get && !ack)
+        return 0;
+    if (vhost_user_recv(dev->sock, msg, rfds, &nr) < 0) {
+        fprintf(stderr, "vhost-user: %s is gone\n", dev->path);
+        return -1;
+    }
+    for (int i = 0; i < nr; i++)
+        close(rfds[i]);
+    if (msg->request != request || !(msg->flags & VHOST_USER_FLAG_REPLY) ||
+        msg->size < sizeof(msg->u64) || (ack && msg->u64)) {
+        fprintf(stderr, "vhost-user: %s failed request %u\n", dev->path, request);
+        return -1;
+    }
+    return 0;
+}
+
+static int vhost_user_blk_set(struct vhost_user_blk_dev *dev,
+                              uint32_t request,
+                              uint64_t value)
+{
+    struct vhost_user_msg msg = {.request = request, .size = sizeof(msg.u64)};
+
+    msg.u64 = value;
+    return vhost_user_blk_call(dev, &msg, NULL, 0, false);
+}
+
+static int vhost_user_blk_get(struct vhost_user_blk_dev *dev,
+                              uint32_t request,
+                              uint64_t *value)
+{
+    struct vhost_user_msg msg = {.request = request};
+
+    if (vhost_user_blk_call(dev, &msg, NULL, 0, true) < 0)
+        return -1;
+    *value = msg.u64;
+    return 0;
+}
+
+static int vhost_user_blk_set_vring(struct vhost_user_blk_dev *dev,
+                                    uint32_t request,
+                                    uint32_t index,
+                                    uint32_t num)
+{
+    struct vhost_user_msg msg = {.request = request, .size = sizeof(msg.state)};
+
+    msg.state = (struct vhost_user_vring_state){.index = index, .num = num};
+    return vhost_user_blk_call(dev, &msg, NULL, 0, false);
+}
+
+static int vhost_user_blk_set_vring_fd(struct vhost_user_blk_dev *dev,
+                                       uint32_t request,
+                                       uint32_t index,
+                                       int fd)
+{
+    struct vhost_user_msg msg = {.request = request, .size = sizeof(msg.u64)};
+
+    msg.u64 = index;
+    return vhost_user_blk_call(dev, &msg, &fd, 1, false);
+}
+
+/* Features, the config space and the guest memory, before the guest sees
+ * the device */
+static int vhost_user_blk_handshake(struct vhost_user_blk_dev *dev)
+{
+    guest *v = dev->guest;
+    struct vhost_user_msg msg = {.request = VHOST_USER_GET_CONFIG};
+    struct vhost_user_region region = {
+        .guest_addr = 0,
+        .size = GUEST_MEMORY_SIZE,
+        .user_addr = (uintptr_t) v->mem,
+        .mmap_offset = 0,
+    };
+    uint64_t protocol_features;
+
+    if (vhost_user_blk_set(dev, VHOST_USER_SET_OWNER, 0) < 0 ||
+        vhost_user_blk_get(dev, VHOST_USER_GET_FEATURES, &dev->features) < 0)
+        return -1;
+    if (!(dev->features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES)) ||
+        !(dev->features & (1ULL << VIRTIO_F_RING_PACKED))) {
+        fprintf(stderr, "vhost-user: %s has no protocol features or no packed ring\n",
+                dev->path);
+        return -1;
+    }
+    if (vhost_user_blk_get(dev, VHOST_USER_GET_PROTOCOL_FEATURES,
+                           &protocol_features) < 0)
+        return -1;
+    protocol_features &= VHOST_USER_BLK_PROTOCOL_FEATURES;
+    if (!(protocol_features & (1ULL << VHOST_USER_PROTOCOL_F_CONFIG))) {
+        fprintf(stderr, "vhost-user: %s does not give its config space\n", dev->path);
+        return -1;
+    }
+    if (vhost_user_blk_set(dev, VHOST_USER_SET_PROTOCOL_FEATURES,
+                           protocol_features) < 0)
+        return -1;
+    /* acks from here on */
+    dev->protocol_features = protocol_features;
+
+    msg.size = offsetof(struct vhost_user_config, data) + sizeof(dev->config);
+    msg.config.offset = 0;
+    msg.config.size = sizeof(dev->config);
+    if (vhost_user_blk_call(dev, &msg, NULL, 0, true) < 0 ||
+        msg.config.size != sizeof(dev->config))
+        return -1;
+    memcpy(&dev->config, msg.config.data, sizeof(dev->config));
+
+    msg = (struct vhost_user_msg){
+        .request = VHOST_USER_SET_MEM_TABLE,
+        .size = offsetof(struct vhost_user_mem, regions) + sizeof(region),
+    };
+    msg.mem.nregions = 1;
+    memcpy(msg.mem.regions, &region, sizeof(region));
+    return vhost_user_blk_call(dev, &msg, &v->mem_fd, 1, false);
+}
+
+/* The queue the driver set up goes to the backend, the doorbell to the kick
+ * fd, and the backend starts on it */
+static int vhost_user_blk_start(struct vhost_user_blk_dev *dev, struct virtq *vq)
+{
+    guest *v = dev->guest;
+    struct virtq_info *info = &vq->info;
+    uint32_t index = vq - dev->vq;
+    uint32_t base = vq->next_avail_idx | (vq->used_wrap_count ? VHOST_USER_VRING_WRAP : 0);
+    struct vhost_user_msg msg = {
+        .request = VHOST_USER_SET_VRING_ADDR,
+        .size = sizeof(msg.addr),
+    };
+
+    if (!vm_guest_range_valid(v, info->desc_addr,
+                              info->size * sizeof(struct vring_packed_desc)) ||
+        !vm_guest_range_valid(v, info->device_addr, sizeof(struct vring_packed_desc_event)) ||
+        !vm_guest_range_valid(v, info->driver_addr, sizeof(struct vring_packed_desc_event)))
+        return -1;
+    msg.addr = (struct vhost_user_vring_addr){
+        .index = index,
+        .desc = (uintptr_t) vm_guest_to_host(v, info->desc_addr),
+        .used = (uintptr_t) vm_guest_to_host(v, info->device_addr),
+        .avail = (uintptr_t) vm_guest_to_host(v, info->driver_addr),
+    };
+    if (vhost_user_blk_set(dev, VHOST_USER_SET_FEATURES,
+                           dev->virtio_pci_dev.guest_feature |
+                               (1ULL << VHOST_USER_F_PROTOCOL_FEATURES)) < 0 ||
+        vhost_user_blk_set_vring(dev, VHOST_USER_SET_VRING_NUM, index, info->size) < 0 ||
+        vhost_user_blk_call(dev, &msg, NULL, 0, false) < 0 ||
+        vhost_user_blk_set_vring(dev, VHOST_USER_SET_VRING_BASE, index,
+                                 base | base << VHOST_USER_VRING_USED_SHIFT) < 0 ||
+        vhost_user_blk_set_vring_fd(dev, VHOST_USER_SET_VRING_CALL, index, dev->call_fd) < 0)
+        return -1;
+
+    /* a doorbell rung before the backend has the fd stays in its counter */
+    vm_ioeventfd_register(v, dev->kick_fd,
+                          virtio_pci_get_notify_addr(&dev->virtio_pci_dev, vq),
+                          dev->virtio_pci_dev.notify_cap->cap.length, 0);
+    if (vhost_user_blk_set_vring_fd(dev, VHOST_USER_SET_VRING_KICK, index, dev->kick_fd) < 0 ||
+        vhost_user_blk_set_vring(dev, VHOST_USER_SET_VRING_ENABLE, index, 1) < 0)
+        return -1;
+    dev->started = true;
+    return 0;
+}
+
+static void vhost_user_blk_enable_vq(struct virtq *vq)
+{
+    struct vhost_user_blk_dev *dev = (struct vhost_user_blk_dev *) vq->dev;
+
+    if (vq->info.enable)
+        return;
+    vq->info.enable = true;
+    if (vhost_user_blk_start(dev, vq) < 0)
+        fprintf(stderr, "vhost-user: %s did not take the queue, the disk stays silent\n",
+                dev->path);
+}
+
+/* The doorbell is the kick fd of the backend once the queue is enabled, the
+ * interrupts come from it through the irqfd */
+static void vhost_user_blk_complete_request(struct virtq *vq)
+{
+    (void) vq;
+}
+
+static void vhost_user_blk_notify_used(struct virtq *vq)
+{
+    (void) vq;
+}
+
+static struct virtq_ops ops = {
+    .enable_vq = vhost_user_blk_enable_vq,
+    .complete_request = vhost_user_blk_complete_request,
+    .notify_used = vhost_user_blk_notify_used,
+};
+
+int vhost_user_blk_init_pci(struct vhost_user_blk_dev *dev,
+                            guest *v,
+                            const char *path,
+                            int irq)
+{
+    struct virtio_pci_dev *pci_dev = &dev->virtio_pci_dev;
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+    if (!v->mem_shared || strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "vhost-user: no shared guest memory or a bad socket path\n");
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    strcpy(dev->path, path);
+    dev->guest = v;
+    dev->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    dev->kick_fd = eventfd(0, EFD_CLOEXEC);
+    dev->call_fd = eventfd(0, EFD_CLOEXEC);
+    if (dev->sock < 0 || dev->kick_fd < 0 || dev->call_fd < 0 ||
+        connect(dev->sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        perror(path);
+        goto err;
+    }
+    if (vhost_user_blk_handshake(dev) < 0)
+        goto err;
+
+    dev->enable = true;
+    dev->irq_num = irq;
+    vm_irqfd_register(v, dev->call_fd, dev->irq_num, 0);
+    for (int i = 0; i < VHOST_USER_BLK_VIRTQ_NUM; i++)
+        virtq_init(&dev->vq[i], dev, &ops);
+    virtio_pci_init(pci_dev, &v->pci, &v->io_bus, &v->mmio_bus);
+    pci_dev->notify_external = true;
+    virtio_pci_set_dev_cfg(pci_dev, &dev->config, sizeof(dev->config));
+    virtio_pci_set_pci_hdr(pci_dev, VIRTIO_PCI_DEVICE_ID_BLK, VIRTIO_BLK_PCI_CLASS,
+                           dev->irq_num);
+    virtio_pci_set_virtq(pci_dev, dev->vq, VHOST_USER_BLK_VIRTQ_NUM);
+    virtio_pci_add_feature(pci_dev, dev->features & VHOST_USER_BLK_FEATURES);
+    return virtio_pci_enable(pci_dev);
+
+err:
+    if (dev->sock >= 0)
+        close(dev->sock);
+    if (dev->kick_fd >= 0)
+        close(dev->kick_fd);
+    if (dev->call_fd >= 0)
+        close(dev->call_fd);
+    return -1;
+}
+
+void vhost_user_blk_exit(struct vhost_user_blk_dev *dev)
+{
+    struct vhost_user_msg msg = {
+        .request = VHOST_USER_GET_VRING_BASE,
+        .size = sizeof(msg.state),
+    };
+
+    if (!dev->enable)
+        return;
+    /* the backend stops touching the guest memory before it goes away */
+    if (dev->started && vhost_user_blk_call(dev, &msg, NULL, 0, true) < 0)
+        fprintf(stderr, "vhost-user: %s did not stop the queue\n", dev->path);
+    virtio_pci_exit(&dev->virtio_pci_dev);
+    close(dev->sock);
+    close(dev->kick_fd);
+    close(dev->call_fd);
+}
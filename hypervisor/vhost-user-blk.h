@@ -0,0 +1,43 @@
+#pragma once
+
+#include <linux/virtio_blk.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "pci.h"
+#include "virtio_pci.h"
+#include "virtq.h"
+
+#define VHOST_USER_BLK_PREFIX "vhost-user:" /* of a disk path */
+#define VHOST_USER_BLK_VIRTQ_NUM 1
+
+struct guest;
+
+/* A virtio-blk device served by a vhost-user backend (vhost-user.h), e.g.
+ * build/vhostblkd: the transport is emulated here, the queue and the disk
+ * image are in the backend.
+ */
+struct vhost_user_blk_dev {
+    struct virtio_pci_dev virtio_pci_dev;
+    struct virtio_blk_config config;
+    struct virtq vq[VHOST_USER_BLK_VIRTQ_NUM];
+    struct guest *guest;
+    char path[108]; /* of the socket */
+    int sock;
+    int kick_fd; /* the ioeventfd of the doorbell, read by the backend */
+    int call_fd; /* the irqfd, written by the backend */
+    int irq_num;
+    uint64_t features; /* of the backend */
+    uint64_t protocol_features;
+    bool started;
+    bool enable;
+};
+
+/* The socket path of a disk path naming a backend, NULL for a disk image */
+const char *vhost_user_blk_path(const char *disk_path);
+/* Connects to the backend and hands it the guest memory. Returns 0 on success */
+int vhost_user_blk_init_pci(struct vhost_user_blk_dev *dev,
+                            struct guest *g,
+                            const char *path,
+                            int irq);
+void vhost_user_blk_exit(struct vhost_user_blk_dev *dev);
@@ -0,0 +1,112 @@
+#include <errno.h>
+#include <linux/memfd.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "vhost-user.h"
+
+int vhost_user_send(int sock, struct vhost_user_msg *msg, const int *fds, int nfds)
+{
+    char control[CMSG_SPACE(VHOST_USER_MAX_FDS * sizeof(int))] = {0};
+    struct iovec iov = {.iov_base = msg, .iov_len = VHOST_USER_HDR_SIZE + msg->size};
+    struct msghdr mh = {.msg_iov = &iov, .msg_iovlen = 1};
+    struct cmsghdr *cmsg;
+    ssize_t n;
+
+    if (nfds > VHOST_USER_MAX_FDS || msg->size > sizeof(*msg) - VHOST_USER_HDR_SIZE)
+        return -1;
+    msg->flags |= VHOST_USER_VERSION;
+    if (nfds) {
+        mh.msg_control = control;
+        mh.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+    }
+    /* a backend that died must not take the frontend with it */
+    do {
+        n = sendmsg(sock, &mh, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    if (n != (ssize_t) iov.iov_len) {
+        perror("vhost-user send");
+        return -1;
+    }
+    return 0;
+}
+
+static int recv_all(int sock, void *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len) {
+        n = recv(sock, buf, len, MSG_WAITALL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf = (uint8_t *) buf + n;
+        len -= n;
+    }
+    return 0;
+}
+
+int vhost_user_recv(int sock, struct vhost_user_msg *msg, int *fds, int *nfds)
+{
+    char control[CMSG_SPACE(VHOST_USER_MAX_FDS * sizeof(int))];
+    struct iovec iov = {.iov_base = msg, .iov_len = VHOST_USER_HDR_SIZE};
+    struct msghdr mh = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr *cmsg;
+    ssize_t n;
+
+    *nfds = 0;
+    do {
+        n = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+    } while (n < 0 && errno == EINTR);
+    for (cmsg = CMSG_FIRSTHDR(&mh); n > 0 && cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            *nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), *nfds * sizeof(int));
+        }
+    }
+    if (n != (ssize_t) VHOST_USER_HDR_SIZE ||
+        (msg->flags & VHOST_USER_VERSION_MASK) != VHOST_USER_VERSION ||
+        msg->size > sizeof(*msg) - VHOST_USER_HDR_SIZE ||
+        recv_all(sock, &msg->u64, msg->size) < 0) {
+        for (int i = 0; i < *nfds; i++)
+            close(fds[i]);
+        *nfds = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void *vhost_user_alloc_mem(size_t size, int *fd)
+{
+    void *mem;
+
+    /* memfd_create(2) is only declared with _GNU_SOURCE */
+    *fd = syscall(SYS_memfd_create, "guest-memory", MFD_CLOEXEC);
+    if (*fd < 0 || ftruncate(*fd, size) < 0) {
+        perror("guest memory memfd");
+        if (*fd >= 0)
+            close(*fd);
+        return MAP_FAILED;
+    }
+    mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, *fd, 0);
+    if (mem == MAP_FAILED) {
+        perror("mmap guest memory memfd");
+        close(*fd);
+    }
+    return mem;
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* The vhost-user protocol (docs/interop/vhost-user.rst of QEMU), the part a
+ * block device needs. The frontend emulates the virtio transport and hands
+ * the queues to a backend process over a unix socket: the guest memory as
+ * memfds, the rings as addresses in it, the kick fd KVM signals on the
+ * doorbell and the call fd that makes KVM interrupt the guest. The requests
+ * then go from the guest to the backend and back without the frontend.
+ */
+
+#define VHOST_USER_VERSION 0x1
+#define VHOST_USER_VERSION_MASK 0x3
+#define VHOST_USER_FLAG_REPLY (1 << 2)
+#define VHOST_USER_FLAG_NEED_REPLY (1 << 3)
+
+#define VHOST_USER_F_PROTOCOL_FEATURES 30
+#define VHOST_USER_PROTOCOL_F_REPLY_ACK 3
+#define VHOST_USER_PROTOCOL_F_CONFIG 9
+
+#define VHOST_USER_MAX_FDS 8
+#define VHOST_USER_MAX_REGIONS 8
+#define VHOST_USER_CONFIG_MAX 256
+#define VHOST_USER_VRING_INDEX_MASK 0xff /* of the kick and call messages */
+#define VHOST_USER_VRING_NOFD (1 << 8)
+
+/* the state of a packed ring in SET_VRING_BASE and GET_VRING_BASE */
+#define VHOST_USER_VRING_WRAP (1 << 15)
+#define VHOST_USER_VRING_USED_SHIFT 16
+
+enum vhost_user_request {
+    VHOST_USER_GET_FEATURES = 1,
+    VHOST_USER_SET_FEATURES = 2,
+    VHOST_USER_SET_OWNER = 3,
+    VHOST_USER_RESET_OWNER = 4,
+    VHOST_USER_SET_MEM_TABLE = 5,
+    VHOST_USER_SET_VRING_NUM = 8,
+    VHOST_USER_SET_VRING_ADDR = 9,
+    VHOST_USER_SET_VRING_BASE = 10,
+    VHOST_USER_GET_VRING_BASE = 11,
+    VHOST_USER_SET_VRING_KICK = 12,
+    VHOST_USER_SET_VRING_CALL = 13,
+    VHOST_USER_SET_VRING_ERR = 14,
+    VHOST_USER_GET_PROTOCOL_FEATURES = 15,
+    VHOST_USER_SET_PROTOCOL_FEATURES = 16,
+    VHOST_USER_GET_QUEUE_NUM = 17,
+    VHOST_USER_SET_VRING_ENABLE = 18,
+    VHOST_USER_GET_CONFIG = 24,
+};
+
+struct vhost_user_vring_state {
+    uint32_t index;
+    uint32_t num;
+};
+
+/* addresses in the address space of the frontend */
+struct vhost_user_vring_addr {
+    uint32_t index;
+    uint32_t flags;
+    uint64_t desc;
+    uint64_t used; /* the device event area of a packed ring */
+    uint64_t avail; /* the driver event area */
+    uint64_t log;
+};
+
+struct vhost_user_region {
+    uint64_t guest_addr;
+    uint64_t size;
+    uint64_t user_addr; /* where the frontend mapped it */
+    uint64_t mmap_offset; /* in the fd */
+};
+
+struct vhost_user_mem {
+    uint32_t nregions;
+    uint32_t padding;
+    struct vhost_user_region regions[VHOST_USER_MAX_REGIONS];
+};
+
+struct vhost_user_config {
+    uint32_t offset;
+    uint32_t size;
+    uint32_t flags;
+    uint8_t data[VHOST_USER_CONFIG_MAX];
+};
+
+struct vhost_user_msg {
+    uint32_t request;
+    uint32_t flags;
+    uint32_t size; /* of the payload */
+    union {
+        uint64_t u64;
+        struct vhost_user_vring_state state;
+        struct vhost_user_vring_addr addr;
+        struct vhost_user_mem mem;
+        struct vhost_user_config config;
+    };
+} __attribute__((packed));
+
+#define VHOST_USER_HDR_SIZE offsetof(struct vhost_user_msg, u64)
+
+/* Sends msg, size bytes of payload, with nfds descriptors. Returns 0 or -1 */
+int vhost_user_send(int sock, struct vhost_user_msg *msg, const int *fds, int nfds);
+/* Receives a message and its descriptors, *nfds of them. Returns 0, or -1
+ * when the peer is gone or the message is garbage */
+int vhost_user_recv(int sock, struct vhost_user_msg *msg, int *fds, int *nfds);
+/* Guest memory a backend can map: size bytes of a memfd, mapped shared.
+ * Returns the mapping and the memfd in *fd, or MAP_FAILED */
+void *vhost_user_alloc_mem(size_t size, int *fd);
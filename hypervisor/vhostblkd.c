@@ -0,0 +1,490 @@
+#include <errno.h>
+#include <getopt.h>
+#include <linux/virtio_config.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "guest.h"
+#include "utils.h"
+#include "vhost-user.h"
+
+/* A vhost-user-blk backend (vhost-user.h): serves the virtio-blk queues of
+ * guests run by other processes, e.g. the hypervisor with a disk path of
+ * vhost-user:<socket>, with the request code of virtio-blk.c. Each socket is
+ * one disk image, one frontend at a time connects to it and the next one
+ * may come once it left. Block maps of the same store directory share one
+ * block store in here (blockstore.h), so the guests of one daemon share its
+ * blocks and their page cache.
+ *
+ * With -p the queue threads spin on their rings, and the drivers stop
+ * ringing the doorbell; with -c the queue threads run on the given CPUs, so
+ * a few cores poll for all the guests.
+ */
+
+#define VHOSTBLK_FEATURES                                                      \
+    (1ULL << VIRTIO_F_VERSION_1 | 1ULL << VIRTIO_F_RING_PACKED |               \
+     1ULL << VHOST_USER_F_PROTOCOL_FEATURES)
+#define VHOSTBLK_PROTOCOL_FEATURES                                             \
+    (1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK | 1ULL << VHOST_USER_PROTOCOL_F_CONFIG)
+#define VHOSTBLK_MAX_QUEUE_SIZE 32768
+
+struct vhostblk_region {
+    uint64_t guest_addr;
+    uint64_t size;
+    uint64_t user_addr; /* in the frontend */
+    uint8_t *host;
+    uint8_t *map; /* the mapping, from offset 0 of the fd */
+    size_t map_size;
+};
+
+/* One frontend. The guest is what virtio-blk.c takes its queue and its
+ * disk image from, its memory the regions the frontend sent */
+struct vhostblk_conn {
+    guest g; /* its first disk */
+    const char *disk_path;
+    enum diskimg_cache cache;
+    int sock;
+    struct vhostblk_region regions[VHOST_USER_MAX_REGIONS];
+    int nregions;
+    uint64_t features;
+    uint64_t protocol_features;
+    uint32_t num;
+    struct vhost_user_vring_addr addr;
+    uint32_t base;
+    int kick_fd; /* until the queue owns them */
+    int call_fd;
+    bool enabled;
+    bool disk_open;
+    bool started;
+};
+
+struct vhostblk_disk {
+    const char *socket_path;
+    const char *disk_path;
+    enum diskimg_cache cache;
+    int listen_fd;
+    pthread_t thread;
+};
+
+static bool poll_rings;
+static bool pin;
+static cpu_mask_t cpus;
+
+static struct vhostblk_conn *conn_of(guest *v)
+{
+    return container_of(v, struct vhostblk_conn, g);
+}
+
+static struct vhostblk_region *region_of(struct vhostblk_conn *c, uint64_t guest_addr)
+{
+    for (int i = 0; i < c->nregions; i++) {
+        struct vhostblk_region *r = &c->regions[i];
+        if (guest_addr >= r->guest_addr && guest_addr - r->guest_addr < r->size)
+            return r;
+    }
+    return NULL;
+}
+
+/* guest.c and vm.c, against the regions of the frontend */
+void *vm_guest_to_host(guest *v, uint64_t guest_addr)
+{
+    struct vhostblk_region *r = region_of(conn_of(v), guest_addr);
+
+    return r ? r->host + (guest_addr - r->guest_addr) : NULL;
+}
+
+bool vm_guest_range_valid(guest *v, uint64_t guest_addr, uint64_t len)
+{
+    struct vhostblk_region *r = region_of(conn_of(v), guest_addr);
+
+    return r && len <= r->size - (guest_addr - r->guest_addr);
+}
+
+/* the frontend put the kick fd on the doorbell and the call fd on the IRQ */
+void vm_ioeventfd_register(guest *v, int fd, unsigned long long addr, int len, int flags)
+{
+    (void) v;
+    (void) fd;
+    (void) addr;
+    (void) len;
+    (void) flags;
+}
+
+void vm_irqfd_register(guest *v, int fd, int gsi, int flags)
+{
+    (void) v;
+    (void) fd;
+    (void) gsi;
+    (void) flags;
+}
+
+void vm_place_io_thread(guest *g)
+{
+    (void) g;
+    if (pin)
+        cpu_mask_pin_self(&cpus);
+}
+
+/* A frontend address in the guest memory, in guest physical addresses */
+static bool frontend_to_guest(struct vhostblk_conn *c, uint64_t user_addr, uint64_t *guest_addr)
+{
+    for (int i = 0; i < c->nregions; i++) {
+        struct vhostblk_region *r = &c->regions[i];
+        if (user_addr >= r->user_addr && user_addr - r->user_addr < r->size) {
+            *guest_addr = r->guest_addr + (user_addr - r->user_addr);
+            return true;
+        }
+    }
+    return false;
+}
+
+static void unmap_regions(struct vhostblk_conn *c)
+{
+    for (int i = 0; i < c->nregions; i++)
+        munmap(c->regions[i].map, c->regions[i].map_size);
+    c->nregions = 0;
+}
+
+static int set_mem_table(struct vhostblk_conn *c, struct vhost_user_msg *msg, int *fds, int nfds)
+{
+    uint32_t n = msg->mem.nregions;
+
+    if (c->started || n > VHOST_USER_MAX_REGIONS || n != (uint32_t) nfds)
+        return -1;
+    unmap_regions(c);
+    for (uint32_t i = 0; i < n; i++) {
+        struct vhostblk_region *r = &c->regions[i];
+        struct vhost_user_region region;
+
+        memcpy(&region, &msg->mem.regions[i], sizeof(region));
+        r->guest_addr = region.guest_addr;
+        r->size = region.size;
+        r->user_addr = region.user_addr;
+        r->map_size = region.size + region.mmap_offset;
+        r->map = mmap(NULL, r->map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE,
+                      fds[i], 0);
+        if (r->map == MAP_FAILED) {
+            perror("vhostblkd: mmap guest memory");
+            unmap_regions(c);
+            return -1;
+        }
+        r->host = r->map + region.mmap_offset;
+        c->nregions++;
+    }
+    return 0;
+}
+
+static void set_fd(int *fd, uint64_t value, int *fds, int nfds)
+{
+    if (*fd >= 0)
+        close(*fd);
+    *fd = (value & VHOST_USER_VRING_NOFD) || !nfds ? -1 : fds[0];
+}
+
+/* Once the queue has its rings, its fds and is enabled, the thread of
+ * virtio-blk.c takes it */
+static int start_queue(struct vhostblk_conn *c)
+{
+    struct virtio_blk_dev *blk = &c->g.virtio_blk_dev[0];
+    struct virtq *vq = &blk->vq[0];
+    uint64_t desc, device, driver;
+
+    if (c->started || c->kick_fd < 0 || c->call_fd < 0 || !c->num ||
+        (!c->enabled && (c->features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES))))
+        return 0;
+    if (!frontend_to_guest(c, c->addr.desc, &desc) ||
+        !frontend_to_guest(c, c->addr.used, &device) ||
+        !frontend_to_guest(c, c->addr.avail, &driver) ||
+        !vm_guest_range_valid(&c->g, desc, c->num * sizeof(struct vring_packed_desc)) ||
+        !vm_guest_range_valid(&c->g, device, sizeof(struct vring_packed_desc_event)) ||
+        !vm_guest_range_valid(&c->g, driver, sizeof(struct vring_packed_desc_event))) {
+        fprintf(stderr, "vhostblkd: %s: rings outside of the guest memory\n", c->disk_path);
+        return -1;
+    }
+    /* a frontend that stopped the queue may start it again */
+    if (!c->disk_open && diskimg_open(&c->g.diskimg[0], c->disk_path, c->cache) < 0)
+        return -1;
+    c->disk_open = true;
+
+    virtio_blk_init(blk);
+    virtio_blk_init_backend(blk, &c->g, &c->g.diskimg[0], c->kick_fd, c->call_fd);
+    blk->poll = poll_rings;
+    vq->info.size = c->num;
+    vq->info.desc_addr = desc;
+    vq->info.device_addr = device;
+    vq->info.driver_addr = driver;
+    vq->next_avail_idx = c->base & (VHOST_USER_VRING_WRAP - 1);
+    vq->used_wrap_count = c->base & VHOST_USER_VRING_WRAP;
+    c->kick_fd = c->call_fd = -1;
+    virtq_enable(vq);
+    c->started = true;
+    return 0;
+}
+
+/* Joins the queue thread, the disk image closes with it. Returns the state
+ * of the ring for GET_VRING_BASE */
+static uint32_t stop_queue(struct vhostblk_conn *c)
+{
+    struct virtq *vq = &c->g.virtio_blk_dev[0].vq[0];
+    uint32_t state;
+
+    if (!c->started)
+        return c->base | c->base << VHOST_USER_VRING_USED_SHIFT;
+    virtio_blk_exit(&c->g.virtio_blk_dev[0]);
+    c->started = false;
+    c->disk_open = false;
+    state = vq->next_avail_idx | (vq->used_wrap_count ? VHOST_USER_VRING_WRAP : 0);
+    c->base = state;
+    return state | state << VHOST_USER_VRING_USED_SHIFT;
+}
+
+static int get_config(struct vhostblk_conn *c, struct vhost_user_msg *msg)
+{
+    struct virtio_blk_config config = {.capacity = c->g.diskimg[0].size >> 9};
+    uint32_t offset = msg->config.offset, size = msg->config.size;
+
+    if (offset > sizeof(config) || size > sizeof(config) - offset)
+        return -1;
+    memcpy(msg->config.data, (uint8_t *) &config + offset, size);
+    msg->size = offsetof(struct vhost_user_config, data) + size;
+    return 0;
+}
+
+/* Serves one message. Returns -1 once the frontend is gone */
+static int handle_msg(struct vhostblk_conn *c)
+{
+    struct vhost_user_msg msg;
+    int fds[VHOST_USER_MAX_FDS], nfds, ret = 0;
+    bool reply = false;
+
+    if (vhost_user_recv(c->sock, &msg, fds, &nfds) < 0)
+        return -1;
+    switch (msg.request) {
+    case VHOST_USER_GET_FEATURES:
+        msg.u64 = VHOSTBLK_FEATURES;
+        msg.size = sizeof(msg.u64);
+        reply = true;
+        break;
+    case VHOST_USER_SET_FEATURES:
+        c->features = msg.u64;
+        ret = (msg.u64 & ~VHOSTBLK_FEATURES) || !(msg.u64 & (1ULL << VIRTIO_F_RING_PACKED)) ? -1 : 0;
+        break;
+    case VHOST_USER_GET_PROTOCOL_FEATURES:
+        msg.u64 = VHOSTBLK_PROTOCOL_FEATURES;
+        msg.size = sizeof(msg.u64);
+        reply = true;
+        break;
+    case VHOST_USER_SET_PROTOCOL_FEATURES:
+        c->protocol_features = msg.u64 & VHOSTBLK_PROTOCOL_FEATURES;
+        break;
+    case VHOST_USER_GET_QUEUE_NUM:
+        msg.u64 = 1;
+        msg.size = sizeof(msg.u64);
+        reply = true;
+        break;
+    case VHOST_USER_GET_CONFIG:
+        ret = get_config(c, &msg);
+        reply = ret == 0;
+        break;
+    case VHOST_USER_SET_OWNER:
+    case VHOST_USER_RESET_OWNER:
+        break;
+    case VHOST_USER_SET_MEM_TABLE:
+        ret = set_mem_table(c, &msg, fds, nfds);
+        nfds = ret < 0 ? nfds : 0;
+        break;
+    /* one queue, set up while it is stopped */
+    case VHOST_USER_SET_VRING_NUM:
+        if (msg.state.index || c->started || !msg.state.num ||
+            msg.state.num > VHOSTBLK_MAX_QUEUE_SIZE)
+            ret = -1;
+        else
+            c->num = msg.state.num;
+        break;
+    case VHOST_USER_SET_VRING_ADDR:
+        if (msg.addr.index || c->started)
+            ret = -1;
+        else
+            memcpy(&c->addr, &msg.addr, sizeof(c->addr));
+        break;
+    case VHOST_USER_SET_VRING_BASE:
+        if (msg.state.index || c->started)
+            ret = -1;
+        else
+            c->base = msg.state.num & 0xffff;
+        break;
+    case VHOST_USER_GET_VRING_BASE:
+        msg.state.num = stop_queue(c);
+        msg.size = sizeof(msg.state);
+        reply = true;
+        break;
+    case VHOST_USER_SET_VRING_KICK:
+    case VHOST_USER_SET_VRING_CALL:
+        if ((msg.u64 & VHOST_USER_VRING_INDEX_MASK) || c->started) {
+            ret = -1;
+            break;
+        }
+        set_fd(msg.request == VHOST_USER_SET_VRING_KICK ? &c->kick_fd : &c->call_fd, msg.u64,
+               fds, nfds);
+        nfds = 0;
+        ret = start_queue(c);
+        break;
+    case VHOST_USER_SET_VRING_ENABLE:
+        c->enabled = msg.state.num;
+        ret = msg.state.index ? -1 : start_queue(c);
+        break;
+    default:
+        fprintf(stderr, "vhostblkd: %s: request %u not handled\n", c->disk_path, msg.request);
+        ret = -1;
+        break;
+    }
+    for (int i = 0; i < nfds; i++)
+        close(fds[i]);
+
+    if (!reply && (msg.flags & VHOST_USER_FLAG_NEED_REPLY) &&
+        (c->protocol_features & (1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK))) {
+        msg.u64 = ret < 0;
+        msg.size = sizeof(msg.u64);
+        reply = true;
+    }
+    if (!reply)
+        return 0;
+    msg.flags = VHOST_USER_FLAG_REPLY;
+    return vhost_user_send(c->sock, &msg, NULL, 0);
+}
+
+static void serve(struct vhostblk_disk *d, int sock)
+{
+    struct vhostblk_conn *c = calloc(1, sizeof(*c));
+
+    if (!c) {
+        close(sock);
+        return;
+    }
+    c->disk_path = d->disk_path;
+    c->cache = d->cache;
+    c->sock = sock;
+    c->kick_fd = c->call_fd = -1;
+    if (diskimg_open(&c->g.diskimg[0], d->disk_path, d->cache) < 0) {
+        fprintf(stderr, "vhostblkd: %s: can't open the disk image\n", d->disk_path);
+        close(sock);
+        free(c);
+        return;
+    }
+    c->disk_open = true;
+    printf("%s: frontend connected\n", d->socket_path);
+    while (handle_msg(c) == 0)
+        ;
+    stop_queue(c);
+    if (c->disk_open)
+        diskimg_exit(&c->g.diskimg[0]);
+    if (c->kick_fd >= 0)
+        close(c->kick_fd);
+    if (c->call_fd >= 0)
+        close(c->call_fd);
+    unmap_regions(c);
+    close(sock);
+    free(c);
+    printf("%s: frontend gone\n", d->socket_path);
+}
+
+static void *disk_thread(void *arg)
+{
+    struct vhostblk_disk *d = arg;
+    int sock;
+
+    for (;;) {
+        sock = accept(d->listen_fd, NULL, NULL);
+        if (sock < 0 && errno == EINTR)
+            continue;
+        if (sock < 0) {
+            perror(d->socket_path);
+            return NULL;
+        }
+        serve(d, sock);
+    }
+}
+
+static int disk_listen(struct vhostblk_disk *d)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+    if (strlen(d->socket_path) >= sizeof(addr.sun_path))
+        return -1;
+    strcpy(addr.sun_path, d->socket_path);
+    unlink(d->socket_path);
+    d->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (d->listen_fd < 0 || bind(d->listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        listen(d->listen_fd, 1) < 0) {
+        perror(d->socket_path);
+        return -1;
+    }
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [-p] [-c cpu_list] <socket_path> <disk_path> [<socket_path> <disk_path>...]\n",
+           prog);
+    printf("  -p  the queue threads poll their rings instead of waiting for the doorbell\n");
+    printf("  -c  run the queue threads on these CPUs, e.g. 2-3\n");
+    printf("  a guest gets the disk with vhost-user:<socket_path> as its disk path, a ,cache=writeback|\n");
+    printf("  writethrough|none suffix of <disk_path> picks how it goes through the page cache\n");
+}
+
+int main(int argc, char **argv)
+{
+    struct vhostblk_disk *disks;
+    int opt, n;
+
+    while ((opt = getopt(argc, argv, "pc:")) != -1) {
+        switch (opt) {
+        case 'p':
+            poll_rings = true;
+            break;
+        case 'c':
+            if (cpu_mask_parse(optarg, &cpus) < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            pin = true;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    n = (argc - optind) / 2;
+    if (!n || (argc - optind) % 2) {
+        usage(argv[0]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    disks = calloc(n, sizeof(*disks));
+    if (!disks)
+        return 1;
+    for (int i = 0; i < n; i++) {
+        disks[i].socket_path = argv[optind + 2 * i];
+        disks[i].disk_path = argv[optind + 2 * i + 1];
+        if (diskimg_parse_path(argv[optind + 2 * i + 1], &disks[i].cache) < 0) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (disk_listen(&disks[i]) < 0)
+            return 1;
+        pthread_create(&disks[i].thread, NULL, disk_thread, &disks[i]);
+        printf("%s: serving %s, cache=%s\n", disks[i].socket_path, disks[i].disk_path,
+               diskimg_cache_name(disks[i].cache));
+    }
+    for (int i = 0; i < n; i++)
+        pthread_join(disks[i].thread, NULL);
+    return 0;
+}
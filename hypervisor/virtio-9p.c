@@ -0,0 +1,160 @@
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "virtio-9p.h"
+#include "vm.h"
+
+static void virtio_9p_notify_used(struct virtq *vq)
+{
+    struct virtio_9p_dev *dev = (struct virtio_9p_dev *) vq->dev;
+    uint64_t n = 1;
+
+    TRACE(TRACE_IRQ, dev->irq_num, 1, 0);
+    if (write(dev->irqfd, &n, sizeof(n)) < 0)
+        perror("Failed to write the irqfd");
+}
+
+static bool virtio_9p_stopped(struct virtio_9p_dev *dev)
+{
+    return __atomic_load_n(&dev->stop, __ATOMIC_RELAXED);
+}
+
+/* File system calls block, so they are made here and not on the vCPU */
+static void *virtio_9p_vq_avail_handler(void *arg)
+{
+    struct virtq *vq = (struct virtq *) arg;
+    struct virtio_9p_dev *dev = (struct virtio_9p_dev *) vq->dev;
+    struct pollfd pfd = {.fd = dev->ioeventfd, .events = POLLIN};
+    uint64_t n;
+
+    vm_place_io_thread(dev->guest);
+    while (poll(&pfd, 1, -1) >= 0 && !virtio_9p_stopped(dev)) {
+        if ((pfd.revents & POLLIN) && read(dev->ioeventfd, &n, sizeof(n)) < 0)
+            perror("virtio-9p queue thread");
+        virtq_handle_avail(vq);
+    }
+    return NULL;
+}
+
+static void virtio_9p_enable_vq(struct virtq *vq)
+{
+    struct virtio_9p_dev *dev = (struct virtio_9p_dev *) vq->dev;
+    guest *v = dev->guest;
+    uint64_t addr;
+
+    if (vq->info.enable)
+        return;
+    vq->info.enable = true;
+    vq->desc_ring =
+        (struct vring_packed_desc *) vm_guest_to_host(v, vq->info.desc_addr);
+    vq->device_event = (struct vring_packed_desc_event *) vm_guest_to_host(
+        v, vq->info.device_addr);
+    vq->guest_event = (struct vring_packed_desc_event *) vm_guest_to_host(
+        v, vq->info.driver_addr);
+
+    addr = virtio_pci_get_notify_addr(&dev->virtio_pci_dev, vq);
+    vm_ioeventfd_register(v, dev->ioeventfd, addr,
+                          dev->virtio_pci_dev.notify_cap->cap.length, 0);
+    pthread_create(&dev->vq_avail_thread, NULL, virtio_9p_vq_avail_handler,
+                   (void *) vq);
+    __atomic_store_n(&dev->vq_avail_started, true, __ATOMIC_RELEASE);
+}
+
+/* A chain is the request, then the buffers of the reply. The server works
+ * on the guest memory in place */
+static void virtio_9p_complete_request(struct virtq *vq)
+{
+    struct virtio_9p_dev *dev = (struct virtio_9p_dev *) vq->dev;
+    struct virtq_chain chain;
+
+    while (virtq_pop_chain(vq, dev->guest, &chain)) {
+        uint32_t len = p9_server_handle(&dev->server, chain.iov, chain.nreadable,
+                                        chain.iov + chain.nreadable,
+                                        chain.niov - chain.nreadable);
+
+        virtq_push_chain(vq, &chain, len);
+        __atomic_or_fetch(&dev->virtio_pci_dev.config.isr_cap.isr_status,
+                          VIRTIO_PCI_ISR_QUEUE, __ATOMIC_RELAXED);
+    }
+}
+
+static struct virtq_ops ops = {
+    .enable_vq = virtio_9p_enable_vq,
+    .complete_request = virtio_9p_complete_request,
+    .notify_used = virtio_9p_notify_used,
+};
+
+int virtio_9p_init_pci(struct virtio_9p_dev *virtio_9p_dev,
+                       guest *g,
+                       const char *path,
+                       const char *tag,
+                       bool readonly,
+                       int irq)
+{
+    struct virtio_pci_dev *dev = &virtio_9p_dev->virtio_pci_dev;
+    size_t tag_len = strlen(tag);
+
+    if (!tag_len || tag_len > VIRTIO_9P_TAG_MAX) {
+        fprintf(stderr, "virtio-9p: the tag is 1 to %d characters\n",
+                VIRTIO_9P_TAG_MAX);
+        return -1;
+    }
+    if (p9_server_init(&virtio_9p_dev->server, path, readonly) < 0)
+        return -1;
+    virtio_9p_dev->enable = true;
+    virtio_9p_dev->guest = g;
+    virtio_9p_dev->path = strdup(path);
+    virtio_9p_dev->irq_num = irq;
+    virtio_9p_dev->config.tag_len = tag_len;
+    memcpy(virtio_9p_dev->config.tag, tag, tag_len);
+    virtio_9p_dev->ioeventfd = eventfd(0, EFD_CLOEXEC);
+    virtio_9p_dev->irqfd = eventfd(0, EFD_CLOEXEC);
+    vm_irqfd_register(g, virtio_9p_dev->irqfd, irq, 0);
+    for (int i = 0; i < VIRTIO_9P_VIRTQ_NUM; i++)
+        virtq_init(&virtio_9p_dev->vq[i], virtio_9p_dev, &ops);
+
+    virtio_pci_init(dev, &g->pci, &g->io_bus, &g->mmio_bus);
+    virtio_pci_set_dev_cfg(dev, &virtio_9p_dev->config,
+                           sizeof(virtio_9p_dev->config));
+    virtio_pci_set_pci_hdr(dev, VIRTIO_PCI_DEVICE_ID_9P, VIRTIO_9P_PCI_CLASS, irq);
+    virtio_pci_set_virtq(dev, virtio_9p_dev->vq, VIRTIO_9P_VIRTQ_NUM);
+    virtio_pci_add_feature(dev, 1ULL << VIRTIO_9P_MOUNT_TAG);
+    return virtio_pci_enable(dev);
+}
+
+void virtio_9p_print_stats(struct virtio_9p_dev *dev)
+{
+    struct p9_stats *st = &dev->server.stats;
+
+    if (!dev->enable)
+        return;
+    printf("virtio-9p: %lu requests, %lu errors, %lu bytes read, %lu bytes written\n",
+           __atomic_load_n(&st->requests, __ATOMIC_RELAXED),
+           __atomic_load_n(&st->errors, __ATOMIC_RELAXED),
+           __atomic_load_n(&st->read_bytes, __ATOMIC_RELAXED),
+           __atomic_load_n(&st->write_bytes, __ATOMIC_RELAXED));
+}
+
+void virtio_9p_exit(struct virtio_9p_dev *dev)
+{
+    uint64_t n = 1;
+
+    if (!dev->enable)
+        return;
+    /* the eventfd wakes up the queue thread, which sees the stop flag */
+    __atomic_store_n(&dev->stop, true, __ATOMIC_RELAXED);
+    if (write(dev->ioeventfd, &n, sizeof(n)) < 0)
+        perror("virtio-9p stop");
+    if (dev->vq_avail_started)
+        pthread_join(dev->vq_avail_thread, NULL);
+    p9_server_exit(&dev->server);
+    virtio_pci_exit(&dev->virtio_pci_dev);
+    close(dev->irqfd);
+    close(dev->ioeventfd);
+    free(dev->path);
+}
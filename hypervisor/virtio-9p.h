@@ -0,0 +1,51 @@
+#pragma once
+
+#include <linux/virtio_9p.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "p9.h"
+#include "pci.h"
+#include "virtio_pci.h"
+#include "virtq.h"
+
+#define VIRTIO_9P_VIRTQ_NUM 1
+#define VIRTIO_9P_PCI_CLASS 0x018000
+#define VIRTIO_9P_TAG_MAX 32
+
+struct guest;
+
+/* the tag the guest mounts the share by, struct virtio_9p_config */
+struct virtio_9p_cfg {
+    uint16_t tag_len;
+    char tag[VIRTIO_9P_TAG_MAX];
+} __attribute__((packed));
+
+/* A host directory shared with the guest, served by p9.c on a queue thread
+ * of its own */
+struct virtio_9p_dev {
+    struct virtio_pci_dev virtio_pci_dev;
+    struct virtio_9p_cfg config;
+    struct virtq vq[VIRTIO_9P_VIRTQ_NUM];
+    struct guest *guest;
+    struct p9_server server;
+    char *path; /* of the shared directory, a copy */
+    int irqfd;
+    int ioeventfd;
+    int irq_num;
+    pthread_t vq_avail_thread;
+    bool vq_avail_started;
+    bool stop;
+    bool enable;
+};
+
+/* Returns 0 on success */
+int virtio_9p_init_pci(struct virtio_9p_dev *dev,
+                       struct guest *g,
+                       const char *path,
+                       const char *tag,
+                       bool readonly,
+                       int irq);
+void virtio_9p_print_stats(struct virtio_9p_dev *dev);
+void virtio_9p_exit(struct virtio_9p_dev *dev);
@@ -0,0 +1,296 @@
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "utils.h"
+#include "virtio-balloon.h"
+#include "vm.h"
+
+static void virtio_balloon_notify_used(struct virtq *vq)
+{
+    struct virtio_balloon_dev *dev = (struct virtio_balloon_dev *) vq->dev;
+    uint64_t n = 1;
+
+    TRACE(TRACE_IRQ, dev->irq_num, 1, 0);
+    if (write(dev->irqfd, &n, sizeof(n)) < 0)
+        perror("Failed to write the irqfd");
+}
+
+static void virtio_balloon_enable_vq(struct virtq *vq)
+{
+    struct virtio_balloon_dev *dev = (struct virtio_balloon_dev *) vq->dev;
+    guest *v = container_of(dev, guest, virtio_balloon_dev);
+
+    if (vq->info.enable)
+        return;
+    vq->info.enable = true;
+    vq->desc_ring =
+        (struct vring_packed_desc *) vm_guest_to_host(v, vq->info.desc_addr);
+    vq->device_event = (struct vring_packed_desc_event *) vm_guest_to_host(
+        v, vq->info.device_addr);
+    vq->guest_event = (struct vring_packed_desc_event *) vm_guest_to_host(
+        v, vq->info.driver_addr);
+}
+
+/* Drop the host pages backing a range of guest memory. The next guest access
+ * faults in a zero page, which is what the guest expects from a page it gave
+ * back.
+ */
+static bool virtio_balloon_discard(struct virtio_balloon_dev *dev,
+                                   uint64_t guest_addr,
+                                   uint64_t len)
+{
+    guest *v = container_of(dev, guest, virtio_balloon_dev);
+    uint64_t page_mask = (1ULL << VIRTIO_BALLOON_PAGE_SHIFT) - 1;
+
+    if ((guest_addr & page_mask) || (len & page_mask) ||
+        !vm_guest_range_valid(v, guest_addr, len))
+        return false;
+    /* pages of a memfd stay in it, the backend may map them too */
+    if (madvise(vm_guest_to_host(v, guest_addr), len,
+                v->mem_shared ? MADV_REMOVE : MADV_DONTNEED) < 0) {
+        perror("madvise guest memory");
+        return false;
+    }
+    return true;
+}
+
+/* Each descriptor of a page reporting request is one free chunk. */
+static void virtio_balloon_report(struct virtio_balloon_dev *dev,
+                                  struct vring_packed_desc *desc)
+{
+    if (virtio_balloon_discard(dev, desc->addr, desc->len))
+        __atomic_add_fetch(&dev->reported_pages,
+                           desc->len >> VIRTIO_BALLOON_PAGE_SHIFT,
+                           __ATOMIC_RELAXED);
+}
+
+/* The driver allocates its queues without gaps, so the queue after the
+ * deflate queue is the stats queue only when the stats feature was negotiated.
+ * Otherwise it is the reporting queue, which the specification places at
+ * index 4. Free page hinting is never offered, so every later queue is the
+ * reporting queue too.
+ */
+static bool virtio_balloon_is_stats_vq(struct virtio_balloon_dev *dev, int index)
+{
+    return index == VIRTIO_BALLOON_VQ_STATS &&
+           (dev->virtio_pci_dev.guest_feature &
+            (1ULL << VIRTIO_BALLOON_F_STATS_VQ));
+}
+
+/* Each inflate buffer is an array of 32-bit page frame numbers. Runs of
+ * contiguous frames are discarded with a single madvise.
+ */
+static void virtio_balloon_inflate(struct virtio_balloon_dev *dev,
+                                   struct vring_packed_desc *desc)
+{
+    guest *v = container_of(dev, guest, virtio_balloon_dev);
+    uint32_t *pfns = vm_guest_to_host(v, desc->addr);
+    uint32_t num = desc->len / sizeof(uint32_t);
+    uint64_t start = 0, count = 0;
+
+    if (!vm_guest_range_valid(v, desc->addr, desc->len))
+        return;
+    for (uint32_t i = 0; i < num; i++) {
+        uint64_t pfn = pfns[i];
+        if (count && pfn == start + count) {
+            count++;
+            continue;
+        }
+        if (count)
+            virtio_balloon_discard(dev, start << VIRTIO_BALLOON_PAGE_SHIFT,
+                                   count << VIRTIO_BALLOON_PAGE_SHIFT);
+        start = pfn;
+        count = 1;
+    }
+    if (count)
+        virtio_balloon_discard(dev, start << VIRTIO_BALLOON_PAGE_SHIFT,
+                               count << VIRTIO_BALLOON_PAGE_SHIFT);
+    __atomic_add_fetch(&dev->inflated_pages, num, __ATOMIC_RELAXED);
+}
+
+/* Deflated pages need no work: the next guest access faults them back in. */
+static void virtio_balloon_deflate(struct virtio_balloon_dev *dev,
+                                   struct vring_packed_desc *desc)
+{
+    __atomic_sub_fetch(&dev->inflated_pages, desc->len / sizeof(uint32_t),
+                       __ATOMIC_RELAXED);
+}
+
+/* The stats buffer is not returned to the driver. It is kept until the next
+ * refresh, and the driver fills it again when it gets it back.
+ */
+static void virtio_balloon_receive_stats(struct virtio_balloon_dev *dev,
+                                         struct vring_packed_desc *desc)
+{
+    guest *v = container_of(dev, guest, virtio_balloon_dev);
+    struct virtio_balloon_stat *stat = vm_guest_to_host(v, desc->addr);
+    uint32_t num = desc->len / sizeof(struct virtio_balloon_stat);
+
+    pthread_mutex_lock(&dev->stats_lock);
+    if (vm_guest_range_valid(v, desc->addr, desc->len)) {
+        for (uint32_t i = 0; i < num; i++) {
+            if (stat[i].tag < VIRTIO_BALLOON_S_NR)
+                dev->stats[stat[i].tag] = stat[i].val;
+        }
+    }
+    dev->stats_desc = desc;
+    dev->stats_gen++;
+    pthread_cond_broadcast(&dev->stats_cond);
+    pthread_mutex_unlock(&dev->stats_lock);
+}
+
+static void virtio_balloon_complete_request(struct virtq *vq)
+{
+    struct virtio_balloon_dev *dev = (struct virtio_balloon_dev *) vq->dev;
+    int index = vq - dev->vq;
+    struct vring_packed_desc *desc;
+
+    while ((desc = virtq_get_avail(vq))) {
+        struct vring_packed_desc *used_desc = desc;
+
+        TRACE(TRACE_VQ_AVAIL, desc->id, (uintptr_t) vq, 0);
+        if (virtio_balloon_is_stats_vq(dev, index)) {
+            virtio_balloon_receive_stats(dev, desc);
+            continue;
+        }
+        while (desc) {
+            if (index == VIRTIO_BALLOON_VQ_INFLATE)
+                virtio_balloon_inflate(dev, desc);
+            else if (index == VIRTIO_BALLOON_VQ_DEFLATE)
+                virtio_balloon_deflate(dev, desc);
+            else
+                virtio_balloon_report(dev, desc);
+            if (!virtq_check_next(desc))
+                break;
+            desc = virtq_get_avail(vq);
+        }
+        TRACE(TRACE_VQ_USED, used_desc->id, (uintptr_t) vq, 0);
+        used_desc->flags ^= (1ULL << VRING_PACKED_DESC_F_USED);
+        used_desc->len = 0;
+        __atomic_or_fetch(&dev->virtio_pci_dev.config.isr_cap.isr_status,
+                          VIRTIO_PCI_ISR_QUEUE, __ATOMIC_RELAXED);
+    }
+}
+
+static struct virtq_ops ops = {
+    .enable_vq = virtio_balloon_enable_vq,
+    .complete_request = virtio_balloon_complete_request,
+    .notify_used = virtio_balloon_notify_used,
+};
+
+static void virtio_balloon_setup(struct virtio_balloon_dev *dev)
+{
+    guest *v = container_of(dev, guest, virtio_balloon_dev);
+    pthread_condattr_t attr;
+
+    dev->enable = true;
+    dev->irq_num = VIRTIO_BALLOON_IRQ;
+    pthread_mutex_init(&dev->stats_lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&dev->stats_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    dev->irqfd = eventfd(0, EFD_CLOEXEC);
+    vm_irqfd_register(v, dev->irqfd, dev->irq_num, 0);
+    for (int i = 0; i < VIRTIO_BALLOON_VIRTQ_NUM; i++)
+        virtq_init(&dev->vq[i], dev, &ops);
+}
+
+void virtio_balloon_init_pci(struct virtio_balloon_dev *virtio_balloon_dev,
+                             struct pci *pci,
+                             struct bus *io_bus,
+                             struct bus *mmio_bus)
+{
+    struct virtio_pci_dev *dev = &virtio_balloon_dev->virtio_pci_dev;
+
+    virtio_balloon_setup(virtio_balloon_dev);
+    virtio_pci_init(dev, pci, io_bus, mmio_bus);
+    virtio_pci_set_dev_cfg(dev, &virtio_balloon_dev->config,
+                           sizeof(virtio_balloon_dev->config));
+    virtio_pci_set_pci_hdr(dev, VIRTIO_PCI_DEVICE_ID_BALLOON,
+                           VIRTIO_BALLOON_PCI_CLASS,
+                           virtio_balloon_dev->irq_num);
+    virtio_pci_set_virtq(dev, virtio_balloon_dev->vq, VIRTIO_BALLOON_VIRTQ_NUM);
+    virtio_pci_add_feature(dev, (1ULL << VIRTIO_BALLOON_F_STATS_VQ) |
+                                    (1ULL << VIRTIO_BALLOON_F_DEFLATE_ON_OOM) |
+                                    (1ULL << VIRTIO_BALLOON_F_REPORTING));
+    virtio_pci_enable(dev);
+}
+
+/* Ask the guest to grow or shrink the balloon to the given number of 4K pages.
+ * The driver picks the new target up from the config change interrupt.
+ */
+void virtio_balloon_set_target(struct virtio_balloon_dev *dev, uint32_t pages)
+{
+    uint64_t n = 1;
+
+    __atomic_store_n(&dev->config.num_pages, pages, __ATOMIC_RELEASE);
+    __atomic_or_fetch(&dev->virtio_pci_dev.config.isr_cap.isr_status,
+                      VIRTIO_PCI_ISR_CONFIG, __ATOMIC_RELAXED);
+    TRACE(TRACE_IRQ, dev->irq_num, 1, 0);
+    if (write(dev->irqfd, &n, sizeof(n)) < 0)
+        perror("Failed to write the irqfd");
+}
+
+/* Hand the stats buffer back so the driver refreshes it. The new values
+ * arrive asynchronously on the stats queue, virtio_balloon_wait_stats waits
+ * for them.
+ */
+uint64_t virtio_balloon_request_stats(struct virtio_balloon_dev *dev)
+{
+    struct virtq *vq = &dev->vq[VIRTIO_BALLOON_VQ_STATS];
+    uint64_t gen;
+
+    pthread_mutex_lock(&dev->stats_lock);
+    gen = dev->stats_gen;
+    if (dev->stats_desc) {
+        TRACE(TRACE_VQ_USED, dev->stats_desc->id, (uintptr_t) vq, 0);
+        dev->stats_desc->flags ^= (1ULL << VRING_PACKED_DESC_F_USED);
+        dev->stats_desc->len = 0;
+        dev->stats_desc = NULL;
+        __atomic_or_fetch(&dev->virtio_pci_dev.config.isr_cap.isr_status,
+                          VIRTIO_PCI_ISR_QUEUE, __ATOMIC_RELAXED);
+        virtq_notify_used(vq);
+    }
+    pthread_mutex_unlock(&dev->stats_lock);
+    return gen;
+}
+
+int virtio_balloon_wait_stats(struct virtio_balloon_dev *dev, uint64_t gen, unsigned int timeout_ms)
+{
+    struct timespec ts;
+    int ret = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += timeout_ms / 1000;
+    ts.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    ts.tv_sec += ts.tv_nsec / 1000000000L;
+    ts.tv_nsec %= 1000000000L;
+    pthread_mutex_lock(&dev->stats_lock);
+    while (dev->stats_gen == gen && ret == 0)
+        ret = pthread_cond_timedwait(&dev->stats_cond, &dev->stats_lock, &ts);
+    ret = dev->stats_gen == gen ? -1 : 0;
+    pthread_mutex_unlock(&dev->stats_lock);
+    return ret;
+}
+
+void virtio_balloon_get_stats(struct virtio_balloon_dev *dev,
+                              uint64_t stats[VIRTIO_BALLOON_S_NR])
+{
+    pthread_mutex_lock(&dev->stats_lock);
+    memcpy(stats, dev->stats, sizeof(dev->stats));
+    pthread_mutex_unlock(&dev->stats_lock);
+}
+
+void virtio_balloon_exit(struct virtio_balloon_dev *dev)
+{
+    if (!dev->enable)
+        return;
+    virtio_pci_exit(&dev->virtio_pci_dev);
+    close(dev->irqfd);
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <linux/virtio_balloon.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "pci.h"
+#include "virtio_pci.h"
+#include "virtq.h"
+
+/* inflateq, deflateq, statsq, free_page_vq and reporting_vq */
+#define VIRTIO_BALLOON_VIRTQ_NUM 5
+#define VIRTIO_BALLOON_VQ_INFLATE 0
+#define VIRTIO_BALLOON_VQ_DEFLATE 1
+#define VIRTIO_BALLOON_VQ_STATS 2
+#define VIRTIO_BALLOON_PCI_CLASS 0xff0000
+#define VIRTIO_BALLOON_IRQ 14
+#define VIRTIO_BALLOON_PAGE_SHIFT 12
+#define VIRTIO_BALLOON_PAGES_PER_MB (1 << (20 - VIRTIO_BALLOON_PAGE_SHIFT))
+
+struct virtio_balloon_dev {
+    struct virtio_pci_dev virtio_pci_dev;
+    struct virtio_balloon_config config;
+    struct virtq vq[VIRTIO_BALLOON_VIRTQ_NUM];
+    int irqfd;
+    int irq_num;
+    uint64_t reported_pages; /* pages freed by the guest and dropped from RAM */
+    uint64_t inflated_pages; /* pages currently held by the balloon */
+    pthread_mutex_t stats_lock;
+    pthread_cond_t stats_cond; /* a new report came in */
+    struct vring_packed_desc *stats_desc; /* held until the next refresh */
+    uint64_t stats[VIRTIO_BALLOON_S_NR];
+    uint64_t stats_gen; /* reports received */
+    bool enable;
+};
+
+void virtio_balloon_set_target(struct virtio_balloon_dev *dev, uint32_t pages);
+/* Returns the number of the last report, for virtio_balloon_wait_stats */
+uint64_t virtio_balloon_request_stats(struct virtio_balloon_dev *dev);
+/* Waits up to timeout_ms for a report after report gen. Returns 0 once
+ * there is one, -1 on timeout: the guest sent none, e.g. it has no driver */
+int virtio_balloon_wait_stats(struct virtio_balloon_dev *dev, uint64_t gen, unsigned int timeout_ms);
+void virtio_balloon_get_stats(struct virtio_balloon_dev *dev,
+                              uint64_t stats[VIRTIO_BALLOON_S_NR]);
+void virtio_balloon_exit(struct virtio_balloon_dev *dev);
+void virtio_balloon_init_pci(struct virtio_balloon_dev *dev,
+                             struct pci *pci,
+                             struct bus *io_bus,
+                             struct bus *mmio_bus);
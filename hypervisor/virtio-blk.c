@@ -1,101 +1,94 @@
 #include <fcntl.h>
 #include <poll.h>
-#include <signal.h>
+#include <sched.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
 
 #include "err.h"
+#include "trace.h"
 #include "utils.h"
 #include "virtio-blk.h"
 #include "vm.h"
 
-//TODO: this will be removed, no need for a function in x86 arch
-static void* vm_guest_to_host(guest *v, uint64_t guest_addr)
-{
-    return (void *) ((uintptr_t) v->mem + guest_addr);
-}
-
-// TODO: this is temp
-void vm_ioeventfd_register(guest *v,
-                           int fd,
-                           unsigned long long addr,
-                           int len,
-                           int flags)
-{
-    struct kvm_ioeventfd ioeventfd = {
-        .fd = fd,
-        .addr = addr,
-        .len = len,
-        .flags = flags,
-    };
-
-    if (ioctl(v->vm_fd, KVM_IOEVENTFD, &ioeventfd) < 0)
-        perror("Failed to set the status of IOEVENTFD");
-}
-
-// TODO: also temp
-void vm_irqfd_register(guest *v, int fd, int gsi, int flags)
-{
-    struct kvm_irqfd irqfd = {
-        .fd = fd,
-        .gsi = gsi,
-        .flags = flags,
-    };
-
-    if (ioctl(v->vm_fd, KVM_IRQFD, &irqfd) < 0)
-        perror("Failed to set the status of IRQFD");
-}
-
-
 static void virtio_blk_notify_used(struct virtq *vq)
 {
     struct virtio_blk_dev *dev = (struct virtio_blk_dev *) vq->dev;
     uint64_t n = 1;
 
+    TRACE(TRACE_IRQ, dev->irq_num, 1, 0);
     if (write(dev->irqfd, &n, sizeof(n)) < 0)
         perror("Failed to write the irqfd");
 }
 
-static int virtio_blk_virtq_available(struct virtio_blk_dev *dev, int timeout)
+static bool virtio_blk_stopped(struct virtio_blk_dev *dev)
 {
-    struct pollfd pollfd = (struct pollfd){
-        .fd = dev->ioeventfd,
-        .events = POLLIN,
-    };
-    return (poll(&pollfd, 1, timeout) > 0) && (pollfd.revents & POLLIN);
+    return __atomic_load_n(&dev->stop, __ATOMIC_RELAXED);
 }
 
-static volatile bool thread_stop = false;
-
-static void *virtio_blk_thread(struct virtio_blk_dev *dev)
+/* On a core of its own: the ring is looked at all the time, so the driver is
+ * told not to ring the doorbell. A request the limits hold back is taken
+ * again on the next round */
+static void virtio_blk_poll(struct virtq *vq)
 {
-    while (!__atomic_load_n(&thread_stop, __ATOMIC_RELAXED)) {
-        if (virtio_blk_virtq_available(dev, -1))
-            pthread_kill((pthread_t) dev->vq_avail_thread, SIGUSR1);
-    }
+    struct virtio_blk_dev *dev = (struct virtio_blk_dev *) vq->dev;
 
-    return NULL;
+    __atomic_store_n(&vq->device_event->flags, VRING_PACKED_EVENT_FLAG_DISABLE,
+                     __ATOMIC_RELEASE);
+    while (!virtio_blk_stopped(dev)) {
+        /* costs nothing on a core of its own, and lets a shared one go on */
+        if (!virtq_has_avail(vq))
+            sched_yield();
+        virtq_handle_avail(vq);
+    }
 }
 
 static void *virtio_blk_vq_avail_handler(void *arg)
 {
     struct virtq *vq = (struct virtq *) arg;
     struct virtio_blk_dev *dev = (struct virtio_blk_dev *) vq->dev;
+    struct pollfd fds[] = {
+        {.fd = dev->ioeventfd, .events = POLLIN},
+        {.fd = dev->timer_fd, .events = POLLIN},
+    };
     uint64_t n;
 
-    while (read(dev->ioeventfd, &n, sizeof(n))) {
+    /* started by the vCPU thread, which may be pinned elsewhere */
+    vm_place_io_thread(dev->guest);
+    if (dev->poll) {
+        virtio_blk_poll(vq);
+        return NULL;
+    }
+    while (poll(fds, 2, -1) >= 0 && !virtio_blk_stopped(dev)) {
+        for (int i = 0; i < 2; i++) {
+            if ((fds[i].revents & POLLIN) && read(fds[i].fd, &n, sizeof(n)) < 0)
+                perror("virtio-blk queue thread");
+        }
         virtq_handle_avail(vq);
     }
     return NULL;
 }
 
+/* The request at next_avail_idx waits for the limits, the queue thread
+ * takes it again when the timer fires */
+static void virtio_blk_defer(struct virtio_blk_dev *dev, uint64_t wait_ns)
+{
+    struct itimerspec its = {
+        .it_value = {.tv_sec = wait_ns / 1000000000,
+                     .tv_nsec = wait_ns % 1000000000},
+    };
+
+    if (timerfd_settime(dev->timer_fd, 0, &its, NULL) < 0)
+        perror("virtio-blk throttle timer");
+}
+
 static void virtio_blk_enable_vq(struct virtq *vq)
 {
     struct virtio_blk_dev *dev = (struct virtio_blk_dev *) vq->dev;
-    guest *v = container_of(dev, guest, virtio_blk_dev);
+    guest *v = dev->guest;
 
     if (vq->info.enable)
         return;
@@ -107,11 +100,15 @@ static void virtio_blk_enable_vq(struct virtq *vq)
     vq->guest_event = (struct vring_packed_desc_event *) vm_guest_to_host(
         v, vq->info.driver_addr);
 
-    uint64_t addr = virtio_pci_get_notify_addr(&dev->virtio_pci_dev, vq);
-    vm_ioeventfd_register(v, dev->ioeventfd, addr,
-                          dev->virtio_pci_dev.notify_cap->cap.length, 0);
+    /* the kick fd of a backend is on the doorbell of the frontend already */
+    if (dev->virtio_pci_dev.notify_cap) {
+        uint64_t addr = virtio_pci_get_notify_addr(&dev->virtio_pci_dev, vq);
+        vm_ioeventfd_register(v, dev->ioeventfd, addr,
+                              dev->virtio_pci_dev.notify_cap->cap.length, 0);
+    }
     pthread_create(&dev->vq_avail_thread, NULL, virtio_blk_vq_avail_handler,
                    (void *) vq);
+    __atomic_store_n(&dev->vq_avail_started, true, __ATOMIC_RELEASE);
 }
 
 static ssize_t virtio_blk_write(struct virtio_blk_dev *dev,
@@ -133,16 +130,30 @@ static ssize_t virtio_blk_read(struct virtio_blk_dev *dev,
 static void virtio_blk_complete_request(struct virtq *vq)
 {
     struct virtio_blk_dev *dev = (struct virtio_blk_dev *) vq->dev;
-    guest *v = container_of(dev, guest, virtio_blk_dev);
+    guest *v = dev->guest;
     uint8_t status;
     struct vring_packed_desc *desc;
     struct virtio_blk_req req;
 
-    while ((desc = virtq_get_avail(vq))) {
-        struct vring_packed_desc *used_desc = desc;
-        int r = 0;
+    boot_profile_mark(&v->boot, BOOT_FIRST_BLK);
+    for (;;) {
+        uint16_t avail_idx = vq->next_avail_idx;
+        bool wrap_count = vq->used_wrap_count;
+        struct vring_packed_desc *used_desc;
+        ssize_t r = 0;
+        uint64_t wait;
 
-        memcpy(&req, vm_guest_to_host(v, desc->addr), desc->len);
+        if (!(desc = virtq_get_avail(vq)))
+            break;
+        used_desc = desc;
+
+        TRACE(TRACE_VQ_AVAIL, desc->id, (uintptr_t) vq, 0);
+        /* the guest picks the addresses, and a backend (vhostblkd.c)
+         * serves many guests: nothing outside the guest memory is used */
+        req.type = UINT32_MAX;
+        if (desc->len >= VIRTIO_BLK_REQ_HDR_SIZE &&
+            vm_guest_range_valid(v, desc->addr, VIRTIO_BLK_REQ_HDR_SIZE))
+            memcpy(&req, vm_guest_to_host(v, desc->addr), VIRTIO_BLK_REQ_HDR_SIZE);
         if (req.type == VIRTIO_BLK_T_IN || req.type == VIRTIO_BLK_T_OUT) {
             if (!virtq_check_next(desc))
                 return;
@@ -150,8 +161,19 @@ static void virtio_blk_complete_request(struct virtq *vq)
             req.data_size = desc->len;
             req.data = vm_guest_to_host(v, desc->addr);
 
-            ssize_t r;
-            if (req.type == VIRTIO_BLK_T_IN)
+            /* over the limits: put the chain back for later, the requests
+             * behind it wait too so the guest sees them in order */
+            wait = throttle_admit(&dev->throttle, req.data_size);
+            if (wait) {
+                vq->next_avail_idx = avail_idx;
+                vq->used_wrap_count = wrap_count;
+                virtio_blk_defer(dev, wait);
+                return;
+            }
+
+            if (!vm_guest_range_valid(v, desc->addr, desc->len))
+                r = -1;
+            else if (req.type == VIRTIO_BLK_T_IN)
                 r = virtio_blk_read(dev, req.data, req.sector << 9,
                                     req.data_size);
             else
@@ -166,9 +188,14 @@ static void virtio_blk_complete_request(struct virtq *vq)
             return;
         desc = virtq_get_avail(vq);
         req.status = vm_guest_to_host(v, desc->addr);
-        *req.status = status;
-        used_desc->flags ^= (1ULL << VRING_PACKED_DESC_F_USED);
+        if (vm_guest_range_valid(v, desc->addr, 1))
+            *req.status = status;
+        TRACE(TRACE_VQ_USED, used_desc->id, (uintptr_t) vq, r);
+        /* the driver owns the descriptor again as soon as it sees the flag */
         used_desc->len = r;
+        __atomic_store_n(&used_desc->flags,
+                         used_desc->flags ^ (1ULL << VRING_PACKED_DESC_F_USED),
+                         __ATOMIC_RELEASE);
         dev->virtio_pci_dev.config.isr_cap.isr_status |= VIRTIO_PCI_ISR_QUEUE;
     }
 }
@@ -180,41 +207,53 @@ static struct virtq_ops ops = {
 };
 
 static void virtio_blk_setup(struct virtio_blk_dev *dev,
-                             struct diskimg *diskimg)
+                             guest *g,
+                             struct diskimg *diskimg,
+                             int irq)
 {
-    guest *v = container_of(dev, guest, virtio_blk_dev);
-
     dev->enable = true;
-    /* FIXME: irq_num should be different to other devs */
-    dev->irq_num = VIRTIO_BLK_IRQ;
+    dev->guest = g;
+    dev->irq_num = irq;
     dev->diskimg = diskimg;
     dev->config.capacity = diskimg->size >> 9;
-    dev->ioeventfd = eventfd(0, EFD_CLOEXEC);
-    dev->irqfd = eventfd(0, EFD_CLOEXEC);
-    vm_irqfd_register(v, dev->irqfd, dev->irq_num, 0);
+    dev->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    throttle_init(&dev->throttle);
     for (int i = 0; i < VIRTIO_BLK_VIRTQ_NUM; i++)
         virtq_init(&dev->vq[i], dev, &ops);
 }
 
-void virtio_blk_init_pci(struct virtio_blk_dev *virtio_blk_dev,
-                         struct diskimg *diskimg,
-                         struct pci *pci,
-                         struct bus *io_bus,
-                         struct bus *mmio_bus)
+void virtio_blk_init_backend(struct virtio_blk_dev *dev,
+                             guest *g,
+                             struct diskimg *diskimg,
+                             int kick_fd,
+                             int call_fd)
+{
+    /* the frontend put the call fd on the IRQ line */
+    virtio_blk_setup(dev, g, diskimg, -1);
+    dev->ioeventfd = kick_fd;
+    dev->irqfd = call_fd;
+}
+
+int virtio_blk_init_pci(struct virtio_blk_dev *virtio_blk_dev,
+                        guest *g,
+                        struct diskimg *diskimg,
+                        int irq)
 {
     struct virtio_pci_dev *dev = &virtio_blk_dev->virtio_pci_dev;
+
     /* Initialize the device based on PCI */
-    virtio_blk_setup(virtio_blk_dev, diskimg);
-    virtio_pci_init(dev, pci, io_bus, mmio_bus);
+    virtio_blk_setup(virtio_blk_dev, g, diskimg, irq);
+    virtio_blk_dev->ioeventfd = eventfd(0, EFD_CLOEXEC);
+    virtio_blk_dev->irqfd = eventfd(0, EFD_CLOEXEC);
+    vm_irqfd_register(g, virtio_blk_dev->irqfd, irq, 0);
+    virtio_pci_init(dev, &g->pci, &g->io_bus, &g->mmio_bus);
     virtio_pci_set_dev_cfg(dev, &virtio_blk_dev->config,
                            sizeof(virtio_blk_dev->config));
     virtio_pci_set_pci_hdr(dev, VIRTIO_PCI_DEVICE_ID_BLK, VIRTIO_BLK_PCI_CLASS,
                            virtio_blk_dev->irq_num);
     virtio_pci_set_virtq(dev, virtio_blk_dev->vq, VIRTIO_BLK_VIRTQ_NUM);
     virtio_pci_add_feature(dev, 0);
-    virtio_pci_enable(dev);
-    pthread_create(&virtio_blk_dev->worker_thread, NULL,
-                   (void *) virtio_blk_thread, (void *) virtio_blk_dev);
+    return virtio_pci_enable(dev);
 }
 
 void virtio_blk_init(struct virtio_blk_dev *dev)
@@ -224,12 +263,19 @@ void virtio_blk_init(struct virtio_blk_dev *dev)
 
 void virtio_blk_exit(struct virtio_blk_dev *dev)
 {
+    uint64_t n = 1;
+
     if (!dev->enable)
         return;
-    __atomic_store_n(&thread_stop, true, __ATOMIC_RELAXED);
-    pthread_join(dev->vq_avail_thread, NULL);
+    /* the eventfd wakes up the queue thread, which sees the stop flag */
+    __atomic_store_n(&dev->stop, true, __ATOMIC_RELAXED);
+    if (write(dev->ioeventfd, &n, sizeof(n)) < 0)
+        perror("virtio-blk stop");
+    if (dev->vq_avail_started)
+        pthread_join(dev->vq_avail_thread, NULL);
     diskimg_exit(dev->diskimg);
     virtio_pci_exit(&dev->virtio_pci_dev);
     close(dev->irqfd);
     close(dev->ioeventfd);
+    close(dev->timer_fd);
 }
@@ -7,12 +7,16 @@
 
 #include "diskimg.h"
 #include "pci.h"
+#include "throttle.h"
 #include "virtio_pci.h"
 #include "virtq.h"
 
 #define VIRTIO_BLK_VIRTQ_NUM 1
 #define VIRTIO_BLK_PCI_CLASS 0x018000
-#define VIRTIO_BLK_IRQ 15
+#define VIRTIO_BLK_IRQ 15 /* of the first disk, see vm_irq_alloc */
+#define VIRTIO_BLK_REQ_HDR_SIZE 16 /* type, reserved and sector */
+
+struct guest;
 
 struct virtio_blk_req {
     uint32_t type;
@@ -27,19 +31,31 @@ struct virtio_blk_dev {
     struct virtio_pci_dev virtio_pci_dev;
     struct virtio_blk_config config;
     struct virtq vq[VIRTIO_BLK_VIRTQ_NUM];
+    struct guest *guest; /* a guest has many of them, no container_of */
     int irqfd;
     int ioeventfd;
+    int timer_fd; /* retries the request a limit held back */
     int irq_num;
     pthread_t vq_avail_thread;
-    pthread_t worker_thread;
     struct diskimg *diskimg;
+    struct throttle throttle;
+    bool vq_avail_started;
+    bool stop;
     bool enable;
+    bool poll; /* the queue thread spins on the ring, no doorbell */
 };
 
 void virtio_blk_init(struct virtio_blk_dev *virtio_blk_dev);
 void virtio_blk_exit(struct virtio_blk_dev *dev);
-void virtio_blk_init_pci(struct virtio_blk_dev *dev,
-                         struct diskimg *diskimg,
-                         struct pci *pci,
-                         struct bus *io_bus,
-                         struct bus *mmio_bus);
+/* Returns 0 on success, -1 when the PCI bus is full */
+int virtio_blk_init_pci(struct virtio_blk_dev *dev,
+                        struct guest *g,
+                        struct diskimg *diskimg,
+                        int irq);
+/* The queue of a vhost-user backend (vhostblkd.c): the transport is emulated
+ * by the frontend, the doorbell and the interrupt are the eventfds it sent */
+void virtio_blk_init_backend(struct virtio_blk_dev *dev,
+                             struct guest *g,
+                             struct diskimg *diskimg,
+                             int kick_fd,
+                             int call_fd);
@@ -0,0 +1,541 @@
+#include <errno.h>
+#include <linux/if_ether.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "utils.h"
+#include "virtio-net.h"
+#include "vm.h"
+
+#define VIRTIO_NET_HDR_LEN sizeof(struct virtio_net_hdr_v1)
+#define VIRTIO_NET_TAG_BACKEND 0
+#define VIRTIO_NET_TAG_KICK 1
+#define VIRTIO_NET_MAX_EVENTS 4
+/* rx packets taken from the backend before the tx queue gets a turn */
+#define VIRTIO_NET_RX_BURST 64
+#define VIRTIO_NET_RX_MAX_IOV 256
+/* a VLAN tagged frame, without and with segmentation offload */
+#define VIRTIO_NET_MAX_FRAME (ETH_HLEN + 4 + ETH_DATA_LEN)
+#define VIRTIO_NET_MAX_GSO_FRAME (ETH_HLEN + 4 + 65535)
+
+#define VIRTIO_NET_GUEST_OFFLOADS                                            \
+    ((1ULL << VIRTIO_NET_F_GUEST_CSUM) | (1ULL << VIRTIO_NET_F_GUEST_TSO4) | \
+     (1ULL << VIRTIO_NET_F_GUEST_TSO6) | (1ULL << VIRTIO_NET_F_GUEST_ECN))
+
+static bool virtio_net_has_feature(struct virtio_net_dev *dev, int feature)
+{
+    return dev->virtio_pci_dev.guest_feature & (1ULL << feature);
+}
+
+static void virtio_net_push(struct virtio_net_dev *dev,
+                            struct virtq *vq,
+                            struct virtq_chain *chain,
+                            uint32_t len)
+{
+    virtq_push_chain(vq, chain, len);
+    dev->used_vqs |= 1U << (vq - dev->vq);
+}
+
+static void virtio_net_set_offload(struct virtio_net_dev *dev,
+                                   uint64_t offloads)
+{
+    dev->guest_offloads = offloads;
+    if (dev->backend->ops->set_offload)
+        dev->backend->ops->set_offload(dev->backend, offloads);
+}
+
+/* Largest packet the guest may get, with its header */
+static size_t virtio_net_rx_max_len(struct virtio_net_dev *dev)
+{
+    if (dev->guest_offloads & ((1ULL << VIRTIO_NET_F_GUEST_TSO4) |
+                               (1ULL << VIRTIO_NET_F_GUEST_TSO6)))
+        return VIRTIO_NET_HDR_LEN + VIRTIO_NET_MAX_GSO_FRAME;
+    return VIRTIO_NET_HDR_LEN + VIRTIO_NET_MAX_FRAME;
+}
+
+/* Complete a partial checksum for a guest that can't. The checksum field holds
+ * the pseudo header sum, so summing from start to the end of the packet gives
+ * the final value. Byte by byte, this only runs for guests without the
+ * checksum offload.
+ */
+static bool virtio_net_csum(const struct iovec *iov,
+                            int niov,
+                            size_t start,
+                            size_t field,
+                            size_t end)
+{
+    uint64_t sum = 0;
+    uint8_t *hi = NULL, *lo = NULL;
+    size_t pos = 0;
+
+    if (start > field || field + 2 > end)
+        return false;
+    for (int i = 0; i < niov && pos < end; i++) {
+        uint8_t *p = iov[i].iov_base;
+
+        for (size_t j = 0; j < iov[i].iov_len && pos < end; j++, pos++) {
+            if (pos == field)
+                hi = &p[j];
+            else if (pos == field + 1)
+                lo = &p[j];
+            if (pos >= start)
+                sum += (pos - start) & 1 ? p[j] : p[j] << 8;
+        }
+    }
+    if (!hi || !lo)
+        return false;
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    sum = ~sum & 0xffff;
+    if (!sum) /* 0 means no checksum for UDP */
+        sum = 0xffff;
+    *hi = sum >> 8;
+    *lo = sum & 0xff;
+    return true;
+}
+
+/* Packets from the backend may use offloads this guest didn't accept.
+ * Checksums are completed here, segmented packets are dropped.
+ */
+static bool virtio_net_rx_offload(struct virtio_net_dev *dev,
+                                  struct virtio_net_hdr_v1 *hdr,
+                                  const struct iovec *iov,
+                                  int niov,
+                                  size_t len)
+{
+    uint8_t gso_type = hdr->gso_type & ~VIRTIO_NET_HDR_GSO_ECN;
+
+    if (gso_type != VIRTIO_NET_HDR_GSO_NONE) {
+        uint64_t needed = gso_type == VIRTIO_NET_HDR_GSO_TCPV4
+                              ? 1ULL << VIRTIO_NET_F_GUEST_TSO4
+                          : gso_type == VIRTIO_NET_HDR_GSO_TCPV6
+                              ? 1ULL << VIRTIO_NET_F_GUEST_TSO6
+                              : 0;
+        if (hdr->gso_type & VIRTIO_NET_HDR_GSO_ECN)
+            needed |= 1ULL << VIRTIO_NET_F_GUEST_ECN;
+        return needed && (dev->guest_offloads & needed) == needed;
+    }
+    if ((hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) &&
+        !(dev->guest_offloads & (1ULL << VIRTIO_NET_F_GUEST_CSUM))) {
+        size_t start = VIRTIO_NET_HDR_LEN + hdr->csum_start;
+
+        if (!virtio_net_csum(iov, niov, start, start + hdr->csum_offset, len))
+            return false;
+        hdr->flags &= ~VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    }
+    return true;
+}
+
+/* Receive one packet straight into the guest rx buffers. With mergeable
+ * buffers a packet spreads over as many chains as it needs, so enough of them
+ * are taken for the largest packet, or for the next one when the backend can
+ * tell its length. The chains left over go back to the driver.
+ */
+static bool virtio_net_rx_one(struct virtio_net_dev *dev)
+{
+    guest *v = container_of(dev, guest, virtio_net_dev);
+    struct virtq *vq = &dev->vq[VIRTIO_NET_VQ_RX];
+    struct netbackend *be = dev->backend;
+    bool mergeable = virtio_net_has_feature(dev, VIRTIO_NET_F_MRG_RXBUF);
+    struct iovec iov[VIRTIO_NET_RX_MAX_IOV];
+    struct virtio_net_hdr_v1 hdr;
+    int nchains = 0, niov = 0, used = 0;
+    size_t total = 0;
+    ssize_t need, n;
+
+    if (be->ops->peek_len) {
+        need = be->ops->peek_len(be);
+        if (need == 0) {
+            fprintf(stderr, "virtio-net: the backend went away\n");
+            dev->backend_closed = true;
+        }
+        if (need <= 0)
+            return false;
+    } else {
+        need = virtio_net_rx_max_len(dev);
+    }
+
+    while (total < (size_t) need && nchains < VIRTIO_NET_RX_MAX_CHAINS &&
+           (mergeable || !nchains)) {
+        struct virtq_chain *chain = &dev->rx_chains[nchains];
+
+        if (!virtq_pop_chain(vq, v, chain))
+            break;
+        nchains++;
+        for (int i = 0; i < chain->niov && niov < VIRTIO_NET_RX_MAX_IOV; i++) {
+            iov[niov++] = chain->iov[i];
+            total += chain->iov[i].iov_len;
+        }
+    }
+    if (!nchains || (mergeable && total < (size_t) need)) {
+        if (nchains)
+            virtq_unpop_chain(vq, &dev->rx_chains[0]);
+        dev->rx_stalled = true;
+        return false;
+    }
+
+    n = be->ops->recv(be, iov, niov);
+    if (n < 0) {
+        virtq_unpop_chain(vq, &dev->rx_chains[0]);
+        return false;
+    }
+    /* a dropped packet leaves the buffers to the next one */
+    if ((size_t) n > total || n < (ssize_t) (VIRTIO_NET_HDR_LEN + ETH_HLEN) ||
+        dev->rx_chains[0].len < VIRTIO_NET_HDR_LEN) {
+        virtq_unpop_chain(vq, &dev->rx_chains[0]);
+        dev->rx_dropped++;
+        return true;
+    }
+    virtq_chain_read(&dev->rx_chains[0], &hdr, VIRTIO_NET_HDR_LEN);
+    if (!virtio_net_rx_offload(dev, &hdr, iov, niov, n)) {
+        virtq_unpop_chain(vq, &dev->rx_chains[0]);
+        dev->rx_dropped++;
+        return true;
+    }
+
+    for (size_t left = n; left; used++)
+        left -= left < dev->rx_chains[used].len ? left
+                                                 : dev->rx_chains[used].len;
+    hdr.num_buffers = used;
+    virtq_chain_write(&dev->rx_chains[0], &hdr, VIRTIO_NET_HDR_LEN);
+    if (used < nchains)
+        virtq_unpop_chain(vq, &dev->rx_chains[used]);
+    for (int i = 0, left = n; i < used; i++) {
+        uint32_t len = (size_t) left < dev->rx_chains[i].len
+                           ? (uint32_t) left
+                           : dev->rx_chains[i].len;
+        virtio_net_push(dev, vq, &dev->rx_chains[i], len);
+        left -= len;
+    }
+    dev->rx_packets++;
+    dev->rx_bytes += n - VIRTIO_NET_HDR_LEN;
+    return true;
+}
+
+static void virtio_net_handle_rx(struct virtio_net_dev *dev)
+{
+    if (!dev->vq[VIRTIO_NET_VQ_RX].info.enable)
+        return;
+    for (int i = 0; i < VIRTIO_NET_RX_BURST; i++) {
+        if (!virtio_net_rx_one(dev))
+            return;
+    }
+}
+
+/* Each tx chain is one packet with its header, the backend takes it as is */
+static void virtio_net_handle_tx(struct virtio_net_dev *dev)
+{
+    guest *v = container_of(dev, guest, virtio_net_dev);
+    struct virtq *vq = &dev->vq[VIRTIO_NET_VQ_TX];
+    struct netbackend *be = dev->backend;
+    struct virtq_chain chain;
+
+    if (!vq->info.enable)
+        return;
+    while (!dev->tx_stalled && virtq_pop_chain(vq, v, &chain)) {
+        if (chain.len < VIRTIO_NET_HDR_LEN) {
+            dev->tx_dropped++;
+            virtio_net_push(dev, vq, &chain, 0);
+            continue;
+        }
+
+        ssize_t n = be->ops->send(be, chain.iov, chain.niov);
+        if (n < 0 && (errno == EAGAIN || errno == ENOBUFS)) {
+            virtq_unpop_chain(vq, &chain);
+            dev->tx_stalled = true;
+            return;
+        }
+        if (n < 0) {
+            dev->tx_dropped++;
+        } else {
+            dev->tx_packets++;
+            dev->tx_bytes += chain.len - VIRTIO_NET_HDR_LEN;
+        }
+        virtio_net_push(dev, vq, &chain, 0);
+    }
+}
+
+static uint8_t virtio_net_ctrl_cmd(struct virtio_net_dev *dev,
+                                   struct virtq_chain *chain)
+{
+    struct {
+        struct virtio_net_ctrl_hdr hdr;
+        uint64_t offloads;
+    } __attribute__((packed)) cmd;
+    size_t len = virtq_chain_read(chain, &cmd, sizeof(cmd));
+
+    if (len < sizeof(cmd.hdr))
+        return VIRTIO_NET_ERR;
+    switch (cmd.hdr.class) {
+    case VIRTIO_NET_CTRL_RX:
+    case VIRTIO_NET_CTRL_MAC:
+        /* everything the backend delivers goes to the guest, there are no
+         * filters to program */
+        return VIRTIO_NET_OK;
+    case VIRTIO_NET_CTRL_GUEST_OFFLOADS:
+        if (cmd.hdr.cmd != VIRTIO_NET_CTRL_GUEST_OFFLOADS_SET ||
+            len < sizeof(cmd))
+            return VIRTIO_NET_ERR;
+        virtio_net_set_offload(dev, cmd.offloads &
+                                        dev->virtio_pci_dev.guest_feature &
+                                        VIRTIO_NET_GUEST_OFFLOADS);
+        return VIRTIO_NET_OK;
+    default:
+        return VIRTIO_NET_ERR;
+    }
+}
+
+/* The ack is the last byte of a control chain */
+static void virtio_net_handle_ctrl(struct virtio_net_dev *dev)
+{
+    guest *v = container_of(dev, guest, virtio_net_dev);
+    struct virtq *vq = &dev->vq[VIRTIO_NET_VQ_CTRL];
+    struct virtq_chain chain;
+    struct iovec ack_iov;
+
+    if (!vq->info.enable)
+        return;
+    while (virtq_pop_chain(vq, v, &chain)) {
+        uint8_t ack = virtio_net_ctrl_cmd(dev, &chain);
+
+        if (chain.len &&
+            virtq_chain_slice(&chain, chain.len - 1, 1, &ack_iov) == 1)
+            *(uint8_t *) ack_iov.iov_base = ack;
+        virtio_net_push(dev, vq, &chain, 1);
+    }
+}
+
+static void virtio_net_update_events(struct virtio_net_dev *dev)
+{
+    struct virtq *rx_vq = &dev->vq[VIRTIO_NET_VQ_RX];
+    struct epoll_event ev = {.data.u32 = VIRTIO_NET_TAG_BACKEND};
+    uint32_t events = 0;
+    int op;
+
+    if (rx_vq->info.enable && !dev->rx_stalled && virtq_has_avail(rx_vq))
+        events |= EPOLLIN;
+    if (dev->tx_stalled)
+        events |= EPOLLOUT;
+    if (dev->backend_closed)
+        events = 0;
+    if (events == dev->epoll_events)
+        return;
+
+    if (!events)
+        op = EPOLL_CTL_DEL;
+    else if (!dev->epoll_events)
+        op = EPOLL_CTL_ADD;
+    else
+        op = EPOLL_CTL_MOD;
+    ev.events = events;
+    if (epoll_ctl(dev->epoll_fd, op, dev->backend->fd, &ev) < 0)
+        perror("virtio-net epoll_ctl");
+    dev->epoll_events = events;
+}
+
+/* One interrupt for everything used in a round of events */
+static void virtio_net_raise_irq(struct virtio_net_dev *dev)
+{
+    struct virtq *notify_vq = NULL;
+
+    for (int i = 0; i < VIRTIO_NET_VIRTQ_NUM; i++) {
+        if ((dev->used_vqs & (1U << i)) &&
+            dev->vq[i].guest_event->flags == VRING_PACKED_EVENT_FLAG_ENABLE)
+            notify_vq = &dev->vq[i];
+    }
+    dev->used_vqs = 0;
+    if (!notify_vq)
+        return;
+    __atomic_or_fetch(&dev->virtio_pci_dev.config.isr_cap.isr_status,
+                      VIRTIO_PCI_ISR_QUEUE, __ATOMIC_RELAXED);
+    virtq_notify_used(notify_vq);
+}
+
+/* All of the queue processing happens here, the vCPU only kicks this thread */
+static void *virtio_net_thread(void *arg)
+{
+    struct virtio_net_dev *dev = (struct virtio_net_dev *) arg;
+    struct epoll_event events[VIRTIO_NET_MAX_EVENTS];
+
+    while (!__atomic_load_n(&dev->stop, __ATOMIC_RELAXED)) {
+        int n = epoll_wait(dev->epoll_fd, events, VIRTIO_NET_MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("virtio-net epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            uint64_t kick;
+
+            if (events[i].data.u32 == VIRTIO_NET_TAG_KICK) {
+                if (read(dev->ioeventfd, &kick, sizeof(kick)) < 0)
+                    perror("virtio-net read kick");
+                dev->rx_stalled = false;
+                virtio_net_handle_ctrl(dev);
+                virtio_net_handle_tx(dev);
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) {
+                dev->tx_stalled = false;
+                virtio_net_handle_tx(dev);
+            }
+            if (events[i].events & EPOLLIN)
+                virtio_net_handle_rx(dev);
+        }
+        virtio_net_update_events(dev);
+        virtio_net_raise_irq(dev);
+    }
+
+    return NULL;
+}
+
+static void virtio_net_kick(struct virtio_net_dev *dev)
+{
+    uint64_t n = 1;
+
+    if (write(dev->ioeventfd, &n, sizeof(n)) < 0)
+        perror("Failed to kick the virtio-net thread");
+}
+
+/* Called on the vCPU thread by virtq_handle_avail after a kick that didn't go
+ * through the ioeventfd. The interrupt is only raised for buffers the worker
+ * marked as used, not for the kick itself.
+ */
+static void virtio_net_notify_used(struct virtq *vq)
+{
+    struct virtio_net_dev *dev = (struct virtio_net_dev *) vq->dev;
+    uint64_t n = 1;
+
+    if (!(__atomic_load_n(&dev->virtio_pci_dev.config.isr_cap.isr_status,
+                          __ATOMIC_RELAXED) &
+          VIRTIO_PCI_ISR_QUEUE))
+        return;
+    TRACE(TRACE_IRQ, dev->irq_num, 1, 0);
+    if (write(dev->irqfd, &n, sizeof(n)) < 0)
+        perror("Failed to write the irqfd");
+}
+
+static void virtio_net_complete_request(struct virtq *vq)
+{
+    virtio_net_kick((struct virtio_net_dev *) vq->dev);
+}
+
+static void virtio_net_enable_vq(struct virtq *vq)
+{
+    struct virtio_net_dev *dev = (struct virtio_net_dev *) vq->dev;
+    guest *v = container_of(dev, guest, virtio_net_dev);
+
+    if (vq->info.enable)
+        return;
+    vq->desc_ring =
+        (struct vring_packed_desc *) vm_guest_to_host(v, vq->info.desc_addr);
+    vq->device_event = (struct vring_packed_desc_event *) vm_guest_to_host(
+        v, vq->info.device_addr);
+    vq->guest_event = (struct vring_packed_desc_event *) vm_guest_to_host(
+        v, vq->info.driver_addr);
+    /* the features are final once the driver sets up its queues */
+    if (vq == &dev->vq[VIRTIO_NET_VQ_RX])
+        virtio_net_set_offload(dev, dev->virtio_pci_dev.guest_feature &
+                                        VIRTIO_NET_GUEST_OFFLOADS);
+    __atomic_store_n(&vq->info.enable, true, __ATOMIC_RELEASE);
+
+    /* All queues share one notify address. The driver writes the 16-bit queue
+     * index there, so that is the length to match.
+     */
+    if (!dev->ioeventfd_registered) {
+        uint64_t addr = virtio_pci_get_notify_addr(&dev->virtio_pci_dev, vq);
+        vm_ioeventfd_register(v, dev->ioeventfd, addr, sizeof(uint16_t), 0);
+        dev->ioeventfd_registered = true;
+    }
+    /* buffers may have been posted before the queue was enabled */
+    virtio_net_kick(dev);
+}
+
+static struct virtq_ops ops = {
+    .enable_vq = virtio_net_enable_vq,
+    .complete_request = virtio_net_complete_request,
+    .notify_used = virtio_net_notify_used,
+};
+
+static void virtio_net_setup(struct virtio_net_dev *dev,
+                             struct netbackend *backend,
+                             const uint8_t mac[6])
+{
+    guest *v = container_of(dev, guest, virtio_net_dev);
+    struct epoll_event ev = {.events = EPOLLIN,
+                             .data.u32 = VIRTIO_NET_TAG_KICK};
+
+    dev->enable = true;
+    dev->irq_num = VIRTIO_NET_IRQ;
+    dev->backend = backend;
+    memcpy(dev->config.mac, mac, sizeof(dev->config.mac));
+    dev->config.status = VIRTIO_NET_S_LINK_UP;
+    dev->config.max_virtqueue_pairs = 1;
+    dev->ioeventfd = eventfd(0, EFD_CLOEXEC);
+    dev->irqfd = eventfd(0, EFD_CLOEXEC);
+    vm_irqfd_register(v, dev->irqfd, dev->irq_num, 0);
+    dev->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    epoll_ctl(dev->epoll_fd, EPOLL_CTL_ADD, dev->ioeventfd, &ev);
+    for (int i = 0; i < VIRTIO_NET_VIRTQ_NUM; i++)
+        virtq_init(&dev->vq[i], dev, &ops);
+}
+
+void virtio_net_init_pci(struct virtio_net_dev *virtio_net_dev,
+                         struct netbackend *backend,
+                         const uint8_t mac[6],
+                         struct pci *pci,
+                         struct bus *io_bus,
+                         struct bus *mmio_bus)
+{
+    struct virtio_pci_dev *dev = &virtio_net_dev->virtio_pci_dev;
+
+    virtio_net_setup(virtio_net_dev, backend, mac);
+    virtio_pci_init(dev, pci, io_bus, mmio_bus);
+    virtio_pci_set_dev_cfg(dev, &virtio_net_dev->config,
+                           sizeof(virtio_net_dev->config));
+    virtio_pci_set_pci_hdr(dev, VIRTIO_PCI_DEVICE_ID_NET, VIRTIO_NET_PCI_CLASS,
+                           virtio_net_dev->irq_num);
+    virtio_pci_set_virtq(dev, virtio_net_dev->vq, VIRTIO_NET_VIRTQ_NUM);
+    virtio_pci_add_feature(
+        dev, (1ULL << VIRTIO_NET_F_MAC) | (1ULL << VIRTIO_NET_F_STATUS) |
+                 (1ULL << VIRTIO_NET_F_MRG_RXBUF) |
+                 (1ULL << VIRTIO_NET_F_CTRL_VQ) |
+                 (1ULL << VIRTIO_NET_F_CTRL_RX) |
+                 (1ULL << VIRTIO_NET_F_CTRL_GUEST_OFFLOADS) |
+                 (1ULL << VIRTIO_NET_F_CSUM) | (1ULL << VIRTIO_NET_F_HOST_TSO4) |
+                 (1ULL << VIRTIO_NET_F_HOST_TSO6) |
+                 (1ULL << VIRTIO_NET_F_HOST_ECN) | VIRTIO_NET_GUEST_OFFLOADS);
+    virtio_pci_enable(dev);
+    pthread_create(&virtio_net_dev->worker_thread, NULL, virtio_net_thread,
+                   virtio_net_dev);
+}
+
+void virtio_net_print_stats(struct virtio_net_dev *dev)
+{
+    if (!dev->enable)
+        return;
+    printf("virtio-net: rx %lu packets %lu bytes %lu dropped, "
+           "tx %lu packets %lu bytes %lu dropped\n",
+           dev->rx_packets, dev->rx_bytes, dev->rx_dropped, dev->tx_packets,
+           dev->tx_bytes, dev->tx_dropped);
+}
+
+void virtio_net_exit(struct virtio_net_dev *dev)
+{
+    if (!dev->enable)
+        return;
+    __atomic_store_n(&dev->stop, true, __ATOMIC_RELAXED);
+    virtio_net_kick(dev);
+    pthread_join(dev->worker_thread, NULL);
+    virtio_pci_exit(&dev->virtio_pci_dev);
+    close(dev->epoll_fd);
+    close(dev->irqfd);
+    close(dev->ioeventfd);
+}
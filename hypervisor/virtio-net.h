@@ -0,0 +1,58 @@
+#pragma once
+
+#include <linux/virtio_net.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "netbackend.h"
+#include "pci.h"
+#include "virtio_pci.h"
+#include "virtq.h"
+
+#define VIRTIO_NET_VIRTQ_NUM 3
+#define VIRTIO_NET_VQ_RX 0
+#define VIRTIO_NET_VQ_TX 1
+#define VIRTIO_NET_VQ_CTRL 2
+#define VIRTIO_NET_PCI_CLASS 0x020000
+#define VIRTIO_NET_IRQ 10
+/* rx buffers a single merged packet may take */
+#define VIRTIO_NET_RX_MAX_CHAINS 64
+
+struct virtio_net_dev {
+    struct virtio_pci_dev virtio_pci_dev;
+    struct virtio_net_config config;
+    struct virtq vq[VIRTIO_NET_VIRTQ_NUM];
+    struct netbackend *backend;
+    int irqfd;
+    int ioeventfd;
+    int irq_num;
+    int epoll_fd;
+    pthread_t worker_thread;
+    /* worker only */
+    struct virtq_chain rx_chains[VIRTIO_NET_RX_MAX_CHAINS];
+    uint64_t guest_offloads;
+    uint32_t epoll_events;
+    uint32_t used_vqs;
+    bool rx_stalled; /* not enough rx buffers for the next packet */
+    bool tx_stalled; /* the backend is full */
+    bool backend_closed;
+    bool ioeventfd_registered;
+    bool stop;
+    bool enable;
+    uint64_t rx_packets;
+    uint64_t rx_bytes;
+    uint64_t rx_dropped;
+    uint64_t tx_packets;
+    uint64_t tx_bytes;
+    uint64_t tx_dropped;
+};
+
+void virtio_net_init_pci(struct virtio_net_dev *dev,
+                         struct netbackend *backend,
+                         const uint8_t mac[6],
+                         struct pci *pci,
+                         struct bus *io_bus,
+                         struct bus *mmio_bus);
+void virtio_net_print_stats(struct virtio_net_dev *dev);
+void virtio_net_exit(struct virtio_net_dev *dev);
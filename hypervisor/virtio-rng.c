@@ -0,0 +1,151 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "utils.h"
+#include "virtio-rng.h"
+#include "vm.h"
+
+static void virtio_rng_notify_used(struct virtq *vq)
+{
+    struct virtio_rng_dev *dev = (struct virtio_rng_dev *) vq->dev;
+    uint64_t n = 1;
+
+    TRACE(TRACE_IRQ, dev->irq_num, 1, 0);
+    if (write(dev->irqfd, &n, sizeof(n)) < 0)
+        perror("Failed to write the irqfd");
+}
+
+static void virtio_rng_enable_vq(struct virtq *vq)
+{
+    struct virtio_rng_dev *dev = (struct virtio_rng_dev *) vq->dev;
+    guest *v = container_of(dev, guest, virtio_rng_dev);
+
+    if (vq->info.enable)
+        return;
+    vq->info.enable = true;
+    vq->desc_ring =
+        (struct vring_packed_desc *) vm_guest_to_host(v, vq->info.desc_addr);
+    vq->device_event = (struct vring_packed_desc_event *) vm_guest_to_host(
+        v, vq->info.device_addr);
+    vq->guest_event = (struct vring_packed_desc_event *) vm_guest_to_host(
+        v, vq->info.driver_addr);
+}
+
+static ssize_t virtio_rng_getrandom(void *buf, size_t len)
+{
+    ssize_t n;
+
+    do {
+        n = getrandom(buf, len, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0)
+        perror("getrandom");
+    return n;
+}
+
+/* The driver mostly asks for a few dozen bytes at a time. Those are served
+ * from a pool filled with one getrandom() per VIRTIO_RNG_POOL_SIZE bytes,
+ * larger buffers are filled by the host directly.
+ */
+static size_t virtio_rng_fill(struct virtio_rng_dev *dev, uint8_t *buf,
+                              size_t len)
+{
+    size_t filled = 0;
+
+    if (len >= VIRTIO_RNG_POOL_SIZE) {
+        ssize_t n = virtio_rng_getrandom(buf, len);
+        return n < 0 ? 0 : n;
+    }
+    while (filled < len) {
+        size_t chunk;
+
+        if (!dev->pool_left) {
+            ssize_t n = virtio_rng_getrandom(dev->pool, sizeof(dev->pool));
+            if (n <= 0)
+                break;
+            dev->pool_left = n;
+        }
+        chunk = len - filled < dev->pool_left ? len - filled : dev->pool_left;
+        dev->pool_left -= chunk;
+        memcpy(buf + filled, dev->pool + dev->pool_left, chunk);
+        /* handed out once, never again */
+        memset(dev->pool + dev->pool_left, 0, chunk);
+        filled += chunk;
+    }
+    return filled;
+}
+
+static void virtio_rng_complete_request(struct virtq *vq)
+{
+    struct virtio_rng_dev *dev = (struct virtio_rng_dev *) vq->dev;
+    guest *v = container_of(dev, guest, virtio_rng_dev);
+    struct virtq_chain chain;
+
+    while (virtq_pop_chain(vq, v, &chain)) {
+        size_t filled = 0;
+
+        for (int i = 0; i < chain.niov; i++)
+            filled += virtio_rng_fill(dev, chain.iov[i].iov_base,
+                                      chain.iov[i].iov_len);
+        virtq_push_chain(vq, &chain, filled);
+        dev->requests++;
+        dev->bytes += filled;
+        __atomic_or_fetch(&dev->virtio_pci_dev.config.isr_cap.isr_status,
+                          VIRTIO_PCI_ISR_QUEUE, __ATOMIC_RELAXED);
+    }
+}
+
+static struct virtq_ops ops = {
+    .enable_vq = virtio_rng_enable_vq,
+    .complete_request = virtio_rng_complete_request,
+    .notify_used = virtio_rng_notify_used,
+};
+
+static void virtio_rng_setup(struct virtio_rng_dev *dev)
+{
+    guest *v = container_of(dev, guest, virtio_rng_dev);
+
+    dev->enable = true;
+    dev->irq_num = VIRTIO_RNG_IRQ;
+    dev->irqfd = eventfd(0, EFD_CLOEXEC);
+    vm_irqfd_register(v, dev->irqfd, dev->irq_num, 0);
+    for (int i = 0; i < VIRTIO_RNG_VIRTQ_NUM; i++)
+        virtq_init(&dev->vq[i], dev, &ops);
+}
+
+/* The device has no configuration space */
+void virtio_rng_init_pci(struct virtio_rng_dev *virtio_rng_dev,
+                         struct pci *pci,
+                         struct bus *io_bus,
+                         struct bus *mmio_bus)
+{
+    struct virtio_pci_dev *dev = &virtio_rng_dev->virtio_pci_dev;
+
+    virtio_rng_setup(virtio_rng_dev);
+    virtio_pci_init(dev, pci, io_bus, mmio_bus);
+    virtio_pci_set_pci_hdr(dev, VIRTIO_PCI_DEVICE_ID_RNG, VIRTIO_RNG_PCI_CLASS,
+                           virtio_rng_dev->irq_num);
+    virtio_pci_set_virtq(dev, virtio_rng_dev->vq, VIRTIO_RNG_VIRTQ_NUM);
+    virtio_pci_add_feature(dev, 0);
+    virtio_pci_enable(dev);
+}
+
+void virtio_rng_print_stats(struct virtio_rng_dev *dev)
+{
+    if (!dev->enable)
+        return;
+    printf("virtio-rng: %lu requests, %lu bytes\n", dev->requests, dev->bytes);
+}
+
+void virtio_rng_exit(struct virtio_rng_dev *dev)
+{
+    if (!dev->enable)
+        return;
+    virtio_pci_exit(&dev->virtio_pci_dev);
+    close(dev->irqfd);
+}
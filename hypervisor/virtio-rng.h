@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "pci.h"
+#include "virtio_pci.h"
+#include "virtq.h"
+
+#define VIRTIO_RNG_VIRTQ_NUM 1
+#define VIRTIO_RNG_PCI_CLASS 0xff0000
+#define VIRTIO_RNG_IRQ 9
+/* host entropy fetched per getrandom() for the small requests */
+#define VIRTIO_RNG_POOL_SIZE 4096
+
+struct virtio_rng_dev {
+    struct virtio_pci_dev virtio_pci_dev;
+    struct virtq vq[VIRTIO_RNG_VIRTQ_NUM];
+    int irqfd;
+    int irq_num;
+    uint8_t pool[VIRTIO_RNG_POOL_SIZE];
+    size_t pool_left; /* unused bytes at the end of the pool */
+    uint64_t requests;
+    uint64_t bytes;
+    bool enable;
+};
+
+void virtio_rng_init_pci(struct virtio_rng_dev *dev,
+                         struct pci *pci,
+                         struct bus *io_bus,
+                         struct bus *mmio_bus);
+void virtio_rng_print_stats(struct virtio_rng_dev *dev);
+void virtio_rng_exit(struct virtio_rng_dev *dev);
@@ -0,0 +1,753 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "utils.h"
+#include "virtio-vsock.h"
+#include "vm.h"
+
+/* epoll tags of the fds that are not connections */
+#define VIRTIO_VSOCK_TAG_LISTEN VIRTIO_VSOCK_MAX_CONNS
+#define VIRTIO_VSOCK_TAG_KICK (VIRTIO_VSOCK_MAX_CONNS + 1)
+
+#define VIRTIO_VSOCK_MAX_EVENTS 16
+/* rx packets a single connection may fill before the others get a turn */
+#define VIRTIO_VSOCK_RX_BURST 16
+#define VIRTIO_VSOCK_SHUTDOWN_BOTH \
+    (VIRTIO_VSOCK_SHUTDOWN_RCV | VIRTIO_VSOCK_SHUTDOWN_SEND)
+
+/* Give a chain back to the driver, the interrupt is raised after the round */
+static void virtio_vsock_push(struct virtio_vsock_dev *dev,
+                              struct virtq *vq,
+                              struct virtq_chain *chain,
+                              uint32_t len)
+{
+    virtq_push_chain(vq, chain, len);
+    dev->used_vqs |= 1U << (vq - dev->vq);
+}
+
+static struct virtio_vsock_conn *virtio_vsock_conn_find(
+    struct virtio_vsock_dev *dev,
+    uint32_t local_port,
+    uint32_t peer_port)
+{
+    for (int i = 0; i < VIRTIO_VSOCK_MAX_CONNS; i++) {
+        struct virtio_vsock_conn *conn = &dev->conns[i];
+        if (conn->state != VSOCK_CONN_FREE &&
+            conn->state != VSOCK_CONN_HANDSHAKE &&
+            conn->local_port == local_port && conn->peer_port == peer_port)
+            return conn;
+    }
+    return NULL;
+}
+
+static struct virtio_vsock_conn *virtio_vsock_conn_alloc(
+    struct virtio_vsock_dev *dev,
+    int fd,
+    enum virtio_vsock_conn_state state)
+{
+    for (int i = 0; i < VIRTIO_VSOCK_MAX_CONNS; i++) {
+        struct virtio_vsock_conn *conn = &dev->conns[i];
+        if (conn->state != VSOCK_CONN_FREE)
+            continue;
+        *conn = (struct virtio_vsock_conn){
+            .state = state,
+            .fd = fd,
+        };
+        return conn;
+    }
+    return NULL;
+}
+
+static void virtio_vsock_conn_close(struct virtio_vsock_conn *conn)
+{
+    /* closing the fd takes it out of the epoll set */
+    close(conn->fd);
+    free(conn->buf);
+    conn->buf = NULL;
+    conn->state = VSOCK_CONN_FREE;
+}
+
+/* Bytes the guest still has room for on this connection */
+static uint32_t virtio_vsock_peer_credit(struct virtio_vsock_conn *conn)
+{
+    uint32_t in_flight = conn->rx_cnt - conn->peer_fwd_cnt;
+
+    return in_flight < conn->peer_buf_alloc ? conn->peer_buf_alloc - in_flight
+                                            : 0;
+}
+
+static void virtio_vsock_init_hdr(struct virtio_vsock_dev *dev,
+                                  struct virtio_vsock_conn *conn,
+                                  struct virtio_vsock_hdr *hdr,
+                                  uint16_t op,
+                                  uint32_t flags,
+                                  uint32_t len)
+{
+    *hdr = (struct virtio_vsock_hdr){
+        .src_cid = VIRTIO_VSOCK_HOST_CID,
+        .dst_cid = dev->config.guest_cid,
+        .src_port = conn->local_port,
+        .dst_port = conn->peer_port,
+        .len = len,
+        .type = VIRTIO_VSOCK_TYPE_STREAM,
+        .op = op,
+        .flags = flags,
+        .buf_alloc = VIRTIO_VSOCK_CONN_BUF_SIZE,
+        .fwd_cnt = conn->fwd_cnt,
+    };
+    /* every packet carries the credit, not only the credit updates */
+    conn->last_fwd_cnt = conn->fwd_cnt;
+}
+
+/* Control packets wait in a ring until the guest posts rx buffers for them */
+static void virtio_vsock_queue_hdr(struct virtio_vsock_dev *dev,
+                                   struct virtio_vsock_hdr *hdr)
+{
+    if (dev->pending_tail - dev->pending_head == VIRTIO_VSOCK_MAX_PENDING) {
+        fprintf(stderr, "vsock: control packet dropped\n");
+        return;
+    }
+    dev->pending[dev->pending_tail++ % VIRTIO_VSOCK_MAX_PENDING] = *hdr;
+}
+
+static void virtio_vsock_send_ctrl(struct virtio_vsock_dev *dev,
+                                   struct virtio_vsock_conn *conn,
+                                   uint16_t op,
+                                   uint32_t flags)
+{
+    struct virtio_vsock_hdr hdr;
+
+    virtio_vsock_init_hdr(dev, conn, &hdr, op, flags, 0);
+    virtio_vsock_queue_hdr(dev, &hdr);
+}
+
+/* Reset a connection the guest asked for or used but that doesn't exist */
+static void virtio_vsock_reply_rst(struct virtio_vsock_dev *dev,
+                                   struct virtio_vsock_hdr *req)
+{
+    struct virtio_vsock_conn conn = {
+        .local_port = req->dst_port,
+        .peer_port = req->src_port,
+    };
+
+    virtio_vsock_send_ctrl(dev, &conn, VIRTIO_VSOCK_OP_RST, 0);
+}
+
+static void virtio_vsock_reset(struct virtio_vsock_dev *dev,
+                               struct virtio_vsock_conn *conn)
+{
+    virtio_vsock_send_ctrl(dev, conn, VIRTIO_VSOCK_OP_RST, 0);
+    virtio_vsock_conn_close(conn);
+}
+
+/* Tell the guest about the forwarded bytes before it runs out of credit */
+static void virtio_vsock_update_credit(struct virtio_vsock_dev *dev,
+                                       struct virtio_vsock_conn *conn)
+{
+    if (conn->fwd_cnt - conn->last_fwd_cnt >= VIRTIO_VSOCK_CONN_BUF_SIZE / 4)
+        virtio_vsock_send_ctrl(dev, conn, VIRTIO_VSOCK_OP_CREDIT_UPDATE, 0);
+}
+
+/* Apply the shutdown of the guest once all of its data reached the socket */
+static void virtio_vsock_check_shutdown(struct virtio_vsock_dev *dev,
+                                        struct virtio_vsock_conn *conn)
+{
+    if (conn->buf_len)
+        return;
+    if ((conn->peer_shutdown & VIRTIO_VSOCK_SHUTDOWN_BOTH) ==
+        VIRTIO_VSOCK_SHUTDOWN_BOTH)
+        virtio_vsock_reset(dev, conn);
+    else if (conn->peer_shutdown & VIRTIO_VSOCK_SHUTDOWN_SEND)
+        shutdown(conn->fd, SHUT_WR);
+}
+
+static void virtio_vsock_flush_ctrl(struct virtio_vsock_dev *dev)
+{
+    guest *v = container_of(dev, guest, virtio_vsock_dev);
+    struct virtq *vq = &dev->vq[VIRTIO_VSOCK_VQ_RX];
+    struct virtq_chain chain;
+
+    if (!vq->info.enable)
+        return;
+    while (dev->pending_head != dev->pending_tail &&
+           virtq_pop_chain(vq, v, &chain)) {
+        struct virtio_vsock_hdr *hdr =
+            &dev->pending[dev->pending_head % VIRTIO_VSOCK_MAX_PENDING];
+
+        if (chain.len < sizeof(*hdr)) {
+            virtio_vsock_push(dev, vq, &chain, 0);
+            continue;
+        }
+        virtq_chain_write(&chain, hdr, sizeof(*hdr));
+        virtio_vsock_push(dev, vq, &chain, sizeof(*hdr));
+        dev->pending_head++;
+    }
+}
+
+/* Move data from the host socket into the rx buffers of the guest, as much as
+ * its credit allows. The data is read straight into the guest memory.
+ */
+static void virtio_vsock_conn_rx(struct virtio_vsock_dev *dev,
+                                 struct virtio_vsock_conn *conn)
+{
+    guest *v = container_of(dev, guest, virtio_vsock_dev);
+    struct virtq *vq = &dev->vq[VIRTIO_VSOCK_VQ_RX];
+    struct virtq_chain chain;
+    struct virtio_vsock_hdr hdr;
+    struct iovec iov[VIRTQ_CHAIN_MAX_IOV];
+
+    if (!vq->info.enable)
+        return;
+    for (int i = 0; i < VIRTIO_VSOCK_RX_BURST; i++) {
+        uint32_t credit = virtio_vsock_peer_credit(conn);
+
+        /* control packets go first, they may be waiting for the same buffers */
+        if (!credit || dev->pending_head != dev->pending_tail ||
+            !virtq_pop_chain(vq, v, &chain))
+            return;
+        if (chain.len <= sizeof(hdr)) {
+            virtio_vsock_push(dev, vq, &chain, 0);
+            continue;
+        }
+
+        int niov = virtq_chain_slice(&chain, sizeof(hdr), credit, iov);
+        ssize_t n = readv(conn->fd, iov, niov);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+            /* nothing to read after all, leave the buffer to the driver */
+            virtq_unpop_chain(vq, &chain);
+            return;
+        }
+
+        if (n > 0) {
+            virtio_vsock_init_hdr(dev, conn, &hdr, VIRTIO_VSOCK_OP_RW, 0, n);
+            conn->rx_cnt += n;
+        } else if (n == 0) {
+            conn->host_eof = true;
+            virtio_vsock_init_hdr(dev, conn, &hdr, VIRTIO_VSOCK_OP_SHUTDOWN,
+                                  VIRTIO_VSOCK_SHUTDOWN_SEND, 0);
+        } else {
+            virtio_vsock_init_hdr(dev, conn, &hdr, VIRTIO_VSOCK_OP_RST, 0, 0);
+        }
+        virtq_chain_write(&chain, &hdr, sizeof(hdr));
+        virtio_vsock_push(dev, vq, &chain, sizeof(hdr) + (n > 0 ? n : 0));
+        if (n < 0)
+            virtio_vsock_conn_close(conn);
+        if (n <= 0)
+            return;
+    }
+}
+
+/* Write guest data to the host socket. What the socket can't take now is kept
+ * and written on EPOLLOUT. The guest never sends more than the buffer size we
+ * advertise, so the buffer can't overflow unless the guest misbehaves.
+ */
+static void virtio_vsock_conn_tx(struct virtio_vsock_dev *dev,
+                                 struct virtio_vsock_conn *conn,
+                                 struct virtq_chain *chain,
+                                 uint32_t len)
+{
+    struct iovec iov[VIRTQ_CHAIN_MAX_IOV];
+    int niov = virtq_chain_slice(chain, sizeof(struct virtio_vsock_hdr),
+                                      len, iov);
+    ssize_t n = 0;
+
+    if (!conn->buf_len) {
+        struct msghdr msg = {.msg_iov = iov, .msg_iovlen = niov};
+
+        n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+        if (n < 0 && errno != EAGAIN && errno != EINTR) {
+            virtio_vsock_reset(dev, conn);
+            return;
+        }
+        if (n < 0)
+            n = 0;
+        conn->fwd_cnt += n;
+    }
+
+    for (int i = 0; i < niov; i++) {
+        size_t skip = (size_t) n < iov[i].iov_len ? (size_t) n : iov[i].iov_len;
+        size_t rest = iov[i].iov_len - skip;
+
+        n -= skip;
+        if (!rest)
+            continue;
+        if (conn->buf_len + rest > VIRTIO_VSOCK_CONN_BUF_SIZE) {
+            fprintf(stderr, "vsock: guest port %u overran its credit\n",
+                    conn->peer_port);
+            virtio_vsock_reset(dev, conn);
+            return;
+        }
+        if (!conn->buf)
+            conn->buf = malloc(VIRTIO_VSOCK_CONN_BUF_SIZE);
+        memcpy(conn->buf + conn->buf_len, (uint8_t *) iov[i].iov_base + skip,
+               rest);
+        conn->buf_len += rest;
+    }
+    virtio_vsock_update_credit(dev, conn);
+}
+
+static void virtio_vsock_conn_flush(struct virtio_vsock_dev *dev,
+                                    struct virtio_vsock_conn *conn)
+{
+    ssize_t n = send(conn->fd, conn->buf, conn->buf_len, MSG_NOSIGNAL);
+
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EINTR)
+            virtio_vsock_reset(dev, conn);
+        return;
+    }
+    conn->buf_len -= n;
+    memmove(conn->buf, conn->buf + n, conn->buf_len);
+    conn->fwd_cnt += n;
+    virtio_vsock_update_credit(dev, conn);
+    virtio_vsock_check_shutdown(dev, conn);
+}
+
+/* The guest connects to a host port: forward it to <uds_path>_<port> */
+static void virtio_vsock_connect_host(struct virtio_vsock_dev *dev,
+                                      struct virtio_vsock_hdr *req)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    struct virtio_vsock_conn *conn;
+    int fd;
+
+    if (snprintf(addr.sun_path, sizeof(addr.sun_path), "%s_%u", dev->uds_path,
+                 req->dst_port) >= (int) sizeof(addr.sun_path)) {
+        virtio_vsock_reply_rst(dev, req);
+        return;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        if (fd >= 0)
+            close(fd);
+        virtio_vsock_reply_rst(dev, req);
+        return;
+    }
+
+    conn = virtio_vsock_conn_alloc(dev, fd, VSOCK_CONN_ESTABLISHED);
+    if (!conn) {
+        close(fd);
+        virtio_vsock_reply_rst(dev, req);
+        return;
+    }
+    conn->local_port = req->dst_port;
+    conn->peer_port = req->src_port;
+    conn->peer_buf_alloc = req->buf_alloc;
+    conn->peer_fwd_cnt = req->fwd_cnt;
+    virtio_vsock_send_ctrl(dev, conn, VIRTIO_VSOCK_OP_RESPONSE, 0);
+}
+
+static void virtio_vsock_handle_pkt(struct virtio_vsock_dev *dev,
+                                    struct virtio_vsock_hdr *hdr,
+                                    struct virtq_chain *chain)
+{
+    struct virtio_vsock_conn *conn;
+    char reply[32];
+
+    if (hdr->src_cid != dev->config.guest_cid ||
+        hdr->dst_cid != VIRTIO_VSOCK_HOST_CID ||
+        hdr->type != VIRTIO_VSOCK_TYPE_STREAM) {
+        if (hdr->op != VIRTIO_VSOCK_OP_RST)
+            virtio_vsock_reply_rst(dev, hdr);
+        return;
+    }
+
+    conn = virtio_vsock_conn_find(dev, hdr->dst_port, hdr->src_port);
+    if (hdr->op == VIRTIO_VSOCK_OP_REQUEST && !conn) {
+        virtio_vsock_connect_host(dev, hdr);
+        return;
+    }
+    if (!conn) {
+        if (hdr->op != VIRTIO_VSOCK_OP_RST)
+            virtio_vsock_reply_rst(dev, hdr);
+        return;
+    }
+    conn->peer_buf_alloc = hdr->buf_alloc;
+    conn->peer_fwd_cnt = hdr->fwd_cnt;
+
+    switch (hdr->op) {
+    case VIRTIO_VSOCK_OP_RESPONSE:
+        if (conn->state != VSOCK_CONN_CONNECTING) {
+            virtio_vsock_reset(dev, conn);
+            break;
+        }
+        conn->state = VSOCK_CONN_ESTABLISHED;
+        snprintf(reply, sizeof(reply), "OK %u\n", conn->local_port);
+        if (send(conn->fd, reply, strlen(reply), MSG_NOSIGNAL) < 0)
+            virtio_vsock_reset(dev, conn);
+        break;
+    case VIRTIO_VSOCK_OP_RW:
+        if (conn->state == VSOCK_CONN_ESTABLISHED &&
+            hdr->len <= chain->len - sizeof(*hdr))
+            virtio_vsock_conn_tx(dev, conn, chain, hdr->len);
+        else
+            virtio_vsock_reset(dev, conn);
+        break;
+    case VIRTIO_VSOCK_OP_CREDIT_UPDATE:
+        break;
+    case VIRTIO_VSOCK_OP_CREDIT_REQUEST:
+        virtio_vsock_send_ctrl(dev, conn, VIRTIO_VSOCK_OP_CREDIT_UPDATE, 0);
+        break;
+    case VIRTIO_VSOCK_OP_SHUTDOWN:
+        conn->peer_shutdown |= hdr->flags & VIRTIO_VSOCK_SHUTDOWN_BOTH;
+        virtio_vsock_check_shutdown(dev, conn);
+        break;
+    case VIRTIO_VSOCK_OP_RST:
+        virtio_vsock_conn_close(conn);
+        break;
+    default:
+        virtio_vsock_reset(dev, conn);
+        break;
+    }
+}
+
+static void virtio_vsock_handle_tx(struct virtio_vsock_dev *dev)
+{
+    guest *v = container_of(dev, guest, virtio_vsock_dev);
+    struct virtq *vq = &dev->vq[VIRTIO_VSOCK_VQ_TX];
+    struct virtq_chain chain;
+    struct virtio_vsock_hdr hdr;
+
+    if (!vq->info.enable)
+        return;
+    while (virtq_pop_chain(vq, v, &chain)) {
+        if (virtq_chain_read(&chain, &hdr, sizeof(hdr)) == sizeof(hdr))
+            virtio_vsock_handle_pkt(dev, &hdr, &chain);
+        virtio_vsock_push(dev, vq, &chain, 0);
+    }
+}
+
+/* The host connects to <uds_path> and names the guest port with a
+ * "CONNECT <port>\n" line before the stream starts.
+ */
+static void virtio_vsock_accept(struct virtio_vsock_dev *dev)
+{
+    struct virtio_vsock_conn *conn;
+    int fd = accept(dev->listen_fd, NULL, NULL);
+
+    if (fd < 0)
+        return;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    conn = virtio_vsock_conn_alloc(dev, fd, VSOCK_CONN_HANDSHAKE);
+    if (!conn) {
+        close(fd);
+        return;
+    }
+    conn->local_port = dev->next_local_port++;
+    if (dev->next_local_port < VIRTIO_VSOCK_LOCAL_PORT_BASE)
+        dev->next_local_port = VIRTIO_VSOCK_LOCAL_PORT_BASE;
+}
+
+/* Read the handshake one byte at a time so none of the stream is consumed */
+static void virtio_vsock_handshake(struct virtio_vsock_dev *dev,
+                                   struct virtio_vsock_conn *conn)
+{
+    unsigned int port;
+    ssize_t n;
+
+    while ((n = recv(conn->fd, &conn->line[conn->line_len], 1, 0)) == 1) {
+        if (conn->line[conn->line_len] != '\n') {
+            if (++conn->line_len == sizeof(conn->line)) {
+                virtio_vsock_conn_close(conn);
+                return;
+            }
+            continue;
+        }
+        conn->line[conn->line_len] = '\0';
+        if (sscanf(conn->line, "CONNECT %u", &port) != 1) {
+            virtio_vsock_conn_close(conn);
+            return;
+        }
+        conn->peer_port = port;
+        conn->state = VSOCK_CONN_CONNECTING;
+        virtio_vsock_send_ctrl(dev, conn, VIRTIO_VSOCK_OP_REQUEST, 0);
+        return;
+    }
+    if (n == 0 || (errno != EAGAIN && errno != EINTR))
+        virtio_vsock_conn_close(conn);
+}
+
+static void virtio_vsock_conn_event(struct virtio_vsock_dev *dev,
+                                    struct virtio_vsock_conn *conn,
+                                    uint32_t events)
+{
+    if (conn->state == VSOCK_CONN_HANDSHAKE) {
+        virtio_vsock_handshake(dev, conn);
+        return;
+    }
+    if (events & EPOLLOUT)
+        virtio_vsock_conn_flush(dev, conn);
+    if (conn->state == VSOCK_CONN_ESTABLISHED && (events & EPOLLIN))
+        virtio_vsock_conn_rx(dev, conn);
+}
+
+/* Wait only for what can make progress. A connection with nothing to wait for
+ * is taken out of the epoll set, so a socket that hung up doesn't spin while
+ * the guest has no credit or rx buffers to give.
+ */
+static void virtio_vsock_update_events(struct virtio_vsock_dev *dev)
+{
+    struct virtq *rx_vq = &dev->vq[VIRTIO_VSOCK_VQ_RX];
+    bool rx_ready = rx_vq->info.enable && virtq_has_avail(rx_vq) &&
+                    dev->pending_head == dev->pending_tail;
+
+    for (int i = 0; i < VIRTIO_VSOCK_MAX_CONNS; i++) {
+        struct virtio_vsock_conn *conn = &dev->conns[i];
+        struct epoll_event ev = {.data.u32 = i};
+        uint32_t events = 0;
+        int op;
+
+        if (conn->state == VSOCK_CONN_FREE)
+            continue;
+        if (conn->state == VSOCK_CONN_HANDSHAKE)
+            events |= EPOLLIN;
+        if (conn->state == VSOCK_CONN_ESTABLISHED && !conn->host_eof &&
+            rx_ready && virtio_vsock_peer_credit(conn))
+            events |= EPOLLIN;
+        if (conn->buf_len)
+            events |= EPOLLOUT;
+        if (events == conn->epoll_events)
+            continue;
+
+        if (!events)
+            op = EPOLL_CTL_DEL;
+        else if (!conn->epoll_events)
+            op = EPOLL_CTL_ADD;
+        else
+            op = EPOLL_CTL_MOD;
+        ev.events = events;
+        if (epoll_ctl(dev->epoll_fd, op, conn->fd, &ev) < 0)
+            perror("vsock epoll_ctl");
+        conn->epoll_events = events;
+    }
+}
+
+/* One interrupt for everything used in a round of events */
+static void virtio_vsock_raise_irq(struct virtio_vsock_dev *dev)
+{
+    struct virtq *notify_vq = NULL;
+
+    for (int i = 0; i < VIRTIO_VSOCK_VIRTQ_NUM; i++) {
+        if ((dev->used_vqs & (1U << i)) &&
+            dev->vq[i].guest_event->flags == VRING_PACKED_EVENT_FLAG_ENABLE)
+            notify_vq = &dev->vq[i];
+    }
+    dev->used_vqs = 0;
+    if (!notify_vq)
+        return;
+    __atomic_or_fetch(&dev->virtio_pci_dev.config.isr_cap.isr_status,
+                      VIRTIO_PCI_ISR_QUEUE, __ATOMIC_RELAXED);
+    virtq_notify_used(notify_vq);
+}
+
+/* All of the queue processing happens here, the vCPU only kicks this thread */
+static void *virtio_vsock_thread(void *arg)
+{
+    struct virtio_vsock_dev *dev = (struct virtio_vsock_dev *) arg;
+    struct epoll_event events[VIRTIO_VSOCK_MAX_EVENTS];
+
+    while (!__atomic_load_n(&dev->stop, __ATOMIC_RELAXED)) {
+        int n = epoll_wait(dev->epoll_fd, events, VIRTIO_VSOCK_MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("vsock epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            uint32_t tag = events[i].data.u32;
+            uint64_t kick;
+
+            if (tag == VIRTIO_VSOCK_TAG_KICK) {
+                if (read(dev->ioeventfd, &kick, sizeof(kick)) < 0)
+                    perror("vsock read kick");
+                virtio_vsock_handle_tx(dev);
+            } else if (tag == VIRTIO_VSOCK_TAG_LISTEN) {
+                virtio_vsock_accept(dev);
+            } else if (dev->conns[tag].state != VSOCK_CONN_FREE) {
+                virtio_vsock_conn_event(dev, &dev->conns[tag],
+                                        events[i].events);
+            }
+        }
+        virtio_vsock_flush_ctrl(dev);
+        virtio_vsock_update_events(dev);
+        virtio_vsock_raise_irq(dev);
+    }
+
+    return NULL;
+}
+
+static void virtio_vsock_kick(struct virtio_vsock_dev *dev)
+{
+    uint64_t n = 1;
+
+    if (write(dev->ioeventfd, &n, sizeof(n)) < 0)
+        perror("Failed to kick the vsock thread");
+}
+
+/* Called on the vCPU thread by virtq_handle_avail after a kick that didn't go
+ * through the ioeventfd. The interrupt is only raised for buffers the worker
+ * marked as used, not for the kick itself.
+ */
+static void virtio_vsock_notify_used(struct virtq *vq)
+{
+    struct virtio_vsock_dev *dev = (struct virtio_vsock_dev *) vq->dev;
+    uint64_t n = 1;
+
+    if (!(__atomic_load_n(&dev->virtio_pci_dev.config.isr_cap.isr_status,
+                          __ATOMIC_RELAXED) &
+          VIRTIO_PCI_ISR_QUEUE))
+        return;
+    TRACE(TRACE_IRQ, dev->irq_num, 1, 0);
+    if (write(dev->irqfd, &n, sizeof(n)) < 0)
+        perror("Failed to write the irqfd");
+}
+
+static void virtio_vsock_complete_request(struct virtq *vq)
+{
+    virtio_vsock_kick((struct virtio_vsock_dev *) vq->dev);
+}
+
+static void virtio_vsock_enable_vq(struct virtq *vq)
+{
+    struct virtio_vsock_dev *dev = (struct virtio_vsock_dev *) vq->dev;
+    guest *v = container_of(dev, guest, virtio_vsock_dev);
+
+    if (vq->info.enable)
+        return;
+    vq->desc_ring =
+        (struct vring_packed_desc *) vm_guest_to_host(v, vq->info.desc_addr);
+    vq->device_event = (struct vring_packed_desc_event *) vm_guest_to_host(
+        v, vq->info.device_addr);
+    vq->guest_event = (struct vring_packed_desc_event *) vm_guest_to_host(
+        v, vq->info.driver_addr);
+    __atomic_store_n(&vq->info.enable, true, __ATOMIC_RELEASE);
+
+    /* All queues share one notify address. The driver writes the 16-bit queue
+     * index there, so that is the length to match.
+     */
+    if (!dev->ioeventfd_registered) {
+        uint64_t addr = virtio_pci_get_notify_addr(&dev->virtio_pci_dev, vq);
+        vm_ioeventfd_register(v, dev->ioeventfd, addr, sizeof(uint16_t), 0);
+        dev->ioeventfd_registered = true;
+    }
+    /* buffers may have been posted before the queue was enabled */
+    virtio_vsock_kick(dev);
+}
+
+static struct virtq_ops ops = {
+    .enable_vq = virtio_vsock_enable_vq,
+    .complete_request = virtio_vsock_complete_request,
+    .notify_used = virtio_vsock_notify_used,
+};
+
+static int virtio_vsock_listen(struct virtio_vsock_dev *dev)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+    strcpy(addr.sun_path, dev->uds_path);
+    dev->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (dev->listen_fd < 0) {
+        perror("vsock socket");
+        return -1;
+    }
+    unlink(dev->uds_path); /* a socket left behind by a previous run */
+    if (bind(dev->listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        listen(dev->listen_fd, 16) < 0) {
+        perror("bind vsock socket");
+        close(dev->listen_fd);
+        return -1;
+    }
+    sudo_chown_socket(dev->uds_path);
+    return 0;
+}
+
+static int virtio_vsock_setup(struct virtio_vsock_dev *dev,
+                              uint64_t guest_cid,
+                              const char *uds_path)
+{
+    guest *v = container_of(dev, guest, virtio_vsock_dev);
+    struct epoll_event ev = {.events = EPOLLIN};
+
+    if (strlen(uds_path) >= sizeof(dev->uds_path)) {
+        fprintf(stderr, "vsock socket path is too long\n");
+        return -1;
+    }
+    strcpy(dev->uds_path, uds_path);
+    if (virtio_vsock_listen(dev) < 0)
+        return -1;
+
+    dev->irq_num = VIRTIO_VSOCK_IRQ;
+    dev->config.guest_cid = guest_cid;
+    dev->next_local_port = VIRTIO_VSOCK_LOCAL_PORT_BASE;
+    dev->ioeventfd = eventfd(0, EFD_CLOEXEC);
+    dev->irqfd = eventfd(0, EFD_CLOEXEC);
+    vm_irqfd_register(v, dev->irqfd, dev->irq_num, 0);
+
+    dev->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    ev.data.u32 = VIRTIO_VSOCK_TAG_LISTEN;
+    epoll_ctl(dev->epoll_fd, EPOLL_CTL_ADD, dev->listen_fd, &ev);
+    ev.data.u32 = VIRTIO_VSOCK_TAG_KICK;
+    epoll_ctl(dev->epoll_fd, EPOLL_CTL_ADD, dev->ioeventfd, &ev);
+
+    for (int i = 0; i < VIRTIO_VSOCK_VIRTQ_NUM; i++)
+        virtq_init(&dev->vq[i], dev, &ops);
+    dev->enable = true;
+    return 0;
+}
+
+int virtio_vsock_init_pci(struct virtio_vsock_dev *virtio_vsock_dev,
+                          uint64_t guest_cid,
+                          const char *uds_path,
+                          struct pci *pci,
+                          struct bus *io_bus,
+                          struct bus *mmio_bus)
+{
+    struct virtio_pci_dev *dev = &virtio_vsock_dev->virtio_pci_dev;
+
+    if (virtio_vsock_setup(virtio_vsock_dev, guest_cid, uds_path) < 0)
+        return -1;
+    virtio_pci_init(dev, pci, io_bus, mmio_bus);
+    virtio_pci_set_dev_cfg(dev, &virtio_vsock_dev->config,
+                           sizeof(virtio_vsock_dev->config));
+    virtio_pci_set_pci_hdr(dev, VIRTIO_PCI_DEVICE_ID_VSOCK,
+                           VIRTIO_VSOCK_PCI_CLASS, virtio_vsock_dev->irq_num);
+    virtio_pci_set_virtq(dev, virtio_vsock_dev->vq, VIRTIO_VSOCK_VIRTQ_NUM);
+    virtio_pci_add_feature(dev, 0);
+    virtio_pci_enable(dev);
+    pthread_create(&virtio_vsock_dev->worker_thread, NULL, virtio_vsock_thread,
+                   virtio_vsock_dev);
+    printf("vsock guest cid %lu, host socket %s\n", guest_cid, uds_path);
+    return 0;
+}
+
+void virtio_vsock_exit(struct virtio_vsock_dev *dev)
+{
+    if (!dev->enable)
+        return;
+    __atomic_store_n(&dev->stop, true, __ATOMIC_RELAXED);
+    virtio_vsock_kick(dev);
+    pthread_join(dev->worker_thread, NULL);
+    for (int i = 0; i < VIRTIO_VSOCK_MAX_CONNS; i++) {
+        if (dev->conns[i].state != VSOCK_CONN_FREE)
+            virtio_vsock_conn_close(&dev->conns[i]);
+    }
+    virtio_pci_exit(&dev->virtio_pci_dev);
+    close(dev->epoll_fd);
+    close(dev->listen_fd);
+    unlink(dev->uds_path);
+    close(dev->irqfd);
+    close(dev->ioeventfd);
+}
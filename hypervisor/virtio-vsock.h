@@ -0,0 +1,82 @@
+#pragma once
+
+#include <linux/virtio_vsock.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/un.h>
+
+#include "pci.h"
+#include "virtio_pci.h"
+#include "virtq.h"
+
+#define VIRTIO_VSOCK_VIRTQ_NUM 3
+#define VIRTIO_VSOCK_VQ_RX 0
+#define VIRTIO_VSOCK_VQ_TX 1
+#define VIRTIO_VSOCK_VQ_EVENT 2
+#define VIRTIO_VSOCK_PCI_CLASS 0xff0000
+#define VIRTIO_VSOCK_IRQ 11
+#define VIRTIO_VSOCK_HOST_CID 2
+#define VIRTIO_VSOCK_DEFAULT_GUEST_CID 3
+#define VIRTIO_VSOCK_MAX_CONNS 64
+#define VIRTIO_VSOCK_CONN_BUF_SIZE (256 * 1024)
+#define VIRTIO_VSOCK_MAX_PENDING 64
+/* host side ports of the connections opened by the host */
+#define VIRTIO_VSOCK_LOCAL_PORT_BASE (1U << 30)
+
+enum virtio_vsock_conn_state {
+    VSOCK_CONN_FREE = 0,
+    VSOCK_CONN_HANDSHAKE, /* waiting for "CONNECT <port>\n" from the host */
+    VSOCK_CONN_CONNECTING, /* request sent, waiting for the guest response */
+    VSOCK_CONN_ESTABLISHED,
+};
+
+/* one guest stream, bridged to a host unix socket */
+struct virtio_vsock_conn {
+    enum virtio_vsock_conn_state state;
+    int fd;
+    uint32_t local_port; /* host side */
+    uint32_t peer_port; /* guest side */
+    uint32_t peer_buf_alloc;
+    uint32_t peer_fwd_cnt;
+    uint32_t rx_cnt; /* bytes sent to the guest */
+    uint32_t fwd_cnt; /* bytes of the guest written to the socket */
+    uint32_t last_fwd_cnt; /* fwd_cnt last told to the guest */
+    uint32_t peer_shutdown; /* VIRTIO_VSOCK_SHUTDOWN_* flags of the guest */
+    bool host_eof;
+    uint32_t epoll_events;
+    uint8_t *buf; /* guest data the socket didn't take yet */
+    size_t buf_len;
+    char line[32]; /* handshake line */
+    size_t line_len;
+};
+
+struct virtio_vsock_dev {
+    struct virtio_pci_dev virtio_pci_dev;
+    struct virtio_vsock_config config;
+    struct virtq vq[VIRTIO_VSOCK_VIRTQ_NUM];
+    int irqfd;
+    int ioeventfd;
+    int irq_num;
+    int epoll_fd;
+    int listen_fd;
+    char uds_path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+    pthread_t worker_thread;
+    struct virtio_vsock_conn conns[VIRTIO_VSOCK_MAX_CONNS];
+    /* control packets waiting for a guest rx buffer */
+    struct virtio_vsock_hdr pending[VIRTIO_VSOCK_MAX_PENDING];
+    unsigned int pending_head, pending_tail;
+    uint32_t next_local_port;
+    bool ioeventfd_registered;
+    uint32_t used_vqs; /* queues with used buffers to notify, worker only */
+    bool stop;
+    bool enable;
+};
+
+int virtio_vsock_init_pci(struct virtio_vsock_dev *dev,
+                          uint64_t guest_cid,
+                          const char *uds_path,
+                          struct pci *pci,
+                          struct bus *io_bus,
+                          struct bus *mmio_bus);
+void virtio_vsock_exit(struct virtio_vsock_dev *dev);
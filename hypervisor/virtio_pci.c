@@ -33,10 +33,11 @@ static void virtio_pci_write_guest_feature(struct virtio_pci_dev *dev)
 
     switch (select) {
     case 0:
-        dev->guest_feature |= feature;
+        dev->guest_feature = (dev->guest_feature & ~0xffffffffULL) | feature;
         break;
     case 1:
-        dev->guest_feature |= (uint64_t) feature << 32;
+        dev->guest_feature =
+            (dev->guest_feature & 0xffffffffULL) | (uint64_t) feature << 32;
         break;
     default:
         /* Ignore writing into the guest feature */
@@ -94,7 +95,8 @@ static void virtio_pci_space_write(struct virtio_pci_dev *dev,
         case VIRTIO_PCI_COMMON_DFSELECT:
             virtio_pci_select_device_feature(dev);
             break;
-        case VIRTIO_PCI_COMMON_GFSELECT:
+        /* the driver selects the half, then writes it */
+        case VIRTIO_PCI_COMMON_GF:
             virtio_pci_write_guest_feature(dev);
             break;
         case VIRTIO_PCI_COMMON_STATUS:
@@ -139,6 +141,9 @@ static void virtio_pci_space_read(struct virtio_pci_dev *dev,
                                   uint8_t size)
 {
     if (offset < offsetof(struct virtio_pci_config, dev_cfg)) {
+        if (dev->notify_external &&
+            offset == offsetof(struct virtio_pci_config, isr_cap))
+            dev->config.isr_cap.isr_status |= VIRTIO_PCI_ISR_QUEUE;
         memcpy(data, (void *) ((uintptr_t) &dev->config + offset), size);
         if (offset == offsetof(struct virtio_pci_config, isr_cap)) {
             dev->config.isr_cap.isr_status = 0;
@@ -247,7 +252,6 @@ void virtio_pci_set_pci_hdr(struct virtio_pci_dev *dev,
 {
     dev->pci_dev.hdr.device_id = device_id;
     dev->pci_dev.hdr.class_id.class_id = class << 8;
-    printf("[class] 0x%x, class before: 0x%x, class after: 0x%x\n", dev->pci_dev.hdr.class_id.class_id, class, class << 8);
     dev->pci_dev.hdr.interrupt_line = irq_line;
 }
 
@@ -273,9 +277,9 @@ void virtio_pci_init(struct virtio_pci_dev *dev,
         (1ULL << VIRTIO_F_RING_PACKED) | (1ULL << VIRTIO_F_VERSION_1);
 }
 
-void virtio_pci_enable(struct virtio_pci_dev *dev)
+int virtio_pci_enable(struct virtio_pci_dev *dev)
 {
-    pci_dev_register(&dev->pci_dev);
+    return pci_dev_register(&dev->pci_dev);
 }
 
 void virtio_pci_exit()
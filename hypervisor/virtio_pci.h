@@ -1,6 +1,7 @@
 #pragma once
 
 #include <linux/virtio_pci.h>
+#include <stdbool.h>
 
 #include "pci.h"
 #include "virtq.h"
@@ -8,6 +9,10 @@
 #define VIRTIO_PCI_VENDOR_ID 0x1AF4
 #define VIRTIO_PCI_DEVICE_ID_NET 0x1041
 #define VIRTIO_PCI_DEVICE_ID_BLK 0x1042
+#define VIRTIO_PCI_DEVICE_ID_RNG 0x1044
+#define VIRTIO_PCI_DEVICE_ID_BALLOON 0x1045
+#define VIRTIO_PCI_DEVICE_ID_9P 0x1049
+#define VIRTIO_PCI_DEVICE_ID_VSOCK 0x1053
 #define VIRTIO_PCI_CAP_NUM 5
 #define VIRTIO_PCI_ISR_QUEUE 1
 
@@ -35,6 +40,9 @@ struct virtio_pci_dev {
     struct virtio_pci_notify_cap *notify_cap;
     struct virtio_pci_cap *dev_cfg_cap;
     struct virtq *vq;
+    /* the queues interrupt the guest through an irqfd another process
+     * writes, the ISR can't follow them and reads as a queue interrupt */
+    bool notify_external;
 };
 
 uint64_t virtio_pci_get_notify_addr(struct virtio_pci_dev *dev,
@@ -50,7 +58,7 @@ void virtio_pci_set_virtq(struct virtio_pci_dev *dev,
                           struct virtq *vq,
                           uint16_t num_queues);
 void virtio_pci_add_feature(struct virtio_pci_dev *dev, uint64_t feature);
-void virtio_pci_enable(struct virtio_pci_dev *dev);
+int virtio_pci_enable(struct virtio_pci_dev *dev); /* returns 0 on success, -1 when the PCI bus is full */
 void virtio_pci_init(struct virtio_pci_dev *dev,
                      struct pci *pci,
                      struct bus *io_bus,
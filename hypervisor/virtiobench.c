@@ -0,0 +1,901 @@
+#include <fcntl.h>
+#include <getopt.h>
+#include <linux/virtio_config.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "guest.h"
+#include "trace.h"
+#include "vhost-user.h"
+#include "vm.h"
+
+/* The virtio stack (virtio_pci.c, virtq.c, virtio-blk.c) driven without KVM.
+ * The guest is a plain heap buffer and this thread is its driver: it scans
+ * the PCI bus the way Linux enumerates it at boot, through the config ports
+ * and through ECAM, finds the device, sets it up through the common
+ * config BAR, puts packed descriptor chains in the ring, rings the doorbell
+ * the way KVM does (a write to the ioeventfd) and takes the completions from
+ * the irqfd or by polling the ring. Every completion is checked, a wrong
+ * status, length or block content fails the run.
+ *
+ * With -u the queue goes to build/vhostblkd over vhost-user (vhost-user-blk.c):
+ * the guest memory is a memfd the backend maps, the doorbell and the
+ * interrupt are eventfds between this process and the backend, as they
+ * would be between KVM and the backend.
+ */
+
+#define VBENCH_MEM_SIZE (64UL << 20)
+#define VBENCH_BAR0 0xd0000000UL
+#define VBENCH_RING 0x1000UL /* descriptors */
+#define VBENCH_DRIVER_EVENT 0x3000UL
+#define VBENCH_DEVICE_EVENT 0x3010UL
+#define VBENCH_HDRS 0x4000UL /* request header and status of each slot */
+#define VBENCH_DATA 0x100000UL /* data buffer of each slot */
+#define VBENCH_MAX_BS 32768 /* the device takes at most 64K - 1 per buffer */
+#define VBENCH_SLOTS 64
+#define VBENCH_SCANS 1000
+#define VBENCH_BOOT_READS 2000
+
+struct vbench_slot {
+    uint16_t descs; /* length of the chain, 0 when the slot is free */
+    uint32_t type;
+    uint64_t sector;
+    uint32_t len;
+    uint8_t expect_status;
+    uint64_t submit_ns;
+};
+
+struct vbench {
+    guest *g;
+    struct virtio_blk_dev *blk;
+    struct virtio_pci_dev *pci_dev; /* of blk, or of the vhost-user device */
+    bool vhost_user; /* the queue is served by build/vhostblkd */
+    int kick_fd;
+    int irq_fd;
+    int disk_fd;
+    uint64_t disk_size;
+    bool conf1; /* config space through 0xCF8/0xCFC, else through ECAM */
+    unsigned long config_exits; /* port or MMIO exits of the config accesses */
+    uint8_t slot; /* of the virtio-blk device on bus 0 */
+    uint64_t common; /* guest physical addresses of the config structures */
+    uint64_t notify;
+    uint64_t isr;
+    uint64_t dev_cfg;
+    struct vring_packed_desc *ring;
+    struct vring_packed_desc_event *driver_event;
+    uint16_t size;
+    uint16_t free;
+    uint16_t next_avail;
+    bool avail_wrap;
+    uint16_t next_used;
+    bool used_wrap;
+    uint64_t capacity; /* in sectors */
+    bool poll; /* no interrupts, spin on the ring */
+    struct vbench_slot slots[VBENCH_SLOTS];
+    uint64_t *lat; /* completion latencies of the current run, in ns */
+    size_t nlat;
+    unsigned long failures;
+};
+
+static uint8_t *bench_mem;
+
+/* guest.c and vm.c, against the heap buffer instead of a VM */
+void *vm_guest_to_host(guest *v, uint64_t guest_addr)
+{
+    return (void *) ((uintptr_t) v->mem + guest_addr);
+}
+
+bool vm_guest_range_valid(guest *v, uint64_t guest_addr, uint64_t len)
+{
+    (void) v;
+    return guest_addr < VBENCH_MEM_SIZE && len <= VBENCH_MEM_SIZE - guest_addr;
+}
+
+/* the driver writes the ioeventfd and reads the irqfd itself */
+void vm_ioeventfd_register(guest *v, int fd, unsigned long long addr, int len, int flags)
+{
+    (void) v;
+    (void) fd;
+    (void) addr;
+    (void) len;
+    (void) flags;
+}
+
+void vm_irqfd_register(guest *v, int fd, int gsi, int flags)
+{
+    (void) v;
+    (void) fd;
+    (void) gsi;
+    (void) flags;
+}
+
+void vm_place_io_thread(guest *g)
+{
+    (void) g;
+}
+
+static uint64_t vbench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void check(struct vbench *b, bool ok, const char *what)
+{
+    if (!ok) {
+        /* a broken device fails every request the same way */
+        if (b->failures < 10)
+            printf("FAIL: %s\n", what);
+        b->failures++;
+    }
+}
+
+/* One access is two port exits through the address and data registers, or
+ * one MMIO exit in the ECAM window */
+static uint32_t pci_config_read32(struct vbench *b, uint8_t slot, uint16_t reg)
+{
+    uint32_t addr = PCI_ADDR_ENABLE_BIT | slot << 11 | reg, value = 0;
+
+    if (b->conf1) {
+        bus_handle_io(&b->g->io_bus, &addr, 1, PCI_CONFIG_ADDR, 4);
+        bus_handle_io(&b->g->io_bus, &value, 0, PCI_CONFIG_DATA, 4);
+        b->config_exits += 2;
+    } else {
+        bus_handle_io(&b->g->mmio_bus, &value, 0, PCI_ECAM_START + PCI_ECAM_OFFSET(0, slot, 0) + reg, 4);
+        b->config_exits++;
+    }
+    return value;
+}
+
+static void pci_config_write32(struct vbench *b, uint8_t slot, uint16_t reg, uint32_t value)
+{
+    uint32_t addr = PCI_ADDR_ENABLE_BIT | slot << 11 | reg;
+
+    if (b->conf1) {
+        bus_handle_io(&b->g->io_bus, &addr, 1, PCI_CONFIG_ADDR, 4);
+        bus_handle_io(&b->g->io_bus, &value, 1, PCI_CONFIG_DATA, 4);
+        b->config_exits += 2;
+    } else {
+        bus_handle_io(&b->g->mmio_bus, &value, 1, PCI_ECAM_START + PCI_ECAM_OFFSET(0, slot, 0) + reg, 4);
+        b->config_exits++;
+    }
+}
+
+static uint64_t mmio_read(struct vbench *b, uint64_t addr, uint8_t size)
+{
+    uint64_t value = 0;
+
+    bus_handle_io(&b->g->mmio_bus, &value, 0, addr, size);
+    return value;
+}
+
+static void mmio_write(struct vbench *b, uint64_t addr, uint64_t value, uint8_t size)
+{
+    bus_handle_io(&b->g->mmio_bus, &value, 1, addr, size);
+}
+
+#define COMMON(field) (b->common + offsetof(struct virtio_pci_common_cfg, field))
+#define COMMON_READ(field) \
+    mmio_read(b, COMMON(field), sizeof(((struct virtio_pci_common_cfg *) 0)->field))
+#define COMMON_WRITE(field, value) \
+    mmio_write(b, COMMON(field), value, sizeof(((struct virtio_pci_common_cfg *) 0)->field))
+
+/* What pci_scan_child_bus and pci_setup_device read of bus 0, function 0 of
+ * each slot: the ids, header type and class, the size of every BAR (save,
+ * write all ones, read back, restore), the capability list and the interrupt
+ * pin. Returns the number of devices, the slot of virtio-blk in b->slot */
+static int vbench_scan(struct vbench *b)
+{
+    int devices = 0;
+
+    for (uint8_t slot = 0; slot < 32; slot++) {
+        uint32_t id = pci_config_read32(b, slot, PCI_VENDOR_ID);
+        uint8_t cap;
+
+        if ((id & 0xffff) == 0xffff || !(id & 0xffff))
+            continue;
+        devices++;
+        if (id == (VIRTIO_PCI_DEVICE_ID_BLK << 16 | VIRTIO_PCI_VENDOR_ID))
+            b->slot = slot;
+        pci_config_read32(b, slot, PCI_CACHE_LINE_SIZE); /* header type */
+        pci_config_read32(b, slot, PCI_CLASS_REVISION);
+        pci_config_read32(b, slot, PCI_COMMAND);
+        for (int bar = 0; bar < PCI_STD_NUM_BARS; bar++) {
+            uint16_t reg = PCI_BASE_ADDRESS_0 + bar * 4;
+            uint32_t saved = pci_config_read32(b, slot, reg);
+            pci_config_write32(b, slot, reg, ~0U);
+            pci_config_read32(b, slot, reg);
+            pci_config_write32(b, slot, reg, saved);
+        }
+        pci_config_read32(b, slot, PCI_SUBSYSTEM_VENDOR_ID);
+        cap = pci_config_read32(b, slot, PCI_CAPABILITY_LIST) & 0xff;
+        while (cap)
+            cap = (pci_config_read32(b, slot, cap) >> 8) & 0xff;
+        pci_config_read32(b, slot, PCI_INTERRUPT_LINE);
+    }
+    return devices;
+}
+
+/* Boot time enumeration cost, one way then the other; both must see the same
+ * config space, and only ECAM reaches past the first 256 bytes */
+static void vbench_scan_bench(struct vbench *b)
+{
+    static const char *names[] = {"conf1", "ECAM"};
+
+    printf("%-8s %8s %14s %14s\n", "pci scan", "devices", "exits/scan", "us/scan");
+    for (int ecam = 0; ecam < 2; ecam++) {
+        uint64_t start;
+        int devices = 0;
+
+        b->conf1 = !ecam;
+        b->config_exits = 0;
+        start = vbench_now();
+        for (int i = 0; i < VBENCH_SCANS; i++)
+            devices = vbench_scan(b);
+        printf("%-8s %8d %14lu %14.2f\n", names[ecam], devices, b->config_exits / VBENCH_SCANS,
+               (vbench_now() - start) / 1e3 / VBENCH_SCANS);
+    }
+    for (uint16_t reg = 0; reg < PCI_CFG_SPACE_SIZE; reg += 4) {
+        uint32_t value;
+        b->conf1 = true;
+        value = pci_config_read32(b, b->slot, reg);
+        b->conf1 = false;
+        check(b, pci_config_read32(b, b->slot, reg) == value, "same config space through ECAM");
+    }
+    check(b, pci_config_read32(b, b->slot, PCI_CFG_SPACE_SIZE) == 0, "empty extended capability list");
+    check(b, pci_config_read32(b, 31, PCI_VENDOR_ID) == 0xffffffff, "no device in slot 31");
+    check(b, pci_config_read32(b, 0, PCI_CLASS_REVISION) >> 8 == PCI_HOST_BRIDGE_CLASS, "host bridge");
+    check(b, pci_config_read32(b, 0, PCI_HOST_BRIDGE_PCIEXBAR) ==
+                 (PCI_ECAM_START | PCI_PCIEXBAR_64M | PCI_PCIEXBAR_EN),
+          "PCIEXBAR of the host bridge");
+}
+
+/* What virtio_pci_modern_probe and virtio_dev_probe do with the device
+ * found by the scan: map BAR 0, find the config structures in the capability list,
+ * negotiate the features and set up queue 0 */
+static void vbench_probe(struct vbench *b)
+{
+    uint32_t id = pci_config_read32(b, b->slot, PCI_VENDOR_ID);
+    uint64_t features;
+    uint8_t cap;
+
+    check(b, (id & 0xffff) == VIRTIO_PCI_VENDOR_ID, "virtio vendor id");
+    check(b, (id >> 16) == VIRTIO_PCI_DEVICE_ID_BLK, "virtio-blk device id");
+    check(b, (pci_config_read32(b, b->slot, PCI_CLASS_REVISION) >> 8) == VIRTIO_BLK_PCI_CLASS,
+          "virtio-blk class");
+
+    pci_config_write32(b, b->slot, PCI_BASE_ADDRESS_0, VBENCH_BAR0);
+    pci_config_write32(b, b->slot, PCI_COMMAND, PCI_COMMAND_MEMORY);
+
+    cap = pci_config_read32(b, b->slot, PCI_CAPABILITY_LIST) & 0xff;
+    while (cap) {
+        uint32_t hdr = pci_config_read32(b, b->slot, cap);
+        uint32_t offset =
+            pci_config_read32(b, b->slot, cap + offsetof(struct virtio_pci_cap, offset));
+        uint64_t addr = VBENCH_BAR0 + offset;
+
+        if ((hdr & 0xff) == PCI_CAP_ID_VNDR) {
+            switch ((hdr >> 24) & 0xff) {
+            case VIRTIO_PCI_CAP_COMMON_CFG:
+                b->common = addr;
+                break;
+            case VIRTIO_PCI_CAP_NOTIFY_CFG:
+                b->notify = addr;
+                break;
+            case VIRTIO_PCI_CAP_ISR_CFG:
+                b->isr = addr;
+                break;
+            case VIRTIO_PCI_CAP_DEVICE_CFG:
+                b->dev_cfg = addr;
+                break;
+            }
+        }
+        cap = (hdr >> 8) & 0xff;
+    }
+    check(b, b->common && b->notify && b->isr && b->dev_cfg, "virtio capabilities");
+
+    COMMON_WRITE(device_status, 0);
+    COMMON_WRITE(device_status, VIRTIO_CONFIG_S_ACKNOWLEDGE | VIRTIO_CONFIG_S_DRIVER);
+    COMMON_WRITE(device_feature_select, 0);
+    features = COMMON_READ(device_feature);
+    COMMON_WRITE(device_feature_select, 1);
+    features |= (uint64_t) COMMON_READ(device_feature) << 32;
+    check(b, features & (1ULL << VIRTIO_F_VERSION_1), "VIRTIO_F_VERSION_1 offered");
+    check(b, features & (1ULL << VIRTIO_F_RING_PACKED), "VIRTIO_F_RING_PACKED offered");
+    COMMON_WRITE(guest_feature_select, 0);
+    COMMON_WRITE(guest_feature, (uint32_t) features);
+    COMMON_WRITE(guest_feature_select, 1);
+    COMMON_WRITE(guest_feature, features >> 32);
+    check(b, b->pci_dev->guest_feature == features, "features accepted");
+    COMMON_WRITE(device_status, VIRTIO_CONFIG_S_ACKNOWLEDGE | VIRTIO_CONFIG_S_DRIVER |
+                                    VIRTIO_CONFIG_S_FEATURES_OK);
+
+    b->capacity = mmio_read(b, b->dev_cfg + offsetof(struct virtio_blk_config, capacity), 8);
+    check(b, b->capacity == b->disk_size >> 9, "capacity of the disk image");
+
+    COMMON_WRITE(queue_select, 0);
+    b->size = COMMON_READ(queue_size);
+    check(b, b->size >= 3, "queue 0 size");
+    COMMON_WRITE(queue_desc_lo, VBENCH_RING);
+    COMMON_WRITE(queue_desc_hi, 0);
+    COMMON_WRITE(queue_avail_lo, VBENCH_DRIVER_EVENT);
+    COMMON_WRITE(queue_avail_hi, 0);
+    COMMON_WRITE(queue_used_lo, VBENCH_DEVICE_EVENT);
+    COMMON_WRITE(queue_used_hi, 0);
+    b->ring = (struct vring_packed_desc *) (bench_mem + VBENCH_RING);
+    b->driver_event = (struct vring_packed_desc_event *) (bench_mem + VBENCH_DRIVER_EVENT);
+    b->driver_event->flags =
+        b->poll ? VRING_PACKED_EVENT_FLAG_DISABLE : VRING_PACKED_EVENT_FLAG_ENABLE;
+    b->free = b->size;
+    b->avail_wrap = b->used_wrap = true;
+    COMMON_WRITE(queue_enable, 1);
+    COMMON_WRITE(device_status, VIRTIO_CONFIG_S_ACKNOWLEDGE | VIRTIO_CONFIG_S_DRIVER |
+                                    VIRTIO_CONFIG_S_FEATURES_OK | VIRTIO_CONFIG_S_DRIVER_OK);
+}
+
+static uint8_t *slot_data(int slot)
+{
+    return bench_mem + VBENCH_DATA + (size_t) slot * VBENCH_MAX_BS;
+}
+
+/* the first 8 bytes of every sector hold its number, with a tag for the writes */
+static void stamp(uint8_t *buf, uint64_t sector, uint32_t len, uint64_t tag)
+{
+    for (uint32_t off = 0; off < len; off += 512) {
+        uint64_t v = (sector + off / 512) ^ tag;
+        memcpy(buf + off, &v, sizeof(v));
+    }
+}
+
+static bool stamped(const uint8_t *buf, uint64_t sector, uint32_t len, uint64_t tag)
+{
+    for (uint32_t off = 0; off < len; off += 512) {
+        uint64_t v;
+        memcpy(&v, buf + off, sizeof(v));
+        if (v != ((sector + off / 512) ^ tag))
+            return false;
+    }
+    return true;
+}
+
+static void vbench_put_desc(struct vbench *b, uint64_t addr, uint32_t len, uint16_t id,
+                            uint16_t flags, uint16_t *head_flags)
+{
+    struct vring_packed_desc *desc = &b->ring[b->next_avail];
+
+    flags |= b->avail_wrap ? 1 << VRING_PACKED_DESC_F_AVAIL : 1 << VRING_PACKED_DESC_F_USED;
+    desc->addr = addr;
+    desc->len = len;
+    desc->id = id;
+    /* the head goes last, once the whole chain is in place */
+    if (head_flags)
+        *head_flags = flags;
+    else
+        __atomic_store_n(&desc->flags, flags, __ATOMIC_RELEASE);
+    if (++b->next_avail == b->size) {
+        b->next_avail = 0;
+        b->avail_wrap = !b->avail_wrap;
+    }
+}
+
+/* Put a request in the ring: header, data unless len is 0, status */
+static bool vbench_submit(struct vbench *b, int slot, uint32_t type, uint64_t sector, uint32_t len)
+{
+    struct vbench_slot *s = &b->slots[slot];
+    uint64_t hdr = VBENCH_HDRS + slot * 32;
+    struct virtio_blk_outhdr *out = (struct virtio_blk_outhdr *) (bench_mem + hdr);
+    uint16_t descs = len ? 3 : 2;
+    uint16_t head = b->next_avail, head_flags;
+
+    if (s->descs || b->free < descs)
+        return false;
+    out->type = type;
+    out->ioprio = 0;
+    out->sector = sector;
+    bench_mem[hdr + 16] = 0xff;
+    *s = (struct vbench_slot){
+        .descs = descs,
+        .type = type,
+        .sector = sector,
+        .len = len,
+        .expect_status = VIRTIO_BLK_S_OK,
+        .submit_ns = vbench_now(),
+    };
+    if (type != VIRTIO_BLK_T_IN && type != VIRTIO_BLK_T_OUT)
+        s->expect_status = VIRTIO_BLK_S_UNSUPP;
+    if (type == VIRTIO_BLK_T_OUT)
+        stamp(slot_data(slot), sector, len, 0);
+    else if (len)
+        memset(slot_data(slot), 0xee, len);
+
+    vbench_put_desc(b, hdr, sizeof(*out), slot, VRING_DESC_F_NEXT, &head_flags);
+    if (len)
+        vbench_put_desc(b, VBENCH_DATA + (uint64_t) slot * VBENCH_MAX_BS, len, slot,
+                        VRING_DESC_F_NEXT | (type == VIRTIO_BLK_T_IN ? VRING_DESC_F_WRITE : 0),
+                        NULL);
+    vbench_put_desc(b, hdr + 16, 1, slot, VRING_DESC_F_WRITE, NULL);
+    __atomic_store_n(&b->ring[head].flags, head_flags, __ATOMIC_RELEASE);
+    b->free -= descs;
+    return true;
+}
+
+/* The doorbell: KVM turns the write to the notify address into this */
+static void vbench_kick(struct vbench *b)
+{
+    uint64_t n = 1;
+
+    if (write(b->kick_fd, &n, sizeof(n)) < 0)
+        perror("virtiobench kick");
+}
+
+/* Take the used chains, as virtqueue_get_buf_ctx_packed does */
+static int vbench_reap(struct vbench *b)
+{
+    int reaped = 0;
+
+    for (;;) {
+        struct vring_packed_desc *desc = &b->ring[b->next_used];
+        uint16_t flags = __atomic_load_n(&desc->flags, __ATOMIC_ACQUIRE);
+        bool avail = flags & (1 << VRING_PACKED_DESC_F_AVAIL);
+        bool used = flags & (1 << VRING_PACKED_DESC_F_USED);
+        struct vbench_slot *s;
+        uint8_t status;
+
+        if (avail != used || used != b->used_wrap)
+            break;
+        if (desc->id >= VBENCH_SLOTS || !b->slots[desc->id].descs) {
+            printf("FAIL: used buffer id %u\n", desc->id);
+            exit(1);
+        }
+        s = &b->slots[desc->id];
+        status = bench_mem[VBENCH_HDRS + desc->id * 32 + 16];
+        b->lat[b->nlat++] = vbench_now() - s->submit_ns;
+        check(b, status == s->expect_status, "request status");
+        if (s->expect_status == VIRTIO_BLK_S_OK) {
+            check(b, desc->len == s->len, "used length");
+            if (s->type == VIRTIO_BLK_T_IN)
+                check(b, stamped(slot_data(desc->id), s->sector, s->len, 0), "data read back");
+        }
+
+        b->next_used += s->descs;
+        if (b->next_used >= b->size) {
+            b->next_used -= b->size;
+            b->used_wrap = !b->used_wrap;
+        }
+        b->free += s->descs;
+        s->descs = 0;
+        reaped++;
+    }
+    return reaped;
+}
+
+/* Wait for the next completions: the interrupt, then the ISR read that acks it */
+static int vbench_wait(struct vbench *b)
+{
+    uint64_t start = vbench_now();
+    int reaped;
+
+    while (!(reaped = vbench_reap(b))) {
+        if (b->poll) {
+            sched_yield();
+        } else {
+            struct pollfd pfd = {.fd = b->irq_fd, .events = POLLIN};
+            uint64_t n;
+            if (poll(&pfd, 1, 1000) > 0 && read(b->irq_fd, &n, sizeof(n)) > 0)
+                mmio_read(b, b->isr, 1);
+        }
+        if (vbench_now() - start > 5000000000ULL) {
+            printf("FAIL: no completion in 5 s\n");
+            exit(1);
+        }
+    }
+    return reaped;
+}
+
+static int vbench_free_slot(struct vbench *b)
+{
+    for (int i = 0; i < VBENCH_SLOTS; i++) {
+        if (!b->slots[i].descs)
+            return i;
+    }
+    return -1;
+}
+
+/* Keep depth requests in flight until count of them completed */
+static double vbench_run(struct vbench *b, uint32_t type, int depth, uint32_t bs, size_t count,
+                         bool sequential)
+{
+    uint64_t blocks = (b->capacity << 9) / bs;
+    size_t submitted = 0, completed = 0;
+    uint64_t start = vbench_now();
+
+    b->nlat = 0;
+    while (completed < count) {
+        int batch = 0;
+        while (submitted < count && submitted - completed < (size_t) depth) {
+            int slot = vbench_free_slot(b);
+            uint64_t block = sequential ? submitted % blocks : (uint64_t) rand() % blocks;
+            if (slot < 0 || !vbench_submit(b, slot, type, block * bs / 512, bs))
+                break;
+            submitted++;
+            batch++;
+        }
+        if (batch)
+            vbench_kick(b);
+        completed += vbench_wait(b);
+    }
+    return count / ((vbench_now() - start) / 1e9);
+}
+
+static int cmp_u64(const void *a, const void *c)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) c;
+
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(struct vbench *b, double p)
+{
+    return b->lat[(size_t) (p * (b->nlat - 1))] / 1e3;
+}
+
+/* A quarter of a second at depth 16 against an IOPS and then a bandwidth
+ * limit: the device must hold the guest to the rate, without the queue
+ * thread blocking, and count what it held back */
+static void vbench_throttle(struct vbench *b, uint32_t bs)
+{
+    struct throttle_limits limits[] = {
+        {.iops = 4000, .iops_burst = 16},
+        {.bps = 5000UL * bs, .bps_burst = 16UL * bs},
+    };
+    struct throttle_limits none = {0}, l;
+    struct throttle_stats before, stats;
+
+    printf("%-6s %12s %12s %10s %10s\n", "limit", "limit IOPS", "IOPS", "p99 us", "delayed");
+    for (int i = 0; i < 2 && !b->failures; i++) {
+        double limit = limits[i].iops ? limits[i].iops : (double) limits[i].bps / bs;
+        double iops;
+
+        throttle_set(&b->blk->throttle, &limits[i]);
+        throttle_get(&b->blk->throttle, &l, &before);
+        iops = vbench_run(b, VIRTIO_BLK_T_IN, 16, bs, limit / 4, false);
+        throttle_get(&b->blk->throttle, &l, &stats);
+        qsort(b->lat, b->nlat, sizeof(*b->lat), cmp_u64);
+        printf("%-6s %12.0f %12.0f %10.1f %10lu\n", i ? "bps" : "iops", limit, iops,
+               percentile_us(b, 0.99), stats.delayed - before.delayed);
+        check(b, iops < limit * 1.1 && iops > limit * 0.9, "throughput held to the limit");
+        check(b, stats.delayed > before.delayed && stats.ops - before.ops == (uint64_t) (limit / 4),
+              "throttle counters");
+    }
+    throttle_set(&b->blk->throttle, &none);
+}
+
+/* What a boot looks like to the disk: mostly runs of 4K to 32K reads, now
+ * and then a seek, one request at a time, the same sequence each time */
+static double vbench_boot_reads(struct vbench *b)
+{
+    uint64_t sectors = b->capacity & ~63ULL, sector = 0;
+    uint64_t start = vbench_now();
+
+    srand(1);
+    b->nlat = 0;
+    for (int i = 0; i < VBENCH_BOOT_READS; i++) {
+        uint32_t len = 4096 * (1 + rand() % (VBENCH_MAX_BS / 4096));
+        int slot = vbench_free_slot(b);
+
+        if (rand() % 4 == 0)
+            sector = (uint64_t) rand() % sectors & ~7ULL;
+        if (sector + len / 512 > sectors)
+            sector = 0;
+        vbench_submit(b, slot, VIRTIO_BLK_T_IN, sector, len);
+        vbench_kick(b);
+        vbench_wait(b);
+        sector += len / 512;
+    }
+    return (vbench_now() - start) / 1e6;
+}
+
+/* The boot reads from a cold page cache, first as they come and then with
+ * the trace a first boot recorded prefetched ahead of them */
+static void vbench_boot_prefetch(struct vbench *b, const char *disk_path)
+{
+    struct diskimg *d = b->blk->diskimg;
+    char trace_path[4096];
+    double warm, cold, prefetched;
+    uint32_t extents;
+
+    snprintf(trace_path, sizeof(trace_path), "%s" BOOT_TRACE_SUFFIX, disk_path);
+    unlink(trace_path);
+    fsync(d->fd);
+    check(b, diskimg_boot_trace(d, disk_path, 3600) == 0 && d->boot_trace.recording,
+          "boot trace recording");
+    warm = vbench_boot_reads(b);
+    extents = d->boot_trace.count;
+    boot_trace_exit(&d->boot_trace);
+    d->traced = false;
+    check(b, extents && access(trace_path, R_OK) == 0, "boot trace written");
+
+    posix_fadvise(d->fd, 0, 0, POSIX_FADV_DONTNEED);
+    cold = vbench_boot_reads(b);
+
+    posix_fadvise(d->fd, 0, 0, POSIX_FADV_DONTNEED);
+    check(b, diskimg_boot_trace(d, disk_path, 3600) == 0 && d->boot_trace.prefetching,
+          "boot trace prefetching");
+    check(b, d->boot_trace.count == extents, "boot trace read back");
+    prefetched = vbench_boot_reads(b);
+    boot_trace_exit(&d->boot_trace);
+    d->traced = false;
+    unlink(trace_path);
+
+    printf("boot reads: %d requests in %u extents, warm %.1f ms, cold %.1f ms, "
+           "cold with prefetch %.1f ms\n",
+           VBENCH_BOOT_READS, extents, warm, cold, prefetched);
+}
+
+static void vbench_check(struct vbench *b, uint32_t bs)
+{
+    unsigned long failures = b->failures;
+    size_t blocks = (b->capacity << 9) / bs;
+    size_t n = blocks < 3 * b->size ? blocks : 3 * b->size;
+    uint8_t *buf = malloc(bs);
+    int slot;
+
+    /* enough requests for the ring to wrap around a few times */
+    vbench_run(b, VIRTIO_BLK_T_OUT, 8, bs, n, true);
+    for (size_t i = 0; i < n; i++) {
+        if (pread(b->disk_fd, buf, bs, i * bs) != (ssize_t) bs ||
+            !stamped(buf, i * bs / 512, bs, 0)) {
+            check(b, false, "writes reached the disk image");
+            break;
+        }
+    }
+    vbench_run(b, VIRTIO_BLK_T_IN, 8, bs, n, true);
+
+    /* one request at a time, the whole chain taken by a single kick */
+    vbench_run(b, VIRTIO_BLK_T_IN, 1, bs, 2 * b->size, true);
+
+    /* flush has no data buffer and isn't emulated */
+    slot = vbench_free_slot(b);
+    vbench_submit(b, slot, VIRTIO_BLK_T_FLUSH, 0, 0);
+    vbench_kick(b);
+    vbench_wait(b);
+
+    printf("checks: %s\n", b->failures == failures ? "ok" : "FAILED");
+    free(buf);
+}
+
+/* build/vhostblkd next to this binary serves the disk image, this process
+ * only has the transport. Returns its pid */
+static pid_t vbench_start_backend(struct vbench *b, const char *prog, const char *sock_path,
+                                  const char *disk_path)
+{
+    char backend[4096];
+    const char *slash = strrchr(prog, '/');
+    pid_t pid;
+
+    snprintf(backend, sizeof(backend), "%.*svhostblkd", slash ? (int) (slash - prog + 1) : 0,
+             prog);
+    pid = fork();
+    if (pid == 0) {
+        if (b->poll)
+            execl(backend, backend, "-p", sock_path, disk_path, (char *) NULL);
+        else
+            execl(backend, backend, sock_path, disk_path, (char *) NULL);
+        perror(backend);
+        _exit(1);
+    }
+    /* until it listens */
+    for (int i = 0; pid > 0 && i < 500; i++) {
+        if (vhost_user_blk_init_pci(&b->g->vhost_user_blk_dev[0], b->g, sock_path,
+                                    VIRTIO_BLK_IRQ) == 0)
+            return pid;
+        usleep(10000);
+    }
+    if (pid > 0) {
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+    }
+    return -1;
+}
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [-p] [-u] [-C cache] [-b bs] [-n requests] [-s disk_mb] [-T trace_file]\n",
+           prog);
+    printf("  -p  poll the ring instead of waiting for the irqfd (the backend polls too)\n");
+    printf("  -u  serve the queue from build/vhostblkd over vhost-user instead of in process\n");
+    printf("  -C  cache policy of the disk image, writeback, writethrough or none\n");
+    printf("  -b  block size in bytes, a multiple of 512 up to %d (default 4096)\n", VBENCH_MAX_BS);
+    printf("  -n  requests per run (default 20000)\n");
+    printf("  -s  size of the temporary disk image in MB (default 64)\n");
+    printf("  -T  trace the device threads and dump the trace to this file\n");
+}
+
+int main(int argc, char **argv)
+{
+    static const int depths[] = {1, 4, 16, 32};
+    struct vbench b = {0};
+    char path[] = "/tmp/virtiobench-XXXXXX";
+    char sock_path[64];
+    char disk_spec[64];
+    enum diskimg_cache cache = DISKIMG_CACHE_WRITEBACK;
+    pid_t backend = 0;
+    const char *trace_path = NULL;
+    uint32_t bs = 4096;
+    size_t count = 20000, disk_mb = 64;
+    uint64_t *sectors;
+    int opt, fd;
+
+    while ((opt = getopt(argc, argv, "puC:b:n:s:T:")) != -1) {
+        switch (opt) {
+        case 'p':
+            b.poll = true;
+            break;
+        case 'u':
+            b.vhost_user = true;
+            break;
+        case 'C':
+            if (diskimg_parse_cache(optarg, &cache) < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'b':
+            bs = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            count = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            disk_mb = strtoul(optarg, NULL, 10);
+            break;
+        case 'T':
+            trace_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!bs || bs % 512 || bs > VBENCH_MAX_BS || !count || disk_mb * (1 << 20) < bs) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    /* a disk image with every sector stamped */
+    fd = mkstemp(path);
+    sectors = malloc(1 << 20);
+    if (fd < 0 || !sectors) {
+        perror("virtiobench");
+        return 1;
+    }
+    for (size_t mb = 0; mb < disk_mb; mb++) {
+        stamp((uint8_t *) sectors, mb * 2048, 1 << 20, 0);
+        if (pwrite(fd, sectors, 1 << 20, mb << 20) != 1 << 20) {
+            perror("virtiobench disk image");
+            unlink(path);
+            return 1;
+        }
+    }
+    free(sectors);
+    close(fd);
+
+    b.g = calloc(1, sizeof(guest));
+    /* the backend maps all of the guest memory the frontend sends */
+    if (b.vhost_user) {
+        bench_mem = vhost_user_alloc_mem(GUEST_MEMORY_SIZE, &b.g->mem_fd);
+        bench_mem = bench_mem == MAP_FAILED ? NULL : bench_mem;
+        b.g->mem_shared = true;
+    } else {
+        /* page aligned like the memory of a guest, cache=none reads into it */
+        bench_mem = mmap(NULL, VBENCH_MEM_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        bench_mem = bench_mem == MAP_FAILED ? NULL : bench_mem;
+    }
+    b.lat = malloc(((count > 1024 ? count : 1024) + VBENCH_SLOTS) * sizeof(*b.lat));
+    b.disk_fd = open(path, O_RDONLY);
+    if (!b.g || !bench_mem || !b.lat || b.disk_fd < 0) {
+        perror("virtiobench");
+        return 1;
+    }
+    b.disk_size = disk_mb << 20;
+    b.g->mem = bench_mem;
+    b.blk = &b.g->virtio_blk_dev[0];
+    bus_init(&b.g->io_bus);
+    bus_init(&b.g->mmio_bus);
+    pci_init(&b.g->pci);
+    bus_register_dev(&b.g->io_bus, &b.g->pci.pci_addr_dev);
+    bus_register_dev(&b.g->io_bus, &b.g->pci.pci_data_dev);
+    bus_register_dev(&b.g->mmio_bus, &b.g->pci.pci_ecam_dev);
+    if (b.vhost_user) {
+        snprintf(sock_path, sizeof(sock_path), "/tmp/virtiobench-%d.sock", getpid());
+        snprintf(disk_spec, sizeof(disk_spec), "%s,cache=%s", path, diskimg_cache_name(cache));
+        backend = vbench_start_backend(&b, argv[0], sock_path, disk_spec);
+        unlink(path);
+        if (backend < 0) {
+            printf("FAIL: no vhost-user backend on %s\n", sock_path);
+            unlink(sock_path);
+            return 1;
+        }
+        b.pci_dev = &b.g->vhost_user_blk_dev[0].virtio_pci_dev;
+        b.kick_fd = b.g->vhost_user_blk_dev[0].kick_fd;
+        b.irq_fd = b.g->vhost_user_blk_dev[0].call_fd;
+    } else {
+        if (diskimg_open(&b.g->diskimg[0], path, cache) < 0) {
+            perror(path);
+            unlink(path);
+            return 1;
+        }
+        unlink(path);
+        virtio_blk_init(b.blk);
+        virtio_blk_init_pci(b.blk, b.g, &b.g->diskimg[0], VIRTIO_BLK_IRQ);
+        b.pci_dev = &b.blk->virtio_pci_dev;
+        b.kick_fd = b.blk->ioeventfd;
+        b.irq_fd = b.blk->irqfd;
+    }
+    if (trace_path)
+        trace_start();
+
+    vbench_scan_bench(&b);
+    vbench_probe(&b);
+    if (b.failures) {
+        printf("probe: FAILED\n");
+        return 1;
+    }
+    printf("probe: ok, %lu sectors, queue of %u descriptors, %s, %s, cache=%s\n", b.capacity,
+           b.size, b.poll ? "polling" : "interrupts",
+           b.vhost_user ? "vhost-user backend" : "in process", diskimg_cache_name(cache));
+    vbench_check(&b, bs);
+
+    printf("%u byte random requests, %zu per run\n", bs, count);
+    printf("%-6s %6s %12s %10s %10s %10s\n", "", "depth", "IOPS", "mean us", "p50 us", "p99 us");
+    for (size_t i = 0; i < sizeof(depths) / sizeof(depths[0]) && !b.failures; i++) {
+        for (int w = 0; w < 2; w++) {
+            double iops = vbench_run(&b, w ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN, depths[i], bs,
+                                     count, false);
+            uint64_t total = 0;
+            for (size_t j = 0; j < b.nlat; j++)
+                total += b.lat[j];
+            qsort(b.lat, b.nlat, sizeof(*b.lat), cmp_u64);
+            printf("%-6s %6d %12.0f %10.1f %10.1f %10.1f\n", w ? "write" : "read", depths[i],
+                   iops, total / 1e3 / b.nlat, percentile_us(&b, 0.5), percentile_us(&b, 0.99));
+        }
+    }
+
+    /* the limits and the boot trace of a vhost-user disk are the backend's */
+    if (!b.vhost_user) {
+        vbench_throttle(&b, bs);
+        /* prefetching is into the page cache */
+        if (!b.failures && cache != DISKIMG_CACHE_NONE)
+            vbench_boot_prefetch(&b, path);
+    }
+
+    if (trace_path) {
+        trace_stop();
+        printf("%d trace records in %s\n", trace_dump(trace_path), trace_path);
+    }
+    if (b.vhost_user) {
+        vhost_user_blk_exit(&b.g->vhost_user_blk_dev[0]);
+        kill(backend, SIGTERM);
+        waitpid(backend, NULL, 0);
+        unlink(sock_path);
+        munmap(bench_mem, GUEST_MEMORY_SIZE);
+        close(b.g->mem_fd);
+    } else {
+        virtio_blk_exit(b.blk);
+        munmap(bench_mem, VBENCH_MEM_SIZE);
+    }
+    close(b.disk_fd);
+    free(b.lat);
+    free(b.g);
+    return b.failures ? 1 : 0;
+}
@@ -2,6 +2,10 @@
 #include <sys/ioctl.h>
 #include <unistd.h>
 
+#include <string.h>
+
+#include "guest.h"
+#include "trace.h"
 #include "virtq.h"
 
 void virtq_complete_request(struct virtq *vq)
@@ -37,14 +41,22 @@ bool virtq_check_next(struct vring_packed_desc *desc)
     return desc->flags & VRING_DESC_F_NEXT;
 }
 
-struct vring_packed_desc *virtq_get_avail(struct virtq *vq)
+/* Whether the driver made the next descriptor available, without taking it */
+bool virtq_has_avail(struct virtq *vq)
 {
     struct vring_packed_desc *desc = &vq->desc_ring[vq->next_avail_idx];
-    uint16_t flags = desc->flags;
+    uint16_t flags = __atomic_load_n(&desc->flags, __ATOMIC_ACQUIRE);
     bool avail = flags & (1ULL << VRING_PACKED_DESC_F_AVAIL);
     bool used = flags & (1ULL << VRING_PACKED_DESC_F_USED);
 
-    if (avail != vq->used_wrap_count || used == vq->used_wrap_count) {
+    return avail == vq->used_wrap_count && used != vq->used_wrap_count;
+}
+
+struct vring_packed_desc *virtq_get_avail(struct virtq *vq)
+{
+    struct vring_packed_desc *desc = &vq->desc_ring[vq->next_avail_idx];
+
+    if (!virtq_has_avail(vq)) {
         return NULL;
     }
     vq->next_avail_idx++;
@@ -63,3 +75,115 @@ void virtq_handle_avail(struct virtq *vq)
     if (vq->guest_event->flags == VRING_PACKED_EVENT_FLAG_ENABLE)
         virtq_notify_used(vq);
 }
+
+/* Take the next descriptor chain of a queue. A chain that points outside of
+ * the guest memory is still taken, with no buffers, so it can be given back.
+ */
+bool virtq_pop_chain(struct virtq *vq,
+                     struct guest *v,
+                     struct virtq_chain *chain)
+{
+    uint16_t avail_idx = vq->next_avail_idx;
+    bool wrap_count = vq->used_wrap_count;
+    struct vring_packed_desc *desc = virtq_get_avail(vq);
+    bool valid = true;
+
+    if (!desc)
+        return false;
+    chain->head = desc;
+    chain->niov = 0;
+    chain->nreadable = 0;
+    chain->len = 0;
+    chain->avail_idx = avail_idx;
+    chain->wrap_count = wrap_count;
+    TRACE(TRACE_VQ_AVAIL, desc->id, (uintptr_t) vq, 0);
+    while (desc) {
+        if (chain->niov == VIRTQ_CHAIN_MAX_IOV ||
+            !vm_guest_range_valid(v, desc->addr, desc->len))
+            valid = false;
+        if (valid) {
+            chain->iov[chain->niov].iov_base = vm_guest_to_host(v, desc->addr);
+            chain->iov[chain->niov].iov_len = desc->len;
+            chain->niov++;
+            chain->len += desc->len;
+            if (!(desc->flags & VRING_DESC_F_WRITE))
+                chain->nreadable = chain->niov;
+        }
+        if (!virtq_check_next(desc))
+            break;
+        desc = virtq_get_avail(vq);
+    }
+    if (!valid) {
+        chain->niov = 0;
+        chain->nreadable = 0;
+        chain->len = 0;
+    }
+    return true;
+}
+
+/* Leave a chain, and every chain taken after it, to the driver */
+void virtq_unpop_chain(struct virtq *vq, struct virtq_chain *chain)
+{
+    vq->next_avail_idx = chain->avail_idx;
+    vq->used_wrap_count = chain->wrap_count;
+}
+
+/* Give a chain back to the driver with len bytes written into it */
+void virtq_push_chain(struct virtq *vq, struct virtq_chain *chain, uint32_t len)
+{
+    TRACE(TRACE_VQ_USED, chain->head->id, (uintptr_t) vq, len);
+    chain->head->len = len;
+    __atomic_store_n(&chain->head->flags,
+                     chain->head->flags ^ (1ULL << VRING_PACKED_DESC_F_USED),
+                     __ATOMIC_RELEASE);
+}
+
+/* Build in out the part of the chain that starts at offset, at most len bytes */
+int virtq_chain_slice(struct virtq_chain *chain,
+                      size_t offset,
+                      size_t len,
+                      struct iovec *out)
+{
+    int n = 0;
+
+    for (int i = 0; i < chain->niov && len; i++) {
+        size_t iov_len = chain->iov[i].iov_len;
+
+        if (offset >= iov_len) {
+            offset -= iov_len;
+            continue;
+        }
+        out[n].iov_base = (uint8_t *) chain->iov[i].iov_base + offset;
+        out[n].iov_len = iov_len - offset < len ? iov_len - offset : len;
+        len -= out[n].iov_len;
+        offset = 0;
+        n++;
+    }
+    return n;
+}
+
+size_t virtq_chain_read(struct virtq_chain *chain, void *buf, size_t len)
+{
+    struct iovec iov[VIRTQ_CHAIN_MAX_IOV];
+    int n = virtq_chain_slice(chain, 0, len, iov);
+    size_t copied = 0;
+
+    for (int i = 0; i < n; i++) {
+        memcpy((uint8_t *) buf + copied, iov[i].iov_base, iov[i].iov_len);
+        copied += iov[i].iov_len;
+    }
+    return copied;
+}
+
+size_t virtq_chain_write(struct virtq_chain *chain, const void *buf, size_t len)
+{
+    struct iovec iov[VIRTQ_CHAIN_MAX_IOV];
+    int n = virtq_chain_slice(chain, 0, len, iov);
+    size_t copied = 0;
+
+    for (int i = 0; i < n; i++) {
+        memcpy(iov[i].iov_base, (const uint8_t *) buf + copied, iov[i].iov_len);
+        copied += iov[i].iov_len;
+    }
+    return copied;
+}
@@ -3,8 +3,10 @@
 #include <linux/virtio_ring.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <sys/uio.h>
 
 struct virtq;
+struct guest;
 
 struct virtq_ops {
     void (*complete_request)(struct virtq *vq);
@@ -34,7 +36,21 @@ struct virtq {
     struct virtq_ops *ops;
 };
 
+#define VIRTQ_CHAIN_MAX_IOV 32
+
+/* a descriptor chain taken from a queue, as host iovecs */
+struct virtq_chain {
+    struct vring_packed_desc *head;
+    struct iovec iov[VIRTQ_CHAIN_MAX_IOV];
+    int niov;
+    int nreadable; /* the driver-readable iovecs, before the writable ones */
+    size_t len;
+    uint16_t avail_idx; /* where the chain starts, to put it back */
+    bool wrap_count;
+};
+
 struct vring_packed_desc *virtq_get_avail(struct virtq *vq);
+bool virtq_has_avail(struct virtq *vq);
 bool virtq_check_next(struct vring_packed_desc *desc);
 void virtq_enable(struct virtq *vq);
 void virtq_disable(struct virtq *vq);
@@ -43,3 +59,14 @@ void virtq_notify_used(struct virtq *vq);
 void virtq_deassert_irq(struct virtq *vq);
 void virtq_handle_avail(struct virtq *vq);
 void virtq_init(struct virtq *vq, void *dev, struct virtq_ops *ops);
+bool virtq_pop_chain(struct virtq *vq,
+                     struct guest *v,
+                     struct virtq_chain *chain);
+void virtq_unpop_chain(struct virtq *vq, struct virtq_chain *chain);
+void virtq_push_chain(struct virtq *vq, struct virtq_chain *chain, uint32_t len);
+int virtq_chain_slice(struct virtq_chain *chain,
+                      size_t offset,
+                      size_t len,
+                      struct iovec *out);
+size_t virtq_chain_read(struct virtq_chain *chain, void *buf, size_t len);
+size_t virtq_chain_write(struct virtq_chain *chain, const void *buf, size_t len);
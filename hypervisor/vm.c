@@ -1,24 +1,30 @@
+#include <pthread.h>
+#include <signal.h>
+
 #include "vm.h"
+#include "cpu_policy.h"
+#include "serial.h"
+#include "trace.h"
+#include "vhost-user.h"
 
-void run_vm(guest* g)
+static uint64_t vm_now_ns(void)
 {
-    // get the VCPU's memory size and mmap it
-    size_t vcpu_mmap_size = ioctl(g->kvm_fd, KVM_GET_VCPU_MMAP_SIZE, 0);
-    if (vcpu_mmap_size < 0) 
-    {
-        perror("KVM_GET_VCPU_MMAP_SIZE");
-        return;
-    }
+    struct timespec ts;
 
-    struct kvm_run* run = mmap(NULL, vcpu_mmap_size, 
-                               PROT_READ | PROT_WRITE, 
-                               MAP_SHARED, g->vcpu_fd, 0);
-    if (run == MAP_FAILED) 
-    {
-        perror("mmap vcpu");
-        return;
-    }
-    printf("VCPU memory mapped successfully.\n");
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// the vCPU thread is the only writer, the atomic store keeps readers from seeing torn values
+static inline void vcpu_acct_add(uint64_t* counter, uint64_t n)
+{
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+void run_vm(guest* g)
+{
+    struct kvm_run* run = g->run;
+    struct vcpu_acct* acct = &g->acct;
 
     // Set up debugging
     struct kvm_guest_debug debug = {
@@ -29,16 +35,47 @@ void run_vm(guest* g)
         return;
     }
 
+    // the vCPU thread of a daemon VM joins its threaded cgroup, standalone the process is there already
+    if (g->cgroup.threaded)
+    {
+        cgroup_enter(&g->cgroup);
+    }
+    if (g->pin_vcpu)
+    {
+        cpu_mask_pin_self(&g->vcpu_cpus);
+    }
+
      // run the virtual CPU
     printf("Starting the virtual CPU...\n");
+    clock_gettime(CLOCK_MONOTONIC, &g->run_start);
+    boot_profile_mark(&g->boot, BOOT_FIRST_RUN);
     printf("test\n");
+    uint64_t exit_end = vm_now_ns();
     while (1) {
+        uint64_t run_start = vm_now_ns();
+        vcpu_acct_add(&acct->exit_ns, run_start - exit_end);
+        TRACE(TRACE_VCPU_RUN, 0, 0, 0);
         int err = ioctl(g->vcpu_fd, KVM_RUN, 0);
-        if (err < 0 && (errno != EINTR && errno != EAGAIN)) {
-            munmap(run, vcpu_mmap_size);
+        exit_end = vm_now_ns();
+        vcpu_acct_add(&acct->run_ns, exit_end - run_start);
+        if (__atomic_load_n(&g->stop, __ATOMIC_ACQUIRE)) {
+            printf("Stopped.\n");
+            return;
+        }
+        if (err < 0) {
+            // a signal interrupted the run, the exit reason is the previous one
+            if (errno == EINTR || errno == EAGAIN) {
+                vcpu_acct_add(&acct->interrupted, 1);
+                TRACE(TRACE_VCPU_EXIT, TRACE_EXIT_INTERRUPTED, 0, 0);
+                continue;
+            }
             perror("Failed to execute kvm_run");
             return;
         }
+        TRACE(TRACE_VCPU_EXIT, run->exit_reason,
+              run->exit_reason == KVM_EXIT_IO ? run->io.port : run->exit_reason == KVM_EXIT_MMIO ? run->mmio.phys_addr : 0, 0);
+        vcpu_acct_add(run->exit_reason == KVM_EXIT_IO ? &acct->io_exits :
+                      run->exit_reason == KVM_EXIT_MMIO ? &acct->mmio_exits : &acct->other_exits, 1);
         // check the exit reason
         switch (run->exit_reason) {
             case KVM_EXIT_HLT:
@@ -90,16 +127,20 @@ void run_vm(guest* g)
     }
 }
 
-void setup_vm(guest* g)
+// returns 0 on success. the daemon opens /dev/kvm once and shares it between its guests (kvm_fd_shared)
+int setup_vm(guest* g)
 {
     // Open the KVM device
-    g->kvm_fd = open("/dev/kvm", O_RDWR | __O_CLOEXEC);
-    if (g->kvm_fd < 0) 
+    if (!g->kvm_fd_shared)
     {
-        perror("open /dev/kvm");
-        return;
+        g->kvm_fd = open("/dev/kvm", O_RDWR | __O_CLOEXEC);
+        if (g->kvm_fd < 0) 
+        {
+            perror("open /dev/kvm");
+            return -1;
+        }
+        printf("Opened /dev/kvm successfully.\n");
     }
-    printf("Opened /dev/kvm successfully.\n");
 
     // Check for guest memory extension
     if (!ioctl(g->kvm_fd, KVM_CHECK_EXTENSION, KVM_CAP_USER_MEMORY))
@@ -113,29 +154,65 @@ void setup_vm(guest* g)
     if (g->vm_fd < 0) 
     {
         perror("KVM_CREATE_VM");
-        return;
+        return -1;
     }
     printf("Virtual machine created successfully.\n");
 
+    if (g->halt_poll_ns >= 0 && vm_set_halt_poll(g, g->halt_poll_ns) == 0)
+    {
+        printf("Halt polling set to %ld ns.\n", g->halt_poll_ns);
+    }
+
     ioctl(g->vm_fd, KVM_SET_TSS_ADDR, TSS_ADDRESS); // required for intel virtualization
     ioctl(g->vm_fd, KVM_SET_IDENTITY_MAP_ADDR, 0); // also required, 0 causes it to default to address 0xfffbc000
-    ioctl(g->vm_fd, KVM_CREATE_IRQCHIP, 0);
-    ioctl(g->vm_fd, KVM_CREATE_PIT2, 0); // needs to be after the irq chip is created
+    ioctl(g->vm_fd, KVM_CREATE_IRQCHIP, 0); // the LAPIC timer and the PIT are emulated in the kernel
     struct kvm_pit_config pit = { .flags = 0 };
-    ioctl(g->vm_fd, KVM_CREATE_PIT2, &pit);
+    ioctl(g->vm_fd, KVM_CREATE_PIT2, &pit); // needs to be after the irq chip is created
 
-    // Allocate memory for the guest
-    g->mem = mmap(NULL, GUEST_MEMORY_SIZE,
-                              PROT_READ | PROT_WRITE,
-                              MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, 
-                              -1, 0);
+    // Allocate memory for the guest, in a memfd when a vhost-user backend maps it too
+    if (g->mem_shared)
+    {
+        g->mem = vhost_user_alloc_mem(GUEST_MEMORY_SIZE, &g->mem_fd);
+    }
+    else
+    {
+        g->mem = mmap(NULL, GUEST_MEMORY_SIZE,
+                                  PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, 
+                                  -1, 0);
+    }
     if (g->mem == MAP_FAILED) 
     {
         perror("mmap guest_memory");
-        return;
+        g->mem = NULL;
+        g->mem_shared = false;
+        return -1;
     }
     printf("Guest memory allocated successfully.\n");
 
+    // NUMA local guest RAM, before anything touches it
+    if (g->numa_node >= 0 && numa_bind(g->mem, GUEST_MEMORY_SIZE, g->numa_node) == 0)
+    {
+        printf("Guest memory bound to NUMA node %d.\n", g->numa_node);
+    }
+
+    // let KSM merge identical pages between guests running the same images, KSM skips shared memory
+    if (g->mem_mergeable && g->mem_shared)
+    {
+        printf("Guest memory is shared with a vhost-user backend, KSM can't merge it.\n");
+    }
+    else if (g->mem_mergeable)
+    {
+        if (madvise(g->mem, GUEST_MEMORY_SIZE, MADV_MERGEABLE) < 0)
+        {
+            perror("madvise MADV_MERGEABLE");
+        }
+        else
+        {
+            printf("Guest memory marked as mergeable.\n");
+        }
+    }
+
     // set up the guest memory mapping
     struct kvm_userspace_memory_region mem_region = {
         .slot = 0,
@@ -146,7 +223,7 @@ void setup_vm(guest* g)
     if (ioctl(g->vm_fd, KVM_SET_USER_MEMORY_REGION, &mem_region) < 0) 
     {
         perror("KVM_SET_USER_MEMORY_REGION");
-        return;
+        return -1;
     }
     printf("Guest memory mapped successfully.\n");
 
@@ -155,10 +232,32 @@ void setup_vm(guest* g)
     if (g->vcpu_fd < 0) 
     {
         perror("KVM_CREATE_VCPU");
-        return;
+        return -1;
     }
     printf("Virtual CPU created successfully.\n");
 
+    // get the VCPU's memory size and mmap it
+    int vcpu_mmap_size = ioctl(g->kvm_fd, KVM_GET_VCPU_MMAP_SIZE, 0);
+    if (vcpu_mmap_size < 0) 
+    {
+        perror("KVM_GET_VCPU_MMAP_SIZE");
+        return -1;
+    }
+    g->run = mmap(NULL, vcpu_mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, g->vcpu_fd, 0);
+    if (g->run == MAP_FAILED) 
+    {
+        perror("mmap vcpu");
+        g->run = NULL;
+        return -1;
+    }
+    g->run_size = vcpu_mmap_size;
+    printf("VCPU memory mapped successfully.\n");
+
+    if (kvm_stats_init(&g->vcpu_stats, g->vcpu_fd) < 0)
+    {
+        printf("vCPU statistics are not available.\n");
+    }
+
     init_regs(g);
     init_cpuid(g);
     init_msrs(g);
@@ -170,6 +269,8 @@ void setup_vm(guest* g)
     pci_init(&g->pci);
     bus_register_dev(&g->io_bus, &g->pci.pci_addr_dev);
     bus_register_dev(&g->io_bus, &g->pci.pci_data_dev);
+    bus_register_dev(&g->mmio_bus, &g->pci.pci_ecam_dev);
+    return 0;
 }
 
 void init_regs(guest* g)
@@ -233,91 +334,97 @@ void init_regs(guest* g)
 }
 
 
-// needed by the kernel to know if it runs on a vm or bare metal
-void init_cpuid(guest* g)
+/*
+identity maps the guest memory with 2M pages, loads a GDT with the flat __BOOT_CS and __BOOT_DS of
+the 64-bit boot protocol and enters long mode at entry. the kernel replaces all of it early on
+*/
+void init_regs_64(guest* g, uint64_t entry)
 {
-    struct {
-        uint32_t nent;
-        uint32_t padding;
-        struct kvm_cpuid_entry2 entries[100];
-    } kvm_cpuid;
-
-    kvm_cpuid.nent = sizeof(kvm_cpuid.entries) / sizeof(kvm_cpuid.entries[0]);
-    ioctl(g->kvm_fd, KVM_GET_SUPPORTED_CPUID, &kvm_cpuid);
-    
-    for (uint32_t i = 0; i < kvm_cpuid.nent; i++) {
-        struct kvm_cpuid_entry2 *entry = &kvm_cpuid.entries[i];
+    uint64_t* pml4 = (uint64_t*) ((uint8_t*) g->mem + BOOT_PML4_START);
+    uint64_t* pdpt = (uint64_t*) ((uint8_t*) g->mem + BOOT_PDPT_START);
+    uint64_t* pd = (uint64_t*) ((uint8_t*) g->mem + BOOT_PD_START);
+    uint64_t* gdt = (uint64_t*) ((uint8_t*) g->mem + BOOT_GDT_START);
+    size_t pd_pages = (GUEST_MEMORY_SIZE + (1UL << 30) - 1) >> 30;
+    struct kvm_sregs sregs;
 
-        // sets response to the string "KVMKVMKVM"
-        if (entry->function == KVM_CPUID_SIGNATURE) 
-        {
-            entry->eax = KVM_CPUID_FEATURES;
-            entry->ebx = 0x4b4d564b; // KVMK
-            entry->ecx = 0x564b4d56; // VMKV
-            entry->edx = 0x4d;       // M
-        }
+    memset(pml4, 0, 4096);
+    memset(pdpt, 0, 4096);
+    pml4[0] = BOOT_PDPT_START | BOOT_PTE_PRESENT | BOOT_PTE_RW;
+    for (size_t i = 0; i < pd_pages; i++)
+    {
+        pdpt[i] = (BOOT_PD_START + i * 4096) | BOOT_PTE_PRESENT | BOOT_PTE_RW;
+    }
+    for (size_t i = 0; i < pd_pages * 512; i++)
+    {
+        pd[i] = (i << 21) | BOOT_PTE_PRESENT | BOOT_PTE_RW | BOOT_PTE_PSE;
     }
-    ioctl(g->vcpu_fd, KVM_SET_CPUID2, &kvm_cpuid);
-}
-
-#define MSR_IA32_MISC_ENABLE 0x000001a0
-#define MSR_IA32_MISC_ENABLE_FAST_STRING_BIT 0
-#define MSR_IA32_MISC_ENABLE_FAST_STRING \
-    (1ULL << MSR_IA32_MISC_ENABLE_FAST_STRING_BIT)
-
-#define KVM_MSR_ENTRY(_index, _data) \
-    (struct kvm_msr_entry) { .index = _index, .data = _data }
-void init_msrs(guest* g)
-{
-    int ndx = 0;
-    struct kvm_msrs *msrs =
-        calloc(1, sizeof(struct kvm_msrs) + (sizeof(struct kvm_msr_entry) * 1));
-
-    msrs->entries[ndx++] =
-        KVM_MSR_ENTRY(MSR_IA32_MISC_ENABLE, MSR_IA32_MISC_ENABLE_FAST_STRING);
-    msrs->nmsrs = ndx;
-
-    ioctl(g->vcpu_fd, KVM_SET_MSRS, msrs);
 
-    free(msrs);
-}
+    // null, null, __BOOT_CS: 64-bit code, __BOOT_DS: flat data
+    gdt[0] = 0;
+    gdt[1] = 0;
+    gdt[BOOT_CS / 8] = 0x00af9b000000ffffULL;
+    gdt[BOOT_DS / 8] = 0x00cf93000000ffffULL;
 
-int load_image(struct guest *g, const char* image_path) 
-{
-    size_t datasz;
-    void *data;
-    int fd = open(image_path, O_RDONLY);
-    if (fd < 0) 
+    if (ioctl(g->vcpu_fd, KVM_GET_SREGS, &sregs) < 0)
     {
-        return 1;
+        perror("KVM_GET_SREGS");
+        return;
+    }
+    struct kvm_segment code = {
+        .base = 0,
+        .limit = ~0,
+        .selector = BOOT_CS,
+        .type = 11, // execute, read, accessed
+        .present = 1,
+        .s = 1,
+        .l = 1,
+        .g = 1,
+    };
+    struct kvm_segment data = code;
+    data.selector = BOOT_DS;
+    data.type = 3; // read, write, accessed
+    data.l = 0;
+    data.db = 1;
+    sregs.cs = code;
+    sregs.ds = sregs.es = sregs.fs = sregs.gs = sregs.ss = data;
+    sregs.gdt.base = BOOT_GDT_START;
+    sregs.gdt.limit = 4 * sizeof(uint64_t) - 1;
+    sregs.cr3 = BOOT_PML4_START;
+    sregs.cr4 |= X86_CR4_PAE;
+    // paging on, and caching: the vCPU comes out of reset with CD and NW set
+    sregs.cr0 = (sregs.cr0 & ~(X86_CR0_CD | X86_CR0_NW)) | X86_CR0_PE | X86_CR0_PG;
+    sregs.efer |= X86_EFER_LME | X86_EFER_LMA;
+    if (ioctl(g->vcpu_fd, KVM_SET_SREGS, &sregs) < 0)
+    {
+        perror("KVM_SET_SREGS");
+        return;
     }
 
-    struct stat st;
-    fstat(fd, &st);
-    datasz = st.st_size;
-    data = mmap(0, datasz, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
-    close(fd);
+    struct kvm_regs regs = {
+        .rflags = FLAGS_INIT,
+        .rip = entry,
+        .rsp = BOOT_STACK_START,
+        .rbp = BOOT_STACK_START,
+        .rsi = BOOT_PARAMS_START,
+    };
+    if (ioctl(g->vcpu_fd, KVM_SET_REGS, &regs) < 0)
+    {
+        perror("KVM_SET_REGS");
+        return;
+    }
+    printf("VCPU set up for the 64-bit entry at 0x%lx.\n", entry);
+}
 
-    struct boot_params* boot = (struct boot_params *)(((uint8_t *)g->mem) + BOOT_PARAMS_START);
+// the command line and the memory map, the same whatever the kernel image is
+static void init_boot_params(guest* g, struct boot_params* boot)
+{
     void* cmdline = (void *)(((uint8_t *)g->mem) + CMD_LINE_START);
-    void* kernel = (void *)(((uint8_t *)g->mem) + KERNEL_START);
 
-    memset(boot, 0, sizeof(struct boot_params));
-    memmove((void *) ((uintptr_t) boot + offsetof(struct boot_params, hdr)),
-            (void *) ((uintptr_t) data + offsetof(struct boot_params, hdr)),
-            sizeof(struct setup_header));
-    
-    size_t setup_sectors = boot->hdr.setup_sects;
-    size_t setupsz = (setup_sectors + 1) * 512;
     boot->hdr.vid_mode = 0xFFFF; // VGA
     boot->hdr.type_of_loader = 0xFF;
-    boot->hdr.loadflags |= CAN_USE_HEAP | LOADED_HIGH | KEEP_SEGMENTS;
-    boot->hdr.heap_end_ptr = 0xFE00;
-    boot->hdr.ext_loader_ver = 0x0;
     boot->hdr.cmd_line_ptr = CMD_LINE_START;
     memset(cmdline, 0, boot->hdr.cmdline_size);
     memcpy(cmdline, KERNEL_OPTIONS, sizeof(KERNEL_OPTIONS));
-    memmove(kernel, (char *)data + setupsz, datasz - setupsz);
 
     unsigned int idx = 0;
     boot->e820_table[idx++] = (struct boot_e820_entry){
@@ -330,11 +437,135 @@ int load_image(struct guest *g, const char* image_path)
         .size = GUEST_MEMORY_SIZE - ISA_END_ADDRESS,
         .type = E820_RAM,
     };
+    // Linux only takes the ECAM window of the host bridge when it is reserved
+    boot->e820_table[idx++] = (struct boot_e820_entry){
+        .addr = PCI_ECAM_START,
+        .size = PCI_ECAM_SIZE,
+        .type = E820_RESERVED,
+    };
     boot->e820_entries = idx;
+}
 
+/*
+a bzImage: the protected mode part goes to KERNEL_START. it starts in 64-bit mode when it has a
+64-bit entry (XLF_KERNEL_64), else init_regs already set up the 32-bit one
+*/
+static int load_bzimage(guest* g, void* data, size_t datasz)
+{
+    struct boot_params* boot = (struct boot_params *)(((uint8_t *)g->mem) + BOOT_PARAMS_START);
+    void* kernel = (void *)(((uint8_t *)g->mem) + KERNEL_START);
+
+    memset(boot, 0, sizeof(struct boot_params));
+    memmove((void *) ((uintptr_t) boot + offsetof(struct boot_params, hdr)),
+            (void *) ((uintptr_t) data + offsetof(struct boot_params, hdr)),
+            sizeof(struct setup_header));
+    
+    size_t setup_sectors = boot->hdr.setup_sects;
+    size_t setupsz = (setup_sectors + 1) * 512;
+    if (boot->hdr.header != 0x53726448 || setupsz >= datasz) // "HdrS"
+    {
+        printf("Not a bzImage.\n");
+        return 1;
+    }
+    boot->hdr.loadflags |= CAN_USE_HEAP | LOADED_HIGH | KEEP_SEGMENTS;
+    boot->hdr.heap_end_ptr = 0xFE00;
+    boot->hdr.ext_loader_ver = 0x0;
+    init_boot_params(g, boot);
+    memmove(kernel, (char *)data + setupsz, datasz - setupsz);
+
+    if (!g->boot_32 && boot->hdr.version >= BZIMAGE_MIN_VERSION_64 && (boot->hdr.xloadflags & XLF_KERNEL_64))
+    {
+        init_regs_64(g, KERNEL_START + BZIMAGE_64BIT_ENTRY);
+    }
     return 0;
 }
 
+/*
+an uncompressed vmlinux: its segments go to their physical addresses and it starts at startup_64,
+no setup code and no decompressor. the boot params only get what a bzImage would bring along
+*/
+static int load_elf(guest* g, void* data, size_t datasz)
+{
+    Elf64_Ehdr* ehdr = (Elf64_Ehdr*) data;
+    struct boot_params* boot = (struct boot_params *)(((uint8_t *)g->mem) + BOOT_PARAMS_START);
+    uint64_t entry = ehdr->e_entry;
+
+    if (datasz < sizeof(*ehdr) || ehdr->e_ident[EI_CLASS] != ELFCLASS64 || ehdr->e_machine != EM_X86_64 ||
+        ehdr->e_phoff + (uint64_t) ehdr->e_phnum * sizeof(Elf64_Phdr) > datasz)
+    {
+        printf("Not an x86-64 ELF kernel.\n");
+        return 1;
+    }
+    for (int i = 0; i < ehdr->e_phnum; i++)
+    {
+        Elf64_Phdr* phdr = (Elf64_Phdr*) ((uint8_t*) data + ehdr->e_phoff) + i;
+
+        if (phdr->p_type != PT_LOAD)
+        {
+            continue;
+        }
+        if (phdr->p_filesz > phdr->p_memsz || phdr->p_offset + phdr->p_filesz > datasz ||
+            !vm_guest_range_valid(g, phdr->p_paddr, phdr->p_memsz))
+        {
+            printf("ELF segment %d does not fit in the guest memory.\n", i);
+            return 1;
+        }
+        memcpy(vm_guest_to_host(g, phdr->p_paddr), (uint8_t*) data + phdr->p_offset, phdr->p_filesz);
+        memset(vm_guest_to_host(g, phdr->p_paddr + phdr->p_filesz), 0, phdr->p_memsz - phdr->p_filesz);
+        // the entry may be a virtual address of the kernel mapping
+        if (entry >= phdr->p_vaddr && entry - phdr->p_vaddr < phdr->p_memsz)
+        {
+            entry = entry - phdr->p_vaddr + phdr->p_paddr;
+        }
+    }
+
+    memset(boot, 0, sizeof(struct boot_params));
+    boot->hdr.boot_flag = 0xAA55;
+    boot->hdr.header = 0x53726448; // "HdrS"
+    boot->hdr.version = BZIMAGE_MIN_VERSION_64;
+    boot->hdr.loadflags = LOADED_HIGH;
+    boot->hdr.kernel_alignment = 0x200000;
+    boot->hdr.cmdline_size = 0x800;
+    boot->hdr.initrd_addr_max = 0x7fffffff;
+    init_boot_params(g, boot);
+    init_regs_64(g, entry);
+    return 0;
+}
+
+int load_image(struct guest *g, const char* image_path) 
+{
+    size_t datasz;
+    void *data;
+    int ret;
+    int fd = open(image_path, O_RDONLY);
+    if (fd < 0) 
+    {
+        return 1;
+    }
+
+    struct stat st;
+    fstat(fd, &st);
+    datasz = st.st_size;
+    data = mmap(0, datasz, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        return 1;
+    }
+
+    if (datasz >= SELFMAG && memcmp(data, ELFMAG, SELFMAG) == 0)
+    {
+        ret = load_elf(g, data, datasz);
+    }
+    else
+    {
+        ret = load_bzimage(g, data, datasz);
+    }
+    munmap(data, datasz); // the daemon loads many guests, don't keep every image mapped
+
+    return ret;
+}
+
 void load_initrd(guest* g, const char* initrd_path)
 {
     int fd = open(initrd_path, O_RDONLY);
@@ -426,4 +657,585 @@ void print_debug_info(guest* g)
         uint32_t *mem = (uint32_t *)((char *)g->mem + regs.rip + i);
         printf("0x%llx: %08x\n", regs.rip + i, *mem);
     }
-}
\ No newline at end of file
+}
+
+void vm_config_init(struct vm_config* cfg)
+{
+    *cfg = (struct vm_config){
+        .initrd_path = INITRD_PATH,
+        .guest_cid = VIRTIO_VSOCK_DEFAULT_GUEST_CID,
+        .net_fd = -1,
+        .numa_node = -1,
+        .halt_poll_ns = -1,
+        .share_tag = VM_SHARE_TAG,
+        .console_log_size = CONSOLE_LOG_DEFAULT_SIZE,
+        // locally administered, the low bytes keep the VMs of one host apart
+        .mac = {0x52, 0x54, 0x00, (getpid() >> 16) & 0xff, (getpid() >> 8) & 0xff, getpid() & 0xff},
+    };
+}
+
+// the path stays in spec, which loses its ,cache= suffix
+int vm_config_add_disk(struct vm_config* cfg, char* spec)
+{
+    if (cfg->disk_count == VM_MAX_DISKS || diskimg_parse_path(spec, &cfg->disk_cache[cfg->disk_count]) < 0)
+    {
+        return -1;
+    }
+    cfg->disk_paths[cfg->disk_count++] = spec;
+    return 0;
+}
+
+// the path stays in spec, which loses its ,size= suffix
+int vm_config_set_console_log(struct vm_config* cfg, char* spec)
+{
+    char* opt = strchr(spec, ',');
+
+    if (opt)
+    {
+        char* end;
+        *opt++ = '\0';
+        if (strncmp(opt, "size=", 5) != 0)
+        {
+            return -1;
+        }
+        cfg->console_log_size = strtoull(opt + 5, &end, 10) << 10;
+        if (end == opt + 5 || *end || cfg->console_log_size < CONSOLE_LOG_MIN_SIZE || cfg->console_log_size > CONSOLE_LOG_MAX_SIZE)
+        {
+            return -1;
+        }
+    }
+    if (!*spec)
+    {
+        return -1;
+    }
+    cfg->console_log_path = spec;
+    return 0;
+}
+
+// the directory stays in spec, which loses its options
+int vm_config_add_share(struct vm_config* cfg, char* spec)
+{
+    char* opt = strchr(spec, ',');
+
+    if (opt)
+    {
+        *opt++ = '\0';
+    }
+    while (opt)
+    {
+        char* next = strchr(opt, ',');
+        if (next)
+        {
+            *next++ = '\0';
+        }
+        if (strncmp(opt, "tag=", 4) == 0 && opt[4])
+        {
+            cfg->share_tag = opt + 4;
+        }
+        else if (strcmp(opt, "ro") == 0)
+        {
+            cfg->share_ro = true;
+        }
+        else
+        {
+            return -1;
+        }
+        opt = next;
+    }
+    if (!*spec || strlen(cfg->share_tag) > VIRTIO_9P_TAG_MAX)
+    {
+        return -1;
+    }
+    cfg->share_path = spec;
+    return 0;
+}
+
+/*
+isolation options by their command line names, the daemon takes the same ones as key=value:
+cpu-max <quota_us>/<period_us>, memory-max <MiB>, io-max <major>:<minor>,rbps=<n>,wbps=<n>,...,
+vcpu-cpus <cpu list>, io-cpus <cpu list>, numa <node>
+*/
+int vm_config_set_isolation(struct vm_config* cfg, const char* key, const char* value)
+{
+    char* end;
+
+    if (strcmp(key, "cpu-max") == 0)
+    {
+        unsigned long quota = strtoul(value, &end, 10);
+        unsigned long period = 100000; // the kernel default
+        if (end == value || (*end == '/' && (period = strtoul(end + 1, &end, 10)) == 0) || *end || quota == 0)
+        {
+            return -1;
+        }
+        snprintf(cfg->cpu_max, sizeof(cfg->cpu_max), "%lu %lu", quota, period);
+    }
+    else if (strcmp(key, "memory-max") == 0)
+    {
+        cfg->memory_max = strtoull(value, &end, 10) << 20;
+        if (end == value || *end || cfg->memory_max == 0)
+        {
+            return -1;
+        }
+    }
+    else if (strcmp(key, "io-max") == 0)
+    {
+        // commas keep the value one word on a daemon command line
+        if (strlen(value) >= sizeof(cfg->io_max) || !strchr(value, ':'))
+        {
+            return -1;
+        }
+        strcpy(cfg->io_max, value);
+        for (char* c = cfg->io_max; (c = strchr(c, ',')); c++)
+        {
+            *c = ' ';
+        }
+    }
+    else if (strcmp(key, "vcpu-cpus") == 0)
+    {
+        cfg->pin_vcpu = true;
+        return cpu_mask_parse(value, &cfg->vcpu_cpus);
+    }
+    else if (strcmp(key, "io-cpus") == 0)
+    {
+        cfg->pin_io = true;
+        return cpu_mask_parse(value, &cfg->io_cpus);
+    }
+    else if (strcmp(key, "numa") == 0)
+    {
+        cfg->numa_node = strtol(value, &end, 10);
+        if (end == value || *end || cfg->numa_node < 0)
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        return -1;
+    }
+    return 0;
+}
+
+// puts the guest in a cgroup of its own with its limits, the calling thread (or process) joins it
+static int vm_isolate(guest* g, const struct vm_config* cfg)
+{
+    char root[PATH_MAX];
+    const char* parent = cfg->cgroup_parent;
+    bool threaded = parent != NULL;
+
+    if (!cfg->cgroup_name)
+    {
+        return 0;
+    }
+    if (threaded && (cfg->memory_max || cfg->io_max[0]))
+    {
+        printf("memory-max and io-max need a process per VM, the daemon VMs share one\n");
+        return -1;
+    }
+    if (!parent)
+    {
+        if (cgroup_root(root, sizeof(root)) < 0)
+        {
+            return -1;
+        }
+        parent = root;
+    }
+    if (cgroup_create(&g->cgroup, parent, cfg->cgroup_name, threaded) < 0)
+    {
+        return -1;
+    }
+    if (cfg->cpu_max[0] && cgroup_write(&g->cgroup, "cpu.max", cfg->cpu_max) < 0)
+    {
+        return -1;
+    }
+    if (cfg->memory_max)
+    {
+        char value[32];
+        snprintf(value, sizeof(value), "%lu", cfg->memory_max);
+        if (cgroup_write(&g->cgroup, "memory.max", value) < 0)
+        {
+            return -1;
+        }
+    }
+    if (cfg->io_max[0] && cgroup_write(&g->cgroup, "io.max", cfg->io_max) < 0)
+    {
+        return -1;
+    }
+    return cgroup_enter(&g->cgroup);
+}
+
+static int vm_create_devices(guest* g, const struct vm_config* cfg, int kvm_fd, int console_fd);
+
+/*
+builds a guest and its devices, ready for run_vm. kvm_fd is an open /dev/kvm to share or -1,
+console_fd the socket of the serial console or -1 for the terminal.
+the device threads start in the cgroup of the guest and on its io CPUs, the calling thread
+gets its own placement back unless the whole process joined the cgroup.
+on failure the caller still calls vm_destroy to release what was set up
+*/
+int vm_create(guest* g, const struct vm_config* cfg, int kvm_fd, int console_fd)
+{
+    cpu_mask_t caller_cpus;
+    int ret;
+
+    boot_profile_start(&g->boot);
+    g->vcpu_stats.fd = -1; // not the fd 0 of a zeroed guest, vm_destroy closes it
+    g->numa_node = cfg->numa_node;
+    g->pin_vcpu = cfg->pin_vcpu;
+    g->pin_io = cfg->pin_io;
+    g->vcpu_cpus = cfg->vcpu_cpus;
+    g->io_cpus = cfg->io_cpus;
+    if (vm_isolate(g, cfg) < 0)
+    {
+        printf("Error isolating the VM.\n");
+        cgroup_destroy(&g->cgroup); // nothing has joined it
+        return -1;
+    }
+    if (g->pin_io)
+    {
+        cpu_mask_get_self(&caller_cpus);
+        cpu_mask_pin_self(&g->io_cpus);
+    }
+
+    ret = vm_create_devices(g, cfg, kvm_fd, console_fd);
+
+    if (g->pin_io)
+    {
+        cpu_mask_pin_self(&caller_cpus);
+    }
+    if (g->cgroup.threaded)
+    {
+        cgroup_leave(&g->cgroup);
+    }
+    return ret;
+}
+
+// disk i of the config on a PCI slot and an IRQ line of its own, served by a disk image or a vhost-user backend
+static int vm_create_disk(guest* g, const struct vm_config* cfg, int i)
+{
+    const char* path = cfg->disk_paths[i];
+    int irq = vm_irq_alloc(g);
+
+    if (irq < 0)
+    {
+        printf("No free IRQ line for disk %d.\n", i);
+        return -1;
+    }
+    g->disk_count = i + 1; // vm_destroy releases what got this far
+    if (vhost_user_blk_path(path))
+    {
+        // the disk image, its limits and its boot trace are the backend's
+        if (vhost_user_blk_init_pci(&g->vhost_user_blk_dev[i], g, vhost_user_blk_path(path), irq) < 0)
+        {
+            printf("Error connecting to the vhost-user backend of disk %d.\n", i);
+            return -1;
+        }
+        if ((i == 0 && cfg->boot_trace_secs) || cfg->blk_limits.iops || cfg->blk_limits.bps ||
+            cfg->disk_cache[i] != DISKIMG_CACHE_WRITEBACK)
+        {
+            printf("Disk limits, cache policies and boot traces don't apply to a vhost-user backend.\n");
+        }
+        return 0;
+    }
+    if (diskimg_open(&g->diskimg[i], path, cfg->disk_cache[i]) < 0)
+    {
+        printf("Error initializing disk image %s.\n", path);
+        return -1;
+    }
+    // the boot still works without it, only slower
+    if (i == 0 && cfg->boot_trace_secs && diskimg_boot_trace(&g->diskimg[i], path, cfg->boot_trace_secs) < 0)
+    {
+        printf("Error setting up the boot trace of the disk image.\n");
+    }
+    if (virtio_blk_init_pci(&g->virtio_blk_dev[i], g, &g->diskimg[i], irq) < 0)
+    {
+        return -1;
+    }
+    throttle_set(&g->virtio_blk_dev[i].throttle, &cfg->blk_limits);
+    return 0;
+}
+
+static int vm_create_devices(guest* g, const struct vm_config* cfg, int kvm_fd, int console_fd)
+{
+    g->mem_mergeable = cfg->mem_mergeable;
+    g->balloon = cfg->balloon;
+    g->rng = cfg->rng;
+    g->no_pv = cfg->no_pv;
+    g->boot_32 = cfg->boot_32;
+    g->halt_poll_ns = cfg->halt_poll_ns;
+    for (int i = 0; i < cfg->disk_count; i++)
+    {
+        g->mem_shared |= vhost_user_blk_path(cfg->disk_paths[i]) != NULL;
+    }
+    if (kvm_fd >= 0)
+    {
+        g->kvm_fd = kvm_fd;
+        g->kvm_fd_shared = true;
+    }
+
+    if (setup_vm(g) < 0)
+    {
+        printf("Error setting up the VM.\n");
+        return -1;
+    }
+    if (console_fd >= 0)
+    {
+        serial_init_fd(&g->serial, &g->io_bus, console_fd);
+    }
+    else
+    {
+        serial_init(&g->serial, &g->io_bus);
+    }
+    g->serial.ready_marker = cfg->ready_marker;
+    if (cfg->console_log_path)
+    {
+        if (console_log_open(&g->console_log, cfg->console_log_path, cfg->console_log_size) < 0)
+        {
+            printf("Error opening the console log %s.\n", cfg->console_log_path);
+            return -1;
+        }
+        g->serial.log = &g->console_log;
+    }
+    boot_profile_mark(&g->boot, BOOT_SETUP_VM);
+
+    if (load_image(g, cfg->image_path) != 0)
+    {
+        printf("Error loading image - Check if the image path is correct\n");
+        return -1;
+    }
+    boot_profile_mark(&g->boot, BOOT_LOAD_IMAGE);
+
+    for (int i = 0; i < cfg->disk_count; i++)
+    {
+        if (vm_create_disk(g, cfg, i) < 0)
+        {
+            return -1;
+        }
+    }
+    if (g->balloon)
+    {
+        virtio_balloon_init_pci(&g->virtio_balloon_dev, &g->pci, &g->io_bus, &g->mmio_bus);
+    }
+    if (cfg->vsock_path && virtio_vsock_init_pci(&g->virtio_vsock_dev, cfg->guest_cid, cfg->vsock_path, &g->pci, &g->io_bus, &g->mmio_bus) < 0)
+    {
+        printf("Error initializing the vsock device.\n");
+        return -1;
+    }
+    if (cfg->net_fd >= 0 || cfg->net_spec)
+    {
+        if (cfg->net_fd >= 0)
+        {
+            netbackend_init_fd(&g->netbackend, cfg->net_fd);
+        }
+        else if (netbackend_init(&g->netbackend, cfg->net_spec) < 0)
+        {
+            printf("Error initializing the network backend.\n");
+            return -1;
+        }
+        virtio_net_init_pci(&g->virtio_net_dev, &g->netbackend, cfg->mac, &g->pci, &g->io_bus, &g->mmio_bus);
+    }
+    if (g->rng)
+    {
+        virtio_rng_init_pci(&g->virtio_rng_dev, &g->pci, &g->io_bus, &g->mmio_bus);
+    }
+    if (cfg->share_path)
+    {
+        int irq = vm_irq_alloc(g);
+        if (irq < 0 || virtio_9p_init_pci(&g->virtio_9p_dev, g, cfg->share_path, cfg->share_tag, cfg->share_ro, irq) < 0)
+        {
+            printf("Error sharing %s with the guest.\n", cfg->share_path);
+            return -1;
+        }
+    }
+    boot_profile_mark(&g->boot, BOOT_DEVICES);
+    load_initrd(g, cfg->initrd_path);
+    boot_profile_mark(&g->boot, BOOT_LOAD_INITRD);
+
+    return 0;
+}
+
+// releases a guest that is not running, or whose run_vm returned
+void vm_destroy(guest* g)
+{
+    boot_profile_record(&g->boot); // a boot that never got ready counts too
+    virtio_balloon_exit(&g->virtio_balloon_dev);
+    virtio_rng_exit(&g->virtio_rng_dev);
+    virtio_9p_exit(&g->virtio_9p_dev);
+    virtio_vsock_exit(&g->virtio_vsock_dev);
+    if (g->virtio_net_dev.enable)
+    {
+        virtio_net_exit(&g->virtio_net_dev);
+        netbackend_exit(&g->netbackend);
+    }
+    for (int i = 0; i < g->disk_count; i++)
+    {
+        virtio_blk_exit(&g->virtio_blk_dev[i]);
+        vhost_user_blk_exit(&g->vhost_user_blk_dev[i]);
+    }
+    if (g->serial.priv)
+    {
+        serial_exit(&g->serial);
+    }
+    console_log_close(&g->console_log); // after the last flush of the serial device
+    if (g->vcpu_fd > 0)
+    {
+        kvm_stats_exit(&g->vcpu_stats);
+        close(g->vcpu_fd);
+    }
+    if (g->run)
+    {
+        munmap(g->run, g->run_size);
+    }
+    if (g->vm_fd > 0)
+    {
+        close(g->vm_fd);
+    }
+    if (g->mem)
+    {
+        munmap(g->mem, GUEST_MEMORY_SIZE);
+    }
+    if (g->mem_shared)
+    {
+        close(g->mem_fd);
+    }
+    if (g->kvm_fd > 0 && !g->kvm_fd_shared)
+    {
+        close(g->kvm_fd);
+    }
+    // the threads of a threaded cgroup are gone, a process has to leave it first
+    if (g->cgroup.path[0] && !g->cgroup.threaded)
+    {
+        cgroup_leave(&g->cgroup);
+    }
+    cgroup_destroy(&g->cgroup);
+}
+
+// a device thread created after vm_create, e.g. from the vCPU thread, moves to the io CPUs
+void vm_place_io_thread(guest* g)
+{
+    if (g->pin_io)
+    {
+        cpu_mask_pin_self(&g->io_cpus);
+    }
+}
+
+static void vm_stop_signal_handler(int sig)
+{
+    (void) sig; // only there to make KVM_RUN return
+}
+
+// makes run_vm return on the thread vcpu_thread runs it on, the caller joins the thread
+void vm_stop(guest* g, pthread_t vcpu_thread)
+{
+    // no SA_RESTART, KVM_RUN has to fail with EINTR
+    struct sigaction sa = {.sa_handler = vm_stop_signal_handler};
+    sigaction(VM_STOP_SIGNAL, &sa, NULL);
+
+    __atomic_store_n(&g->stop, true, __ATOMIC_RELEASE);
+    // in case the signal comes before the thread enters KVM_RUN
+    __atomic_store_n(&g->run->immediate_exit, 1, __ATOMIC_RELEASE);
+    pthread_kill(vcpu_thread, VM_STOP_SIGNAL);
+}
+
+// reads a single number from a procfs/sysfs file, returns 0 if it can't be read
+static uint64_t read_u64_file(const char* path)
+{
+    unsigned long long value = 0;
+    FILE* f = fopen(path, "r");
+    if (!f)
+    {
+        return 0;
+    }
+    if (fscanf(f, "%llu", &value) != 1)
+    {
+        value = 0;
+    }
+    fclose(f);
+    return value;
+}
+
+void vm_get_mem_stats(guest* g, struct vm_mem_stats* stats)
+{
+    // KSM counts merged pages per process, in the daemon this covers all of its guests
+    stats->process_ksm_merging_pages = read_u64_file("/proc/self/ksm_merging_pages");
+    stats->reported_pages = __atomic_load_n(&g->virtio_balloon_dev.reported_pages, __ATOMIC_RELAXED);
+    stats->balloon_pages = __atomic_load_n(&g->virtio_balloon_dev.inflated_pages, __ATOMIC_RELAXED);
+}
+
+// exits handled inside the kernel, timer exits among them, next to their rate over the run
+void vm_print_exit_stats(guest* g)
+{
+    static const char* names[] = {"exits", "halt_exits", "irq_exits", "irq_window_exits", "io_exits", "mmio_exits"};
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double seconds = (now.tv_sec - g->run_start.tv_sec) + (now.tv_nsec - g->run_start.tv_nsec) / 1e9;
+
+    printf("vCPU exits over %.1f seconds:\n", seconds);
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+    {
+        uint64_t value;
+        if (kvm_stats_read(&g->vcpu_stats, names[i], &value) == 0)
+        {
+            printf("  %-18s %12lu  %10.1f/s\n", names[i], value, seconds > 0 ? value / seconds : 0);
+        }
+    }
+
+    struct vm_vcpu_stats vcpu;
+    vm_get_vcpu_stats(g, &vcpu);
+    printf("vCPU time: guest %.1f%%, halt polling %.1f%%, halted %.1f%%, userspace exits %.1f%%\n",
+           vcpu.wall_ns ? 100.0 * vcpu.guest_ns / vcpu.wall_ns : 0,
+           vcpu.wall_ns ? 100.0 * vcpu.halt_poll_ns / vcpu.wall_ns : 0,
+           vcpu.wall_ns ? 100.0 * vcpu.halt_wait_ns / vcpu.wall_ns : 0,
+           vcpu.wall_ns ? 100.0 * vcpu.exit_ns / vcpu.wall_ns : 0);
+}
+
+void vm_get_vcpu_stats(guest* g, struct vm_vcpu_stats* stats)
+{
+    struct vcpu_acct* acct = &g->acct;
+    uint64_t poll_success_ns = 0;
+    uint64_t poll_fail_ns = 0;
+    uint64_t halt_ns;
+
+    memset(stats, 0, sizeof(*stats));
+    if (g->run_start.tv_sec || g->run_start.tv_nsec)
+    {
+        stats->wall_ns = vm_now_ns() - (g->run_start.tv_sec * 1000000000ULL + g->run_start.tv_nsec);
+    }
+    stats->run_ns = __atomic_load_n(&acct->run_ns, __ATOMIC_RELAXED);
+    stats->exit_ns = __atomic_load_n(&acct->exit_ns, __ATOMIC_RELAXED);
+    stats->io_exits = __atomic_load_n(&acct->io_exits, __ATOMIC_RELAXED);
+    stats->mmio_exits = __atomic_load_n(&acct->mmio_exits, __ATOMIC_RELAXED);
+    stats->other_exits = __atomic_load_n(&acct->other_exits, __ATOMIC_RELAXED);
+    stats->interrupted = __atomic_load_n(&acct->interrupted, __ATOMIC_RELAXED);
+
+    kvm_stats_read(&g->vcpu_stats, "halt_poll_success_ns", &poll_success_ns);
+    kvm_stats_read(&g->vcpu_stats, "halt_poll_fail_ns", &poll_fail_ns);
+    kvm_stats_read(&g->vcpu_stats, "halt_wait_ns", &stats->halt_wait_ns);
+    kvm_stats_read(&g->vcpu_stats, "halt_exits", &stats->halt_exits);
+    kvm_stats_read(&g->vcpu_stats, "halt_successful_poll", &stats->halt_successful_polls);
+    stats->halt_poll_ns = poll_success_ns + poll_fail_ns;
+
+    // the two clocks are read at different times, a halt in progress may not be in run_ns yet
+    halt_ns = stats->halt_poll_ns + stats->halt_wait_ns;
+    stats->guest_ns = stats->run_ns > halt_ns ? stats->run_ns - halt_ns : 0;
+}
+
+int vm_set_halt_poll(guest* g, long ns)
+{
+    struct kvm_enable_cap cap = {
+        .cap = KVM_CAP_HALT_POLL,
+        .args[0] = ns,
+    };
+
+    if (ioctl(g->vm_fd, KVM_CHECK_EXTENSION, KVM_CAP_HALT_POLL) <= 0)
+    {
+        printf("KVM_CAP_HALT_POLL is not available.\n");
+        return -1;
+    }
+    if (ioctl(g->vm_fd, KVM_ENABLE_CAP, &cap) < 0)
+    {
+        perror("KVM_ENABLE_CAP KVM_CAP_HALT_POLL");
+        return -1;
+    }
+    g->halt_poll_ns = ns;
+    return 0;
+}
@@ -18,6 +18,9 @@
 #include <stddef.h>
 #include <asm/e820.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <signal.h>
+#include <elf.h>
 
 #include "guest.h"
 #include "pci.h"
@@ -29,24 +32,124 @@
 #define BOOT_PARAMS_START 0x10000
 #define CMD_LINE_START 0x20000
 
+// the 64-bit boot protocol: a GDT, a stack and identity mapped page tables below the boot params
+#define BOOT_GDT_START 0x500
+#define BOOT_STACK_START 0x8ff0
+#define BOOT_PML4_START 0x9000
+#define BOOT_PDPT_START 0xa000
+#define BOOT_PD_START 0xb000 // 2M pages over the guest memory, one 4K table per 1G
+#define BOOT_PTE_PRESENT (1 << 0)
+#define BOOT_PTE_RW (1 << 1)
+#define BOOT_PTE_PSE (1 << 7) // a 2M page in a page directory
+#define BOOT_CS 0x10 // __BOOT_CS and __BOOT_DS of the kernel
+#define BOOT_DS 0x18
+#define BZIMAGE_64BIT_ENTRY 0x200 // startup_64 of a bzImage, after the 32-bit entry
+#define BZIMAGE_MIN_VERSION_64 0x020c // boot protocol 2.12 added xloadflags
+
 // Can be changed
 #define GUEST_MEMORY_SIZE (1 << 30)  // 2 Mb
 #define TSS_ADDRESS 0xffffd000
-#define KERNEL_OPTIONS "console=ttyS0 pci=conf1"
+#define KERNEL_OPTIONS "console=ttyS0" // the host bridge passes the conf1 sanity check, no pci=conf1
 #define INITRD_PATH "rootfs.cpio"
+#define VM_SHARE_TAG "share" // of a shared directory given no tag=
+
+// sent to a vCPU thread to make KVM_RUN return
+#define VM_STOP_SIGNAL SIGUSR2
 
 // x86 flags
 #define X86_EFER_LME (1<<8) // Long Moede Enabled
 #define X86_EFER_LMA (1<<10) // Long Mode Active
 
 
+// guest memory density counters, in 4K pages
+struct vm_mem_stats
+{
+    uint64_t process_ksm_merging_pages; // pages of the whole process deduplicated by KSM, every guest of the daemon
+    uint64_t reported_pages; // pages the guest freed and we dropped from RAM
+    uint64_t balloon_pages; // pages currently held by the balloon
+};
+
+/*
+where the vCPU time goes, in ns since run_vm started. run_ns splits into guest_ns, halt_poll_ns
+and halt_wait_ns, the halt times come from the stats fd of the vCPU (the kernel handles halts).
+halt_wait_ns over wall_ns is how idle the guest is, halt_poll_ns burns a host CPU for it
+*/
+struct vm_vcpu_stats
+{
+    uint64_t wall_ns;
+    uint64_t run_ns;
+    uint64_t guest_ns;
+    uint64_t halt_poll_ns;
+    uint64_t halt_wait_ns;
+    uint64_t exit_ns; // in userspace, handling io and mmio exits
+    uint64_t halt_exits;
+    uint64_t halt_successful_polls; // wake ups that came while polling
+    uint64_t io_exits;
+    uint64_t mmio_exits;
+    uint64_t other_exits;
+    uint64_t interrupted;
+};
+
+// what a guest is built from, the command line or a create command of the daemon
+struct vm_config
+{
+    const char* image_path;
+    const char* disk_paths[VM_MAX_DISKS]; // the first one is the boot disk, see vm_config_add_disk
+    enum diskimg_cache disk_cache[VM_MAX_DISKS];
+    int disk_count;
+    const char* initrd_path;
+    bool mem_mergeable;
+    bool balloon;
+    bool rng;
+    bool no_pv;
+    bool boot_32; // enter the kernel through its 32-bit entry even when it has a 64-bit one
+    const char* vsock_path; // NULL for no vsock device
+    uint64_t guest_cid;
+    const char* net_spec; // tap:<ifname> or switch:<socket_path>, NULL for no network
+    int net_fd; // an already connected switch port, used instead of net_spec when >= 0
+    uint8_t mac[6];
+    const char* ready_marker;
+    const char* console_log_path; // NULL for no console log, see vm_config_set_console_log
+    uint64_t console_log_size; // bytes of output kept
+    long halt_poll_ns; // -1 for the kernel default
+    const char* share_path; // a host directory for a virtio-9p device, NULL for none. See vm_config_add_share
+    const char* share_tag; // the guest mounts the share by it
+    bool share_ro;
+    struct throttle_limits blk_limits; // of each virtio-blk device, all 0 for no limit
+    unsigned int boot_trace_secs; // record the reads of the boot disk for this much of the boot or prefetch them, 0 for off
+
+    // isolation, see isolation.h
+    const char* cgroup_parent; // the daemon cgroup, the VM cgroup is then threaded. NULL below the root
+    const char* cgroup_name; // NULL for no cgroup
+    char cpu_max[48]; // cpu.max, "<quota_us> <period_us>", empty for no limit
+    uint64_t memory_max; // bytes, 0 for no limit
+    char io_max[128]; // io.max, "<major>:<minor> rbps=<n> wbps=<n> riops=<n> wiops=<n>", empty for no limit
+    int numa_node; // -1 for no binding
+    bool pin_vcpu;
+    bool pin_io;
+    cpu_mask_t vcpu_cpus;
+    cpu_mask_t io_cpus;
+};
+
 void run_vm(guest* g);
-void setup_vm(guest* g);
+int setup_vm(guest* g); // returns 0 on success
 void init_regs(guest* g);
-void init_cpuid(guest* g);
-void init_msrs(guest* g);
-int load_image(struct guest *g, const char* image_path); // reutrns 0 on success
+void init_regs_64(guest* g, uint64_t entry); // long mode, rsi at the boot params, rip at entry
+int load_image(struct guest *g, const char* image_path); // a bzImage or an ELF vmlinux, reutrns 0 on success
 void load_initrd(guest* g, const char* initrd_path);
 void print_debug_info(guest* g);
+void vm_get_mem_stats(guest* g, struct vm_mem_stats* stats);
+void vm_print_exit_stats(guest* g);
+void vm_get_vcpu_stats(guest* g, struct vm_vcpu_stats* stats);
+int vm_set_halt_poll(guest* g, long ns); // returns 0 on success, can be called while the guest runs
+void vm_config_init(struct vm_config* cfg);
+int vm_config_add_disk(struct vm_config* cfg, char* spec); // <disk_path>[,cache=<policy>], returns 0 on success
+int vm_config_set_console_log(struct vm_config* cfg, char* spec); // <path>[,size=<KiB>], returns 0 on success
+int vm_config_add_share(struct vm_config* cfg, char* spec); // <dir>[,tag=<tag>][,ro], returns 0 on success
+int vm_config_set_isolation(struct vm_config* cfg, const char* key, const char* value); // returns 0 on success
+void vm_place_io_thread(guest* g);
+int vm_create(guest* g, const struct vm_config* cfg, int kvm_fd, int console_fd); // returns 0 on success
+void vm_destroy(guest* g);
+void vm_stop(guest* g, pthread_t vcpu_thread);
 
 #endif // VM_H
@@ -1,4 +1,5 @@
 #include "SSHClientThread.h"
+#include <memory>
 #include <iostream>
 #include <unistd.h>
 #include <fcntl.h>
@@ -56,18 +57,32 @@ void SSHClientThread::handle_client() {
         return;
     }
         
-    SubprocessHandler subprocess_handler = SubprocessHandler(vmId);
+    std::unique_ptr<SubprocessHandler> subprocess_handler;
+    try
+    {
+        subprocess_handler = std::make_unique<SubprocessHandler>(vmId);
+    }
+    catch(const std::exception& e)
+    {
+        std::cerr << "Error in starting the VM: " << e.what() << '\n';
+        this->~SSHClientThread();
+        return;
+    }
     
     fd_set read_fds;
     char buffer[1024];
 
     // Determine the maximum descriptor for select()
-    int max_fd = std::max(client_socket, subprocess_handler.out_pipe[0]);
+    int max_fd = std::max(client_socket, subprocess_handler->console_fd);
+
+    time_t last_client_input = time(nullptr);
+    time_t next_shrink = last_client_input + VM_IDLE_SHRINK_SECONDS;
+    bool vm_shrunk = false;
     
     while (true) 
     {
         FD_ZERO(&read_fds);
-        FD_SET(subprocess_handler.out_pipe[0], &read_fds);   // Monitor hypervisor output
+        FD_SET(subprocess_handler->console_fd, &read_fds);   // Monitor hypervisor output
         FD_SET(client_socket, &read_fds); // Monitor client input
 
         struct timeval timeout = { 1, 0 }; // 1-second timeout
@@ -76,9 +91,9 @@ void SSHClientThread::handle_client() {
         if (ready > 0) 
         {
             // If data is available from the hypervisor, read it and send it to the client.
-            if (FD_ISSET(subprocess_handler.out_pipe[0], &read_fds)) 
+            if (FD_ISSET(subprocess_handler->console_fd, &read_fds)) 
             {
-                ssize_t bytes_read = read(subprocess_handler.out_pipe[0], buffer, sizeof(buffer) - 1);
+                ssize_t bytes_read = read(subprocess_handler->console_fd, buffer, sizeof(buffer) - 1);
                 if (bytes_read > 0) 
                 {
                     buffer[bytes_read] = '\0';
@@ -108,7 +123,21 @@ void SSHClientThread::handle_client() {
                     {
                         break;
                     }
-                    ssize_t bytes_sent = write(subprocess_handler.in_pipe[1], client_input.c_str(), client_input.size());
+                    last_client_input = time(nullptr);
+                    next_shrink = last_client_input + VM_IDLE_SHRINK_SECONDS;
+                    if (vm_shrunk) 
+                    {
+                        vm_shrunk = false;
+                        try
+                        {
+                            subprocess_handler->restore_vm_memory();
+                        }
+                        catch(const std::exception& e)
+                        {
+                            std::cerr << "Error in restoring the memory of an idle VM: " << e.what() << '\n';
+                        }
+                    }
+                    ssize_t bytes_sent = write(subprocess_handler->console_fd, client_input.c_str(), client_input.size());
                     if (bytes_sent <= 0) 
                     {
                         throw SshException("Error: Failed to send data to hypervisor. Bytes sent: " + bytes_sent);
@@ -126,6 +155,21 @@ void SSHClientThread::handle_client() {
             break;
         }
         // If timeout, loop again.
+
+        if (!vm_shrunk && time(nullptr) >= next_shrink) 
+        {
+            try
+            {
+                vm_shrunk = subprocess_handler->shrink_idle_vm();
+                // the stats wait blocks the session, a guest without a fresh report waits a while
+                next_shrink = time(nullptr) + VM_IDLE_SHRINK_RETRY_SECONDS;
+            }
+            catch(const std::exception& e)
+            {
+                std::cerr << "Error in shrinking an idle VM: " << e.what() << '\n';
+                next_shrink = time(nullptr) + VM_IDLE_SHRINK_SECONDS; // try again after another idle period
+            }
+        }
     }
     
     this->~SSHClientThread();
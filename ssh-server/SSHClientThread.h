@@ -12,6 +12,8 @@
 #include "VmsHandler.h"
 
 #define CLIENT_DISCONNECT_CHAR "\x03"
+#define VM_IDLE_SHRINK_SECONDS 300 // a VM without client input for this long gives its free memory back to the host
+#define VM_IDLE_SHRINK_RETRY_SECONDS 30 // after a guest that didn't report its memory in time
 class SSHClientThread {
 public:
     explicit SSHClientThread(int socket);
@@ -1,9 +1,12 @@
 #include "SubprocessHandler.h"
 #include <string.h>
+#include <sstream>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/un.h>
 
-SubprocessHandler::SubprocessHandler(std::string vmId) : vmId(vmId) {
-    setup_pipes();
-    create_subprocess();
+SubprocessHandler::SubprocessHandler(std::string vmId) : console_fd(-1), vmId(vmId), vsockPath(VM_STORAGE_DIR + vmId + ".vsock") {
+    create_vm();
 };
 
 SubprocessHandler::~SubprocessHandler() {
@@ -15,60 +18,51 @@ SubprocessHandler::~SubprocessHandler() {
     {
         std::cerr << e.what() << '\n';
     }
-    close(in_pipe[0]);
-    close(in_pipe[1]);
-    close(out_pipe[0]);
-    close(out_pipe[1]);
-    
-    close_subprocess(pid);
+    destroy_vm();
 }
 
-pid_t SubprocessHandler::create_subprocess() {
-    pid = fork();
-    if (pid == 0) { // Child process
-        close(in_pipe[1]);
-        close(out_pipe[0]);
-        
-        dup2(in_pipe[0], STDIN_FILENO);
-        dup2(out_pipe[1], STDOUT_FILENO);
-
-        // Construct the path to the VM-specific ext4 file
-        std::string ext4Path = "./hypervisor/vmStorage/" + vmId + ".ext4";
-        
-        execlp("sudo", "sudo", "./hypervisor/main", "./hypervisor/bzImage", ext4Path.c_str(), "./hypervisor/rootfs.cpio", NULL);
-        perror("execlp failed");
-        exit(1);
-    }
-    else if (pid > 0) { // Parent
-        std::cout << "Parent = Subprocess created with PID: " << pid << std::endl;
-        close(in_pipe[0]);
-        close(out_pipe[1]);
-        return pid;
-    }
-    else {
-        perror("fork failed");
-        exit(1);
-    }
-}
+// the daemon builds and starts the VM, and hands back its console
+void SubprocessHandler::create_vm() {
+    // Construct the path to the VM-specific ext4 file
+    std::string ext4Path = VM_STORAGE_DIR + vmId + ".ext4";
 
-void SubprocessHandler::setup_pipes() {
-    pipe(in_pipe);  // Parent writes, subprocess reads
-    pipe(out_pipe); // Subprocess writes, parent reads
+    send_daemon_command("create " + vmId + " ./hypervisor/bzImage " + ext4Path + " balloon vsock=" + vsockPath);
+    try
+    {
+        send_daemon_command("start " + vmId);
+        send_daemon_command("console " + vmId, &console_fd);
+    }
+    catch(const std::exception& e)
+    {
+        destroy_vm();
+        throw;
+    }
+    std::cout << "VM " << vmId << " started in the hypervisor daemon" << std::endl;
 }
 
-void SubprocessHandler::close_subprocess(pid_t pid) {
-    kill(pid, SIGKILL);
-    waitpid(pid, NULL, 0);
+void SubprocessHandler::destroy_vm() {
+    try
+    {
+        send_daemon_command("stop " + vmId);
+    }
+    catch(const std::exception& e)
+    {
+        std::cerr << e.what() << '\n';
+    }
+    if (console_fd >= 0) {
+        close(console_fd);
+        console_fd = -1;
+    }
 }
 
 void SubprocessHandler::poweroff_subprocess() {
     // we send a halt command to the hypervisor
-    write(in_pipe[1], SYSTEM_HALT_COMMAND, sizeof(SYSTEM_HALT_COMMAND));
+    write(console_fd, SYSTEM_HALT_COMMAND, sizeof(SYSTEM_HALT_COMMAND));
     // we wait for the hypervisor to finish. we wait untill the "reboot: System halted" message is printed.
     size_t total_bytes_read = 0;
     char buffer[1024];
     while (true) {
-        size_t bytes_read = read(out_pipe[0], buffer + total_bytes_read, sizeof(buffer) - 1);
+        size_t bytes_read = read(console_fd, buffer + total_bytes_read, sizeof(buffer) - 1);
         total_bytes_read += bytes_read;
         if (bytes_read > 0) {
             buffer[total_bytes_read] = '\0';
@@ -78,3 +72,109 @@ void SubprocessHandler::poweroff_subprocess() {
         }
     }
 }
+
+// sends one command line to the hypervisor daemon and returns its one line answer.
+// received_fd takes the fd the daemon attaches to the answer (the console)
+std::string SubprocessHandler::send_daemon_command(const std::string& command, int* received_fd) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to create the daemon socket");
+    }
+
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, HYPERVISOR_DAEMON_SOCKET, sizeof(addr.sun_path) - 1);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        throw std::runtime_error("Failed to connect to the hypervisor daemon");
+    }
+
+    std::string line = command + "\n";
+    if (send(fd, line.c_str(), line.size(), MSG_NOSIGNAL) != (ssize_t)line.size()) {
+        close(fd);
+        throw std::runtime_error("Failed to send a daemon command");
+    }
+
+    std::string reply;
+    char buffer[1024];
+    char control[CMSG_SPACE(sizeof(int))];
+    while (reply.find('\n') == std::string::npos) {
+        struct iovec iov = { buffer, sizeof(buffer) };
+        struct msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t bytes_read = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+        if (bytes_read <= 0) {
+            break;
+        }
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                int passed_fd;
+                memcpy(&passed_fd, CMSG_DATA(cmsg), sizeof(passed_fd));
+                if (received_fd) {
+                    *received_fd = passed_fd;
+                } else {
+                    close(passed_fd);
+                }
+            }
+        }
+        reply.append(buffer, bytes_read);
+    }
+    close(fd);
+
+    reply = reply.substr(0, reply.find('\n'));
+    if (reply.rfind("error", 0) == 0) {
+        throw std::runtime_error("Hypervisor daemon: " + reply);
+    }
+    return reply;
+}
+
+// a control command "<name> [args]" of this VM goes to the daemon as "<name> <vm id> [args]"
+std::string SubprocessHandler::send_control_command(const std::string& command) {
+    size_t separator = command.find(' ');
+    if (separator == std::string::npos) {
+        return send_daemon_command(command + " " + vmId);
+    }
+    return send_daemon_command(command.substr(0, separator) + " " + vmId + command.substr(separator));
+}
+
+// the stats answer is a list of key=value pairs
+std::map<std::string, long> SubprocessHandler::get_vm_stats(bool fresh) {
+    std::map<std::string, long> stats;
+    std::istringstream reply(send_control_command(fresh ? "stats fresh" : "stats"));
+    std::string field;
+
+    while (reply >> field) {
+        size_t separator = field.find('=');
+        if (separator != std::string::npos) {
+            stats[field.substr(0, separator)] = std::stol(field.substr(separator + 1));
+        }
+    }
+    return stats;
+}
+
+void SubprocessHandler::set_balloon_size(long sizeMb) {
+    send_control_command("balloon " + std::to_string(sizeMb));
+}
+
+// inflates the balloon over the memory the idle guest doesn't use. returns false if the guest didn't
+// report its memory now, an older report could size the balloon over memory the guest uses since
+bool SubprocessHandler::shrink_idle_vm() {
+    std::map<std::string, long> stats = get_vm_stats(true);
+    long available = stats["guest_available_mb"];
+    long balloon = stats["balloon_actual_mb"];
+
+    if (stats["guest_stats_fresh"] != 1 || available == 0) {
+        return false;
+    }
+    if (available > VM_IDLE_KEEP_AVAILABLE_MB) {
+        set_balloon_size(balloon + available - VM_IDLE_KEEP_AVAILABLE_MB);
+    }
+    return true;
+}
+
+void SubprocessHandler::restore_vm_memory() {
+    set_balloon_size(0);
+}
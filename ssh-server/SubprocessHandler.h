@@ -1,6 +1,9 @@
 #pragma once
 
 #include <iostream>
+#include <map>
+#include <stdint.h>
+#include <string>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -9,21 +12,34 @@
 #define SYSTEM_HALT_COMMAND "halt\n"
 #define SYSTEM_HALT_MESSAGE "reboot: System halted"
 
+#define VM_STORAGE_DIR "./hypervisor/vmStorage/"
+// the hypervisor runs once as a daemon hosting all the VMs:
+// sudo ./hypervisor/main --daemon ./hypervisor/vmStorage/hypervisor.sock
+#define HYPERVISOR_DAEMON_SOCKET VM_STORAGE_DIR "hypervisor.sock"
+#define VM_IDLE_KEEP_AVAILABLE_MB 128 // memory left available to an idle VM when it is shrunk
+
 class SubprocessHandler
 {
 public:
     SubprocessHandler(std::string vmId);
     ~SubprocessHandler();
-    pid_t create_subprocess();
-    void setup_pipes();
-    void close_subprocess(pid_t pid);
+    void create_vm();
+    void destroy_vm();
     void poweroff_subprocess();
 
-    int in_pipe[2];
-    int out_pipe[2];
+    // control interface of the VM in the hypervisor daemon
+    std::string send_control_command(const std::string& command);
+    std::map<std::string, long> get_vm_stats(bool fresh = false); // fresh waits for a new report of the guest
+    void set_balloon_size(long sizeMb);
+    bool shrink_idle_vm();
+    void restore_vm_memory();
+
+    int console_fd; // serial console of the VM, read and written like a terminal
 
 private:
-    pid_t pid;
+    std::string send_daemon_command(const std::string& command, int* received_fd = nullptr);
+
     std::string vmId;
+    std::string vsockPath; // host end of the vsock device of the guest, see hypervisor/virtio-vsock.h
 
 };
\ No newline at end of file